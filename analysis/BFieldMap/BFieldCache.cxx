@@ -2,6 +2,7 @@
 // BFieldCache.cxx
 //
 #include "BFieldCache.h"
+#include <algorithm>
 
 //
 // Interpolate the field to return the B vetor at (z, r, phi)
@@ -21,11 +22,16 @@ BFieldCache::getB( double z, double r, double phi, double *B, double *deriv ) co
     double gphi = 1.0 - fphi;
     // interpolate field values in z, r, phi
     double Bzrphi[3];
-    for ( int i = 0; i < 3; i++ ) { // z, r, phi
-        Bzrphi[i] = m_scale*( gz*( gr*( gphi*m_field[0][i] + fphi*m_field[1][i] ) +
-                                   fr*( gphi*m_field[2][i] + fphi*m_field[3][i] ) ) +
-                              fz*( gr*( gphi*m_field[4][i] + fphi*m_field[5][i] ) +
-                                   fr*( gphi*m_field[6][i] + fphi*m_field[7][i] ) ) );
+    double dBdz[3], dBdr[3], dBdphi[3];
+    if ( m_tricubic ) {
+        tricubic( fz, fr, fphi, Bzrphi, deriv ? dBdz : 0, dBdr, dBdphi );
+    } else {
+        for ( int i = 0; i < 3; i++ ) { // z, r, phi
+            Bzrphi[i] = m_scale*( gz*( gr*( gphi*m_field[0][i] + fphi*m_field[1][i] ) +
+                                       fr*( gphi*m_field[2][i] + fphi*m_field[3][i] ) ) +
+                                  fz*( gr*( gphi*m_field[4][i] + fphi*m_field[5][i] ) +
+                                       fr*( gphi*m_field[6][i] + fphi*m_field[7][i] ) ) );
+        }
     }
     // convert (Bz,Br,Bphi) to (Bx,By,Bz)
     double c = cos(phi);
@@ -36,37 +42,125 @@ BFieldCache::getB( double z, double r, double phi, double *B, double *deriv ) co
 
     // compute field derivatives if requested
     if ( deriv ) {
-        double sz = m_scale/(m_zmax-m_zmin);
-        double sr = m_scale/(m_rmax-m_rmin);
-        double sphi = m_scale/(m_phimax-m_phimin);
-        double dBdz[3], dBdr[3], dBdphi[3];
-        for ( int j = 0; j < 3; j++ ) { // Bz, Br, Bphi components
-            dBdz[j]   = sz*( gr*( gphi*(m_field[4][j]-m_field[0][j]) +
-                                  fphi*(m_field[5][j]-m_field[1][j]) ) +
-                             fr*( gphi*(m_field[6][j]-m_field[2][j]) +
-                                  fphi*(m_field[7][j]-m_field[3][j]) ) );
-            dBdr[j]   = sr*( gz*( gphi*(m_field[2][j]-m_field[0][j]) +
-                                  fphi*(m_field[3][j]-m_field[1][j]) ) +
-                             fz*( gphi*(m_field[6][j]-m_field[4][j]) +
-                                  fphi*(m_field[7][j]-m_field[5][j]) ) );
-            dBdphi[j] = sphi*( gz*( gr*(m_field[1][j]-m_field[0][j]) +
-                                    fr*(m_field[3][j]-m_field[2][j]) ) +
-                               fz*( gr*(m_field[5][j]-m_field[4][j]) +
-                                    fr*(m_field[7][j]-m_field[6][j]) ) );
+        if ( !m_tricubic ) {
+            double sz = m_scale/(m_zmax-m_zmin);
+            double sr = m_scale/(m_rmax-m_rmin);
+            double sphi = m_scale/(m_phimax-m_phimin);
+            for ( int j = 0; j < 3; j++ ) { // Bz, Br, Bphi components
+                dBdz[j]   = sz*( gr*( gphi*(m_field[4][j]-m_field[0][j]) +
+                                      fphi*(m_field[5][j]-m_field[1][j]) ) +
+                                 fr*( gphi*(m_field[6][j]-m_field[2][j]) +
+                                      fphi*(m_field[7][j]-m_field[3][j]) ) );
+                dBdr[j]   = sr*( gz*( gphi*(m_field[2][j]-m_field[0][j]) +
+                                      fphi*(m_field[3][j]-m_field[1][j]) ) +
+                                 fz*( gphi*(m_field[6][j]-m_field[4][j]) +
+                                      fphi*(m_field[7][j]-m_field[5][j]) ) );
+                dBdphi[j] = sphi*( gz*( gr*(m_field[1][j]-m_field[0][j]) +
+                                        fr*(m_field[3][j]-m_field[2][j]) ) +
+                                   fz*( gr*(m_field[5][j]-m_field[4][j]) +
+                                        fr*(m_field[7][j]-m_field[6][j]) ) );
+            }
         }
         // convert to cartesian coordinates
+        // the 1/r terms are dropped on the axis, where they are undefined
+        double invr = ( r > 1.0e-6 ) ? 1.0/r : 0.0;
         double cc = c*c;
         double cs = c*s;
         double ss = s*s;
-        deriv[0] = cc*dBdr[1] - cs*dBdr[2] - cs*dBdphi[1]/r + ss*dBdphi[2]/r + s*B[1]/r;
-        deriv[1] = cs*dBdr[1] - ss*dBdr[2] + cc*dBdphi[1]/r - cs*dBdphi[2]/r - c*B[1]/r;
+        deriv[0] = cc*dBdr[1] - cs*dBdr[2] - cs*dBdphi[1]*invr + ss*dBdphi[2]*invr + s*B[1]*invr;
+        deriv[1] = cs*dBdr[1] - ss*dBdr[2] + cc*dBdphi[1]*invr - cs*dBdphi[2]*invr - c*B[1]*invr;
         deriv[2] = c*dBdz[1] - s*dBdz[2];
-        deriv[3] = cs*dBdr[1] + cc*dBdr[2] - ss*dBdphi[1]/r - cs*dBdphi[2]/r - s*B[0]/r;
-        deriv[4] = ss*dBdr[1] + cs*dBdr[2] + cs*dBdphi[1]/r + cc*dBdphi[2]/r + c*B[0]/r;
+        deriv[3] = cs*dBdr[1] + cc*dBdr[2] - ss*dBdphi[1]*invr - cs*dBdphi[2]*invr - s*B[0]*invr;
+        deriv[4] = ss*dBdr[1] + cs*dBdr[2] + cs*dBdphi[1]*invr + cc*dBdphi[2]*invr + c*B[0]*invr;
         deriv[5] = s*dBdz[1] + c*dBdz[2];
-        deriv[6] = c*dBdr[0] - s*dBdphi[0]/r;
-        deriv[7] = s*dBdr[1] + c*dBdphi[0]/r;
+        deriv[6] = c*dBdr[0] - s*dBdphi[0]*invr;
+        deriv[7] = s*dBdr[0] + c*dBdphi[0]*invr;
         deriv[8] = dBdz[0];
     }
 }
 
+
+//
+// Tricubic Hermite interpolation inside the bin, from the field and its 7
+// derivatives at the 8 corners.  fz, fr, fphi are the fractional positions.
+// The result is C1 across bins that share the corner derivatives.
+// Also returns the derivatives d(Bz,Br,Bphi)/dz, dr, dphi if dBdz is given.
+//
+void
+BFieldCache::tricubic( double fz, double fr, double fphi, double *Bzrphi,
+                       double *dBdz, double *dBdr, double *dBdphi ) const
+{
+    // cubic Hermite basis along each axis: w[a][corner][d] multiplies the field (d=0)
+    // or its derivative (d=1) at corner 0 or 1, and dw[a][corner][d] is its derivative
+    const double t[3] = { fz, fr, fphi };
+    const double h[3] = { m_zmax-m_zmin, m_rmax-m_rmin, m_phimax-m_phimin };
+    double w[3][2][2], dw[3][2][2];
+    for ( int a = 0; a < 3; a++ ) {
+        double x = t[a], x2 = x*x, x3 = x2*x;
+        w[a][0][0] = 1.0 - 3.0*x2 + 2.0*x3;
+        w[a][1][0] = 3.0*x2 - 2.0*x3;
+        w[a][0][1] = h[a]*( x - 2.0*x2 + x3 );
+        w[a][1][1] = h[a]*( x3 - x2 );
+        dw[a][0][0] = 6.0*( x2 - x )/h[a];
+        dw[a][1][0] = -dw[a][0][0];
+        dw[a][0][1] = 1.0 - 4.0*x + 3.0*x2;
+        dw[a][1][1] = 3.0*x2 - 2.0*x;
+    }
+    for ( int j = 0; j < 3; j++ ) {
+        Bzrphi[j] = 0.0;
+        if ( dBdz ) dBdz[j] = dBdr[j] = dBdphi[j] = 0.0;
+    }
+    for ( int i = 0; i < 8; i++ ) { // corners: bit 2 = z, bit 1 = r, bit 0 = phi
+        int cz = (i>>2)&1, cr = (i>>1)&1, cphi = i&1;
+        for ( int k = 0; k < 8; k++ ) { // derivatives: bit 2 = d/dz, bit 1 = d/dr, bit 0 = d/dphi
+            int kz = (k>>2)&1, kr = (k>>1)&1, kphi = k&1;
+            const BFieldVector<double>& f = ( k == 0 ) ? m_field[i] : m_deriv[7*i+k-1];
+            double scale = ( k == 0 ) ? m_scale : m_dscale[k-1];
+            double wz = w[0][cz][kz], wr = w[1][cr][kr], wphi = w[2][cphi][kphi];
+            double a = scale*wz*wr*wphi;
+            for ( int j = 0; j < 3; j++ ) Bzrphi[j] += a*f[j];
+            if ( dBdz ) {
+                double az = scale*dw[0][cz][kz]*wr*wphi;
+                double ar = scale*wz*dw[1][cr][kr]*wphi;
+                double aphi = scale*wz*wr*dw[2][cphi][kphi];
+                for ( int j = 0; j < 3; j++ ) {
+                    dBdz[j] += az*f[j];
+                    dBdr[j] += ar*f[j];
+                    dBdphi[j] += aphi*f[j];
+                }
+            }
+        }
+    }
+}
+
+//
+// Move a bin taken from the image of a folded zone back to the zone.
+// Mirroring z swaps the corners at zmin and zmax, and reverses the sign of
+// the derivatives with respect to z.
+//
+void
+BFieldCache::unfold( double dphi, bool reflect, const int *sign )
+{
+    m_phimin -= dphi;
+    m_phimax -= dphi;
+    if ( reflect ) {
+        double zmin = m_zmin;
+        m_zmin = -m_zmax;
+        m_zmax = -zmin;
+        for ( int i = 0; i < 4; i++ ) {
+            std::swap( m_field[i], m_field[i+4] );
+            if ( m_tricubic ) {
+                for ( int k = 0; k < 7; k++ ) std::swap( m_deriv[7*i+k], m_deriv[7*(i+4)+k] );
+            }
+        }
+    }
+    for ( int i = 0; i < 8; i++ ) {
+        m_field[i].set( sign[0]*m_field[i].z(), sign[1]*m_field[i].r(), sign[2]*m_field[i].phi() );
+        if ( !m_tricubic ) continue;
+        for ( int k = 1; k < 8; k++ ) {
+            double s = ( reflect && ( k & 4 ) ) ? -1.0 : 1.0;
+            BFieldVector<double>& d( m_deriv[7*i+k-1] );
+            d.set( s*sign[0]*d.z(), s*sign[1]*d.r(), s*sign[2]*d.phi() );
+        }
+    }
+}
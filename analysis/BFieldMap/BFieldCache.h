@@ -3,6 +3,7 @@
 //
 // Cashe of one bin of the magnetic field map.
 // Defined by ranges in z, r, phi, and the B vectors at the 8 corners of the "bin".
+// For tricubic interpolation, the derivatives of B at the corners are stored too.
 //
 // Masahiro Morii, Harvard University
 //
@@ -10,12 +11,15 @@
 #define BFIELDCACHE_H
 
 #include <cmath>
+#include <vector>
 #include "BFieldVector.h"
 
+class BFieldZone;
+
 class BFieldCache {
 public:
     // default constructor sets unphysical boundaries, so that inside() will fail
-    BFieldCache() : m_phimin(0.0), m_phimax(-1.0) {;}
+    BFieldCache() : m_phimin(0.0), m_phimax(-1.0), m_zone(0), m_tricubic(false) {;}
     // set the z, r, phi range that defines the bin
     void setRange( double zmin, double zmax, double rmin, double rmax, double phimin, double phimax )
     { m_zmin = zmin; m_zmax = zmax; m_rmin = rmin; m_rmax = rmax; m_phimin = phimin; m_phimax = phimax; }
@@ -24,19 +28,49 @@ public:
     void setField( int i, BFieldVector<short> field ) { m_field[i].set( field.z(), field.r(), field.phi() ); }
     // set the multiplicative factor for the field vectors
     void setBscale( double bscale ) { m_scale = bscale; }
+    // switch tricubic interpolation on or off.  The space for the derivatives
+    // is allocated the first time it is switched on.
+    void setTricubic( bool tricubic )
+    { m_tricubic = tricubic; if ( tricubic && m_deriv.empty() ) m_deriv.resize( 8*7 ); }
+    bool tricubic() const { return m_tricubic; }
+    // set the derivatives of the field at each corner for tricubic interpolation.
+    // k = 1..7 is a bit mask of the variables differentiated: 4 = d/dz, 2 = d/dr, 1 = d/dphi.
+    // The values are multiplied by the factor set with setDscale( k ).
+    // setTricubic( true ) must be called first.
+    void setDeriv( int i, int k, BFieldVector<double> field ) { m_deriv[7*i+k-1] = field; }
+    void setDeriv( int i, int k, BFieldVector<short> field ) { m_deriv[7*i+k-1].set( field.z(), field.r(), field.phi() ); }
+    void setDscale( int k, double dscale ) { m_dscale[k-1] = dscale; }
+    // set the toroid zone this bin belongs to (0 for the solenoid)
+    void setZone( const BFieldZone* zone ) { m_zone = zone; }
+    const BFieldZone* zone() const { return m_zone; }
+    // move a bin of the image of a folded zone back to the zone (see BFieldZone::fold()):
+    // shift phi by -dphi, mirror z if reflect, and multiply (Bz,Br,Bphi) by sign[3]
+    void unfold( double dphi, bool reflect, const int *sign );
+    // invalidate the cache, so that inside() will fail
+    void clear() { m_phimin = 0.0; m_phimax = -1.0; m_zone = 0; }
     // test if (z, r, phi) is inside this bin
     bool inside( double z, double r, double phi ) const
     { if ( phi < m_phimin ) phi += 2.0*M_PI;
       return ( phi >= m_phimin && phi <= m_phimax && z >= m_zmin && z <= m_zmax && r >= m_rmin && r <= m_rmax ); }
+    // bin edges in z (i=0), r (1), phi (2)
+    double min( int i ) const { return ( i == 0 ) ? m_zmin : ( i == 1 ) ? m_rmin : m_phimin; }
+    double max( int i ) const { return ( i == 0 ) ? m_zmax : ( i == 1 ) ? m_rmax : m_phimax; }
     // interpolate the field and return B[3].
     // also compute field derivatives if deriv[9] is given.
     void getB( double z, double r, double phi, double *B, double *derive=0 ) const;
 private:
+    // tricubic Hermite interpolation of (Bz,Br,Bphi), and of their derivatives if dBdz is given
+    void tricubic( double fz, double fr, double fphi, double *Bzrphi,
+                   double *dBdz, double *dBdr, double *dBdphi ) const;
     double m_zmin, m_zmax;
     double m_rmin, m_rmax;
     double m_phimin, m_phimax;
     BFieldVector<double> m_field[8];
     double m_scale;
+    const BFieldZone* m_zone;
+    bool m_tricubic;
+    std::vector< BFieldVector<double> > m_deriv; // 7 derivatives at each corner, for tricubic only
+    double m_dscale[7];
 };
 
 #endif
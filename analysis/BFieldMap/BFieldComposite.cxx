@@ -0,0 +1,83 @@
+//
+// BFieldComposite.cxx
+//
+#include "BFieldComposite.h"
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+//
+// Returns the magnetic field at any position.
+//
+void
+BFieldComposite::getB( const double *xyz, double *B, double *deriv ) const
+{
+    getB( xyz, B, deriv, m_cache );
+}
+
+//
+// Returns the magnetic field from the component that covers xyz,
+// using the caches given by the caller.
+// The H8 and solenoid bin caches are tested first, since they lie inside the
+// volume of their component.
+//
+void
+BFieldComposite::getB( const double *xyz, double *B, double *deriv, Cache& cache ) const
+{
+    if ( m_h8 && ( cache.h8.inside( xyz ) || m_h8->inside( xyz ) ) ) {
+        m_h8->getB( xyz, B, deriv, cache.h8 );
+        return;
+    }
+    if ( m_solenoid && m_solenoid->tiltedMap() ) {
+        double r = sqrt(xyz[0]*xyz[0]+xyz[1]*xyz[1]);
+        double phi = atan2(xyz[1],xyz[0]);
+        if ( cache.solenoid.inside( xyz[2], r, phi ) ||
+             m_solenoid->tiltedMap()->inside( xyz[2], r, phi ) ) {
+            m_solenoid->getB( xyz, B, deriv, cache.solenoid );
+            if ( m_solenoidScale != 1.0 ) {
+                for ( int i = 0; i < 3; i++ ) B[i] *= m_solenoidScale;
+                if ( deriv ) for ( int i = 0; i < 9; i++ ) deriv[i] *= m_solenoidScale;
+            }
+            return;
+        }
+    }
+    if ( m_toroid ) {
+        m_toroid->getB( xyz, B, deriv, cache.toroid );
+        return;
+    }
+    B[0] = B[1] = B[2] = 0.0;
+    if ( deriv ) for ( int i = 0; i < 9; i++ ) deriv[i] = 0.0;
+}
+
+//
+// Returns the magnetic field at n points, computed in blocks on the thread pool.
+// Consecutive points go to the same thread, so that they can share the bin caches.
+//
+void
+BFieldComposite::getB( int n, const double *xyz, double *B, double *deriv, BFieldThreadPool& pool ) const
+{
+    const int block = 256;
+    vector<Cache> cache( pool.nthread() );
+    pool.run( (n+block-1)/block, [&]( int ib, int ithread ) {
+        int iend = min( n, (ib+1)*block );
+        for ( int i = ib*block; i < iend; i++ ) {
+            getB( &xyz[3*i], &B[3*i], deriv ? &deriv[9*i] : 0, cache[ithread] );
+        }
+    } );
+}
+
+//
+// Returns the component that provides the field at xyz
+//
+int
+BFieldComposite::region( const double *xyz ) const
+{
+    if ( m_h8 && m_h8->inside( xyz ) ) return H8;
+    if ( m_solenoid && m_solenoid->tiltedMap() ) {
+        double r = sqrt(xyz[0]*xyz[0]+xyz[1]*xyz[1]);
+        double phi = atan2(xyz[1],xyz[0]);
+        if ( m_solenoid->tiltedMap()->inside( xyz[2], r, phi ) ) return Solenoid;
+    }
+    if ( m_toroid ) return Toroid;
+    return None;
+}
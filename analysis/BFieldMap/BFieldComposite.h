@@ -0,0 +1,63 @@
+//
+// BFieldComposite.h
+//
+// Field of the toroid, solenoid and H8 maps combined into one object, with one
+// getB() interface.  Each point is dispatched by region to the component map:
+// the H8 map wherever it is defined, then the (moved and tilted) solenoid map
+// inside its volume, then the toroid map.  The solenoid keeps its double-precision
+// values, unlike the zone that combineMaps appends to the toroid map, and is
+// scaled by a factor that can be changed at run time (the toroid currents are
+// scaled by BFieldScaledMap).
+// The components are not owned and any of them may be 0.
+//
+// Units: mm, kT.
+//
+#ifndef BFIELDCOMPOSITE_H
+#define BFIELDCOMPOSITE_H
+
+#include "BFieldMap.h"
+#include "BFieldSolenoid.h"
+#include "BFieldH8Map.h"
+#include "BFieldThreadPool.h"
+
+class BFieldComposite {
+public:
+    // component that provides the field at a point
+    enum Region { None = 0, Toroid = 1, Solenoid = 2, H8 = 3 };
+    // per-thread field caches, one per component
+    class Cache {
+    public:
+        BFieldCache toroid;
+        BFieldCache solenoid;
+        BFieldH8Cache h8;
+    };
+    // constructor
+    BFieldComposite( const BFieldMap* toroid = 0, const BFieldSolenoid* solenoid = 0,
+                     const BFieldH8Map* h8 = 0 )
+        : m_toroid(toroid), m_solenoid(solenoid), m_h8(h8), m_solenoidScale(1.0) {;}
+    // compute magnetic field, with derivatives if deriv[9] is given
+    void getB( const double *xyz, double *B, double *deriv=0 ) const;
+    // same, using a cache owned by the caller (one per thread)
+    void getB( const double *xyz, double *B, double *deriv, Cache& cache ) const;
+    // field at n points xyz[3*n] on the thread pool: fills B[3*n], and deriv[9*n] if given
+    void getB( int n, const double *xyz, double *B, double *deriv, BFieldThreadPool& pool ) const;
+    // scale factor of the solenoid field and its derivatives, e.g. the ratio of
+    // the current to that of the map.  Not thread-safe with getB().
+    void setSolenoidScale( double scale ) { m_solenoidScale = scale; }
+    double solenoidScale() const { return m_solenoidScale; }
+    // component that provides the field at xyz
+    int region( const double *xyz ) const;
+    // accessors
+    const BFieldMap* toroid() const { return m_toroid; }
+    const BFieldSolenoid* solenoid() const { return m_solenoid; }
+    const BFieldH8Map* h8() const { return m_h8; }
+private:
+    const BFieldMap* m_toroid;
+    const BFieldSolenoid* m_solenoid;
+    const BFieldH8Map* m_h8;
+    double m_solenoidScale;
+    // cache for speed
+    mutable Cache m_cache;
+};
+
+#endif
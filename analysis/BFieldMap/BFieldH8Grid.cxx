@@ -4,6 +4,83 @@
 // Masahiro Morii, Harvard University
 //
 #include "BFieldH8Grid.h"
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <string>
+
+namespace {
+    // read the next number from a null-terminated buffer, advancing p.
+    // ok becomes false if there is no number.
+    inline double nextDouble( const char*& p, bool& ok )
+    {
+        char* end;
+        double x = strtod( p, &end );
+        if ( end == p ) ok = false;
+        p = end;
+        return x;
+    }
+    inline int nextInt( const char*& p, bool& ok )
+    {
+        char* end;
+        long n = strtol( p, &end, 10 );
+        if ( end == p ) ok = false;
+        p = end;
+        return int(n);
+    }
+
+    // 4 doubles (Bx,By,Bz,0) handled as one SIMD vector
+#if defined(__GNUC__)
+    typedef double V4 __attribute__((vector_size(32)));
+    inline void load4( V4& v, const double *p ) { __builtin_memcpy( &v, p, sizeof(v) ); }
+#else
+    struct V4 {
+        double v[4];
+        double operator[]( int i ) const { return v[i]; }
+        V4& operator+=( const V4& a ) { for ( int i=0; i<4; i++ ) v[i] += a.v[i]; return *this; }
+    };
+    inline V4 operator-( const V4& a, const V4& b ) { V4 c; for ( int i=0; i<4; i++ ) c.v[i] = a.v[i]-b.v[i]; return c; }
+    inline V4 operator*( double w, const V4& a ) { V4 c; for ( int i=0; i<4; i++ ) c.v[i] = w*a.v[i]; return c; }
+    inline void load4( V4& v, const double *p ) { for ( int i=0; i<4; i++ ) v.v[i] = p[i]; }
+#endif
+
+    //
+    // Trilinear interpolation between the 8 corners c[k] = (Bx,By,Bz,0), with the
+    // fractional position f[3] (g = 1-f) inside the cell.  Corner k is at +x if (k&1),
+    // +y if (k&2) and +z if (k&4).  Each corner adds weight*(Bx,By,Bz,0) as one vector.
+    //
+    inline void interpolate( const double *const *c, const double *f, const double *g,
+                             const double *invunit, double *B, double *deriv )
+    {
+        V4 c4[8];
+        for ( int k=0; k<8; k++ ) load4( c4[k], c[k] );
+        const double wx[2] = { g[0], f[0] };
+        const double wy[2] = { g[1], f[1] };
+        const double wz[2] = { g[2], f[2] };
+        const double wxy[4] = { g[0]*g[1], f[0]*g[1], g[0]*f[1], f[0]*f[1] };
+        V4 b = ( wxy[0]*g[2] )*c4[0];
+        for ( int k=1; k<4; k++ ) b += ( wxy[k]*g[2] )*c4[k];
+        for ( int k=0; k<4; k++ ) b += ( wxy[k]*f[2] )*c4[k+4];
+        B[0] = b[0];
+        B[1] = b[1];
+        B[2] = b[2];
+        if ( deriv != 0 ) {
+            // differences along x, y and z between the 4 pairs of corners
+            V4 d[3] = { 0.0*c4[0], 0.0*c4[0], 0.0*c4[0] };
+            for ( int k=0; k<4; k++ ) {
+                int kx = 2*k;                 // 0,2,4,6 -> +1
+                int ky = (k&1) + 4*(k>>1);    // 0,1,4,5 -> +2
+                d[0] += ( wy[k&1]*wz[k>>1] )*( c4[kx+1] - c4[kx] );
+                d[1] += ( wx[k&1]*wz[k>>1] )*( c4[ky+2] - c4[ky] );
+                d[2] += ( wx[k&1]*wy[k>>1] )*( c4[k+4] - c4[k] );
+            }
+            for ( int j=0; j<3; j++ ) { // d/dx, d/dy, d/dz
+                for ( int i=0; i<3; i++ ) deriv[i*3+j] = d[j][i]*invunit[j];
+            }
+        }
+    }
+}
 
 BFieldH8Grid::BFieldH8Grid()
 {
@@ -12,6 +89,7 @@ BFieldH8Grid::BFieldH8Grid()
         m_min[i] = 0.0;
         m_max[i] = 0.0;
         m_d[i] = 0.0;
+        m_invunit[i] = 0.0;
     }
 }
 
@@ -38,10 +116,11 @@ BFieldH8Grid::readMap( std::istream& input )
     }
     // prepare space for the field data
     int nxyz = m_n[0]*m_n[1]*m_n[2];
-    for ( int i=0; i<3; i++ ) m_B[i].resize(nxyz);
+    m_B.assign( 4*nxyz, 0.0 );
     // read the field data
     double xyz[3];
     double B[3];
+    int nskip = 0; // nodes outside the grid
     for ( int k=0; k<nxyz; k++ ) {
         input >> xyz[0] >> xyz[1] >> xyz[2] >> B[0] >> B[1] >> B[2];
         // adjust unit and scale
@@ -51,22 +130,168 @@ BFieldH8Grid::readMap( std::istream& input )
             xyz[i] *= cm;
             B[i] *= -cor*tesla;
         }
-        // find the grid number
+        // find the grid number, and skip the node if it is outside the grid
         int j[3];
+        bool outside = false;
         for ( int i=0; i<3; i++ ) {
-            j[i] = int((xyz[i]-m_min[i])/(m_max[i]-m_min[i])*(m_n[i]-1)+0.5);
+            j[i] = int(floor((xyz[i]-m_min[i])/(m_max[i]-m_min[i])*(m_n[i]-1)+0.5));
+            if ( j[i] < 0 || j[i] >= m_n[i] ) outside = true;
+        }
+        if ( outside ) {
+            nskip++;
+            continue;
         }
         // store
         int ixyz = j[0] + m_n[0]*(j[1] + m_n[1]*j[2]);
         for ( int i=0; i<3; i++ ) {
-            m_B[i][ixyz] = B[i];
+            m_B[4*ixyz+i] = B[i];
         }
     }
+    if ( nskip > 0 ) {
+        std::cerr << "BFieldH8Grid::readMap(): " << nskip << " nodes of " << name
+                  << " are outside the grid, skipped" << std::endl;
+    }
     // apply offset to the range
     for ( int i=0; i<3; i++ ) {
         m_min[i] += m_d[i];
         m_max[i] += m_d[i];
     }
+    // inverse pitch used in the interpolation
+    for ( int i=0; i<3; i++ ) {
+        m_invunit[i] = (m_n[i]-1) / (m_max[i]-m_min[i]);
+    }
+}
+
+//
+// Read one grid from the null-terminated text buffer at p, and advance p past it.
+// Same format as readMap(std::istream&).  The nodes are expected in the order
+// x, y, z (x fastest), so the grid index is incremented from node to node and only
+// checked against the coordinates; it is recomputed if the order is different.
+// Nothing is defined if no grid header is found.
+//
+void
+BFieldH8Grid::readMap( const char*& p )
+{
+    // read the magnet header line
+    m_n[0] = 0;
+    while ( *p != '\0' && isspace( (unsigned char)*p ) ) p++;
+    if ( *p == '\0' ) return;
+    const char* name = p;
+    while ( *p != '\0' && !isspace( (unsigned char)*p ) ) p++;
+    std::string magnet( name, p );
+    bool ok = true;
+    int n[3];
+    double range[6], d[3];
+    for ( int i=0; i<3; i++ ) n[i] = nextInt( p, ok );
+    for ( int i=0; i<6; i++ ) range[i] = nextDouble( p, ok );
+    for ( int i=0; i<3; i++ ) d[i] = nextDouble( p, ok );
+    double cor = nextDouble( p, ok );
+    // anything read?
+    if ( !ok || n[0] <= 0 ) return;
+    // convert unit to mm
+    const double meter(1000.); // m in mm
+    for ( int i=0; i<3; i++ ) {
+        m_n[i] = n[i];
+        m_min[i] = range[2*i]*meter;
+        m_max[i] = range[2*i+1]*meter;
+        m_d[i] = d[i]*meter;
+        m_invunit[i] = (m_n[i]-1) / (m_max[i]-m_min[i]);
+    }
+    // prepare space for the field data
+    int nxyz = m_n[0]*m_n[1]*m_n[2];
+    m_B.assign( 4*nxyz, 0.0 );
+    // read the field data
+    const double cm(10.); // cm in mm
+    const double tesla(0.001); // T in kT
+    const double scale(-cor*tesla);
+    int j[3] = { 0, 0, 0 }; // expected grid number of the next node
+    int nskip = 0;          // nodes outside the grid
+    for ( int k=0; k<nxyz; k++ ) {
+        double xyz[3];
+        double B[3];
+        for ( int i=0; i<3; i++ ) xyz[i] = nextDouble( p, ok )*cm;
+        for ( int i=0; i<3; i++ ) B[i] = nextDouble( p, ok )*scale;
+        if ( !ok ) break;
+        // check the grid number, and find it if the node is not the expected one
+        bool expected = true;
+        for ( int i=0; i<3; i++ ) {
+            double a = (xyz[i]-m_min[i])*m_invunit[i];
+            if ( j[i] < 0 || fabs( a - j[i] ) >= 0.5 ) expected = false;
+        }
+        if ( !expected ) {
+            bool outside = false;
+            for ( int i=0; i<3; i++ ) {
+                j[i] = int(floor((xyz[i]-m_min[i])*m_invunit[i]+0.5));
+                if ( j[i] < 0 || j[i] >= m_n[i] ) outside = true;
+            }
+            if ( outside ) {
+                // skip the node; the next one is located from its coordinates
+                nskip++;
+                j[0] = j[1] = j[2] = -1;
+                continue;
+            }
+        }
+        // store
+        int ixyz = j[0] + m_n[0]*(j[1] + m_n[1]*j[2]);
+        for ( int i=0; i<3; i++ ) {
+            m_B[4*ixyz+i] = B[i];
+        }
+        // next grid number
+        if ( ++j[0] == m_n[0] ) {
+            j[0] = 0;
+            if ( ++j[1] == m_n[1] ) {
+                j[1] = 0;
+                if ( ++j[2] == m_n[2] ) j[2] = 0;
+            }
+        }
+    }
+    if ( nskip > 0 ) {
+        std::cerr << "BFieldH8Grid::readMap(): " << nskip << " nodes of " << magnet
+                  << " are outside the grid, skipped" << std::endl;
+    }
+    // apply offset to the range
+    for ( int i=0; i<3; i++ ) {
+        m_min[i] += m_d[i];
+        m_max[i] += m_d[i];
+    }
+}
+
+//
+// Write the grid to a binary cache file: n[3], min[3], max[3], d[3], (Bx,By,Bz,0) per node
+//
+void
+BFieldH8Grid::writeCache( std::ostream& output ) const
+{
+    output.write( (const char*)m_n, sizeof(m_n) );
+    output.write( (const char*)m_min, sizeof(m_min) );
+    output.write( (const char*)m_max, sizeof(m_max) );
+    output.write( (const char*)m_d, sizeof(m_d) );
+    output.write( (const char*)&m_B[0], m_B.size()*sizeof(double) );
+}
+
+//
+// Read the grid from a binary cache in [p,end), and advance p past it.
+// Returns false if the buffer is too short.
+//
+bool
+BFieldH8Grid::readCache( const char*& p, const char* end )
+{
+    const size_t header = sizeof(m_n) + sizeof(m_min) + sizeof(m_max) + sizeof(m_d);
+    if ( size_t(end-p) < header ) return false;
+    memcpy( m_n, p, sizeof(m_n) ); p += sizeof(m_n);
+    memcpy( m_min, p, sizeof(m_min) ); p += sizeof(m_min);
+    memcpy( m_max, p, sizeof(m_max) ); p += sizeof(m_max);
+    memcpy( m_d, p, sizeof(m_d) ); p += sizeof(m_d);
+    if ( m_n[0] <= 0 || m_n[1] <= 0 || m_n[2] <= 0 ) return false;
+    size_t nxyz = size_t(m_n[0])*m_n[1]*m_n[2];
+    if ( size_t(end-p) < 4*nxyz*sizeof(double) ) return false;
+    m_B.resize( 4*nxyz );
+    memcpy( &m_B[0], p, 4*nxyz*sizeof(double) );
+    p += 4*nxyz*sizeof(double);
+    for ( int i=0; i<3; i++ ) {
+        m_invunit[i] = (m_n[i]-1) / (m_max[i]-m_min[i]);
+    }
+    return true;
 }
 
 void
@@ -80,17 +305,46 @@ BFieldH8Grid::getB( const double *xyz, double *B, double *deriv ) const
         return;
     }
     // find the grid index
-    double invunit[3];
     int j[3];
     double f[3];
     double g[3];
     for ( int i=0; i<3; i++ ) {
-        invunit[i] = (m_n[i]-1) / (m_max[i]-m_min[i]);
-        double a = (xyz[i]-m_min[i]) * invunit[i];
+        double a = (xyz[i]-m_min[i]) * m_invunit[i];
         j[i] = int(a);
+        if ( j[i] > m_n[i]-2 ) j[i] = m_n[i]-2;
         f[i] = a - j[i];
         g[i] = 1.0 - f[i];
     }
+    const double *c[8];
+    c[0] = &m_B[4*( j[0] + m_n[0]*(j[1] + m_n[1]*j[2]) )];
+    c[1] = c[0] + 4;
+    c[2] = c[0] + 4*m_n[0];
+    c[3] = c[2] + 4;
+    c[4] = c[0] + 4*m_n[0]*m_n[1];
+    c[5] = c[4] + 4;
+    c[6] = c[4] + 4*m_n[0];
+    c[7] = c[6] + 4;
+    interpolate( c, f, g, m_invunit, B, deriv );
+}
+
+//
+// Copy the field at the 8 corners of the cell containing xyz into the cache.
+// A point on the upper edge of the grid goes to the last cell.
+//
+void
+BFieldH8Grid::getCache( const double *xyz, BFieldH8Cache& cache ) const
+{
+    // find the grid index
+    int j[3];
+    for ( int i=0; i<3; i++ ) {
+        double a = (xyz[i]-m_min[i]) * m_invunit[i];
+        j[i] = int(a);
+        if ( j[i] > m_n[i]-2 ) j[i] = m_n[i]-2;
+        if ( j[i] < 0 ) j[i] = 0;
+        cache.m_j[i] = j[i];
+        cache.m_min[i] = m_min[i];
+        cache.m_invunit[i] = m_invunit[i];
+    }
     int ixyz[8];
     ixyz[0] = j[0] + m_n[0]*(j[1] + m_n[1]*j[2]);
     ixyz[1] = ixyz[0] + 1;
@@ -100,30 +354,29 @@ BFieldH8Grid::getB( const double *xyz, double *B, double *deriv ) const
     ixyz[5] = ixyz[4] + 1;
     ixyz[6] = ixyz[4] + m_n[0];
     ixyz[7] = ixyz[6] + 1;
-    // interpolate field values
-    for ( int i=0; i<3; i++ ) { // Bx, By, Bz
-        B[i] = g[2]*( g[1]*( g[0]*m_B[i][ixyz[0]] + f[0]*m_B[i][ixyz[1]] ) +
-                      f[1]*( g[0]*m_B[i][ixyz[2]] + f[0]*m_B[i][ixyz[3]] ) ) +
-               f[2]*( g[1]*( g[0]*m_B[i][ixyz[4]] + f[0]*m_B[i][ixyz[5]] ) +
-                      f[1]*( g[0]*m_B[i][ixyz[6]] + f[0]*m_B[i][ixyz[7]] ) );
-    }
-    // derivatives
-    if ( deriv != 0 ) {
-        for ( int i=0; i<3; i++ ) { // Bx, By, Bz
-            deriv[i*3  ] = ( g[2]*( g[1]*(m_B[i][ixyz[1]] - m_B[i][ixyz[0]] ) +
-                                    f[1]*(m_B[i][ixyz[3]] - m_B[i][ixyz[2]] ) ) +
-                             f[2]*( g[1]*(m_B[i][ixyz[5]] - m_B[i][ixyz[4]] ) +
-                                    f[1]*(m_B[i][ixyz[7]] - m_B[i][ixyz[6]] ) ) ) * invunit[0];
-            deriv[i*3+1] = ( g[2]*( g[0]*(m_B[i][ixyz[2]] - m_B[i][ixyz[0]] ) +
-                                    f[0]*(m_B[i][ixyz[3]] - m_B[i][ixyz[1]] ) ) +
-                             f[2]*( g[0]*(m_B[i][ixyz[6]] - m_B[i][ixyz[4]] ) +
-                                    f[0]*(m_B[i][ixyz[7]] - m_B[i][ixyz[5]] ) ) ) * invunit[1];
-            deriv[i*3+2] = ( g[1]*( g[0]*(m_B[i][ixyz[4]] - m_B[i][ixyz[0]] ) +
-                                    f[0]*(m_B[i][ixyz[5]] - m_B[i][ixyz[1]] ) ) +
-                             f[1]*( g[0]*(m_B[i][ixyz[6]] - m_B[i][ixyz[2]] ) +
-                                    f[0]*(m_B[i][ixyz[7]] - m_B[i][ixyz[3]] ) ) ) * invunit[2];
-        }
+    // corners 0,1 (and 2,3 etc.) are adjacent in memory
+    for ( int k=0; k<8; k++ ) {
+        const double *b = &m_B[4*ixyz[k]];
+        for ( int l=0; l<4; l++ ) cache.m_B[k][l] = b[l];
+    }
+}
+
+//
+// Interpolate the field inside the cell
+//
+void
+BFieldH8Cache::getB( const double *xyz, double *B, double *deriv ) const
+{
+    double f[3];
+    double g[3];
+    for ( int i=0; i<3; i++ ) {
+        double a = (xyz[i]-m_min[i]) * m_invunit[i];
+        f[i] = a - m_j[i];
+        g[i] = 1.0 - f[i];
     }
+    const double *c[8];
+    for ( int k=0; k<8; k++ ) c[k] = m_B[k];
+    interpolate( c, f, g, m_invunit, B, deriv );
 }
 
 void
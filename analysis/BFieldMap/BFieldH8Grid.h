@@ -9,22 +9,68 @@
 #include <vector>
 #include <iostream>
 
+//
+// Cache of one cell of a BFieldH8Grid: the B vectors at its 8 corners
+//
+class BFieldH8Cache {
+public:
+    // default constructor makes an empty cache, so that inside() will fail
+    BFieldH8Cache() : m_grid(-1) {;}
+    // invalidate the cache
+    void clear() { m_grid = -1; }
+    // index of the grid in BFieldH8Map this cell belongs to (-1 if empty)
+    void setGrid( int i ) { m_grid = i; }
+    int grid() const { return m_grid; }
+    // test if xyz is inside this cell
+    bool inside( const double *xyz ) const
+    { if ( m_grid < 0 ) return false;
+      for ( int i=0; i<3; i++ ) {
+          double a = (xyz[i]-m_min[i]) * m_invunit[i];
+          if ( a < m_j[i] || a > m_j[i]+1 ) return false;
+      }
+      return true; }
+    // interpolate the field and return B[3], plus the derivatives if deriv[9] is given
+    void getB( const double *xyz, double *B, double *deriv=0 ) const;
+private:
+    friend class BFieldH8Grid;
+    friend class BFieldH8Map;
+    int    m_grid;
+    int    m_j[3];                 // grid index of the low corner
+    double m_min[3], m_invunit[3]; // grid origin and inverse pitch
+    double m_B[8][4];              // (Bx,By,Bz,0) at the 8 corners (kT)
+    std::vector<int> m_order;      // grids of the map in the order of the search, last used first
+};
+
 class BFieldH8Grid {
 public:
     BFieldH8Grid();
     void readMap( std::istream& input );
+    // same, from a null-terminated text buffer; p is moved past the grid
+    void readMap( const char*& p );
+    // write/read the grid in the binary cache format
+    void writeCache( std::ostream& output ) const;
+    bool readCache( const char*& p, const char* end );
     void getB( const double *xyz, double *B, double *deriv=0 ) const;
+    // fill the cache with the cell that contains xyz, which must be inside
+    void getCache( const double *xyz, BFieldH8Cache& cache ) const;
     bool defined() const { return ( m_n[0] > 0 ); }
     bool inside( const double *xyz ) const
     { return ( xyz[0]>=m_min[0] && xyz[0]<=m_max[0] &&
                xyz[1]>=m_min[1] && xyz[1]<=m_max[1] &&
                xyz[2]>=m_min[2] && xyz[2]<=m_max[2] ); }
     void setOffset( const double *dxyz );
+    // range in x,y,z (mm)
+    double min( int i ) const { return m_min[i]; }
+    double max( int i ) const { return m_max[i]; }
+    // number of grid points in x,y,z, and component i of the field at node ixyz
+    int n( int i ) const { return m_n[i]; }
+    double field( int ixyz, int i ) const { return m_B[4*ixyz+i]; }
 private:
     int    m_n[3];              // number of grid points
     double m_min[3], m_max[3];  // range in x,y,z (mm)
     double m_d[3];              // offset in x,y,z (mm)
-    std::vector<double> m_B[3]; // Bz,By,Bz (kT)
+    double m_invunit[3];        // 1/(grid pitch) in x,y,z (1/mm)
+    std::vector<double> m_B;    // (Bx,By,Bz,0) at each node (kT), padded to 4 for SIMD
 };
 
 #endif
@@ -4,34 +4,250 @@
 // Masahiro Morii, Harvard University
 //
 #include "BFieldH8Map.h"
+#include <fstream>
+#include <string>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
+namespace {
+    // header of the binary cache file
+    const char cacheMagic[8] = { 'B', 'F', 'H', '8', 'C', 'A', 'C', '2' };
+    struct CacheHeader {
+        char magic[8];
+        long long size;  // size of the text file
+        long long mtime; // modification time of the text file
+        int ngrid;
+        int pad;
+    };
+}
+
+//
+// Read the map from text.  The whole stream is read into memory and parsed
+// from the buffer, which is much faster than reading each number from the stream.
+//
 void
 BFieldH8Map::readMap( std::istream& input )
 {
+    std::string text( (std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>() );
     // skip the file header line
-    char line[256];
-    input.getline( line, 256 );
+    const char* p = text.c_str();
+    const char* eol = strchr( p, '\n' );
+    p = eol ? eol+1 : p+text.size();
     // read grids
     while (1) {
         BFieldH8Grid grid;
-        grid.readMap( input );
+        grid.readMap( p );
         if ( grid.defined() ) {
             m_grid.push_back( grid );
         } else {
-            return;
+            break;
         }
     }
+    buildIndex();
+}
+
+//
+// Read the map from file, using the binary cache if it is up to date
+//
+int
+BFieldH8Map::readMap( const char* filename )
+{
+    struct stat src;
+    if ( stat( filename, &src ) != 0 ) {
+        std::cerr << "BFieldH8Map::readMap(): failed to open " << filename << std::endl;
+        return 1;
+    }
+    std::string cachename( filename );
+    cachename += ".cache";
+    if ( readCache( cachename.c_str(), src.st_size, src.st_mtime ) == 0 ) return 0;
+    std::ifstream input( filename, std::ios::binary );
+    if ( ! input.good() ) {
+        std::cerr << "BFieldH8Map::readMap(): failed to open " << filename << std::endl;
+        return 1;
+    }
+    m_grid.clear();
+    readMap( input );
+    if ( m_grid.empty() ) {
+        std::cerr << "BFieldH8Map::readMap(): no grid found in " << filename << std::endl;
+        return 1;
+    }
+    writeCache( cachename.c_str(), src.st_size, src.st_mtime );
+    return 0;
 }
 
+//
+// Read the grids from the memory-mapped binary cache.
+// returns 0 if successful, non-zero if the cache is missing, stale or corrupt.
+//
+int
+BFieldH8Map::readCache( const char* cachename, long long size, long long mtime )
+{
+    int fd = open( cachename, O_RDONLY );
+    if ( fd < 0 ) return 1;
+    struct stat st;
+    if ( fstat( fd, &st ) != 0 || size_t(st.st_size) < sizeof(CacheHeader) ) {
+        close( fd );
+        return 2;
+    }
+    void* addr = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( addr == MAP_FAILED ) return 3;
+    const char* p = (const char*)addr;
+    const char* end = p + st.st_size;
+    CacheHeader header;
+    memcpy( &header, p, sizeof(header) );
+    p += sizeof(header);
+    int status = 0;
+    if ( memcmp( header.magic, cacheMagic, sizeof(cacheMagic) ) != 0 ||
+         header.size != size || header.mtime != mtime || header.ngrid <= 0 ) {
+        status = 4;
+    } else {
+        m_grid.assign( header.ngrid, BFieldH8Grid() );
+        for ( int i = 0; i < header.ngrid; i++ ) {
+            if ( ! m_grid[i].readCache( p, end ) ) {
+                status = 5;
+                break;
+            }
+        }
+    }
+    munmap( addr, st.st_size );
+    if ( status != 0 ) m_grid.clear();
+    buildIndex();
+    return status;
+}
+
+//
+// Write the binary cache.  It is written under a temporary name and renamed,
+// so that a concurrent reader never sees a partial file.  Failure is not an error.
+//
 void
-BFieldH8Map::getB( const double *xyz, double *B, double *deriv ) const
+BFieldH8Map::writeCache( const char* cachename, long long size, long long mtime ) const
 {
-    for ( unsigned i = 0; i < m_grid.size(); i++ ) {
-        // find the grid that contains xyz
-        if ( m_grid[i].inside( xyz ) ) {
-            m_grid[i].getB( xyz, B, deriv );
-            return;
+    std::string tmpname( cachename );
+    tmpname += ".tmp" + std::to_string( getpid() );
+    std::ofstream output( tmpname.c_str(), std::ios::binary );
+    if ( ! output.good() ) return;
+    CacheHeader header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, cacheMagic, sizeof(cacheMagic) );
+    header.size = size;
+    header.mtime = mtime;
+    header.ngrid = m_grid.size();
+    output.write( (const char*)&header, sizeof(header) );
+    for ( unsigned i = 0; i < m_grid.size(); i++ ) m_grid[i].writeCache( output );
+    output.close();
+    if ( output.fail() || rename( tmpname.c_str(), cachename ) != 0 ) remove( tmpname.c_str() );
+}
+
+//
+// Prepare the grid search.  The bounds of the grids are kept together, so
+// that the search does not touch the grids themselves.  Where grids overlap,
+// the one that comes first in the file is used, so each grid keeps the list
+// of earlier grids it overlaps: a grid that contains the point is the right
+// one only if none of these contains it too.
+//
+void
+BFieldH8Map::buildIndex()
+{
+    m_cache.clear();
+    m_overlap.assign( m_grid.size(), std::vector<int>() );
+    m_bounds.resize( 6*m_grid.size() );
+    for ( int i=0; i<3; i++ ) {
+        m_min[i] = 1e30;
+        m_max[i] = -1e30;
+    }
+    for ( unsigned k = 0; k < m_grid.size(); k++ ) {
+        const BFieldH8Grid& g = m_grid[k];
+        for ( int i=0; i<3; i++ ) {
+            m_bounds[6*k+i] = g.min(i);
+            m_bounds[6*k+3+i] = g.max(i);
+            if ( g.min(i) < m_min[i] ) m_min[i] = g.min(i);
+            if ( g.max(i) > m_max[i] ) m_max[i] = g.max(i);
         }
+        for ( unsigned l = 0; l < k; l++ ) {
+            const BFieldH8Grid& h = m_grid[l];
+            bool overlap = true;
+            for ( int i=0; i<3; i++ ) {
+                if ( h.max(i) < g.min(i) || h.min(i) > g.max(i) ) overlap = false;
+            }
+            if ( overlap ) m_overlap[k].push_back( l );
+        }
+    }
+}
+
+bool
+BFieldH8Map::firstGrid( int i, const double *xyz ) const
+{
+    const std::vector<int>& overlap = m_overlap[i];
+    for ( unsigned k = 0; k < overlap.size(); k++ ) {
+        if ( insideGrid( overlap[k], xyz ) ) return false;
+    }
+    return true;
+}
+
+//
+// Search the grids in the most-recently-used order of the cache (file order
+// for a new cache), and move the grid found to the front.  Only one grid
+// contains xyz and takes precedence, so the order does not change the result.
+//
+int
+BFieldH8Map::findGrid( const double *xyz, BFieldH8Cache& cache ) const
+{
+    // outside all grids?
+    for ( int i=0; i<3; i++ ) {
+        if ( xyz[i] < m_min[i] || xyz[i] > m_max[i] ) return -1;
+    }
+    std::vector<int>& order = cache.m_order;
+    if ( order.size() != m_grid.size() ) {
+        order.resize( m_grid.size() );
+        for ( unsigned k = 0; k < order.size(); k++ ) order[k] = k;
+    }
+    for ( unsigned k = 0; k < order.size(); k++ ) {
+        int i = order[k];
+        if ( insideGrid( i, xyz ) && firstGrid( i, xyz ) ) {
+            for ( ; k > 0; k-- ) order[k] = order[k-1];
+            order[0] = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool
+BFieldH8Map::inside( const double *xyz ) const
+{
+    for ( unsigned i = 0; i < m_grid.size(); i++ ) {
+        if ( insideGrid( i, xyz ) ) return true;
+    }
+    return false;
+}
+
+void
+BFieldH8Map::getB( const double *xyz, double *B, double *deriv ) const
+{
+    getB( xyz, B, deriv, m_cache );
+}
+
+void
+BFieldH8Map::getB( const double *xyz, double *B, double *deriv, BFieldH8Cache& cache ) const
+{
+    if ( m_recorder ) m_recorder->record( BFieldRecorder::H8, xyz, deriv != 0 );
+    // same cell as the last call?
+    if ( cache.inside( xyz ) && firstGrid( cache.grid(), xyz ) ) {
+        cache.getB( xyz, B, deriv );
+        return;
+    }
+    int i = findGrid( xyz, cache );
+    if ( i >= 0 ) {
+        m_grid[i].getCache( xyz, cache );
+        cache.setGrid( i );
+        cache.getB( xyz, B, deriv );
+        return;
     }
     // xyz is outside all grids
     B[0] = B[1] = B[2] = 0.0;
@@ -40,4 +256,3 @@ BFieldH8Map::getB( const double *xyz, double *B, double *deriv ) const
     }
     return;
 }
-
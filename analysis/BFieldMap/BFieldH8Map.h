@@ -12,14 +12,49 @@
 #include <iostream>
 
 #include "BFieldH8Grid.h"
+#include "BFieldRecorder.h"
 
 class BFieldH8Map {
 public:
-    BFieldH8Map() {;}
+    BFieldH8Map() : m_recorder(0) { buildIndex(); }
     void readMap( std::istream& input );
+    // read the map from a text file, or from its binary cache <filename>.cache
+    // if it is up to date.  The cache is (re)written after reading the text.
+    // returns 0 if successful.
+    int readMap( const char* filename );
     void getB( const double *xyz, double *B, double *deriv=0 ) const;
+    // same, using a cache owned by the caller (one per thread)
+    void getB( const double *xyz, double *B, double *deriv, BFieldH8Cache& cache ) const;
+    // test if xyz is inside any of the grids
+    bool inside( const double *xyz ) const;
+    // write every getB() query to recorder, which must outlive its use here (0 to stop)
+    void setRecorder( BFieldRecorder* recorder ) { m_recorder = recorder; }
+    // access grids
+    int ngrid() const { return m_grid.size(); }
+    const BFieldH8Grid& grid( int i ) const { return m_grid[i]; }
 private:
+    // index of the grid that contains xyz, -1 if none.  The grids are tried in
+    // the order of the cache, which is updated to put the grid found first.
+    int findGrid( const double *xyz, BFieldH8Cache& cache ) const;
+    // test if xyz is inside the bounds of grid i
+    bool insideGrid( int i, const double *xyz ) const
+    { const double *b = &m_bounds[6*i];
+      return ( xyz[0]>=b[0] && xyz[0]<=b[3] && xyz[1]>=b[1] && xyz[1]<=b[4] && xyz[2]>=b[2] && xyz[2]<=b[5] ); }
+    // true if no grid that takes precedence over grid i contains xyz
+    bool firstGrid( int i, const double *xyz ) const;
+    void buildIndex(); // called from readMap
+    // binary cache, tagged with the size and modification time of the text file
+    int readCache( const char* cachename, long long size, long long mtime );
+    void writeCache( const char* cachename, long long size, long long mtime ) const;
     std::vector<BFieldH8Grid> m_grid;
+    // index for the grid search
+    double m_min[3], m_max[3];           // bounding box of all grids
+    std::vector<double> m_bounds;        // (min x,y,z, max x,y,z) of each grid
+    std::vector< std::vector<int> > m_overlap; // earlier grids that overlap each grid
+    // cache for speed
+    mutable BFieldH8Cache m_cache;
+    // query recorder, if any
+    BFieldRecorder* m_recorder;
 };
 
 #endif
@@ -0,0 +1,209 @@
+//
+// BFieldHolder.h
+//
+// Holder of the active field map of a long-running process, which can be
+// replaced at any time (e.g. at a run boundary) while other threads use it.
+//
+// The map is published through an atomic pointer, and old maps are reclaimed
+// with epochs: each reader thread owns a slot in which it announces the epoch
+// it entered while it holds the map.  publish() bumps the epoch, and an old map
+// is deleted once no slot still shows an epoch older than its retirement.
+// Readers never block and never take a lock; only publish() and reclaim() do.
+//
+// A published map must be fully built (zones appended, buildLUT() called), and
+// is never modified afterwards.  Readers must use the getB() methods with a cache
+// of their own, and clear it when version() changes: the cache points into the
+// zones of the map it was filled from.
+//
+// A reader that gets no slot (registerReader() returns -1) may still use a
+// Guard with slot -1: it then holds the writers' lock instead, which is safe
+// but blocks publish() and the other readers without a slot meanwhile.
+//
+// Usage, in each reader thread:
+//     int slot = holder.registerReader();
+//     ...
+//     {
+//         BFieldHolder<BFieldMap>::Guard map( holder, slot );
+//         if ( map.version() != lastVersion ) { cache.clear(); lastVersion = map.version(); }
+//         map->getB( xyz, B, deriv, cache );
+//     }
+//     ...
+//     holder.unregisterReader( slot );
+//
+#ifndef BFIELDHOLDER_H
+#define BFIELDHOLDER_H
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+
+template <class T>
+class BFieldHolder {
+public:
+    // constructor - takes ownership of map (may be 0); at most nslot reader threads
+    explicit BFieldHolder( T* map = 0, int nslot = 64 );
+    // destructor deletes all the maps - no reader may hold one any more
+    ~BFieldHolder();
+    // get a reader slot for the calling thread (-1 if all are taken)
+    int registerReader();
+    void unregisterReader( int slot );
+    // publish a new map, taking ownership of it; the previous one is retired,
+    // and deleted once no reader can see it any more
+    void publish( T* map );
+    // delete the retired maps that no reader can see; returns the number left
+    int reclaim();
+    // number of maps published so far, and of retired maps not yet deleted
+    unsigned long version() const { return m_version.load(); }
+    int nretired() const { std::lock_guard<std::mutex> lock( m_mutex ); return m_retired.size(); }
+    //
+    // Access to the current map for the lifetime of the guard.
+    // Guards may not be nested within one slot.  With slot -1, the guard
+    // holds the writers' lock, and the holder may not be called meanwhile.
+    //
+    class Guard {
+    public:
+        Guard( const BFieldHolder<T>& holder, int slot )
+            : m_slot( ( slot >= 0 && slot < int(holder.m_slot.size()) ) ? &holder.m_slot[slot] : 0 ),
+              m_mutex( m_slot ? 0 : &holder.m_mutex )
+        {
+            if ( m_mutex ) {
+                m_mutex->lock();
+            } else {
+                // announce the epoch before loading the pointer, so that publish()
+                // either sees this reader or has already replaced the map
+                m_slot->epoch.store( holder.m_epoch.load() );
+            }
+            m_node = holder.m_current.load();
+        }
+        ~Guard()
+        {
+            if ( m_mutex ) m_mutex->unlock();
+            else m_slot->epoch.store( 0, std::memory_order_release );
+        }
+        const T* get() const { return m_node->map; }
+        const T* operator->() const { return m_node->map; }
+        const T& operator*() const { return *m_node->map; }
+        unsigned long version() const { return m_node->version; }
+    private:
+        Guard( const Guard& );            // not copyable
+        Guard& operator=( const Guard& );
+        typename BFieldHolder<T>::Slot* m_slot; // 0 without a slot
+        std::mutex* m_mutex;                     // the writers' lock, held without a slot
+        const typename BFieldHolder<T>::Node* m_node;
+    };
+private:
+    BFieldHolder( const BFieldHolder& );            // not copyable
+    BFieldHolder& operator=( const BFieldHolder& );
+    // a published map
+    struct Node {
+        T* map;
+        unsigned long version;
+        unsigned long retired; // epoch at which it was replaced
+    };
+    // a reader slot, on its own cache line
+    struct Slot {
+        std::atomic<unsigned long> epoch; // 0 when the reader holds no map
+        std::atomic<bool> used;
+        char pad[64 - sizeof(std::atomic<unsigned long>) - sizeof(std::atomic<bool>)];
+    };
+    std::atomic<Node*> m_current;
+    std::atomic<unsigned long> m_epoch; // starts at 1
+    std::atomic<unsigned long> m_version; // version of m_current, readable without a guard
+    mutable std::vector<Slot> m_slot;
+    mutable std::mutex m_mutex;         // serializes the writers
+    std::vector<Node*> m_retired;
+    int reclaimLocked(); // reclaim(), with m_mutex held
+};
+
+template <class T>
+BFieldHolder<T>::BFieldHolder( T* map, int nslot )
+    : m_epoch(1), m_version(0), m_slot(nslot)
+{
+    for ( int i = 0; i < nslot; i++ ) {
+        m_slot[i].epoch.store( 0 );
+        m_slot[i].used.store( false );
+    }
+    Node* node = new Node;
+    node->map = map;
+    node->version = 0;
+    node->retired = 0;
+    m_current.store( node );
+}
+
+template <class T>
+BFieldHolder<T>::~BFieldHolder()
+{
+    for ( unsigned i = 0; i < m_retired.size(); i++ ) {
+        delete m_retired[i]->map;
+        delete m_retired[i];
+    }
+    Node* node = m_current.load();
+    delete node->map;
+    delete node;
+}
+
+template <class T>
+int BFieldHolder<T>::registerReader()
+{
+    for ( unsigned i = 0; i < m_slot.size(); i++ ) {
+        bool expected = false;
+        if ( m_slot[i].used.compare_exchange_strong( expected, true ) ) return i;
+    }
+    return -1;
+}
+
+template <class T>
+void BFieldHolder<T>::unregisterReader( int slot )
+{
+    if ( slot < 0 || slot >= int(m_slot.size()) ) return;
+    m_slot[slot].epoch.store( 0 );
+    m_slot[slot].used.store( false );
+}
+
+template <class T>
+void BFieldHolder<T>::publish( T* map )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    Node* node = new Node;
+    node->map = map;
+    node->version = m_version.load() + 1;
+    node->retired = 0;
+    Node* old = m_current.exchange( node );
+    m_version.store( node->version );
+    // readers that announce the new epoch can only load the new map
+    old->retired = m_epoch.fetch_add( 1 ) + 1;
+    m_retired.push_back( old );
+    reclaimLocked();
+}
+
+template <class T>
+int BFieldHolder<T>::reclaim()
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return reclaimLocked();
+}
+
+template <class T>
+int BFieldHolder<T>::reclaimLocked()
+{
+    // oldest epoch announced by a reader that holds a map
+    unsigned long oldest = m_epoch.load();
+    for ( unsigned i = 0; i < m_slot.size(); i++ ) {
+        unsigned long e = m_slot[i].epoch.load();
+        if ( e != 0 && e < oldest ) oldest = e;
+    }
+    // a map retired at epoch e can only be held by readers that entered before e
+    std::vector<Node*> left;
+    for ( unsigned i = 0; i < m_retired.size(); i++ ) {
+        if ( m_retired[i]->retired <= oldest ) {
+            delete m_retired[i]->map;
+            delete m_retired[i];
+        } else {
+            left.push_back( m_retired[i] );
+        }
+    }
+    m_retired.swap( left );
+    return m_retired.size();
+}
+
+#endif
@@ -0,0 +1,179 @@
+//
+// BFieldIntegralTable.cxx
+//
+#include "BFieldIntegralTable.h"
+#include "BFieldThreadPool.h"
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+namespace {
+    const char magic[8] = { 'B', 'F', 'I', 'N', 'T', 'T', 'B', '1' };
+
+    // node below x (in units of the step, from the first node) on an axis of
+    // n nodes, and the fraction f of the step above it.  x is clamped to the
+    // axis, and status set to 1 if it was outside.
+    inline int locate( double x, int n, double& f, int& status )
+    {
+        if ( !( x >= 0.0 ) ) {
+            x = 0.0;
+            status = 1;
+        } else if ( x > n-1 ) {
+            x = n-1;
+            status = 1;
+        }
+        int i = min( int(x), max( n-2, 0 ) );
+        f = x - i;
+        return i;
+    }
+}
+
+//
+// Compute the integrals at the nodes, one z0 at a time.
+// BFieldLineIntegral::integrateGrid() works at the centres of bins, so the
+// bins are shifted by half a step to centre them on the nodes.
+//
+void
+BFieldIntegralTable::fill( const BFieldLineIntegral& integral, int neta, double etamin, double etamax,
+                           int nphi, int nz0, double z0min, double z0max, BFieldThreadPool& pool )
+{
+    m_neta = max( neta, 1 );
+    m_nphi = max( nphi, 1 );
+    m_nz0 = max( nz0, 1 );
+    m_etamin = etamin;
+    m_etamax = ( m_neta > 1 ) ? etamax : etamin;
+    m_z0min = z0min;
+    m_z0max = ( m_nz0 > 1 ) ? z0max : z0min;
+    m_range[0] = integral.rin();
+    m_range[1] = integral.rout();
+    m_range[2] = integral.zin();
+    m_range[3] = integral.zout();
+    setSteps();
+    double deta = ( m_neta > 1 ) ? ( m_etamax-m_etamin )/( m_neta-1 ) : 0.0;
+    double dphi = 2.0*M_PI/m_nphi;
+    m_value.resize( m_nz0*m_neta*m_nphi*N );
+    vector<double> result;
+    for ( int iz0 = 0; iz0 < m_nz0; iz0++ ) {
+        double z0 = ( m_nz0 > 1 ) ? m_z0min + ( m_z0max-m_z0min )*iz0/( m_nz0-1 ) : m_z0min;
+        integral.integrateGrid( m_neta, m_etamin-0.5*deta, m_etamax+0.5*deta,
+                                m_nphi, -M_PI-0.5*dphi, M_PI-0.5*dphi, z0, result, pool );
+        float *value = &m_value[iz0*m_neta*m_nphi*N];
+        for ( int i = 0; i < m_neta*m_nphi; i++ ) {
+            value[N*i+Bphi] = result[BFieldLineIntegral::N*i+BFieldLineIntegral::Bphi];
+            value[N*i+Btheta] = result[BFieldLineIntegral::N*i+BFieldLineIntegral::Btheta];
+        }
+    }
+}
+
+//
+// Write the table to a binary file
+//
+int
+BFieldIntegralTable::write( const char* filename ) const
+{
+    FILE* file = fopen( filename, "wb" );
+    const int n[3] = { m_neta, m_nphi, m_nz0 };
+    const double x[8] = { m_etamin, m_etamax, m_z0min, m_z0max, m_range[0], m_range[1], m_range[2], m_range[3] };
+    bool ok = ( file != 0 && fwrite( magic, 1, sizeof(magic), file ) == sizeof(magic) &&
+                fwrite( n, sizeof(int), 3, file ) == 3 && fwrite( x, sizeof(double), 8, file ) == 8 &&
+                fwrite( m_value.data(), sizeof(float), m_value.size(), file ) == m_value.size() );
+    if ( file && fclose( file ) != 0 ) ok = false;
+    if ( !ok ) {
+        cerr << "BFieldIntegralTable::write(): failed to write " << filename << endl;
+        return 1;
+    }
+    return 0;
+}
+
+//
+// Read the table from a binary file
+//
+int
+BFieldIntegralTable::read( const char* filename )
+{
+    m_neta = m_nphi = m_nz0 = 0;
+    m_value.clear();
+    FILE* file = fopen( filename, "rb" );
+    char head[sizeof(magic)];
+    int n[3];
+    double x[8];
+    if ( file == 0 || fread( head, 1, sizeof(head), file ) != sizeof(head) ||
+         memcmp( head, magic, sizeof(magic) ) != 0 ) {
+        cerr << "BFieldIntegralTable::read(): " << filename << " is not an integral table" << endl;
+        if ( file ) fclose( file );
+        return 1;
+    }
+    if ( fread( n, sizeof(int), 3, file ) != 3 || fread( x, sizeof(double), 8, file ) != 8 ||
+         n[0] < 1 || n[1] < 1 || n[2] < 1 ) {
+        cerr << "BFieldIntegralTable::read(): bad header in " << filename << endl;
+        fclose( file );
+        return 1;
+    }
+    size_t size = size_t(n[0])*n[1]*n[2]*N;
+    m_value.resize( size );
+    size_t nread = fread( m_value.data(), sizeof(float), size, file );
+    bool extra = ( fgetc( file ) != EOF );
+    fclose( file );
+    if ( nread != size || extra ) {
+        cerr << "BFieldIntegralTable::read(): " << filename << " has " << ( extra ? "more" : "fewer" )
+             << " values than its grid" << endl;
+        m_value.clear();
+        return 1;
+    }
+    m_neta = n[0];
+    m_nphi = n[1];
+    m_nz0 = n[2];
+    m_etamin = x[0];
+    m_etamax = x[1];
+    m_z0min = x[2];
+    m_z0max = x[3];
+    for ( int i = 0; i < 4; i++ ) m_range[i] = x[4+i];
+    setSteps();
+    return 0;
+}
+
+//
+// Trilinear interpolation between the 8 nodes around (eta, phi, z0).
+// phi is periodic, eta and z0 are clamped to the table.
+//
+int
+BFieldIntegralTable::lookup( double eta, double phi, double z0, double *I ) const
+{
+    I[Bphi] = I[Btheta] = 0.0;
+    if ( m_value.empty() ) return 1;
+    int status = 0;
+    double feta, fz0;
+    int ieta = locate( ( eta-m_etamin )*m_invdeta, m_neta, feta, status );
+    int iz0 = locate( ( z0-m_z0min )*m_invdz0, m_nz0, fz0, status );
+    double x = ( phi+M_PI )*m_invdphi;
+    x -= m_nphi*floor( x/m_nphi );
+    if ( !( x < m_nphi ) ) x = 0.0; // rounding up to 2pi, or not a number
+    int iphi = int(x);
+    double fphi = x - iphi;
+    // strides to the next node along each axis (0 on an axis of one node)
+    const int seta = ( m_neta > 1 ) ? m_nphi*N : 0;
+    const int sz0 = ( m_nz0 > 1 ) ? m_neta*m_nphi*N : 0;
+    const int sphi = ( iphi+1 < m_nphi ) ? N : ( 1-m_nphi )*N;
+    const float *v = &m_value[( ( iz0*m_neta + ieta )*m_nphi + iphi )*N];
+    double geta = 1.0-feta, gphi = 1.0-fphi, gz0 = 1.0-fz0;
+    for ( int k = 0; k < N; k++ ) {
+        I[k] = gz0*( geta*( gphi*v[k] + fphi*v[k+sphi] ) + feta*( gphi*v[k+seta] + fphi*v[k+seta+sphi] ) )
+             + fz0*( geta*( gphi*v[k+sz0] + fphi*v[k+sz0+sphi] ) +
+                     feta*( gphi*v[k+sz0+seta] + fphi*v[k+sz0+seta+sphi] ) );
+    }
+    return status;
+}
+
+//
+// utility function: inverse steps of the grid
+//
+void
+BFieldIntegralTable::setSteps()
+{
+    m_invdeta = ( m_neta > 1 && m_etamax > m_etamin ) ? ( m_neta-1 )/( m_etamax-m_etamin ) : 0.0;
+    m_invdz0 = ( m_nz0 > 1 && m_z0max > m_z0min ) ? ( m_nz0-1 )/( m_z0max-m_z0min ) : 0.0;
+    m_invdphi = m_nphi/( 2.0*M_PI );
+}
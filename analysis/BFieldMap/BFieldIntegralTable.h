@@ -0,0 +1,59 @@
+//
+// BFieldIntegralTable.h
+//
+// Table of the bending power Int Bphi dl and Int Btheta dl along straight
+// rays from (0,0,z0), as computed by BFieldLineIntegral, on a grid of nodes
+// in (eta, phi, z0).  The table is filled once for a map by makeIntTable and
+// written to a binary file; lookup() then interpolates it in constant time,
+// so that the integral can be attached to every muon of a skim.
+// The file holds the magic "BFINTTB1", the grid and the integration range,
+// and the values as floats, all in the native byte order.
+//
+#ifndef BFIELDINTEGRALTABLE_H
+#define BFIELDINTEGRALTABLE_H
+
+#include <vector>
+#include "BFieldLineIntegral.h"
+
+class BFieldThreadPool;
+
+class BFieldIntegralTable {
+public:
+    // components of the table
+    enum { Bphi = 0, Btheta = 1, N = 2 };
+    BFieldIntegralTable() : m_neta(0), m_nphi(0), m_nz0(0) {;}
+    // compute the table with integral, on neta nodes from etamin to etamax,
+    // nphi nodes from -pi with a step of 2pi/nphi, and nz0 nodes from z0min
+    // to z0max (a single one at z0min if nz0 = 1), on the threads of pool
+    void fill( const BFieldLineIntegral& integral, int neta, double etamin, double etamax,
+               int nphi, int nz0, double z0min, double z0max, BFieldThreadPool& pool );
+    // write/read the table.  Return 0 if successful
+    int write( const char* filename ) const;
+    int read( const char* filename );
+    // interpolate the table at (eta, phi, z0): I[Bphi], I[Btheta] in kT mm = T m.
+    // returns 0 inside the table, 1 if eta or z0 is outside, where the
+    // values at the edge are used
+    int lookup( double eta, double phi, double z0, double *I ) const;
+    // accessors
+    int neta() const { return m_neta; }
+    int nphi() const { return m_nphi; }
+    int nz0() const { return m_nz0; }
+    double etamin() const { return m_etamin; }
+    double etamax() const { return m_etamax; }
+    double z0min() const { return m_z0min; }
+    double z0max() const { return m_z0max; }
+    // integration range: rin, rout, zin, zout (mm), see BFieldLineIntegral::setRange()
+    const double* range() const { return m_range; }
+    // memory used by the values (bytes)
+    size_t memory() const { return m_value.size()*sizeof(float); }
+private:
+    int m_neta, m_nphi, m_nz0;
+    double m_etamin, m_etamax, m_z0min, m_z0max;
+    double m_range[4];
+    double m_invdeta, m_invdphi, m_invdz0;
+    // values at node (iz0, ieta, iphi): m_value[((iz0*m_neta+ieta)*m_nphi+iphi)*N+k]
+    std::vector<float> m_value;
+    void setSteps();
+};
+
+#endif
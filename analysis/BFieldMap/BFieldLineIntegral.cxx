@@ -0,0 +1,77 @@
+//
+// BFieldLineIntegral.cxx
+//
+#include "BFieldLineIntegral.h"
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+//
+// Constructor
+//
+BFieldLineIntegral::BFieldLineIntegral( const BFieldMap* map )
+    : m_map(map), m_rin(4300.), m_rout(12200.), m_zin(7100.), m_zout(15000.)
+{
+}
+
+//
+// Integrate along one ray, with a cache of its own
+//
+double
+BFieldLineIntegral::integrate( double eta, double phi, double z0, double *I ) const
+{
+    BFieldCache cache;
+    return integrate( eta, phi, z0, I, cache );
+}
+
+//
+// Integrate along one ray.
+// The ray enters the range at the inner cylinder or the inner end-plane,
+// whichever comes first, and leaves it in the same way at the outer ones.
+//
+double
+BFieldLineIntegral::integrate( double eta, double phi, double z0, double *I, BFieldCache& cache ) const
+{
+    double theta = 2.0*atan(exp(-eta));
+    double sintheta = sin(theta);
+    double costheta = cos(theta);
+    double cotTheta = costheta/sintheta;
+    // transverse distance where the ray crosses the end-planes |z| = zin, zout
+    double Rstart = m_rin;
+    double Rend = m_rout;
+    if ( cotTheta != 0.0 ) {
+        double sign = ( cotTheta > 0.0 ) ? 1.0 : -1.0;
+        Rstart = min( Rstart, max( 0.0, (sign*m_zin-z0)/cotTheta ) );
+        Rend = min( Rend, max( 0.0, (sign*m_zout-z0)/cotTheta ) );
+    }
+    for ( int k = 0; k < N; k++ ) I[k] = 0.0;
+    if ( Rend <= Rstart ) return 0.0;
+    double cosphi = cos(phi);
+    double sinphi = sin(phi);
+    double p1[3] = { Rstart*cosphi, Rstart*sinphi, z0 + Rstart*cotTheta };
+    double p2[3] = { Rend*cosphi, Rend*sinphi, z0 + Rend*cotTheta };
+    m_map->integrateB( p1, p2, I, cache );
+    // project on the unit vectors of the ray
+    I[Bphi] = -sinphi*I[Bx] + cosphi*I[By];
+    I[Btheta] = costheta*( cosphi*I[Bx] + sinphi*I[By] ) - sintheta*I[Bz];
+    return Rend - Rstart;
+}
+
+//
+// Integrate on a grid of rays in parallel, each worker with its own cache.
+//
+void
+BFieldLineIntegral::integrateGrid( int neta, double etamin, double etamax,
+                                   int nphi, double phimin, double phimax, double z0,
+                                   vector<double>& result, BFieldThreadPool& pool ) const
+{
+    result.resize( neta*nphi*N );
+    vector<BFieldCache> cache( pool.nthread() );
+    pool.run( neta, [&]( int ieta, int ithread ) {
+        double eta = etamin + (etamax-etamin)/neta*(ieta+0.5);
+        for ( int iphi = 0; iphi < nphi; iphi++ ) {
+            double phi = phimin + (phimax-phimin)/nphi*(iphi+0.5);
+            integrate( eta, phi, z0, &result[(ieta*nphi+iphi)*N], cache[ithread] );
+        }
+    } );
+}
@@ -0,0 +1,44 @@
+//
+// BFieldLineIntegral.h
+//
+// Integrals of the toroid field along straight rays from a point (0,0,z0)
+// on the beam line, as used to compare the bending power of two maps.
+// Each ray is defined by (eta,phi) and integrated between an inner and an
+// outer cylinder, like the old TF1-based compIntBphi/compIntBtheta.
+//
+#ifndef BFIELDLINEINTEGRAL_H
+#define BFIELDLINEINTEGRAL_H
+
+#include <vector>
+#include "BFieldMap.h"
+#include "BFieldThreadPool.h"
+
+class BFieldLineIntegral {
+public:
+    // components of the result
+    enum { Bx = 0, By = 1, Bz = 2, Bphi = 3, Btheta = 4, N = 5 };
+    // constructor - default range is the muon spectrometer
+    BFieldLineIntegral( const BFieldMap* map );
+    // set the integration range: from the cylinder (rin,zin) to the cylinder (rout,zout)
+    void setRange( double rin, double rout, double zin, double zout )
+    { m_rin = rin; m_rout = rout; m_zin = zin; m_zout = zout; }
+    double rin() const { return m_rin; }
+    double rout() const { return m_rout; }
+    double zin() const { return m_zin; }
+    double zout() const { return m_zout; }
+    // integrals along the ray (eta,phi) from (0,0,z0), in kT mm = T m:
+    // I[Bx..Bz] = Int B dl, I[Bphi] = Int B.e_phi dl, I[Btheta] = Int B.e_theta dl
+    // returns the transverse length of the integration range
+    double integrate( double eta, double phi, double z0, double *I, BFieldCache& cache ) const;
+    double integrate( double eta, double phi, double z0, double *I ) const;
+    // integrals on a grid of neta x nphi rays, computed on the thread pool.
+    // the bin centres are used, and result[(ieta*nphi+iphi)*N+k] is filled.
+    void integrateGrid( int neta, double etamin, double etamax,
+                        int nphi, double phimin, double phimax, double z0,
+                        std::vector<double>& result, BFieldThreadPool& pool ) const;
+private:
+    const BFieldMap* m_map;
+    double m_rin, m_rout, m_zin, m_zout;
+};
+
+#endif
@@ -0,0 +1,41 @@
+//
+// BFieldLogHistogram.h
+//
+// Binning shared by the latency histograms of BFieldProfiler (in cycles) and
+// BFieldLatency (in ns): 4 bins per factor 2 from 1, with bin 0 taking all
+// values below 2^(1/4) and the last bin taking the overflow.
+//
+#ifndef BFIELDLOGHISTOGRAM_H
+#define BFIELDLOGHISTOGRAM_H
+
+#include <cmath>
+
+class BFieldLogHistogram {
+public:
+    // bin of x in a histogram of nbin bins
+    static int bin( double x, int nbin )
+    {
+        int k = ( x > 1.0 ) ? int( 4.0*log2( x ) ) : 0;
+        return ( k < nbin ) ? k : nbin-1;
+    }
+    // lower edge of bin k
+    static double edge( double k ) { return pow( 2.0, k/4.0 ); }
+    // quantile q (0-1) of the contents of nbin bins, interpolated in log
+    // scale inside the bin (0 if the bins are empty)
+    static double quantile( const unsigned long *count, int nbin, double q )
+    {
+        double n( 0.0 );
+        for ( int k = 0; k < nbin; k++ ) n += count[k];
+        if ( n == 0 ) return 0.0;
+        double target = q*n;
+        double sum( 0.0 );
+        for ( int k = 0; k < nbin; k++ ) {
+            double nk = count[k];
+            if ( nk > 0 && sum + nk >= target ) return edge( k + ( target-sum )/nk );
+            sum += nk;
+        }
+        return edge( nbin );
+    }
+};
+
+#endif
@@ -2,39 +2,25 @@
 // BFieldMap.cxx
 //
 #include "BFieldMap.h"
+#include "BFieldThreadPool.h"
 #include <fstream>
 #include <string>
 #include <cmath>
 #include <algorithm>
-#include "TTree.h"
 using namespace std;
 
-//
-// Read the solenoid map from file.
-// If the filename ends with ".root", it's in a ROOT format.
-// Otherwise, it's in a compressed ASCII format.
-//
-int
-BFieldMap::readMap( const char* filename )
-{
-    if ( strstr( filename, ".root" ) != 0 ) {
-        TFile* rootfile = new TFile( filename, "OLD" );
-        if ( ! rootfile ) {
-            cerr << "BFieldMap::readMap(): failed to open " << filename << endl;
-            return 1;
-        }
-        readMap( rootfile );
-        rootfile->Close();
-        delete rootfile;
-    } else {
-        ifstream textfile( filename );
-        if ( ! textfile.good() ) {
-            cerr << "BFieldMap::readMap(): failed to open " << filename << endl;
-            return 1;
-        }
-        readMap( textfile );
-    } 
-    return 0;
+namespace {
+    // valid field volume
+    const double r2max(14000.*14000.);
+    const double zmax(23000.);
+    const double r2beam(60.*60.);
+    const double zbeam(12850.);
+    const double defaultB(1e-8); // 0.1 gauss in kT - returned outside the valid volume
+
+    inline bool insideVolume( double z, double r2 )
+    {
+        return !( abs(z) > zmax || r2 > r2max || ( abs(z) > zbeam && r2 < r2beam ) );
+    }
 }
 
 //
@@ -287,292 +273,6 @@ BFieldMap::readMap( istream& input )
     return 0;
 }
 
-//
-// wrire the map to a ROOT file
-//
-void
-BFieldMap::writeMap( TFile* rootfile )
-{
-    if ( rootfile == 0 ) return; // no file
-    if ( rootfile->cd() == false ) return; // could not make it current directory
-    // define the tree
-    TTree* tree = new TTree( "BFieldMap", "BFieldMap version 6" );
-    TTree* tmax = new TTree( "BFieldMapSize", "Buffer size information" );
-    int id;
-    double zmin, zmax, rmin, rmax, phimin, phimax;
-    double bscale;
-    int ncond;
-    bool *finite;
-    double *p1x, *p1y, *p1z, *p2x, *p2y, *p2z;
-    double *curr;
-    int nmeshz, nmeshr, nmeshphi;
-    double *meshz, *meshr, *meshphi;
-    int nfield;
-    short *fieldz, *fieldr, *fieldphi;
-    // prepare arrays - need to know the maximum sizes
-    unsigned maxcond(0), maxmeshz(0), maxmeshr(0), maxmeshphi(0), maxfield(0);
-    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
-        maxcond = max( maxcond, m_zone[i].ncond() );
-        maxmeshz = max( maxmeshz, m_zone[i].nmesh(0) );
-        maxmeshr = max( maxmeshr, m_zone[i].nmesh(1) );
-        maxmeshphi = max( maxmeshphi, m_zone[i].nmesh(2) );
-        maxfield = max( maxfield, m_zone[i].nfield() );
-    }
-    // store the maximum sizes
-    tmax->Branch( "maxcond", &maxcond, "maxcond/i" );
-    tmax->Branch( "maxmeshz", &maxmeshz, "maxmeshz/i" );
-    tmax->Branch( "maxmeshr", &maxmeshr, "maxmeshr/i" );
-    tmax->Branch( "maxmeshphi", &maxmeshphi, "maxmeshphi/i" );
-    tmax->Branch( "maxfield", &maxfield, "maxfield/i" );
-    tmax->Fill();
-    // prepare buffers
-    finite = new bool[maxcond];
-    p1x = new double[maxcond];
-    p1y = new double[maxcond];
-    p1z = new double[maxcond];
-    p2x = new double[maxcond];
-    p2y = new double[maxcond];
-    p2z = new double[maxcond];
-    curr = new double[maxcond];
-    meshz = new double[maxmeshz];
-    meshr = new double[maxmeshr];
-    meshphi = new double[maxmeshphi];
-    fieldz = new short[maxfield];
-    fieldr = new short[maxfield];
-    fieldphi = new short[maxfield];
-    // define the tree branches
-    tree->Branch( "id", &id, "id/I" );
-    tree->Branch( "zmin", &zmin, "zmin/D" );
-    tree->Branch( "zmax", &zmax, "zmax/D" );
-    tree->Branch( "rmin", &rmin, "rmin/D" );
-    tree->Branch( "rmax", &rmax, "rmax/D" );
-    tree->Branch( "phimin", &phimin, "phimin/D" );
-    tree->Branch( "phimax", &phimax, "phimax/D" );
-    tree->Branch( "bscale", &bscale, "bscale/D" );
-    tree->Branch( "ncond", &ncond, "ncond/I" );
-    tree->Branch( "finite", finite, "finite[ncond]/O" );
-    tree->Branch( "p1x", p1x, "p1x[ncond]/D" );
-    tree->Branch( "p1y", p1y, "p1y[ncond]/D" );
-    tree->Branch( "p1z", p1z, "p1z[ncond]/D" );
-    tree->Branch( "p2x", p2x, "p2x[ncond]/D" );
-    tree->Branch( "p2y", p2y, "p2y[ncond]/D" );
-    tree->Branch( "p2z", p2z, "p2z[ncond]/D" );
-    tree->Branch( "curr", curr, "curr[ncond]/D" );
-    tree->Branch( "nmeshz", &nmeshz, "nmeshz/I" );
-    tree->Branch( "meshz", meshz, "meshz[nmeshz]/D" );
-    tree->Branch( "nmeshr", &nmeshr, "nmeshr/I" );
-    tree->Branch( "meshr", meshr, "meshr[nmeshr]/D" );
-    tree->Branch( "nmeshphi", &nmeshphi, "nmeshphi/I" );
-    tree->Branch( "meshphi", meshphi, "meshphi[nmeshphi]/D" );
-    tree->Branch( "nfield", &nfield, "nfield/I" );
-    tree->Branch( "fieldz", fieldz, "fieldz[nfield]/S" );
-    tree->Branch( "fieldr", fieldr, "fieldr[nfield]/S" );
-    tree->Branch( "fieldphi", fieldphi, "fieldphi[nfield]/S" );
-    //tree->Branch( "fbyte", fbyte, "fbyte[nfield]/b" );
-    // loop over zones to write
-    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
-        const BFieldZone z = m_zone[i];
-        id = z.id();
-        zmin = z.zmin(); zmax = z.zmax();
-        rmin = z.rmin(); rmax = z.rmax();
-        phimin = z.phimin(); phimax = z.phimax();
-        bscale = z.bscale();
-        ncond = z.ncond();
-        for ( int j = 0; j < ncond; j++ ) {
-            const BFieldCond c = z.cond(j);
-            finite[j] = c.finite();
-            p1x[j] = c.p1(0);
-            p1y[j] = c.p1(1);
-            p1z[j] = c.p1(2);
-            p2x[j] = c.p2(0);
-            p2y[j] = c.p2(1);
-            p2z[j] = c.p2(2);
-            curr[j] = c.curr();
-        }
-        nmeshz = z.nmesh(0);
-        for ( int j = 0; j < nmeshz; j++ ) {
-            meshz[j] = z.mesh(0,j);
-        }
-        nmeshr = z.nmesh(1);
-        for ( int j = 0; j < nmeshr; j++ ) {
-            meshr[j] = z.mesh(1,j);
-        }
-        nmeshphi = z.nmesh(2);
-        for ( int j = 0; j < nmeshphi; j++ ) {
-            meshphi[j] = z.mesh(2,j);
-        }
-        nfield = z.nfield();
-        for ( int j = 0; j < nfield; j++ ) {
-            const BFieldVector<short> f = z.field(j);
-            fieldz[j] = f.z();
-            fieldr[j] = f.r();
-            fieldphi[j] = f.phi();
-        }
-        tree->Fill();
-    }
-    rootfile->Write();
-    // clean up
-    delete[] finite;
-    delete[] p1x;
-    delete[] p1y;
-    delete[] p1z;
-    delete[] p2x;
-    delete[] p2y;
-    delete[] p2z;
-    delete[] curr;
-    delete[] meshz;
-    delete[] meshr;
-    delete[] meshphi;
-    delete[] fieldz;
-    delete[] fieldr;
-    delete[] fieldphi;
-}
-
-//
-// read the map from a ROOT file.
-// returns 0 if successful.
-//
-int
-BFieldMap::readMap( TFile* rootfile )
-{
-    if ( rootfile == 0 ) return 1; // no file
-    if ( rootfile->cd() == false ) return 2; // could not make it current directory
-    // open the tree
-    TTree* tree = (TTree*)rootfile->Get("BFieldMap");
-    if ( tree == 0 ) return 3; // no tree
-    int id;
-    double zmin, zmax, rmin, rmax, phimin, phimax;
-    double bscale;
-    int ncond;
-    bool *finite;
-    double *p1x, *p1y, *p1z, *p2x, *p2y, *p2z;
-    double *curr;
-    int nmeshz, nmeshr, nmeshphi;
-    double *meshz, *meshr, *meshphi;
-    int nfield;
-    short *fieldz, *fieldr, *fieldphi;
-    // define the fixed-sized branches first
-    tree->SetBranchAddress( "id", &id );
-    tree->SetBranchAddress( "zmin", &zmin );
-    tree->SetBranchAddress( "zmax", &zmax );
-    tree->SetBranchAddress( "rmin", &rmin );
-    tree->SetBranchAddress( "rmax", &rmax );
-    tree->SetBranchAddress( "phimin", &phimin );
-    tree->SetBranchAddress( "phimax", &phimax );
-    tree->SetBranchAddress( "bscale", &bscale );
-    tree->SetBranchAddress( "ncond", &ncond );
-    tree->SetBranchAddress( "nmeshz", &nmeshz );
-    tree->SetBranchAddress( "nmeshr", &nmeshr );
-    tree->SetBranchAddress( "nmeshphi", &nmeshphi );
-    tree->SetBranchAddress( "nfield", &nfield );
-    // prepare arrays - need to know the maximum sizes
-    // open the tree of buffer sizes (may not exist in old maps)
-    unsigned maxcond(0), maxmeshz(0), maxmeshr(0), maxmeshphi(0), maxfield(0);
-    TTree* tmax = (TTree*)rootfile->Get("BFieldMapSize");
-    if ( tmax != 0 ) {
-        tmax->SetBranchAddress( "maxcond", &maxcond );
-        tmax->SetBranchAddress( "maxmeshz", &maxmeshz );
-        tmax->SetBranchAddress( "maxmeshr", &maxmeshr );
-        tmax->SetBranchAddress( "maxmeshphi", &maxmeshphi );
-        tmax->SetBranchAddress( "maxfield", &maxfield );
-        tmax->GetEntry(0);
-    } else { // "BFieldMapSize" tree does not exist
-        for ( int i = 0; i < tree->GetEntries(); i++ ) {
-            tree->GetEntry(i);
-            maxcond = max( maxcond, unsigned(ncond) );
-            maxmeshz = max( maxmeshz, unsigned(nmeshz) );
-            maxmeshr = max( maxmeshr, unsigned(nmeshr) );
-            maxmeshphi = max( maxmeshphi, unsigned(nmeshphi) );
-            maxfield = max( maxfield, unsigned(nfield) );
-        }
-    }
-    finite = new bool[maxcond];
-    p1x = new double[maxcond];
-    p1y = new double[maxcond];
-    p1z = new double[maxcond];
-    p2x = new double[maxcond];
-    p2y = new double[maxcond];
-    p2z = new double[maxcond];
-    curr = new double[maxcond];
-    meshz = new double[maxmeshz];
-    meshr = new double[maxmeshr];
-    meshphi = new double[maxmeshphi];
-    fieldz = new short[maxfield];
-    fieldr = new short[maxfield];
-    fieldphi = new short[maxfield];
-    // define the variable length branches
-    tree->SetBranchAddress( "finite", finite );
-    tree->SetBranchAddress( "p1x", p1x );
-    tree->SetBranchAddress( "p1y", p1y );
-    tree->SetBranchAddress( "p1z", p1z );
-    tree->SetBranchAddress( "p2x", p2x );
-    tree->SetBranchAddress( "p2y", p2y );
-    tree->SetBranchAddress( "p2z", p2z );
-    tree->SetBranchAddress( "curr", curr );
-    tree->SetBranchAddress( "meshz", meshz );
-    tree->SetBranchAddress( "meshr", meshr );
-    tree->SetBranchAddress( "meshphi", meshphi );
-    tree->SetBranchAddress( "fieldz", fieldz );
-    tree->SetBranchAddress( "fieldr", fieldr );
-    tree->SetBranchAddress( "fieldphi", fieldphi );
-    //tree->SetBranchAddress( "fbyte", fbyte );
-    // reserve the space for m_zone so that it won't move as the vector grows
-    m_zone.reserve( tree->GetEntries() );
-    // read all tree and store
-    for ( int i = 0; i < tree->GetEntries(); i++ ) {
-        tree->GetEntry(i);
-        BFieldZone z( id, zmin, zmax, rmin, rmax, phimin, phimax, bscale );
-        z.reserve( nmeshz, nmeshr, nmeshphi );
-        m_zone.push_back(z);
-        for ( int j = 0; j < ncond; j++ ) {
-            double p1[3], p2[3];
-            p1[0] = p1x[j];
-            p1[1] = p1y[j];
-            p1[2] = p1z[j];
-            p2[0] = p2x[j];
-            p2[1] = p2y[j];
-            p2[2] = p2z[j];
-            BFieldCond cond( finite[j], p1, p2, curr[j] );
-            m_zone.back().appendCond(cond);
-        }
-        for ( int j = 0; j < nmeshz; j++ ) {
-            m_zone.back().appendMesh( 0, meshz[j] );
-        }
-        for ( int j = 0; j < nmeshr; j++ ) {
-            m_zone.back().appendMesh( 1, meshr[j] );
-        }
-        for ( int j = 0; j < nmeshphi; j++ ) {
-            m_zone.back().appendMesh( 2, meshphi[j] );
-        }
-        for ( int j = 0; j < nfield; j++ ) {
-            BFieldVector<short> field( fieldz[j], fieldr[j], fieldphi[j] );
-            m_zone.back().appendField( field );
-            //m_zone.back().appendFbyte( fbyte[j] );
-        }
-    }
-    // clean up
-    tree->Delete();
-    delete[] finite;
-    delete[] p1x;
-    delete[] p1y;
-    delete[] p1z;
-    delete[] p2x;
-    delete[] p2y;
-    delete[] p2z;
-    delete[] curr;
-    delete[] meshz;
-    delete[] meshr;
-    delete[] meshphi;
-    delete[] fieldz;
-    delete[] fieldr;
-    delete[] fieldphi;
-    //delete[] fbyte;
-    // build the LUTs
-    buildLUT();
-
-    return 0;
-}
-
 //
 // utility function used by readMap()
 //
@@ -675,16 +375,30 @@ BFieldMap::read_packed_int( istream &input, int &n )
 }
 
 //
-// Search for the zone that contains a point (z, r, phi)
-// This is a linear-search version, used only to construct the LUT.
+// Test if a zone with range zone[6] = { zmin, zmax, rmin, rmax, phimin, phimax }
+// overlaps range[6].  phi is compared modulo 2pi: zones have phimax in [0,2pi]
+// and phimin possibly < 0, while the range is usually given in [-pi,pi].  Both
+// phi ranges are brought to start in [0,2pi), and one that then wraps past 2pi
+// is compared in two parts, by shifting the other one by 2pi.
 //
-const BFieldZone*
-BFieldMap::findZoneSlow( double z, double r, double phi ) const
+bool
+BFieldMap::overlaps( const double *zone, const double *range )
 {
-    for ( int j = m_zone.size()-1; j >= 0; --j ) {
-        if ( m_zone[j].inside( z, r, phi ) ) return &m_zone[j];
-    }
-    return 0;
+    for ( int k = 0; k < 2; k++ ) {
+        if ( zone[2*k] > range[2*k+1] || zone[2*k+1] < range[2*k] ) return false;
+    }
+    const double twopi = 2.0*M_PI;
+    double w1 = zone[5] - zone[4];
+    double w2 = range[5] - range[4];
+    if ( !( w1 >= 0.0 && w2 >= 0.0 ) ) return false;
+    if ( w1 >= twopi || w2 >= twopi ) return true; // the whole circle
+    double a = zone[4] - twopi*floor( zone[4]/twopi );
+    double c = range[4] - twopi*floor( range[4]/twopi );
+    for ( int s = -1; s <= 1; s++ ) {
+        double c1 = c + s*twopi;
+        if ( a <= c1 + w2 && a + w1 >= c1 ) return true;
+    }
+    return false;
 }
 
 //
@@ -694,7 +408,8 @@ BFieldMap::findZoneSlow( double z, double r, double phi ) const
 const BFieldZone*
 BFieldMap::findZone( double z, double r, double phi ) const
 {
-    // make sure it's inside the largest zone
+    // make sure it's inside the largest zone (there is none in an empty map)
+    if ( m_zoneLUT.empty() ) return 0;
     if ( z < m_edge[0].front() || z > m_edge[0].back() || r > m_edge[1].back() ) return 0;
     // find the edges of the zone
     // z
@@ -722,47 +437,231 @@ BFieldMap::findZone( double z, double r, double phi ) const
 // Returns the magnetic field at any position.
 //
 void
-BFieldMap::getB( const double *xyz, double *B, double * ) const
+BFieldMap::getB( const double *xyz, double *B, double *deriv ) const
+{
+    getB( xyz, B, deriv, m_cache );
+}
+
+//
+// Returns the magnetic field at any position.
+// If the direction of motion dir[3] is given, the bin that the track enters
+// next is prefetched whenever a new bin is loaded into the cache.
+//
+void
+BFieldMap::getB( const double *xyz, double *B, double *deriv, const double *dir ) const
+{
+    getB( xyz, B, deriv, m_cache, dir );
+}
+
+//
+// Returns the magnetic field at any position, using the cache given by the caller.
+// Also computes the field derivatives dBi/dxj if deriv[9] is given.
+//
+void
+BFieldMap::getB( const double *xyz, double *B, double *deriv, BFieldCache& cache, const double *dir ) const
+{
+    if ( m_recorder ) m_recorder->record( BFieldRecorder::Toroid, xyz, deriv != 0 );
+    if ( m_profiler && m_profiler->sample() ) {
+        unsigned long long t0 = BFieldProfiler::cycles();
+        int hit = evaluate( xyz, B, deriv, cache, dir );
+        unsigned long long t1 = BFieldProfiler::cycles();
+        int zone = ( hit < 0 ) ? nzone() : cache.zone() - &m_zone[0];
+        m_profiler->fill( zone, hit > 0, t1-t0 );
+        return;
+    }
+    evaluate( xyz, B, deriv, cache, dir );
+}
+
+//
+// Body of getB().
+// Returns 1 if the point was inside the cached bin, 0 if a bin was loaded,
+// and -1 if the point is outside all zones.
+//
+int
+BFieldMap::evaluate( const double *xyz, double *B, double *deriv, BFieldCache& cache, const double *dir ) const
 {
-    static const double r2max(14000.*14000.);
-    static const double zmax(23000.);
-    static const double r2beam(60.*60.);
-    static const double zbeam(12850.);
-    static const double defaultB(1e-8); // 0.1 gauss in kT
     // is the position inside the valid field volume?
     double z = xyz[2];
     double r2 = xyz[0]*xyz[0] + xyz[1]*xyz[1];
-    if ( abs(z) > zmax || r2 > r2max || ( abs(z) > zbeam && r2 < r2beam ) ) {
+    if ( ! insideVolume( z, r2 ) ) {
         B[0] = B[1] = B[2] = defaultB;
-        return;
+        if ( deriv ) for ( int i = 0; i < 9; i++ ) deriv[i] = 0.0;
+        return -1;
     }
     // convert to cylindrical coordinates
     double r = sqrt(r2);
     double phi = atan2(xyz[1], xyz[0]);
     // test the cache
-    if ( ! m_cache.inside( z, r, phi ) ) {
+    int hit = 1;
+    if ( ! cache.inside( z, r, phi ) ) {
         // outside the last cached bin
+        hit = 0;
         // search for the zone
-        m_lastzone = findZone( z, r, phi );
-        if ( m_lastzone == 0 ) {
+        const BFieldZone* zone = findZone( z, r, phi );
+        if ( zone == 0 ) {
             // outsize all zones (should not happen)
             B[0] = B[1] = B[2] = defaultB;
-            return;
+            if ( deriv ) for ( int i = 0; i < 9; i++ ) deriv[i] = 0.0;
+            return -1;
+        }
+        zone->getCache( z, r, phi, cache );
+        cache.setZone( zone );
+        if ( dir ) {
+            // convert the direction to (dz/ds, dr/ds, dphi/ds)
+            double dzrphi[3];
+            dzrphi[0] = dir[2];
+            dzrphi[1] = ( r > 0.0 ) ? (xyz[0]*dir[0]+xyz[1]*dir[1])/r : 0.0;
+            dzrphi[2] = ( r2 > 0.0 ) ? (xyz[0]*dir[1]-xyz[1]*dir[0])/r2 : 0.0;
+            zone->prefetchNext( z, r, phi, dzrphi );
+        }
+    }
+    cache.getB( z, r, phi, B, deriv );
+    cache.zone()->addBiotSavart( xyz, B, deriv );
+    return hit;
+}
+
+//
+// Integrate B along the straight line from p1 to p2: intB[3] = Int B dl (kT mm).
+// The line is followed bin by bin through the zones, and each piece is
+// integrated with 3-point Gauss-Legendre quadrature.  Along lines through
+// the z axis the interpolated field is a quadratic polynomial inside a bin,
+// so the quadrature is exact up to the Biot-Savart term.
+//
+void
+BFieldMap::integrateB( const double *p1, const double *p2, double *intB ) const
+{
+    integrateB( p1, p2, intB, m_cache );
+}
+
+void
+BFieldMap::integrateB( const double *p1, const double *p2, double *intB, BFieldCache& cache ) const
+{
+    static const double xg[3] = { -0.774596669241483377, 0.0, 0.774596669241483377 }; // sqrt(3/5)
+    static const double wg[3] = { 5.0/9.0, 8.0/9.0, 5.0/9.0 };
+    static const double tiny(1.0e-5); // mm - used to step across bin boundaries
+    static const double outstep(50.); // mm - step outside the zones
+    double u[3];
+    double len2 = 0.0;
+    for ( int i = 0; i < 3; i++ ) {
+        u[i] = p2[i] - p1[i];
+        len2 += u[i]*u[i];
+        intB[i] = 0.0;
+    }
+    double len = sqrt(len2);
+    if ( len == 0.0 ) return;
+    for ( int i = 0; i < 3; i++ ) u[i] /= len;
+    double t = 0.0;
+    while ( t < len ) {
+        // probe slightly ahead to find the bin that the line enters
+        double ta = min( t + tiny, len );
+        double xyz[3] = { p1[0]+ta*u[0], p1[1]+ta*u[1], p1[2]+ta*u[2] };
+        double z = xyz[2];
+        double r2 = xyz[0]*xyz[0] + xyz[1]*xyz[1];
+        double r = sqrt(r2);
+        double phi = atan2(xyz[1], xyz[0]);
+        const BFieldZone* zone = 0;
+        if ( insideVolume( z, r2 ) ) {
+            if ( cache.inside( z, r, phi ) ) {
+                zone = cache.zone();
+            } else {
+                zone = findZone( z, r, phi );
+                if ( zone ) {
+                    zone->getCache( z, r, phi, cache );
+                    cache.setZone( zone );
+                }
+            }
+        }
+        // end of this piece
+        double tend = zone ? binExit( p1, u, t, cache ) : t + outstep;
+        tend = min( max( tend, ta ), len );
+        // integrate over [t,tend]
+        double half = 0.5*(tend-t);
+        double mid = 0.5*(tend+t);
+        for ( int k = 0; k < 3; k++ ) {
+            double tk = mid + half*xg[k];
+            double x[3] = { p1[0]+tk*u[0], p1[1]+tk*u[1], p1[2]+tk*u[2] };
+            double B[3];
+            if ( zone ) {
+                double zk = x[2];
+                double rk = sqrt(x[0]*x[0]+x[1]*x[1]);
+                double phik = atan2(x[1], x[0]);
+                // a line along a phi edge of the bin may fall outside it by
+                // rounding, where BFieldCache::getB() would take phi around by
+                // 2pi: take phi on the side of the bin, and clamp it into the bin
+                double phic = 0.5*( cache.min(2) + cache.max(2) );
+                if ( phik < phic - M_PI ) phik += 2.0*M_PI;
+                else if ( phik > phic + M_PI ) phik -= 2.0*M_PI;
+                phik = min( max( phik, cache.min(2) ), cache.max(2) );
+                cache.getB( zk, rk, phik, B );
+                zone->addBiotSavart( x, B );
+            } else {
+                getB( x, B, 0, cache );
+            }
+            for ( int i = 0; i < 3; i++ ) intB[i] += wg[k]*half*B[i];
         }
-        m_lastzone->getCache( z, r, phi, m_cache );
+        t = tend;
     }
-    m_cache.getB( z, r, phi, B );
-    m_lastzone->addBiotSavart( xyz, B );
+}
+
+//
+// Utility function used by integrateB().
+// Find where the line p1 + t*u, t > t0, leaves the bin stored in the cache.
+//
+double
+BFieldMap::binExit( const double *p1, const double *u, double t0, const BFieldCache& cache ) const
+{
+    double texit = 1e30;
+    // z planes
+    if ( u[2] > 0.0 ) texit = (cache.max(0)-p1[2])/u[2];
+    else if ( u[2] < 0.0 ) texit = (cache.min(0)-p1[2])/u[2];
+    // r cylinders: |a + t b|^2 = R^2 with a, b the transverse parts of p1, u
+    double a2 = p1[0]*p1[0] + p1[1]*p1[1];
+    double ab = p1[0]*u[0] + p1[1]*u[1];
+    double b2 = u[0]*u[0] + u[1]*u[1];
+    if ( b2 > 0.0 ) {
+        for ( int k = 0; k < 2; k++ ) {
+            double R = ( k == 0 ) ? cache.min(1) : cache.max(1);
+            double d = ab*ab - b2*(a2-R*R);
+            if ( d < 0.0 ) continue;
+            double sq = sqrt(d);
+            double t1 = (-ab - sq)/b2;
+            double t2 = (-ab + sq)/b2;
+            if ( t1 > t0 ) texit = min( texit, t1 );
+            else if ( t2 > t0 ) texit = min( texit, t2 );
+        }
+    }
+    // phi half-planes containing the z axis
+    for ( int k = 0; k < 2; k++ ) {
+        double phi = ( k == 0 ) ? cache.min(2) : cache.max(2);
+        double c = cos(phi);
+        double s = sin(phi);
+        double nb = -s*u[0] + c*u[1];
+        if ( nb == 0.0 ) continue;
+        double t = ( s*p1[0] - c*p1[1] )/nb;
+        if ( t <= t0 ) continue;
+        // must be on the correct side of the axis
+        if ( c*(p1[0]+t*u[0]) + s*(p1[1]+t*u[1]) < 0.0 ) continue;
+        texit = min( texit, t );
+    }
+    return texit;
 }
 
 //
 // Build the look-up table used by FindZone().
 // Called by readMap()
-// It also calls buildLUT() for all zones.
+// It also calls buildLUT() for all zones, on the threads of pool, or on a
+// pool of its own for maps with many zones.
 //
 void
-BFieldMap::buildLUT()
+BFieldMap::buildLUT( BFieldThreadPool* pool )
 {
+    // start from scratch, so that the tables can be rebuilt
+    for ( int j = 0; j < 3; j++ ) {
+        m_edge[j].clear();
+        m_edgeLUT[j].clear();
+    }
+    m_zoneLUT.clear();
+    m_cache.clear();
     // make lists of (z,r,phi) edges of all zones
     for ( int j = 0; j < 3; j++ ) { // z, r, phi
         for ( unsigned i = 0; i < m_zone.size(); i++ ) {
@@ -792,15 +691,12 @@ BFieldMap::buildLUT()
         // m_edge[][] values do not exactly match the m_zone[] boundaries.
         // we have to fix this up in order to avoid invalid field values
         // very close to the zone boundaries.
+        // the edges are sorted, so only those around the boundary are tested
         for ( unsigned i = 0; i < m_zone.size(); i++ ) {
-            for ( unsigned k = 0; k < m_edge[j].size(); k++ ) {
-                if ( fabs(m_zone[i].min(j) - m_edge[j][k]) < 1.0e-6 ) {
-                    m_zone[i].adjustMin(j,m_edge[j][k]);
-                }
-                if ( fabs(m_zone[i].max(j) - m_edge[j][k]) < 1.0e-6 ) {
-                    m_zone[i].adjustMax(j,m_edge[j][k]);
-                }
-            }
+            int k = closeEdge( m_edge[j], m_zone[i].min(j) );
+            if ( k >= 0 ) m_zone[i].adjustMin(j,m_edge[j][k]);
+            k = closeEdge( m_edge[j], m_zone[i].max(j) );
+            if ( k >= 0 ) m_zone[i].adjustMax(j,m_edge[j][k]);
         }
     }
     // build LUT for edge finding
@@ -823,24 +719,186 @@ BFieldMap::buildLUT()
             m_edgeLUT[j].push_back(m);
         }
     }
-    // build LUT for zone finding
-    int nz = m_edge[0].size() - 1;
-    int nr = m_edge[1].size() - 1;
-    int nphi = m_edge[2].size() - 1;
-    for ( int iz = 0; iz < nz; iz++ ) {
-        double z = 0.5*(m_edge[0][iz]+m_edge[0][iz+1]);
-        for ( int ir = 0; ir < nr; ir++ ) {
-            double r = 0.5*(m_edge[1][ir]+m_edge[1][ir+1]);
-            for ( int iphi = 0; iphi < nphi; iphi++ ) {
-                double phi = 0.5*(m_edge[2][iphi]+m_edge[2][iphi+1]);
-                const BFieldZone* zone = findZoneSlow( z, r, phi );
-                m_zoneLUT.push_back( zone );
+    // build LUT for zone finding.
+    // the zones are painted in order over the cells whose centres they contain,
+    // so that where zones overlap, the last one wins.
+    int n[3];
+    vector<double> centre[3];
+    for ( int j = 0; j < 3; j++ ) {
+        n[j] = m_edge[j].size() - 1;
+        for ( int i = 0; i < n[j]; i++ ) centre[j].push_back( 0.5*(m_edge[j][i]+m_edge[j][i+1]) );
+    }
+    m_zoneLUT.assign( n[0]*n[1]*n[2], 0 );
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        vector<int> cell[3];
+        for ( int j = 0; j < 3; j++ ) insideCells( m_zone[i], j, centre[j], cell[j] );
+        for ( unsigned a = 0; a < cell[0].size(); a++ ) {
+            for ( unsigned b = 0; b < cell[1].size(); b++ ) {
+                const BFieldZone** lut = &m_zoneLUT[( cell[0][a]*n[1] + cell[1][b] )*n[2]];
+                for ( unsigned c = 0; c < cell[2].size(); c++ ) lut[cell[2][c]] = &m_zone[i];
             }
         }
     }
-    // build LUT in each zone
+    // build LUT in each zone, in parallel for large maps
+    const unsigned minParallel = 256;
+    BFieldThreadPool* mypool = ( pool == 0 && m_zone.size() >= minParallel ) ? new BFieldThreadPool : 0;
+    if ( mypool ) pool = mypool;
+    if ( pool ) {
+        pool->run( m_zone.size(), [&]( int i, int ) { m_zone[i].buildLUT(); } );
+    } else {
+        for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+            m_zone[i].buildLUT();
+        }
+    }
+    delete mypool;
+}
+
+//
+// utility function used by buildLUT(): the index of the first of the sorted
+// edges within 1e-6 of x, or -1 if there is none
+//
+int
+BFieldMap::closeEdge( const vector<double>& edge, double x )
+{
+    int k = lower_bound( edge.begin(), edge.end(), x-2.0e-6 ) - edge.begin();
+    for ( ; k < int(edge.size()) && edge[k] < x+2.0e-6; k++ ) {
+        if ( fabs(x - edge[k]) < 1.0e-6 ) return k;
+    }
+    return -1;
+}
+
+//
+// utility function used by buildLUT(): the cells along axis j (z, r, phi)
+// whose centres, sorted, pass the test of BFieldZone::inside() for that axis.
+// In phi, the zone may cover the centres in [phimin,phimax] and, through the
+// wrap-around, those in [phimin-2pi,phimax-2pi].
+//
+void
+BFieldMap::insideCells( const BFieldZone& zone, int j, const vector<double>& centre, vector<int>& cell )
+{
+    const int n = centre.size();
+    int nrange = ( j == 2 ) ? 2 : 1;
+    for ( int k = 0; k < nrange; k++ ) {
+        double shift = ( k == 1 ) ? 2.0*M_PI : 0.0;
+        int i = lower_bound( centre.begin(), centre.end(), zone.min(j)-shift ) - centre.begin();
+        for ( i = max( i-1, 0 ); i < n && centre[i] <= zone.max(j)-shift+1.0e-9; i++ ) {
+            double x = centre[i];
+            if ( j == 2 && x < zone.phimin() ) x += 2.0*M_PI;
+            bool inside = ( x >= zone.min(j) && x <= zone.max(j) );
+            // in phi, each centre belongs to one of the two ranges only
+            if ( j == 2 && ( centre[i] < zone.phimin() ) != ( k == 1 ) ) inside = false;
+            if ( inside ) cell.push_back( i );
+        }
+    }
+}
+
+//
+// Switch between trilinear and tricubic interpolation in all zones
+//
+void
+BFieldMap::setTricubic( bool tricubic )
+{
+    if ( tricubic && compressed() ) {
+        cerr << "BFieldMap::setTricubic(): not available with a compressed map" << endl;
+        return;
+    }
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        if ( tricubic ) m_zone[i].buildTricubic();
+        else m_zone[i].clearTricubic();
+    }
+    m_cache.clear();
+}
+
+//
+// Compress the field of all zones, or expand it again
+//
+int
+BFieldMap::compress( int brick )
+{
+    int status = 0;
+    for ( unsigned i = 0; i < m_zone.size() && status == 0; i++ ) {
+        status = m_zone[i].compress( brick );
+    }
+    if ( status != 0 ) uncompress();
+    m_cache.clear();
+    return status;
+}
+
+void
+BFieldMap::uncompress()
+{
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        m_zone[i].uncompress();
+    }
+    m_cache.clear();
+}
+
+//
+// Fold the zones onto earlier zones with the same field, up to the symmetries
+// of the toroid.  The candidates for each zone are the earlier zones that are
+// not folded themselves.
+//
+int
+BFieldMap::fold()
+{
+    if ( compressed() ) {
+        cerr << "BFieldMap::fold(): not available with a compressed map" << endl;
+        return 0;
+    }
+    int nfold = 0;
+    for ( unsigned i = 1; i < m_zone.size(); i++ ) {
+        for ( unsigned j = 0; j < i; j++ ) {
+            if ( m_zone[j].folded() || !m_zone[i].fold( m_zone[j] ) ) continue;
+            nfold++;
+            break;
+        }
+    }
+    m_cache.clear();
+    return nfold;
+}
+
+void
+BFieldMap::unfold()
+{
+    uncompress();
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        m_zone[i].unfold();
+    }
+    m_cache.clear();
+}
+
+int
+BFieldMap::nfolded() const
+{
+    int n = 0;
     for ( unsigned i = 0; i < m_zone.size(); i++ ) {
-        m_zone[i].buildLUT();
+        n += m_zone[i].folded();
     }
+    return n;
 }
 
+size_t
+BFieldMap::memory() const
+{
+    size_t memory = 0;
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        memory += m_zone[i].memory();
+    }
+    return memory;
+}
+
+//
+// Attach a sampling profiler, with one histogram per zone
+//
+void
+BFieldMap::setProfiler( BFieldProfiler* profiler )
+{
+    m_profiler = profiler;
+    if ( profiler == 0 ) return;
+    vector<int> id( m_zone.size() ), ncond( m_zone.size() );
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        id[i] = m_zone[i].id();
+        ncond[i] = m_zone[i].ncond();
+    }
+    profiler->setZones( id, ncond );
+}
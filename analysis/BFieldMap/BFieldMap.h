@@ -3,7 +3,8 @@
 //
 // Magnetic field map for the ATLAS detector
 // The map can be read from an ASCII text file (a la John Hart)
-// or from a ROOT file.
+// or from a ROOT file.  The functions that take a file name or a TFile are
+// in the BFieldIO library, so that the rest needs no ROOT.
 //
 // Masahiro Morii, Harvard University
 //
@@ -12,22 +13,84 @@
 
 #include <vector>
 #include <iostream>
-#include "TFile.h"
 #include "BFieldZone.h"
+#include "BFieldProfiler.h"
+#include "BFieldRecorder.h"
+
+class BFieldThreadPool;
+class TFile;
 
 class BFieldMap {
 public:
+    // compression of the columnar ROOT format, in the ROOT convention
+    // 100*algorithm + level: LZ4 reads fastest, ZSTD makes the smallest files
+    enum Compression { LZ4 = 404, ZSTD = 505 };
     // constructor
-    BFieldMap() : m_lastzone(0) {;}
+    BFieldMap() : m_profiler(0), m_recorder(0) {;}
     // compute magnetic field
     void getB( const double *xyz, double *B, double *deriv=0 ) const;
-    // read/write map from/to file
+    // same, with a hint of the track direction dir[3] used to prefetch the next bin
+    void getB( const double *xyz, double *B, double *deriv, const double *dir ) const;
+    // same, using a cache owned by the caller - safe to call from many threads,
+    // as long as each thread has its own cache
+    void getB( const double *xyz, double *B, double *deriv, BFieldCache& cache,
+               const double *dir=0 ) const;
+    // integrate B along the straight line from p1[3] to p2[3]: intB[3] = Int B dl (kT mm)
+    void integrateB( const double *p1, const double *p2, double *intB ) const;
+    void integrateB( const double *p1, const double *p2, double *intB, BFieldCache& cache ) const;
+    // read/write map from/to file.
+    // all but readMap( std::istream& ) are in the BFieldIO library.
     int readMap( const char* filename );
     int readMap( std::istream& input );
     int readMap( TFile* rootfile );
     void writeMap( TFile* rootfile );
+    // write the map in the columnar format, which readMap( TFile* ) recognizes:
+    // the zone ranges and sizes, meshes, conductors and fields in separate
+    // trees, with one entry per zone.  Needs the map expanded and unfolded.
+    void writeColumns( TFile* rootfile, int compression = LZ4 );
+    // read only some zones of a map in the columnar format: those with the
+    // given IDs, or those that overlap range[6] = { zmin, zmax, rmin, rmax, phimin, phimax },
+    // with phi in any interval of width up to 2pi (see overlaps())
+    int readMap( TFile* rootfile, const std::vector<int>& ids );
+    int readMap( TFile* rootfile, const double *range );
+    // test if the range of a zone, in the same order, overlaps range[6], with phi modulo 2pi
+    static bool overlaps( const double *zone, const double *range );
     // append a zone
     void appendZone( BFieldZone zone ) { m_zone.push_back( zone ); }
+    // build the look-up tables, once all zones have been appended.
+    // called from the map-reading functions.
+    // the zones are done in parallel on pool, if given.
+    void buildLUT( BFieldThreadPool* pool=0 );
+    // use tricubic interpolation, with derivatives precomputed at the nodes,
+    // instead of trilinear.  Caches must be cleared after a change.
+    void setTricubic( bool tricubic );
+    bool tricubic() const { return !m_zone.empty() && m_zone[0].tricubic(); }
+    // keep the field of all zones compressed in memory, in bricks of brick^3 bins
+    // decoded on demand (see BFieldZone::compress()), or expand it again.
+    // Not available with tricubic interpolation, and writeMap() needs the map
+    // expanded.  Caches must be cleared after a change.
+    int compress( int brick=8 );
+    void uncompress();
+    bool compressed() const { return !m_zone.empty() && m_zone[0].compressed(); }
+    // share one field between the zones related by the 8-fold symmetry in phi
+    // or by the reflection z -> -z (see BFieldZone::fold()): each zone whose
+    // field is that of an earlier zone turned and/or mirrored keeps only its
+    // mesh and conductors.  Zones with asymmetric corrections keep their field.
+    // Returns the number of zones folded.  Not available on a compressed map
+    // (compress after folding), and writeMap() needs the map unfolded.
+    // Zones must not be appended to a folded map.  Caches must be cleared after a change.
+    int fold();
+    // give every zone its own field again (expands a compressed map first)
+    void unfold();
+    int nfolded() const;
+    // memory used by the field of all zones (bytes)
+    size_t memory() const;
+    // time a fraction of the getB() calls with profiler, which must outlive
+    // its use here (0 to stop).  Set up the histograms for the zones.
+    void setProfiler( BFieldProfiler* profiler );
+    BFieldProfiler* profiler() const { return m_profiler; }
+    // write every getB() query to recorder, which must outlive its use here (0 to stop)
+    void setRecorder( BFieldRecorder* recorder ) { m_recorder = recorder; }
     // access zones
     int nzone() const { return m_zone.size(); }
     const BFieldZone& zone( int i ) const { return m_zone[i]; }
@@ -41,13 +104,21 @@ private:
     std::vector<const BFieldZone*> m_zoneLUT; // look-up table for zones
     // cache for speed
     mutable BFieldCache m_cache;
-    mutable const BFieldZone* m_lastzone;
+    // sampling profiler, if any
+    BFieldProfiler* m_profiler;
+    // query recorder, if any
+    BFieldRecorder* m_recorder;
     // utility functions
     int read_packed_data( std::istream& input, std::vector<int>& data );
     int read_packed_int( std::istream& input, int &n );
-    void buildLUT(); // called from map-reading functions
+    int readColumns( TFile* rootfile, const std::vector<int>* ids, const double *range );
     const BFieldZone* findZone( double z, double r, double phi ) const;
-    const BFieldZone* findZoneSlow( double z, double r, double phi ) const;
+    // getB() itself: returns 1 if the cache was hit, 0 if not, -1 outside all zones
+    int evaluate( const double *xyz, double *B, double *deriv, BFieldCache& cache, const double *dir ) const;
+    static int closeEdge( const std::vector<double>& edge, double x );
+    static void insideCells( const BFieldZone& zone, int j, const std::vector<double>& centre,
+                             std::vector<int>& cell );
+    double binExit( const double *p1, const double *u, double t0, const BFieldCache& cache ) const;
 };
 
 #endif
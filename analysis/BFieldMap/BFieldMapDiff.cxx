@@ -0,0 +1,260 @@
+//
+// BFieldMapDiff.cxx
+//
+#include "BFieldMapDiff.h"
+#include <cmath>
+#include <iomanip>
+#include <algorithm>
+using namespace std;
+
+BFieldMapDiff::ZoneDiff::ZoneDiff()
+    : id(-1), matched(false), samecond(false), npoint(0),
+      maxdB(0.0), rmsdB(0.0), maxB(0.0), maxdpos(0.0), maxdcurr(0.0)
+{
+    izone[0] = izone[1] = -1;
+    where[0] = where[1] = where[2] = 0.0;
+}
+
+//
+// Constructor
+//
+BFieldMapDiff::BFieldMapDiff( const BFieldMap* map1, const BFieldMap* map2 )
+    : m_nsample(20), m_tol(1e-6)
+{
+    m_map[0] = map1;
+    m_map[1] = map2;
+}
+
+//
+// Test if two zones cover the same range with the same mesh
+//
+bool
+BFieldMapDiff::sameMesh( const BFieldZone& z1, const BFieldZone& z2, double tol )
+{
+    for ( int i = 0; i < 3; i++ ) {
+        if ( abs( z1.min(i) - z2.min(i) ) > tol || abs( z1.max(i) - z2.max(i) ) > tol ) return false;
+        if ( z1.nmesh(i) != z2.nmesh(i) ) return false;
+        for ( unsigned j = 0; j < z1.nmesh(i); j++ ) {
+            if ( abs( z1.mesh(i,j) - z2.mesh(i,j) ) > tol ) return false;
+        }
+    }
+    return z1.nfield() == z2.nfield();
+}
+
+//
+// Compare the conductors of two zones.
+// Fills the max displacement and current change in diff if the lists have the same length.
+// Returns true if they are identical.
+//
+bool
+BFieldMapDiff::sameCond( const BFieldZone& z1, const BFieldZone& z2, ZoneDiff& diff )
+{
+    diff.maxdpos = diff.maxdcurr = 0.0;
+    if ( z1.ncond() != z2.ncond() ) return false;
+    bool same = true;
+    for ( unsigned i = 0; i < z1.ncond(); i++ ) {
+        const BFieldCond& c1 = z1.cond(i);
+        const BFieldCond& c2 = z2.cond(i);
+        if ( c1.finite() != c2.finite() ) return false;
+        double d1(0.), d2(0.);
+        for ( int j = 0; j < 3; j++ ) {
+            d1 += (c1.p1(j)-c2.p1(j))*(c1.p1(j)-c2.p1(j));
+            d2 += (c1.p2(j)-c2.p2(j))*(c1.p2(j)-c2.p2(j));
+        }
+        // p2 is a direction vector for an infinite conductor
+        double dpos = c1.finite() ? sqrt( max( d1, d2 ) ) : sqrt( d1 );
+        if ( !c1.finite() && d2 > 0.0 ) same = false;
+        diff.maxdpos = max( diff.maxdpos, dpos );
+        diff.maxdcurr = max( diff.maxdcurr, abs( c1.curr() - c2.curr() ) );
+    }
+    return same && diff.maxdpos == 0.0 && diff.maxdcurr == 0.0;
+}
+
+//
+// Compare two zones with identical meshes node by node.
+// The stored values are (Bz,Br,Bphi) in units of bscale; the Biot-Savart fields
+// are added only if the conductors differ, since they cancel otherwise.
+//
+void
+BFieldMapDiff::compareNodes( const BFieldZone& z1, const BFieldZone& z2, ZoneDiff& diff ) const
+{
+    const double s1 = z1.bscale();
+    const double s2 = z2.bscale();
+    const unsigned nz = z1.nmesh(0), nr = z1.nmesh(1), nphi = z1.nmesh(2);
+    double sum2(0.);
+    for ( unsigned iphi = 0; iphi < nphi; iphi++ ) {
+        double phi = z1.mesh(2,iphi);
+        double c = cos(phi), s = sin(phi);
+        for ( unsigned iz = 0; iz < nz; iz++ ) {
+            double z = z1.mesh(0,iz);
+            for ( unsigned ir = 0; ir < nr; ir++ ) {
+                double r = z1.mesh(1,ir);
+                const BFieldVector<short>& f1 = z1.field( (iz*nr+ir)*nphi+iphi );
+                const BFieldVector<short>& f2 = z2.field( (iz*nr+ir)*nphi+iphi );
+                double B1[3], dB[3];
+                for ( int j = 0; j < 3; j++ ) {
+                    B1[j] = s1*f1[j];
+                    dB[j] = B1[j] - s2*f2[j];
+                }
+                if ( !diff.samecond ) {
+                    double xyz[3] = { r*c, r*s, z };
+                    double BS1[3] = { 0.0, 0.0, 0.0 };
+                    double BS2[3] = { 0.0, 0.0, 0.0 };
+                    z1.addBiotSavart( xyz, BS1 );
+                    z2.addBiotSavart( xyz, BS2 );
+                    // to (z,r,phi) components
+                    B1[0] += BS1[2];
+                    B1[1] += c*BS1[0] + s*BS1[1];
+                    B1[2] += -s*BS1[0] + c*BS1[1];
+                    dB[0] += BS1[2] - BS2[2];
+                    dB[1] += c*(BS1[0]-BS2[0]) + s*(BS1[1]-BS2[1]);
+                    dB[2] += -s*(BS1[0]-BS2[0]) + c*(BS1[1]-BS2[1]);
+                }
+                double d2 = dB[0]*dB[0] + dB[1]*dB[1] + dB[2]*dB[2];
+                sum2 += d2;
+                if ( d2 > diff.maxdB*diff.maxdB ) {
+                    diff.maxdB = sqrt(d2);
+                    diff.where[0] = z; diff.where[1] = r; diff.where[2] = phi;
+                }
+                diff.maxB = max( diff.maxB, sqrt( B1[0]*B1[0] + B1[1]*B1[1] + B1[2]*B1[2] ) );
+            }
+        }
+    }
+    diff.npoint = nz*nr*nphi;
+    diff.rmsdB = sqrt( sum2/diff.npoint );
+}
+
+//
+// Compare the two maps at the centres of an n x n x n grid inside the zone
+//
+void
+BFieldMapDiff::compareSampled( const BFieldZone& zone, ZoneDiff& diff, BFieldCache* cache ) const
+{
+    const int n = m_nsample;
+    double sum2(0.);
+    for ( int iphi = 0; iphi < n; iphi++ ) {
+        double phi = zone.phimin() + (iphi+0.5)/n*( zone.phimax() - zone.phimin() );
+        double c = cos(phi), s = sin(phi);
+        for ( int iz = 0; iz < n; iz++ ) {
+            double z = zone.zmin() + (iz+0.5)/n*( zone.zmax() - zone.zmin() );
+            for ( int ir = 0; ir < n; ir++ ) {
+                double r = zone.rmin() + (ir+0.5)/n*( zone.rmax() - zone.rmin() );
+                double xyz[3] = { r*c, r*s, z };
+                double B[2][3];
+                for ( int k = 0; k < 2; k++ ) m_map[k]->getB( xyz, B[k], 0, cache[k] );
+                double d2(0.), b2(0.);
+                for ( int j = 0; j < 3; j++ ) {
+                    d2 += (B[0][j]-B[1][j])*(B[0][j]-B[1][j]);
+                    b2 += B[0][j]*B[0][j];
+                }
+                sum2 += d2;
+                if ( d2 > diff.maxdB*diff.maxdB ) {
+                    diff.maxdB = sqrt(d2);
+                    diff.where[0] = z; diff.where[1] = r; diff.where[2] = phi;
+                }
+                diff.maxB = max( diff.maxB, sqrt(b2) );
+            }
+        }
+    }
+    diff.npoint = n*n*n;
+    diff.rmsdB = sqrt( sum2/diff.npoint );
+}
+
+//
+// Pair the zones of the two maps by ID and compare each pair.
+// Zones present in only one of the maps, or compressed or folded in either, are sampled.
+//
+void
+BFieldMapDiff::compare( BFieldThreadPool& pool )
+{
+    m_diff.clear();
+    vector<bool> used( m_map[1]->nzone(), false );
+    for ( int i = 0; i < m_map[0]->nzone(); i++ ) {
+        ZoneDiff diff;
+        diff.id = m_map[0]->zone(i).id();
+        diff.izone[0] = i;
+        for ( int j = 0; j < m_map[1]->nzone(); j++ ) {
+            if ( !used[j] && m_map[1]->zone(j).id() == diff.id ) {
+                diff.izone[1] = j;
+                used[j] = true;
+                break;
+            }
+        }
+        m_diff.push_back( diff );
+    }
+    for ( int j = 0; j < m_map[1]->nzone(); j++ ) {
+        if ( used[j] ) continue;
+        ZoneDiff diff;
+        diff.id = m_map[1]->zone(j).id();
+        diff.izone[1] = j;
+        m_diff.push_back( diff );
+    }
+    // compare, one zone at a time
+    vector<BFieldCache> cache( 2*pool.nthread() );
+    pool.run( m_diff.size(), [&]( int i, int ithread ) {
+        ZoneDiff& diff = m_diff[i];
+        if ( diff.izone[0] >= 0 && diff.izone[1] >= 0 ) {
+            const BFieldZone& z1 = m_map[0]->zone( diff.izone[0] );
+            const BFieldZone& z2 = m_map[1]->zone( diff.izone[1] );
+            diff.samecond = sameCond( z1, z2, diff );
+            // the nodes are read directly, which needs the field expanded and unfolded
+            diff.matched = ( !z1.compressed() && !z2.compressed() && !z1.folded() && !z2.folded() &&
+                             sameMesh( z1, z2, m_tol ) );
+            if ( diff.matched ) {
+                compareNodes( z1, z2, diff );
+                return;
+            }
+        }
+        int k = ( diff.izone[0] >= 0 ) ? 0 : 1;
+        compareSampled( m_map[k]->zone( diff.izone[k] ), diff, &cache[2*ithread] );
+    } );
+}
+
+//
+// Overall max of |B1-B2|
+//
+double
+BFieldMapDiff::maxdB() const
+{
+    double dB(0.);
+    for ( unsigned i = 0; i < m_diff.size(); i++ ) dB = max( dB, m_diff[i].maxdB );
+    return dB;
+}
+
+//
+// Overall rms of |B1-B2|, weighted by the number of points in each zone
+//
+double
+BFieldMapDiff::rmsdB() const
+{
+    double sum2(0.);
+    int n(0);
+    for ( unsigned i = 0; i < m_diff.size(); i++ ) {
+        sum2 += m_diff[i].rmsdB*m_diff[i].rmsdB*m_diff[i].npoint;
+        n += m_diff[i].npoint;
+    }
+    return ( n > 0 ) ? sqrt( sum2/n ) : 0.0;
+}
+
+//
+// Print one line per zone.  B is converted from kT to T.
+//
+void
+BFieldMapDiff::print( ostream& out ) const
+{
+    const double tesla(1000.0);
+    out << "  zone  mode    npoint   max|B1|(T)  max|dB|(T)  rms|dB|(T)     at (z,r,phi)"
+        << "            dpos(mm)  dcurr(A)" << endl;
+    for ( unsigned i = 0; i < m_diff.size(); i++ ) {
+        const ZoneDiff& d = m_diff[i];
+        const char* mode = d.matched ? "node  " : ( d.izone[0] < 0 ? "map2  " : ( d.izone[1] < 0 ? "map1  " : "sample" ) );
+        out << setw(6) << d.id << "  " << mode << setw(8) << d.npoint
+            << setw(13) << d.maxB*tesla << setw(12) << d.maxdB*tesla << setw(12) << d.rmsdB*tesla
+            << "   (" << d.where[0] << "," << d.where[1] << "," << d.where[2] << ")";
+        if ( !d.samecond && d.izone[0] >= 0 && d.izone[1] >= 0 ) {
+            out << "  " << d.maxdpos << "  " << d.maxdcurr;
+        }
+        out << endl;
+    }
+    out << "  all zones: max|dB| = " << maxdB()*tesla << " T, rms|dB| = " << rmsdB()*tesla << " T" << endl;
+}
@@ -0,0 +1,70 @@
+//
+// BFieldMapDiff.h
+//
+// Zone-by-zone difference of two toroid field maps.
+// Zones that have the same ID, range and mesh in both maps are compared node by node,
+// using the stored field values scaled by bscale, plus the difference of the
+// Biot-Savart fields if the conductors differ.  Other zones, and compressed or folded
+// ones, are compared by sampling getB() of both maps on a regular grid inside the zone.
+//
+// Units: mm, kT.
+//
+#ifndef BFIELDMAPDIFF_H
+#define BFIELDMAPDIFF_H
+
+#include <vector>
+#include <iostream>
+#include "BFieldMap.h"
+#include "BFieldThreadPool.h"
+
+class TFile;
+
+class BFieldMapDiff {
+public:
+    // summary of the difference in one zone
+    class ZoneDiff {
+    public:
+        ZoneDiff();
+        int id;          // zone ID
+        int izone[2];    // zone index in each map, -1 if absent
+        bool matched;    // true if the meshes match and the nodes were compared directly
+        bool samecond;   // true if the conductors are identical
+        int npoint;      // number of nodes or sampling points compared
+        double maxdB;    // max |B1-B2|
+        double rmsdB;    // rms |B1-B2|
+        double maxB;     // max |B1|, for reference
+        double where[3]; // (z,r,phi) of the point with the max difference
+        double maxdpos;  // max displacement of a conductor end point (mm)
+        double maxdcurr; // max change in the conductor current (A)
+    };
+    // constructor
+    BFieldMapDiff( const BFieldMap* map1, const BFieldMap* map2 );
+    // number of sampling points per axis in zones that do not match
+    void setSampling( int n ) { m_nsample = n; }
+    // tolerance (mm or rad) for the mesh positions to match
+    void setTolerance( double tol ) { m_tol = tol; }
+    // compute the differences, one zone per task on the thread pool
+    void compare( BFieldThreadPool& pool );
+    // results
+    unsigned nzone() const { return m_diff.size(); }
+    const ZoneDiff& zone( int i ) const { return m_diff[i]; }
+    // overall max and rms of |B1-B2| over all zones
+    double maxdB() const;
+    double rmsdB() const;
+    // print a table of the zones, with B in tesla
+    void print( std::ostream& out ) const;
+    // write one tree entry per zone to a ROOT file (in the BFieldIO library)
+    void writeDiff( TFile* rootfile ) const;
+    // test if two zones have the same range and mesh, or the same conductors
+    static bool sameMesh( const BFieldZone& z1, const BFieldZone& z2, double tol );
+    static bool sameCond( const BFieldZone& z1, const BFieldZone& z2, ZoneDiff& diff );
+private:
+    void compareNodes( const BFieldZone& z1, const BFieldZone& z2, ZoneDiff& diff ) const;
+    void compareSampled( const BFieldZone& zone, ZoneDiff& diff, BFieldCache* cache ) const;
+    const BFieldMap* m_map[2];
+    std::vector<ZoneDiff> m_diff;
+    int m_nsample;
+    double m_tol;
+};
+
+#endif
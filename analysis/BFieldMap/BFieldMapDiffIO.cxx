@@ -0,0 +1,37 @@
+//
+// BFieldMapDiffIO.cxx
+//
+// Writing of BFieldMapDiff to ROOT files, in the BFieldIO library
+//
+#include "BFieldMapDiff.h"
+#include "TFile.h"
+#include "TTree.h"
+using namespace std;
+
+//
+// Write the per-zone summaries to a ROOT file, in kT and mm
+//
+void
+BFieldMapDiff::writeDiff( TFile* rootfile ) const
+{
+    if ( rootfile == 0 ) return; // no file
+    if ( rootfile->cd() == false ) return; // could not make it current directory
+    TTree* tree = new TTree( "BFieldMapDiff", "BFieldMap difference per zone" );
+    ZoneDiff d;
+    tree->Branch( "id", &d.id, "id/I" );
+    tree->Branch( "izone", d.izone, "izone[2]/I" );
+    tree->Branch( "matched", &d.matched, "matched/O" );
+    tree->Branch( "samecond", &d.samecond, "samecond/O" );
+    tree->Branch( "npoint", &d.npoint, "npoint/I" );
+    tree->Branch( "maxdB", &d.maxdB, "maxdB/D" );
+    tree->Branch( "rmsdB", &d.rmsdB, "rmsdB/D" );
+    tree->Branch( "maxB", &d.maxB, "maxB/D" );
+    tree->Branch( "where", d.where, "where[3]/D" );
+    tree->Branch( "maxdpos", &d.maxdpos, "maxdpos/D" );
+    tree->Branch( "maxdcurr", &d.maxdcurr, "maxdcurr/D" );
+    for ( unsigned i = 0; i < m_diff.size(); i++ ) {
+        d = m_diff[i];
+        tree->Fill();
+    }
+    rootfile->Write();
+}
@@ -0,0 +1,572 @@
+//
+// BFieldMapIO.cxx
+//
+// Reading and writing of BFieldMap in ROOT files, in the BFieldIO library
+//
+#include "BFieldMap.h"
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+using namespace std;
+
+namespace {
+    // sizes and ranges of a zone in the columnar format
+    struct ZoneHead {
+        int id;
+        double range[6]; // zmin, zmax, rmin, rmax, phimin, phimax
+        double bscale;
+        int ncond;
+        int nmesh[3];
+        int nfield;
+    };
+}
+
+//
+// Read the solenoid map from file.
+// If the filename ends with ".root", it's in a ROOT format.
+// Otherwise, it's in a compressed ASCII format.
+//
+int
+BFieldMap::readMap( const char* filename )
+{
+    if ( strstr( filename, ".root" ) != 0 ) {
+        TFile* rootfile = new TFile( filename, "OLD" );
+        if ( ! rootfile ) {
+            cerr << "BFieldMap::readMap(): failed to open " << filename << endl;
+            return 1;
+        }
+        readMap( rootfile );
+        rootfile->Close();
+        delete rootfile;
+    } else {
+        ifstream textfile( filename );
+        if ( ! textfile.good() ) {
+            cerr << "BFieldMap::readMap(): failed to open " << filename << endl;
+            return 1;
+        }
+        readMap( textfile );
+    } 
+    return 0;
+}
+
+//
+// wrire the map to a ROOT file
+//
+void
+BFieldMap::writeMap( TFile* rootfile )
+{
+    if ( rootfile == 0 ) return; // no file
+    if ( rootfile->cd() == false ) return; // could not make it current directory
+    if ( compressed() ) {
+        cerr << "BFieldMap::writeMap(): the map is compressed, call uncompress() first" << endl;
+        return;
+    }
+    if ( nfolded() > 0 ) {
+        cerr << "BFieldMap::writeMap(): the map is folded, call unfold() first" << endl;
+        return;
+    }
+    // define the tree
+    TTree* tree = new TTree( "BFieldMap", "BFieldMap version 6" );
+    TTree* tmax = new TTree( "BFieldMapSize", "Buffer size information" );
+    int id;
+    double zmin, zmax, rmin, rmax, phimin, phimax;
+    double bscale;
+    int ncond;
+    bool *finite;
+    double *p1x, *p1y, *p1z, *p2x, *p2y, *p2z;
+    double *curr;
+    int nmeshz, nmeshr, nmeshphi;
+    double *meshz, *meshr, *meshphi;
+    int nfield;
+    short *fieldz, *fieldr, *fieldphi;
+    // prepare arrays - need to know the maximum sizes
+    unsigned maxcond(0), maxmeshz(0), maxmeshr(0), maxmeshphi(0), maxfield(0);
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        maxcond = max( maxcond, m_zone[i].ncond() );
+        maxmeshz = max( maxmeshz, m_zone[i].nmesh(0) );
+        maxmeshr = max( maxmeshr, m_zone[i].nmesh(1) );
+        maxmeshphi = max( maxmeshphi, m_zone[i].nmesh(2) );
+        maxfield = max( maxfield, m_zone[i].nfield() );
+    }
+    // store the maximum sizes
+    tmax->Branch( "maxcond", &maxcond, "maxcond/i" );
+    tmax->Branch( "maxmeshz", &maxmeshz, "maxmeshz/i" );
+    tmax->Branch( "maxmeshr", &maxmeshr, "maxmeshr/i" );
+    tmax->Branch( "maxmeshphi", &maxmeshphi, "maxmeshphi/i" );
+    tmax->Branch( "maxfield", &maxfield, "maxfield/i" );
+    tmax->Fill();
+    // prepare buffers
+    finite = new bool[maxcond];
+    p1x = new double[maxcond];
+    p1y = new double[maxcond];
+    p1z = new double[maxcond];
+    p2x = new double[maxcond];
+    p2y = new double[maxcond];
+    p2z = new double[maxcond];
+    curr = new double[maxcond];
+    meshz = new double[maxmeshz];
+    meshr = new double[maxmeshr];
+    meshphi = new double[maxmeshphi];
+    fieldz = new short[maxfield];
+    fieldr = new short[maxfield];
+    fieldphi = new short[maxfield];
+    // define the tree branches
+    tree->Branch( "id", &id, "id/I" );
+    tree->Branch( "zmin", &zmin, "zmin/D" );
+    tree->Branch( "zmax", &zmax, "zmax/D" );
+    tree->Branch( "rmin", &rmin, "rmin/D" );
+    tree->Branch( "rmax", &rmax, "rmax/D" );
+    tree->Branch( "phimin", &phimin, "phimin/D" );
+    tree->Branch( "phimax", &phimax, "phimax/D" );
+    tree->Branch( "bscale", &bscale, "bscale/D" );
+    tree->Branch( "ncond", &ncond, "ncond/I" );
+    tree->Branch( "finite", finite, "finite[ncond]/O" );
+    tree->Branch( "p1x", p1x, "p1x[ncond]/D" );
+    tree->Branch( "p1y", p1y, "p1y[ncond]/D" );
+    tree->Branch( "p1z", p1z, "p1z[ncond]/D" );
+    tree->Branch( "p2x", p2x, "p2x[ncond]/D" );
+    tree->Branch( "p2y", p2y, "p2y[ncond]/D" );
+    tree->Branch( "p2z", p2z, "p2z[ncond]/D" );
+    tree->Branch( "curr", curr, "curr[ncond]/D" );
+    tree->Branch( "nmeshz", &nmeshz, "nmeshz/I" );
+    tree->Branch( "meshz", meshz, "meshz[nmeshz]/D" );
+    tree->Branch( "nmeshr", &nmeshr, "nmeshr/I" );
+    tree->Branch( "meshr", meshr, "meshr[nmeshr]/D" );
+    tree->Branch( "nmeshphi", &nmeshphi, "nmeshphi/I" );
+    tree->Branch( "meshphi", meshphi, "meshphi[nmeshphi]/D" );
+    tree->Branch( "nfield", &nfield, "nfield/I" );
+    tree->Branch( "fieldz", fieldz, "fieldz[nfield]/S" );
+    tree->Branch( "fieldr", fieldr, "fieldr[nfield]/S" );
+    tree->Branch( "fieldphi", fieldphi, "fieldphi[nfield]/S" );
+    //tree->Branch( "fbyte", fbyte, "fbyte[nfield]/b" );
+    // loop over zones to write
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        const BFieldZone z = m_zone[i];
+        id = z.id();
+        zmin = z.zmin(); zmax = z.zmax();
+        rmin = z.rmin(); rmax = z.rmax();
+        phimin = z.phimin(); phimax = z.phimax();
+        bscale = z.bscale();
+        ncond = z.ncond();
+        for ( int j = 0; j < ncond; j++ ) {
+            const BFieldCond c = z.cond(j);
+            finite[j] = c.finite();
+            p1x[j] = c.p1(0);
+            p1y[j] = c.p1(1);
+            p1z[j] = c.p1(2);
+            p2x[j] = c.p2(0);
+            p2y[j] = c.p2(1);
+            p2z[j] = c.p2(2);
+            curr[j] = c.curr();
+        }
+        nmeshz = z.nmesh(0);
+        for ( int j = 0; j < nmeshz; j++ ) {
+            meshz[j] = z.mesh(0,j);
+        }
+        nmeshr = z.nmesh(1);
+        for ( int j = 0; j < nmeshr; j++ ) {
+            meshr[j] = z.mesh(1,j);
+        }
+        nmeshphi = z.nmesh(2);
+        for ( int j = 0; j < nmeshphi; j++ ) {
+            meshphi[j] = z.mesh(2,j);
+        }
+        nfield = z.nfield();
+        for ( int j = 0; j < nfield; j++ ) {
+            const BFieldVector<short> f = z.field(j);
+            fieldz[j] = f.z();
+            fieldr[j] = f.r();
+            fieldphi[j] = f.phi();
+        }
+        tree->Fill();
+    }
+    rootfile->Write();
+    // clean up
+    delete[] finite;
+    delete[] p1x;
+    delete[] p1y;
+    delete[] p1z;
+    delete[] p2x;
+    delete[] p2y;
+    delete[] p2z;
+    delete[] curr;
+    delete[] meshz;
+    delete[] meshr;
+    delete[] meshphi;
+    delete[] fieldz;
+    delete[] fieldr;
+    delete[] fieldphi;
+}
+
+//
+// read the map from a ROOT file.
+// returns 0 if successful.
+//
+int
+BFieldMap::readMap( TFile* rootfile )
+{
+    if ( rootfile == 0 ) return 1; // no file
+    if ( rootfile->cd() == false ) return 2; // could not make it current directory
+    // the columnar format
+    if ( rootfile->Get("BFieldMapZones") != 0 ) return readColumns( rootfile, 0, 0 );
+    // open the tree
+    TTree* tree = (TTree*)rootfile->Get("BFieldMap");
+    if ( tree == 0 ) return 3; // no tree
+    int id;
+    double zmin, zmax, rmin, rmax, phimin, phimax;
+    double bscale;
+    int ncond;
+    bool *finite;
+    double *p1x, *p1y, *p1z, *p2x, *p2y, *p2z;
+    double *curr;
+    int nmeshz, nmeshr, nmeshphi;
+    double *meshz, *meshr, *meshphi;
+    int nfield;
+    short *fieldz, *fieldr, *fieldphi;
+    // define the fixed-sized branches first
+    tree->SetBranchAddress( "id", &id );
+    tree->SetBranchAddress( "zmin", &zmin );
+    tree->SetBranchAddress( "zmax", &zmax );
+    tree->SetBranchAddress( "rmin", &rmin );
+    tree->SetBranchAddress( "rmax", &rmax );
+    tree->SetBranchAddress( "phimin", &phimin );
+    tree->SetBranchAddress( "phimax", &phimax );
+    tree->SetBranchAddress( "bscale", &bscale );
+    tree->SetBranchAddress( "ncond", &ncond );
+    tree->SetBranchAddress( "nmeshz", &nmeshz );
+    tree->SetBranchAddress( "nmeshr", &nmeshr );
+    tree->SetBranchAddress( "nmeshphi", &nmeshphi );
+    tree->SetBranchAddress( "nfield", &nfield );
+    // prepare arrays - need to know the maximum sizes
+    // open the tree of buffer sizes (may not exist in old maps)
+    unsigned maxcond(0), maxmeshz(0), maxmeshr(0), maxmeshphi(0), maxfield(0);
+    TTree* tmax = (TTree*)rootfile->Get("BFieldMapSize");
+    if ( tmax != 0 ) {
+        tmax->SetBranchAddress( "maxcond", &maxcond );
+        tmax->SetBranchAddress( "maxmeshz", &maxmeshz );
+        tmax->SetBranchAddress( "maxmeshr", &maxmeshr );
+        tmax->SetBranchAddress( "maxmeshphi", &maxmeshphi );
+        tmax->SetBranchAddress( "maxfield", &maxfield );
+        tmax->GetEntry(0);
+    } else { // "BFieldMapSize" tree does not exist
+        for ( int i = 0; i < tree->GetEntries(); i++ ) {
+            tree->GetEntry(i);
+            maxcond = max( maxcond, unsigned(ncond) );
+            maxmeshz = max( maxmeshz, unsigned(nmeshz) );
+            maxmeshr = max( maxmeshr, unsigned(nmeshr) );
+            maxmeshphi = max( maxmeshphi, unsigned(nmeshphi) );
+            maxfield = max( maxfield, unsigned(nfield) );
+        }
+    }
+    finite = new bool[maxcond];
+    p1x = new double[maxcond];
+    p1y = new double[maxcond];
+    p1z = new double[maxcond];
+    p2x = new double[maxcond];
+    p2y = new double[maxcond];
+    p2z = new double[maxcond];
+    curr = new double[maxcond];
+    meshz = new double[maxmeshz];
+    meshr = new double[maxmeshr];
+    meshphi = new double[maxmeshphi];
+    fieldz = new short[maxfield];
+    fieldr = new short[maxfield];
+    fieldphi = new short[maxfield];
+    // define the variable length branches
+    tree->SetBranchAddress( "finite", finite );
+    tree->SetBranchAddress( "p1x", p1x );
+    tree->SetBranchAddress( "p1y", p1y );
+    tree->SetBranchAddress( "p1z", p1z );
+    tree->SetBranchAddress( "p2x", p2x );
+    tree->SetBranchAddress( "p2y", p2y );
+    tree->SetBranchAddress( "p2z", p2z );
+    tree->SetBranchAddress( "curr", curr );
+    tree->SetBranchAddress( "meshz", meshz );
+    tree->SetBranchAddress( "meshr", meshr );
+    tree->SetBranchAddress( "meshphi", meshphi );
+    tree->SetBranchAddress( "fieldz", fieldz );
+    tree->SetBranchAddress( "fieldr", fieldr );
+    tree->SetBranchAddress( "fieldphi", fieldphi );
+    //tree->SetBranchAddress( "fbyte", fbyte );
+    // reserve the space for m_zone so that it won't move as the vector grows
+    m_zone.reserve( tree->GetEntries() );
+    // read all tree and store
+    for ( int i = 0; i < tree->GetEntries(); i++ ) {
+        tree->GetEntry(i);
+        BFieldZone z( id, zmin, zmax, rmin, rmax, phimin, phimax, bscale );
+        z.reserve( nmeshz, nmeshr, nmeshphi );
+        m_zone.push_back(z);
+        for ( int j = 0; j < ncond; j++ ) {
+            double p1[3], p2[3];
+            p1[0] = p1x[j];
+            p1[1] = p1y[j];
+            p1[2] = p1z[j];
+            p2[0] = p2x[j];
+            p2[1] = p2y[j];
+            p2[2] = p2z[j];
+            BFieldCond cond( finite[j], p1, p2, curr[j] );
+            m_zone.back().appendCond(cond);
+        }
+        for ( int j = 0; j < nmeshz; j++ ) {
+            m_zone.back().appendMesh( 0, meshz[j] );
+        }
+        for ( int j = 0; j < nmeshr; j++ ) {
+            m_zone.back().appendMesh( 1, meshr[j] );
+        }
+        for ( int j = 0; j < nmeshphi; j++ ) {
+            m_zone.back().appendMesh( 2, meshphi[j] );
+        }
+        for ( int j = 0; j < nfield; j++ ) {
+            BFieldVector<short> field( fieldz[j], fieldr[j], fieldphi[j] );
+            m_zone.back().appendField( field );
+            //m_zone.back().appendFbyte( fbyte[j] );
+        }
+    }
+    // clean up
+    tree->Delete();
+    delete[] finite;
+    delete[] p1x;
+    delete[] p1y;
+    delete[] p1z;
+    delete[] p2x;
+    delete[] p2y;
+    delete[] p2z;
+    delete[] curr;
+    delete[] meshz;
+    delete[] meshr;
+    delete[] meshphi;
+    delete[] fieldz;
+    delete[] fieldr;
+    delete[] fieldphi;
+    //delete[] fbyte;
+    // build the LUTs
+    buildLUT();
+
+    return 0;
+}
+
+//
+// Write the map in the columnar format: the tree "BFieldMapZones" holds the
+// range, scale and sizes of each zone, and "BFieldMapMesh", "BFieldMapCond"
+// and "BFieldMapField" the arrays, with entry i for zone i in each.  The
+// zones can then be selected from the first tree and read alone.
+//
+void
+BFieldMap::writeColumns( TFile* rootfile, int compression )
+{
+    if ( rootfile == 0 ) return; // no file
+    if ( rootfile->cd() == false ) return; // could not make it current directory
+    if ( compressed() ) {
+        cerr << "BFieldMap::writeColumns(): the map is compressed, call uncompress() first" << endl;
+        return;
+    }
+    if ( nfolded() > 0 ) {
+        cerr << "BFieldMap::writeColumns(): the map is folded, call unfold() first" << endl;
+        return;
+    }
+    int oldCompression = rootfile->GetCompressionSettings();
+    rootfile->SetCompressionSettings( compression );
+    TTree* tzone = new TTree( "BFieldMapZones", "BFieldMap columnar version 7: zones" );
+    TTree* tmesh = new TTree( "BFieldMapMesh", "BFieldMap columnar version 7: meshes" );
+    TTree* tcond = new TTree( "BFieldMapCond", "BFieldMap columnar version 7: conductors" );
+    TTree* tfield = new TTree( "BFieldMapField", "BFieldMap columnar version 7: fields" );
+    // buffers of the largest sizes
+    unsigned maxcond(1), maxmesh(1), maxfield(1);
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        maxcond = max( maxcond, m_zone[i].ncond() );
+        for ( int j = 0; j < 3; j++ ) maxmesh = max( maxmesh, m_zone[i].nmesh(j) );
+        maxfield = max( maxfield, m_zone[i].nfield() );
+    }
+    ZoneHead h;
+    vector<char> finite( maxcond );
+    vector<double> cond( 7*maxcond ); // p1x, p1y, p1z, p2x, p2y, p2z, curr
+    vector<double> mesh( 3*maxmesh );
+    vector<short> field( 3*maxfield );
+    // zones
+    tzone->Branch( "id", &h.id, "id/I" );
+    tzone->Branch( "zmin", &h.range[0], "zmin/D" );
+    tzone->Branch( "zmax", &h.range[1], "zmax/D" );
+    tzone->Branch( "rmin", &h.range[2], "rmin/D" );
+    tzone->Branch( "rmax", &h.range[3], "rmax/D" );
+    tzone->Branch( "phimin", &h.range[4], "phimin/D" );
+    tzone->Branch( "phimax", &h.range[5], "phimax/D" );
+    tzone->Branch( "bscale", &h.bscale, "bscale/D" );
+    tzone->Branch( "ncond", &h.ncond, "ncond/I" );
+    tzone->Branch( "nmeshz", &h.nmesh[0], "nmeshz/I" );
+    tzone->Branch( "nmeshr", &h.nmesh[1], "nmeshr/I" );
+    tzone->Branch( "nmeshphi", &h.nmesh[2], "nmeshphi/I" );
+    tzone->Branch( "nfield", &h.nfield, "nfield/I" );
+    // meshes
+    tmesh->Branch( "nmeshz", &h.nmesh[0], "nmeshz/I" );
+    tmesh->Branch( "nmeshr", &h.nmesh[1], "nmeshr/I" );
+    tmesh->Branch( "nmeshphi", &h.nmesh[2], "nmeshphi/I" );
+    tmesh->Branch( "meshz", &mesh[0], "meshz[nmeshz]/D" );
+    tmesh->Branch( "meshr", &mesh[maxmesh], "meshr[nmeshr]/D" );
+    tmesh->Branch( "meshphi", &mesh[2*maxmesh], "meshphi[nmeshphi]/D" );
+    // conductors
+    const char* condName[7] = { "p1x", "p1y", "p1z", "p2x", "p2y", "p2z", "curr" };
+    tcond->Branch( "ncond", &h.ncond, "ncond/I" );
+    tcond->Branch( "finite", &finite[0], "finite[ncond]/O" );
+    for ( int k = 0; k < 7; k++ ) {
+        tcond->Branch( condName[k], &cond[k*maxcond], ( string( condName[k] ) + "[ncond]/D" ).c_str() );
+    }
+    // fields
+    tfield->Branch( "nfield", &h.nfield, "nfield/I" );
+    tfield->Branch( "fieldz", &field[0], "fieldz[nfield]/S" );
+    tfield->Branch( "fieldr", &field[maxfield], "fieldr[nfield]/S" );
+    tfield->Branch( "fieldphi", &field[2*maxfield], "fieldphi[nfield]/S" );
+    // loop over zones to write
+    for ( unsigned i = 0; i < m_zone.size(); i++ ) {
+        const BFieldZone& z = m_zone[i];
+        h.id = z.id();
+        h.range[0] = z.zmin(); h.range[1] = z.zmax();
+        h.range[2] = z.rmin(); h.range[3] = z.rmax();
+        h.range[4] = z.phimin(); h.range[5] = z.phimax();
+        h.bscale = z.bscale();
+        h.ncond = z.ncond();
+        for ( int j = 0; j < h.ncond; j++ ) {
+            const BFieldCond& c = z.cond(j);
+            finite[j] = c.finite();
+            for ( int k = 0; k < 3; k++ ) {
+                cond[k*maxcond+j] = c.p1(k);
+                cond[(k+3)*maxcond+j] = c.p2(k);
+            }
+            cond[6*maxcond+j] = c.curr();
+        }
+        for ( int k = 0; k < 3; k++ ) {
+            h.nmesh[k] = z.nmesh(k);
+            for ( int j = 0; j < h.nmesh[k]; j++ ) mesh[k*maxmesh+j] = z.mesh(k,j);
+        }
+        h.nfield = z.nfield();
+        for ( int j = 0; j < h.nfield; j++ ) {
+            const BFieldVector<short>& f = z.field(j);
+            field[j] = f.z();
+            field[maxfield+j] = f.r();
+            field[2*maxfield+j] = f.phi();
+        }
+        tzone->Fill();
+        tmesh->Fill();
+        tcond->Fill();
+        tfield->Fill();
+    }
+    rootfile->Write();
+    rootfile->SetCompressionSettings( oldCompression );
+}
+
+int
+BFieldMap::readMap( TFile* rootfile, const vector<int>& ids )
+{
+    return readColumns( rootfile, &ids, 0 );
+}
+
+int
+BFieldMap::readMap( TFile* rootfile, const double *range )
+{
+    return readColumns( rootfile, 0, range );
+}
+
+//
+// Read the zones of a map in the columnar format, all of them or those
+// selected by ID or by range.  The zone table is read first, then only the
+// entries of the selected zones in the other trees.  The branches are
+// decompressed in parallel, with ROOT's implicit multithreading turned on
+// for the time of the reading if the application has not done so.
+// returns 0 if successful.
+//
+int
+BFieldMap::readColumns( TFile* rootfile, const vector<int>* ids, const double *range )
+{
+    if ( rootfile == 0 ) return 1; // no file
+    if ( rootfile->cd() == false ) return 2; // could not make it current directory
+    TTree* tzone = (TTree*)rootfile->Get("BFieldMapZones");
+    TTree* tmesh = (TTree*)rootfile->Get("BFieldMapMesh");
+    TTree* tcond = (TTree*)rootfile->Get("BFieldMapCond");
+    TTree* tfield = (TTree*)rootfile->Get("BFieldMapField");
+    if ( tzone == 0 || tmesh == 0 || tcond == 0 || tfield == 0 ) {
+        cerr << "BFieldMap::readMap(): no map in the columnar format" << endl;
+        return 3; // no tree
+    }
+    // read the zone table and select the zones
+    ZoneHead h;
+    tzone->SetBranchAddress( "id", &h.id );
+    tzone->SetBranchAddress( "zmin", &h.range[0] );
+    tzone->SetBranchAddress( "zmax", &h.range[1] );
+    tzone->SetBranchAddress( "rmin", &h.range[2] );
+    tzone->SetBranchAddress( "rmax", &h.range[3] );
+    tzone->SetBranchAddress( "phimin", &h.range[4] );
+    tzone->SetBranchAddress( "phimax", &h.range[5] );
+    tzone->SetBranchAddress( "bscale", &h.bscale );
+    tzone->SetBranchAddress( "ncond", &h.ncond );
+    tzone->SetBranchAddress( "nmeshz", &h.nmesh[0] );
+    tzone->SetBranchAddress( "nmeshr", &h.nmesh[1] );
+    tzone->SetBranchAddress( "nmeshphi", &h.nmesh[2] );
+    tzone->SetBranchAddress( "nfield", &h.nfield );
+    vector<ZoneHead> head;
+    vector<long long> entry;
+    unsigned maxcond(1), maxmesh(1), maxfield(1);
+    for ( long long i = 0; i < tzone->GetEntries(); i++ ) {
+        tzone->GetEntry(i);
+        bool keep = true;
+        if ( ids ) keep = ( find( ids->begin(), ids->end(), h.id ) != ids->end() );
+        if ( range && keep ) keep = overlaps( h.range, range );
+        if ( !keep ) continue;
+        head.push_back( h );
+        entry.push_back( i );
+        maxcond = max( maxcond, unsigned(h.ncond) );
+        for ( int k = 0; k < 3; k++ ) maxmesh = max( maxmesh, unsigned(h.nmesh[k]) );
+        maxfield = max( maxfield, unsigned(h.nfield) );
+    }
+    tzone->Delete();
+    // read the selected entries of the arrays
+    bool imt = ROOT::IsImplicitMTEnabled();
+    if ( !imt ) ROOT::EnableImplicitMT();
+    vector<char> finite( maxcond );
+    vector<double> cond( 7*maxcond );
+    vector<double> mesh( 3*maxmesh );
+    vector<short> field( 3*maxfield );
+    const char* meshName[3] = { "meshz", "meshr", "meshphi" };
+    for ( int k = 0; k < 3; k++ ) tmesh->SetBranchAddress( meshName[k], &mesh[k*maxmesh] );
+    const char* condName[7] = { "p1x", "p1y", "p1z", "p2x", "p2y", "p2z", "curr" };
+    tcond->SetBranchAddress( "finite", &finite[0] );
+    for ( int k = 0; k < 7; k++ ) tcond->SetBranchAddress( condName[k], &cond[k*maxcond] );
+    const char* fieldName[3] = { "fieldz", "fieldr", "fieldphi" };
+    for ( int k = 0; k < 3; k++ ) tfield->SetBranchAddress( fieldName[k], &field[k*maxfield] );
+    TTree* tree[3] = { tmesh, tcond, tfield };
+    for ( int t = 0; t < 3; t++ ) {
+        tree[t]->SetCacheSize( 32<<20 );
+        tree[t]->AddBranchToCache( "*", true );
+    }
+    // reserve the space for m_zone so that it won't move as the vector grows
+    m_zone.reserve( m_zone.size() + head.size() );
+    for ( unsigned i = 0; i < head.size(); i++ ) {
+        for ( int t = 0; t < 3; t++ ) tree[t]->GetEntry( entry[i] );
+        const ZoneHead& zh = head[i];
+        BFieldZone z( zh.id, zh.range[0], zh.range[1], zh.range[2], zh.range[3], zh.range[4], zh.range[5],
+                      zh.bscale );
+        z.reserve( zh.nmesh[0], zh.nmesh[1], zh.nmesh[2] );
+        m_zone.push_back(z);
+        for ( int j = 0; j < zh.ncond; j++ ) {
+            double p1[3], p2[3];
+            for ( int k = 0; k < 3; k++ ) {
+                p1[k] = cond[k*maxcond+j];
+                p2[k] = cond[(k+3)*maxcond+j];
+            }
+            m_zone.back().appendCond( BFieldCond( finite[j], p1, p2, cond[6*maxcond+j] ) );
+        }
+        for ( int k = 0; k < 3; k++ ) {
+            for ( int j = 0; j < zh.nmesh[k]; j++ ) m_zone.back().appendMesh( k, mesh[k*maxmesh+j] );
+        }
+        for ( int j = 0; j < zh.nfield; j++ ) {
+            m_zone.back().appendField( BFieldVector<short>( field[j], field[maxfield+j], field[2*maxfield+j] ) );
+        }
+    }
+    for ( int t = 0; t < 3; t++ ) tree[t]->Delete();
+    if ( !imt ) ROOT::DisableImplicitMT();
+    // build the LUTs
+    buildLUT();
+
+    return 0;
+}
@@ -11,18 +11,26 @@
 
 #include <vector>
 #include <cmath>
+#include <limits>
 #include <iostream>
 #include "BFieldVector.h"
 #include "BFieldCache.h"
 
+// software prefetch hint, used to pull the next bin into the cache ahead of time
+#if defined(__GNUC__)
+#define BFIELD_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define BFIELD_PREFETCH(p)
+#endif
+
 template <class T>
 class BFieldMesh {
 public:
     // constructor
-    BFieldMesh() : m_scale(1.0) {;}
+    BFieldMesh() : m_min(), m_max(), m_scale(1.0), m_invUnit(), m_nbin(), m_roff(0), m_zoff(0), m_dscale() {;}
     BFieldMesh( double zmin, double zmax, double rmin, double rmax, double phimin, double phimax,
                 double bscale )
-        : m_scale(bscale)
+        : m_scale(bscale), m_invUnit(), m_nbin(), m_roff(0), m_zoff(0), m_dscale()
         { m_min[0] = zmin; m_max[0] = zmax; m_min[1] = rmin; m_max[1] = rmax; m_min[2] = phimin; m_max[2] = phimax; }
     // set ranges
     void setRange( double zmin, double zmax, double rmin, double rmax, double phimin, double phimax )
@@ -36,13 +44,24 @@ public:
     void appendField( const BFieldVector<T> & field ) { m_field.push_back(field); }
     // build LUT
     void buildLUT();
+    // compute the derivatives at the nodes for tricubic interpolation,
+    // or drop them to go back to trilinear interpolation
+    void buildTricubic();
+    void clearTricubic() { std::vector< BFieldVector<T> >().swap( m_deriv ); }
+    bool tricubic() const { return !m_deriv.empty(); }
     // adjust the min/max edges to a new value
     void adjustMin( int i, double x ) { m_min[i] = x; m_mesh[i].front() = x; }
     void adjustMax( int i, double x ) { m_max[i] = x; m_mesh[i].back() = x; }
     // test if a point is inside this zone
     bool inside( double z, double r, double phi ) const;
+    // find the mesh indices of the bin containing (z,r,phi), with phi already in [phimin,phimax]
+    void findBin( double z, double r, double phi, int & iz, int & ir, int & iphi ) const;
+    // same, along axis i only
+    int findIndex( int i, double x ) const;
     // find the bin
     void getCache( double z, double r, double phi, BFieldCache & cache ) const;
+    // prefetch the bin that a track at (z,r,phi) moving along dzrphi[3] will enter next
+    void prefetchNext( double z, double r, double phi, const double *dzrphi ) const;
     // get the B field
     void getB( double z, double r, double phi, double *B ) const
     { BFieldCache cache; getCache( z, r, phi, cache ); cache.getB( z, r, phi, B ); }
@@ -60,15 +79,24 @@ public:
     unsigned nfield() const { return m_field.size(); }
     const BFieldVector<T> & field( int i ) const { return m_field[i]; }
     double bscale() const { return m_scale; }
-private:
+    // memory used by the field values and derivatives (bytes)
+    size_t memory() const { return ( m_field.size() + m_deriv.size() )*sizeof(BFieldVector<T>); }
+    // memory used by the look-up tables (bytes), and whether axis i is uniform (needs none)
+    size_t memoryLUT() const { return ( m_LUT[0].size() + m_LUT[1].size() + m_LUT[2].size() )*sizeof(int); }
+    bool uniform( int i ) const { return m_LUT[i].empty(); }
+protected:
     double m_min[3], m_max[3];
     std::vector<double> m_mesh[3];
     std::vector< BFieldVector<T> > m_field;
     double m_scale;
     // look-up table and related variables
-    std::vector<int> m_LUT[3];
-    double m_invUnit[3];     // inverse unit size in the LUT
+    std::vector<int> m_LUT[3];  // bin at the start of each unit, empty if uniform
+    double m_invUnit[3];     // inverse unit size in the LUT (inverse bin size if uniform)
+    int m_nbin[3];           // number of bins
     int m_roff, m_zoff;
+    // derivatives for tricubic interpolation: 7 per node, see BFieldCache::setDeriv()
+    std::vector< BFieldVector<T> > m_deriv;
+    double m_dscale[7];      // units of m_deriv, relative to bscale
 };
 
 //
@@ -101,6 +129,47 @@ bool BFieldMesh<T>::inside( double z, double r, double phi ) const
              z >= zmin() && z <= zmax() && r >= rmin() && r <= rmax() );
 }
 
+//
+// Find the mesh index of the bin containing x along axis j.
+// On a uniform axis the index is computed directly, and moved up by one if
+// rounding put it below the right bin; if x is within rounding of a node,
+// either bin may be returned.  Otherwise the LUT gives the bins at the start
+// of the unit that contains x and of the next one, and a branchless binary
+// search picks the bin between them (a single comparison if the unit overlaps
+// at most two bins, which is the usual case).
+//
+template <class T>
+inline int BFieldMesh<T>::findIndex( int j, double x ) const
+{
+    const double* mesh = &m_mesh[j][0];
+    int i = int((x-m_min[j])*m_invUnit[j]); // index to LUT
+    if ( m_LUT[j].empty() ) { // uniform
+        i = std::min( i, m_nbin[j]-1 );
+        return i + ( x > mesh[i+1] );
+    }
+    int lo = m_LUT[j][i];
+    int len = m_LUT[j][i+1] - lo + 1;
+    if ( len <= 2 ) return lo + ( x > mesh[lo+1] );
+    while ( len > 1 ) {
+        int half = len/2;
+        lo = ( x > mesh[lo+half] ) ? lo+half : lo;
+        len -= half;
+    }
+    return lo;
+}
+
+//
+// Find the mesh indices of the bin containing (z,r,phi)
+// phi must already be inside [phimin,phimax]
+//
+template <class T>
+void BFieldMesh<T>::findBin( double z, double r, double phi, int & iz, int & ir, int & iphi ) const
+{
+    iz = findIndex( 0, z );
+    ir = findIndex( 1, r );
+    iphi = findIndex( 2, phi );
+}
+
 //
 // Find and return the cache of the bin containing (z,r,phi)
 //
@@ -110,21 +179,11 @@ void BFieldMesh<T>::getCache( double z, double r, double phi, BFieldCache & cach
     // make sure phi is inside this zone
     if ( phi < phimin() ) phi += 2.0*M_PI;
     // find the mesh, and relative location in the mesh
-    // z
     const std::vector<double>& mz(m_mesh[0]);
-    int iz = int((z-zmin())*m_invUnit[0]); // index to LUT
-    iz = m_LUT[0][iz]; // tentative mesh index from LUT
-    if ( z > mz[iz+1] ) iz++;
-    // r
     const std::vector<double>& mr(m_mesh[1]);
-    int ir = int((r-rmin())*m_invUnit[1]); // index to LUT
-    ir = m_LUT[1][ir]; // tentative mesh index from LUT
-    if ( r > mr[ir+1] ) ir++;
-    // phi
     const std::vector<double>& mphi(m_mesh[2]);
-    int iphi = int((phi-phimin())*m_invUnit[2]); // index to LUT
-    iphi = m_LUT[2][iphi]; // tentative mesh index from LUT
-    if ( phi > mphi[iphi+1] ) iphi++;
+    int iz, ir, iphi;
+    findBin( z, r, phi, iz, ir, iphi );
     // store the bin edges
     cache.setRange( mz[iz], mz[iz+1], mr[ir], mr[ir+1], mphi[iphi], mphi[iphi+1] );
     // store the B field at the 8 corners
@@ -139,33 +198,100 @@ void BFieldMesh<T>::getCache( double z, double r, double phi, BFieldCache & cach
     cache.setField( 7, m_field[im0+m_zoff+m_roff+1] );
     // store the B scale
     cache.setBscale( m_scale );
+    // and the derivatives at the corners for tricubic interpolation
+    cache.setTricubic( !m_deriv.empty() );
+    if ( !m_deriv.empty() ) {
+        const int corner[8] = { im0, im0+1, im0+m_roff, im0+m_roff+1, im0+m_zoff, im0+m_zoff+1,
+                                im0+m_zoff+m_roff, im0+m_zoff+m_roff+1 };
+        for ( int k = 1; k < 8; k++ ) {
+            for ( int i = 0; i < 8; i++ ) cache.setDeriv( i, k, m_deriv[7*corner[i]+k-1] );
+            cache.setDscale( k, m_scale*m_dscale[k-1] );
+        }
+    }
     return;
 }
 
+//
+// Issue prefetches for the bin next to the one containing (z,r,phi),
+// in the direction dzrphi[3] = (dz/ds, dr/ds, dphi/ds) of a moving track.
+// Only the 4 corners not shared with the current bin are fetched.
+// Nothing is done if the track leaves this mesh.
+//
+template <class T>
+void BFieldMesh<T>::prefetchNext( double z, double r, double phi, const double *dzrphi ) const
+{
+    if ( phi < phimin() ) phi += 2.0*M_PI;
+    int i[3];
+    findBin( z, r, phi, i[0], i[1], i[2] );
+    // find the face through which the track leaves the bin first
+    const double x[3] = { z, r, phi };
+    int axis = -1;
+    double smin = 0.0;
+    for ( int j = 0; j < 3; j++ ) {
+        double d = dzrphi[j];
+        if ( d == 0.0 ) continue;
+        double s = ( d > 0.0 ) ? (m_mesh[j][i[j]+1]-x[j])/d : (m_mesh[j][i[j]]-x[j])/d;
+        if ( axis < 0 || s < smin ) { axis = j; smin = s; }
+    }
+    if ( axis < 0 ) return;
+    int step = ( dzrphi[axis] > 0.0 ) ? 1 : -1;
+    i[axis] += step;
+    if ( i[axis] < 0 || i[axis] >= int(m_mesh[axis].size())-1 ) return;
+    // the far face of the next bin
+    const int off[3] = { m_zoff, m_roff, 1 };
+    const BFieldVector<T> *f = &m_field[i[0]*m_zoff+i[1]*m_roff+i[2]];
+    if ( step > 0 ) f += off[axis];
+    int a1 = (axis+1)%3;
+    int a2 = (axis+2)%3;
+    BFIELD_PREFETCH( f );
+    BFIELD_PREFETCH( f + off[a1] );
+    BFIELD_PREFETCH( f + off[a2] );
+    BFIELD_PREFETCH( f + off[a1] + off[a2] );
+}
+
 //
 // Construct the look-up table to accelerate bin-finding.
+// A uniform axis needs no table.  Otherwise the axis is divided into units of
+// the size of the smallest bin, but at most maxLUTPerBin times as many units as
+// bins, and the table holds the bin at the start of each unit.
 //
 template <class T>
 void BFieldMesh<T>::buildLUT()
 {
+    const int maxLUTPerBin = 4;
     for ( int j = 0; j < 3; j++ ) { // z, r, phi
         // align the m_mesh edges to m_min/max
         m_mesh[j].front() = m_min[j];
         m_mesh[j].back() = m_max[j];
+        const std::vector<double>& mesh(m_mesh[j]);
+        const int nbin = mesh.size()-1;
+        m_nbin[j] = nbin;
+        double width = mesh.back() - mesh.front();
+        m_LUT[j].clear();
+        // uniform axis: every node at its place, to rounding
+        double h = width/nbin;
+        bool uniform = true;
+        for ( int i = 1; i < nbin && uniform; i++ ) {
+            uniform = ( std::abs( mesh[i] - ( mesh.front() + i*h ) ) < 1.0e-6*h );
+        }
+        if ( uniform ) {
+            m_invUnit[j] = 1.0/h;
+            continue;
+        }
         // determine the unit size, q, to be used in the LUTs
-        double width = m_mesh[j].back() - m_mesh[j].front();
         double q(width);
-        for ( unsigned i = 0; i < m_mesh[j].size()-1; i++ ) {
-            q = std::min( q, m_mesh[j][i+1] - m_mesh[j][i] );
+        for ( int i = 0; i < nbin; i++ ) {
+            q = std::min( q, mesh[i+1] - mesh[i] );
         }
         // find the number of units in the LUT
-        int n = int(width/q) + 1;
+        int n = int( std::min( width/q, double( maxLUTPerBin*nbin ) ) ) + 1;
         q = width/(n+0.5);
         m_invUnit[j] = 1.0/q; // new unit size
         n++;
+        // the bin at the start of each unit, and of the one after the last
         int m = 0; // mesh number
-        for ( int i = 0; i < n; i++ ) { // LUT index
-            if ( i*q + m_mesh[j].front() > m_mesh[j][m+1] ) m++;
+        for ( int i = 0; i <= n; i++ ) { // LUT index
+            while ( m < nbin-1 && i*q + mesh.front() > mesh[m+1] ) m++;
             m_LUT[j].push_back(m);
         }
     }
@@ -173,4 +299,89 @@ void BFieldMesh<T>::buildLUT()
     m_zoff = m_roff*m_mesh[1].size(); // index offset for incrementing z by 1
 }
 
+//
+// Compute the derivatives of the field at each node, for tricubic interpolation:
+// d/dz, d/dr, d/dphi and their mixed products, by 3-point finite differences on
+// the (non-uniform) mesh, one-sided at the edges of the mesh.  A phi axis that
+// spans 2pi (the solenoid) is periodic: its first and last nodes are the same
+// point, and take central differences across phi = 0.
+// For shorts, each derivative is stored with its own scale to use the full range.
+//
+template <class T>
+void BFieldMesh<T>::buildTricubic()
+{
+    const int n[3] = { int(m_mesh[0].size()), int(m_mesh[1].size()), int(m_mesh[2].size()) };
+    const int stride[3] = { n[1]*n[2], n[2], 1 };
+    const int nnode = m_field.size();
+    const bool periodic = ( n[2] > 2 && std::abs( m_mesh[2].back() - m_mesh[2].front() - 2.0*M_PI ) < 1.0e-9 );
+    // d[k] for the bit mask k of the variables differentiated (4 = z, 2 = r, 1 = phi)
+    std::vector<double> d[8];
+    d[0].resize( 3*nnode );
+    for ( int i = 0; i < nnode; i++ ) {
+        for ( int j = 0; j < 3; j++ ) d[0][3*i+j] = m_field[i][j];
+    }
+    for ( int k = 1; k < 8; k++ ) {
+        // differentiate d[from] along the axis of the lowest bit of k
+        int bit = k & -k;
+        int from = k - bit;
+        int a = ( bit == 4 ) ? 0 : ( bit == 2 ) ? 1 : 2;
+        const std::vector<double>& x( m_mesh[a] );
+        const std::vector<double>& f( d[from] );
+        d[k].assign( 3*nnode, 0.0 );
+        if ( n[a] < 2 ) continue;
+        for ( int node = 0; node < nnode; node++ ) {
+            int i = ( node / stride[a] ) % n[a];
+            int s = 3*stride[a];
+            double c[3];     // weights of the 3 points
+            int offset[3];   // their offsets from this node (in units of s)
+            if ( a == 2 && periodic && ( i == 0 || i == n[a]-1 ) ) {
+                // the node before is n-2, and the one after is 1
+                double h1 = x[n[a]-1]-x[n[a]-2], h2 = x[1]-x[0];
+                c[0] = -h2/(h1*(h1+h2)); c[1] = (h2-h1)/(h1*h2); c[2] = h1/(h2*(h1+h2));
+                offset[0] = n[a]-2-i; offset[1] = 0; offset[2] = 1-i;
+            } else if ( n[a] == 2 ) {
+                double h = x[1]-x[0];
+                c[0] = -1.0/h; c[1] = 1.0/h; c[2] = 0.0;
+                offset[0] = -i; offset[1] = 1-i; offset[2] = 0;
+            } else if ( i == 0 ) {
+                double h1 = x[1]-x[0], h2 = x[2]-x[1];
+                c[0] = -(2*h1+h2)/(h1*(h1+h2)); c[1] = (h1+h2)/(h1*h2); c[2] = -h1/(h2*(h1+h2));
+                offset[0] = 0; offset[1] = 1; offset[2] = 2;
+            } else if ( i == n[a]-1 ) {
+                double h1 = x[i]-x[i-1], h2 = x[i-1]-x[i-2];
+                c[0] = (2*h1+h2)/(h1*(h1+h2)); c[1] = -(h1+h2)/(h1*h2); c[2] = h1/(h2*(h1+h2));
+                offset[0] = 0; offset[1] = -1; offset[2] = -2;
+            } else {
+                double h1 = x[i]-x[i-1], h2 = x[i+1]-x[i];
+                c[0] = -h2/(h1*(h1+h2)); c[1] = (h2-h1)/(h1*h2); c[2] = h1/(h2*(h1+h2));
+                offset[0] = -1; offset[1] = 0; offset[2] = 1;
+            }
+            for ( int j = 0; j < 3; j++ ) {
+                d[k][3*node+j] = c[0]*f[3*node+offset[0]*s+j] + c[1]*f[3*node+offset[1]*s+j]
+                               + c[2]*f[3*node+offset[2]*s+j];
+            }
+        }
+    }
+    // store, in units of m_dscale
+    m_deriv.resize( 7*nnode );
+    for ( int k = 1; k < 8; k++ ) {
+        double scale( 1.0 );
+        if ( std::numeric_limits<T>::is_integer ) {
+            double maxd( 0.0 );
+            for ( int i = 0; i < 3*nnode; i++ ) maxd = std::max( maxd, std::abs( d[k][i] ) );
+            scale = ( maxd > 0.0 ) ? maxd/32000. : 1.0;
+        }
+        m_dscale[k-1] = scale;
+        for ( int i = 0; i < nnode; i++ ) {
+            T v[3];
+            for ( int j = 0; j < 3; j++ ) {
+                double x = d[k][3*i+j]/scale;
+                if ( std::numeric_limits<T>::is_integer ) x = ( x >= 0 ) ? x+0.5 : x-0.5;
+                v[j] = T(x);
+            }
+            m_deriv[7*i+k-1] = BFieldVector<T>( v[0], v[1], v[2] );
+        }
+    }
+}
+
 #endif
@@ -0,0 +1,148 @@
+//
+// BFieldProfiler.cxx
+//
+#include "BFieldProfiler.h"
+#include <thread>
+#include <sstream>
+#include <climits>
+using namespace std;
+
+namespace {
+    //
+    // Rate of the cycle counter, against the steady clock over 20 ms
+    //
+    double
+    measureCyclesPerNs()
+    {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        unsigned long long c0 = BFieldProfiler::cycles();
+        this_thread::sleep_for( chrono::milliseconds(20) );
+        unsigned long long c1 = BFieldProfiler::cycles();
+        double ns = chrono::duration<double,nano>( chrono::steady_clock::now()-t0 ).count();
+        return ( c1-c0 )/ns;
+    }
+}
+
+BFieldProfiler::BFieldProfiler( const string& name, double fraction )
+    : m_name(name)
+{
+    static const double cyclesPerNs = measureCyclesPerNs();
+    m_cyclesPerNs = cyclesPerNs;
+    setFraction( fraction );
+    setZones( vector<int>(), vector<int>() );
+}
+
+void
+BFieldProfiler::setFraction( double fraction )
+{
+    m_fraction = ( fraction < 0.0 ) ? 0.0 : ( fraction > 1.0 ) ? 1.0 : fraction;
+    m_threshold = ( m_fraction == 1.0 ) ? ULLONG_MAX : (unsigned long long)( m_fraction*18446744073709551616.0 );
+}
+
+void
+BFieldProfiler::setZones( const vector<int>& id, const vector<int>& ncond )
+{
+    m_id = id;
+    m_ncond = ncond;
+    m_ncond.resize( m_id.size() );
+    m_bin = vector< atomic<unsigned> >( 2*( m_id.size()+1 )*nbin );
+    clear();
+}
+
+void
+BFieldProfiler::clear()
+{
+    for ( unsigned i = 0; i < m_bin.size(); i++ ) m_bin[i] = 0;
+}
+
+unsigned long
+BFieldProfiler::bin( int zone, bool hit, int k ) const
+{
+    if ( zone >= 0 ) return m_bin[ ( 2*zone + hit )*nbin + k ].load();
+    unsigned long n( 0 );
+    for ( int i = 0; i <= nzone(); i++ ) n += m_bin[ ( 2*i + hit )*nbin + k ].load();
+    return n;
+}
+
+unsigned long
+BFieldProfiler::entries( int zone, bool hit ) const
+{
+    unsigned long n( 0 );
+    for ( int k = 0; k < nbin; k++ ) n += bin( zone, hit, k );
+    return n;
+}
+
+//
+// Quantile, interpolated in log scale inside the bin
+//
+double
+BFieldProfiler::quantile( int zone, bool hit, double q ) const
+{
+    unsigned long count[nbin];
+    for ( int k = 0; k < nbin; k++ ) count[k] = bin( zone, hit, k );
+    return BFieldLogHistogram::quantile( count, nbin, q );
+}
+
+//
+// Write the non-empty histograms, one per line:
+//   <zone> <ID> <ncond> <hit> <bin> <count> <bin> <count> ...
+// with zone = nzone for the calls outside all zones
+//
+void
+BFieldProfiler::dump( ostream& out ) const
+{
+    out << "BFieldProfiler " << ( m_name.empty() ? "-" : m_name ) << " " << nzone() << " " << m_fraction
+        << " " << m_cyclesPerNs << endl;
+    for ( int i = 0; i <= nzone(); i++ ) {
+        for ( int hit = 0; hit < 2; hit++ ) {
+            if ( entries( i, hit ) == 0 ) continue;
+            out << i << " " << ( i < nzone() ? m_id[i] : -1 ) << " " << ( i < nzone() ? m_ncond[i] : 0 )
+                << " " << hit;
+            for ( int k = 0; k < nbin; k++ ) {
+                unsigned long n = bin( i, hit, k );
+                if ( n > 0 ) out << " " << k << " " << n;
+            }
+            out << endl;
+        }
+    }
+    out << "end" << endl;
+}
+
+//
+// Read the histograms written by dump(), replacing the zones.
+// Returns 0 if successful
+//
+int
+BFieldProfiler::read( istream& in )
+{
+    string word;
+    int nz;
+    double fraction;
+    in >> word >> m_name >> nz >> fraction >> m_cyclesPerNs;
+    if ( !in || word != "BFieldProfiler" || nz < 0 ) {
+        cerr << "BFieldProfiler::read(): bad header" << endl;
+        return 1;
+    }
+    if ( m_name == "-" ) m_name = "";
+    setFraction( fraction );
+    setZones( vector<int>( nz, -1 ), vector<int>( nz, 0 ) );
+    string line;
+    getline( in, line );
+    while ( getline( in, line ) ) {
+        if ( line == "end" ) return 0;
+        istringstream words( line );
+        int i, id, ncond, hit, k;
+        unsigned long n;
+        words >> i >> id >> ncond >> hit;
+        if ( !words || i < 0 || i > nz || hit < 0 || hit > 1 ) break;
+        if ( i < nz ) {
+            m_id[i] = id;
+            m_ncond[i] = ncond;
+        }
+        while ( words >> k >> n ) {
+            if ( k >= 0 && k < nbin ) m_bin[ ( 2*i + hit )*nbin + k ] = n;
+        }
+    }
+    cerr << "BFieldProfiler::read(): bad or missing line in " << m_name << endl;
+    return 1;
+}
@@ -0,0 +1,90 @@
+//
+// BFieldProfiler.h
+//
+// Sampling profiler of the field evaluation.  A fraction of the calls to
+// getB() are timed with the cycle counter, and their latencies are filled in
+// histograms with 4 bins per factor 2, one for each zone and for cache hits
+// and misses separately.  The histograms are filled with atomics, so one
+// profiler can be shared by all threads.
+//
+#ifndef BFIELDPROFILER_H
+#define BFIELDPROFILER_H
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <iostream>
+#include <chrono>
+#include "BFieldLogHistogram.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+class BFieldProfiler {
+public:
+    enum { nbin = 80 }; // up to 2^20 cycles, the last bin takes the overflow
+    // constructor - name identifies the profiler in the dump
+    explicit BFieldProfiler( const std::string& name = "", double fraction = 0.01 );
+    // fraction of the calls that are timed
+    void setFraction( double fraction );
+    double fraction() const { return m_fraction; }
+    // make the histograms for zones 0..nzone-1 and one for the calls outside
+    // all zones, with the zone ID and number of conductors of each.  Clears
+    // the histograms.  Called by the map when the profiler is attached.
+    void setZones( const std::vector<int>& id, const std::vector<int>& ncond );
+    // decide whether to time this call - a per-thread random draw
+    bool sample() const
+    {
+        static thread_local unsigned long long state = 0x9e3779b97f4a7c15ULL ^ (unsigned long long)&state;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state < m_threshold;
+    }
+    // cycle counter (ns where there is none)
+    static unsigned long long cycles()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch() ).count();
+#endif
+    }
+    // cycles per ns, measured when the first profiler is made (or read back)
+    double cyclesPerNs() const { return m_cyclesPerNs; }
+    // fill the histogram of a zone (nzone() for outside all zones)
+    void fill( int zone, bool hit, unsigned long long ncycle )
+    {
+        int k = BFieldLogHistogram::bin( double(ncycle), nbin );
+        m_bin[ ( 2*zone + hit )*nbin + k ].fetch_add( 1, std::memory_order_relaxed );
+    }
+    void clear();
+    // accessors
+    const std::string& name() const { return m_name; }
+    int nzone() const { return m_id.size(); }
+    int id( int zone ) const { return m_id[zone]; }
+    int ncond( int zone ) const { return m_ncond[zone]; }
+    // number of calls timed, and quantile q (0-1) in cycles, for a zone
+    // (nzone() for outside all zones, -1 for all together)
+    unsigned long entries( int zone, bool hit ) const;
+    double quantile( int zone, bool hit, double q ) const;
+    // contents of bin k, and its lower edge in cycles
+    unsigned long bin( int zone, bool hit, int k ) const;
+    static double binEdge( int k ) { return BFieldLogHistogram::edge( k ); }
+    // write the histograms as text, and read them back
+    void dump( std::ostream& out ) const;
+    int read( std::istream& in );
+private:
+    BFieldProfiler( const BFieldProfiler& );            // not copyable
+    BFieldProfiler& operator=( const BFieldProfiler& );
+    std::string m_name;
+    double m_fraction;
+    double m_cyclesPerNs;
+    unsigned long long m_threshold; // sample() if the random number is below
+    std::vector<int> m_id;          // zone IDs
+    std::vector<int> m_ncond;       // conductors per zone
+    std::vector< std::atomic<unsigned> > m_bin; // [zone][miss,hit][bin], zone = nzone() for outside
+};
+
+#endif
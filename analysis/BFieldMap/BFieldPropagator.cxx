@@ -0,0 +1,277 @@
+//
+// BFieldPropagator.cxx
+//
+#include "BFieldPropagator.h"
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+namespace {
+    const double kappa(0.299792458); // curvature (1/mm) per kT per 1/GeV
+    const int maxSteps(100000);      // give up after this many steps
+    const double surfaceTol(1.0e-3); // distance to the final surface (mm)
+
+    // c = a x b
+    inline void cross( const double *a, const double *b, double *c )
+    {
+        c[0] = a[1]*b[2] - a[2]*b[1];
+        c[1] = a[2]*b[0] - a[0]*b[2];
+        c[2] = a[0]*b[1] - a[1]*b[0];
+    }
+
+    // d(T x B) for a change (dT, dr, dqop) at one RKN stage:
+    // dA = kappa*( dqop*(T x B) + qop*(dT x B) + qop*(T x (G dr)) )
+    inline void dAccel( double qop, const double *T, const double *B, const double *G,
+                        const double *dT, const double *dr, double dqop, double *dA )
+    {
+        double TxB[3], dTxB[3], GdR[3], TxGdR[3];
+        cross( T, B, TxB );
+        cross( dT, B, dTxB );
+        for ( int i = 0; i < 3; i++ ) GdR[i] = G[3*i]*dr[0] + G[3*i+1]*dr[1] + G[3*i+2]*dr[2];
+        cross( T, GdR, TxGdR );
+        for ( int i = 0; i < 3; i++ ) dA[i] = kappa*( dqop*TxB[i] + qop*( dTxB[i] + TxGdR[i] ) );
+    }
+
+    // straight-line distance from xyz along u to the cylinder r = rmax, |z| = zmax
+    double distToSurface( const double *xyz, const double *u, double rmax, double zmax )
+    {
+        double s = 1e30;
+        if ( u[2] > 0.0 ) s = (zmax-xyz[2])/u[2];
+        else if ( u[2] < 0.0 ) s = (-zmax-xyz[2])/u[2];
+        double a = u[0]*u[0] + u[1]*u[1];
+        if ( a > 0.0 ) {
+            double b = xyz[0]*u[0] + xyz[1]*u[1];
+            double c = xyz[0]*xyz[0] + xyz[1]*xyz[1] - rmax*rmax;
+            double d = b*b - a*c;
+            if ( d >= 0.0 ) {
+                double sr = (-b + sqrt(d))/a;
+                if ( sr >= 0.0 ) s = min( s, sr );
+            }
+        }
+        return s;
+    }
+
+    // straight-line distance back from xyz (outside the cylinder) to the surface
+    double distBeyondSurface( const double *xyz, const double *u, double rmax, double zmax )
+    {
+        double s = 0.0;
+        double r = sqrt(xyz[0]*xyz[0]+xyz[1]*xyz[1]);
+        if ( r > rmax ) {
+            double ur = (xyz[0]*u[0]+xyz[1]*u[1])/r;
+            if ( ur > 0.0 ) s = max( s, (r-rmax)/ur );
+        }
+        if ( abs(xyz[2]) > zmax && xyz[2]*u[2] > 0.0 ) s = max( s, (abs(xyz[2])-zmax)/abs(u[2]) );
+        return s;
+    }
+
+    inline bool outside( const double *xyz, double rmax, double zmax )
+    {
+        return ( xyz[0]*xyz[0]+xyz[1]*xyz[1] > rmax*rmax || abs(xyz[2]) > zmax );
+    }
+}
+
+//
+// Track states start with a unit Jacobian
+//
+BFieldTrack::BFieldTrack()
+    : qop(0.0), path(0.0)
+{
+    for ( int i = 0; i < 3; i++ ) pos[i] = dir[i] = 0.0;
+    for ( int i = 0; i < 49; i++ ) jac[i] = ( i%8 == 0 ) ? 1.0 : 0.0;
+}
+
+BFieldTrack::BFieldTrack( const double *xyz, const double *u, double q_over_p )
+    : qop(q_over_p), path(0.0)
+{
+    double norm = sqrt(u[0]*u[0]+u[1]*u[1]+u[2]*u[2]);
+    for ( int i = 0; i < 3; i++ ) {
+        pos[i] = xyz[i];
+        dir[i] = u[i]/norm;
+    }
+    for ( int i = 0; i < 49; i++ ) jac[i] = ( i%8 == 0 ) ? 1.0 : 0.0;
+}
+
+//
+// Constructors
+//
+BFieldPropagator::BFieldPropagator( const BFieldMap* toroid, const BFieldSolenoid* solenoid )
+    : m_field(toroid,solenoid), m_tol(1.0e-3), m_hmin(0.1), m_hmax(1000.0)
+{
+}
+
+BFieldPropagator::BFieldPropagator( const BFieldComposite& field )
+    : m_field(field), m_tol(1.0e-3), m_hmin(0.1), m_hmax(1000.0)
+{
+}
+
+//
+// One Runge-Kutta-Nystrom step (Abramowitz & Stegun 25.5.20) of length h.
+// The field is evaluated 3 times: at the start, the mid-point (shared by
+// stages 2 and 3) and the end.  The Jacobian is transported with the same
+// stages, using the analytic field derivatives, and projected like the
+// direction when that is renormalized.
+// Returns the Bugge-Myrheim error estimate h^2 |A1 - A2 - A3 + A4|.
+//
+double
+BFieldPropagator::step( const BFieldTrack& in, double h, BFieldTrack& out, bool jacobian, Cache& cache ) const
+{
+    const double *r = in.pos;
+    const double *T = in.dir;
+    const double qop = in.qop;
+    double B1[3], B2[3], B4[3];
+    double G1[9], G2[9], G4[9];
+    double *d1 = jacobian ? G1 : 0;
+    double *d2 = jacobian ? G2 : 0;
+    double *d4 = jacobian ? G4 : 0;
+    double A1[3], A2[3], A3[3], A4[3];
+    double r2[3], T2[3], T3[3], r4[3], T4[3];
+    // stage 1
+    getB( r, B1, d1, cache );
+    cross( T, B1, A1 );
+    for ( int i = 0; i < 3; i++ ) {
+        A1[i] *= kappa*qop;
+        r2[i] = r[i] + 0.5*h*T[i] + 0.125*h*h*A1[i];
+        T2[i] = T[i] + 0.5*h*A1[i];
+    }
+    // stages 2 and 3 at the mid-point
+    getB( r2, B2, d2, cache );
+    cross( T2, B2, A2 );
+    for ( int i = 0; i < 3; i++ ) {
+        A2[i] *= kappa*qop;
+        T3[i] = T[i] + 0.5*h*A2[i];
+    }
+    cross( T3, B2, A3 );
+    for ( int i = 0; i < 3; i++ ) {
+        A3[i] *= kappa*qop;
+        r4[i] = r[i] + h*T[i] + 0.5*h*h*A3[i];
+        T4[i] = T[i] + h*A3[i];
+    }
+    // stage 4 at the end
+    getB( r4, B4, d4, cache );
+    cross( T4, B4, A4 );
+    for ( int i = 0; i < 3; i++ ) A4[i] *= kappa*qop;
+    // new state
+    double norm2 = 0.0;
+    for ( int i = 0; i < 3; i++ ) {
+        out.pos[i] = r[i] + h*T[i] + h*h/6.0*( A1[i] + A2[i] + A3[i] );
+        out.dir[i] = T[i] + h/6.0*( A1[i] + 2.0*A2[i] + 2.0*A3[i] + A4[i] );
+        norm2 += out.dir[i]*out.dir[i];
+    }
+    double norm = 1.0/sqrt(norm2);
+    for ( int i = 0; i < 3; i++ ) out.dir[i] *= norm;
+    out.qop = qop;
+    out.path = in.path + h;
+    // error estimate
+    double err = 0.0;
+    for ( int i = 0; i < 3; i++ ) err += abs( A1[i] - A2[i] - A3[i] + A4[i] );
+    err *= h*h;
+    // transport the Jacobian: each column is a tangent vector (dr, dT, dqop)
+    if ( jacobian ) {
+        for ( int k = 0; k < 7; k++ ) {
+            double dr[3], dT[3];
+            for ( int i = 0; i < 3; i++ ) {
+                dr[i] = in.jac[7*i+k];
+                dT[i] = in.jac[7*(i+3)+k];
+            }
+            double dq = in.jac[7*6+k];
+            double dA1[3], dA2[3], dA3[3], dA4[3];
+            double dr2[3], dT2[3], dT3[3], dr4[3], dT4[3];
+            dAccel( qop, T, B1, G1, dT, dr, dq, dA1 );
+            for ( int i = 0; i < 3; i++ ) {
+                dr2[i] = dr[i] + 0.5*h*dT[i] + 0.125*h*h*dA1[i];
+                dT2[i] = dT[i] + 0.5*h*dA1[i];
+            }
+            dAccel( qop, T2, B2, G2, dT2, dr2, dq, dA2 );
+            for ( int i = 0; i < 3; i++ ) dT3[i] = dT[i] + 0.5*h*dA2[i];
+            dAccel( qop, T3, B2, G2, dT3, dr2, dq, dA3 );
+            for ( int i = 0; i < 3; i++ ) {
+                dr4[i] = dr[i] + h*dT[i] + 0.5*h*h*dA3[i];
+                dT4[i] = dT[i] + h*dA3[i];
+            }
+            dAccel( qop, T4, B4, G4, dT4, dr4, dq, dA4 );
+            double dTout[3];
+            double TdT = 0.0;
+            for ( int i = 0; i < 3; i++ ) {
+                out.jac[7*i+k] = dr[i] + h*dT[i] + h*h/6.0*( dA1[i] + dA2[i] + dA3[i] );
+                dTout[i] = dT[i] + h/6.0*( dA1[i] + 2.0*dA2[i] + 2.0*dA3[i] + dA4[i] );
+                TdT += out.dir[i]*dTout[i];
+            }
+            // the direction was renormalized: d(T/|T|) = ( dT - T (T.dT) )/|T|
+            for ( int i = 0; i < 3; i++ ) out.jac[7*(i+3)+k] = norm*( dTout[i] - out.dir[i]*TdT );
+            out.jac[7*6+k] = dq;
+        }
+    }
+    return err;
+}
+
+//
+// Propagate one track with its own caches
+//
+int
+BFieldPropagator::propagate( BFieldTrack& track, double rmax, double zmax, double smax, bool jacobian ) const
+{
+    Cache cache;
+    return propagate( track, rmax, zmax, smax, jacobian, cache );
+}
+
+//
+// Propagate one track with adaptive steps until it reaches the cylinder
+// r = rmax, |z| = zmax, or the path length smax.
+// The last step is adjusted so that the track ends on the surface.
+//
+int
+BFieldPropagator::propagate( BFieldTrack& track, double rmax, double zmax, double smax,
+                             bool jacobian, Cache& cache ) const
+{
+    if ( outside( track.pos, rmax, zmax ) ) return Surface;
+    double h = min( m_hmax, 10.0*m_hmin );
+    BFieldTrack next( track );
+    for ( int istep = 0; istep < maxSteps; istep++ ) {
+        // do not step beyond the surface or the maximum path
+        double sleft = smax - track.path;
+        double ssurf = distToSurface( track.pos, track.dir, rmax, zmax );
+        bool last = false;
+        if ( h >= ssurf ) { h = ssurf; last = true; }
+        if ( h >= sleft ) { h = sleft; last = true; }
+        double err = step( track, h, next, jacobian, cache );
+        if ( err > m_tol && h > m_hmin ) {
+            // reject and retry with a smaller step
+            h = max( m_hmin, h*max( 0.25, 0.9*pow( m_tol/err, 0.25 ) ) );
+            continue;
+        }
+        if ( outside( next.pos, rmax, zmax ) ) {
+            // overshoot due to curvature - shorten the step to end on the surface
+            double sback = distBeyondSurface( next.pos, next.dir, rmax, zmax );
+            if ( sback > surfaceTol ) {
+                h -= min( sback, 0.5*h );
+                continue;
+            }
+            track = next;
+            return Surface;
+        }
+        track = next;
+        if ( last ) {
+            if ( track.path >= smax - surfaceTol ) return MaxPath;
+            if ( distToSurface( track.pos, track.dir, rmax, zmax ) < surfaceTol ) return Surface;
+        }
+        // next step size
+        double fac = ( err > 0.0 ) ? 0.9*pow( m_tol/err, 0.25 ) : 4.0;
+        h = min( m_hmax, max( m_hmin, h*min( 4.0, fac ) ) );
+    }
+    return Failed;
+}
+
+//
+// Propagate many tracks in parallel.  Each worker has its own caches.
+//
+void
+BFieldPropagator::propagate( vector<BFieldTrack>& tracks, vector<int>& status,
+                             double rmax, double zmax, double smax, bool jacobian,
+                             BFieldThreadPool& pool ) const
+{
+    status.resize( tracks.size() );
+    vector<Cache> cache( pool.nthread() );
+    pool.run( tracks.size(), [&]( int i, int ithread ) {
+        status[i] = propagate( tracks[i], rmax, zmax, smax, jacobian, cache[ithread] );
+    } );
+}
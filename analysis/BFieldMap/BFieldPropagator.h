@@ -0,0 +1,65 @@
+//
+// BFieldPropagator.h
+//
+// Runge-Kutta-Nystrom propagation of charged tracks through the field of
+// a BFieldComposite: the toroid map plus the (moved and tilted) solenoid map,
+// which takes precedence inside its volume.
+//
+// Units: mm, kT, GeV.
+//
+#ifndef BFIELDPROPAGATOR_H
+#define BFIELDPROPAGATOR_H
+
+#include <vector>
+#include "BFieldComposite.h"
+#include "BFieldThreadPool.h"
+
+//
+// Track state at a point along the trajectory
+//
+class BFieldTrack {
+public:
+    BFieldTrack();
+    BFieldTrack( const double *xyz, const double *u, double q_over_p );
+    double pos[3];  // position (mm)
+    double dir[3];  // unit direction vector
+    double qop;     // charge/momentum (1/GeV)
+    double path;    // path length travelled (mm)
+    double jac[49]; // transport Jacobian d(pos,dir,qop)/d(pos0,dir0,qop0), 7x7 row-major
+};
+
+class BFieldPropagator {
+public:
+    // return codes of propagate()
+    enum Status { Surface = 0, MaxPath = 1, Failed = 2 };
+    // per-thread field caches
+    typedef BFieldComposite::Cache Cache;
+    // constructors - either map may be 0
+    BFieldPropagator( const BFieldMap* toroid, const BFieldSolenoid* solenoid = 0 );
+    BFieldPropagator( const BFieldComposite& field );
+    // step-size control: position error per step (mm), min/max step (mm)
+    void setTolerance( double tol ) { m_tol = tol; }
+    void setStepRange( double hmin, double hmax ) { m_hmin = hmin; m_hmax = hmax; }
+    // propagate until the track leaves the cylinder r < rmax, |z| < zmax,
+    // or the path length reaches smax.  The Jacobian is computed if requested.
+    int propagate( BFieldTrack& track, double rmax, double zmax, double smax,
+                   bool jacobian = false ) const;
+    int propagate( BFieldTrack& track, double rmax, double zmax, double smax,
+                   bool jacobian, Cache& cache ) const;
+    // propagate many tracks on a thread pool; status[i] is filled for each track
+    void propagate( std::vector<BFieldTrack>& tracks, std::vector<int>& status,
+                    double rmax, double zmax, double smax, bool jacobian,
+                    BFieldThreadPool& pool ) const;
+    // field at a point, in kT, with derivatives if deriv[9] is given
+    void getB( const double *xyz, double *B, double *deriv, Cache& cache ) const
+    { m_field.getB( xyz, B, deriv, cache ); }
+private:
+    // one RKN step of length h; returns the error estimate
+    double step( const BFieldTrack& in, double h, BFieldTrack& out, bool jacobian, Cache& cache ) const;
+    BFieldComposite m_field;
+    double m_tol;  // position error tolerance per step (mm)
+    double m_hmin; // minimum step (mm)
+    double m_hmax; // maximum step (mm)
+};
+
+#endif
@@ -0,0 +1,84 @@
+//
+// BFieldRecorder.cxx
+//
+#include "BFieldRecorder.h"
+#include <iostream>
+#include <cstring>
+using namespace std;
+
+namespace {
+    const char magic[8] = { 'B', 'F', 'T', 'R', 'A', 'C', 'E', '1' };
+    const unsigned bufferSize( 1<<16 ); // bytes written at a time
+}
+
+int
+BFieldRecorder::open( const char* filename )
+{
+    close();
+    m_file = fopen( filename, "wb" );
+    if ( m_file == 0 || fwrite( magic, 1, sizeof(magic), m_file ) != sizeof(magic) ) {
+        cerr << "BFieldRecorder::open(): failed to open " << filename << endl;
+        if ( m_file ) fclose( m_file );
+        m_file = 0;
+        return 1;
+    }
+    m_buffer.reserve( bufferSize );
+    m_n = 0;
+    return 0;
+}
+
+void
+BFieldRecorder::close()
+{
+    lock_guard<mutex> lock( m_mutex );
+    if ( m_file == 0 ) return;
+    fwrite( m_buffer.data(), 1, m_buffer.size(), m_file );
+    fclose( m_file );
+    m_file = 0;
+    m_buffer.clear();
+}
+
+void
+BFieldRecorder::record( int component, const double *xyz, bool deriv )
+{
+    char rec[BFieldTrace::recordSize];
+    rec[0] = ( component & 3 ) | ( deriv ? 4 : 0 );
+    memcpy( rec+1, xyz, 3*sizeof(double) );
+    lock_guard<mutex> lock( m_mutex );
+    if ( m_file == 0 ) return;
+    if ( m_buffer.size() + sizeof(rec) > bufferSize ) {
+        fwrite( m_buffer.data(), 1, m_buffer.size(), m_file );
+        m_buffer.clear();
+    }
+    m_buffer.insert( m_buffer.end(), rec, rec+sizeof(rec) );
+    m_n++;
+}
+
+int
+BFieldTrace::read( const char* filename )
+{
+    m_flag.clear();
+    m_xyz.clear();
+    FILE* file = fopen( filename, "rb" );
+    char head[sizeof(magic)];
+    if ( file == 0 || fread( head, 1, sizeof(head), file ) != sizeof(head) ||
+         memcmp( head, magic, sizeof(magic) ) != 0 ) {
+        cerr << "BFieldTrace::read(): " << filename << " is not a field trace" << endl;
+        if ( file ) fclose( file );
+        return 1;
+    }
+    char rec[recordSize];
+    size_t nread;
+    while ( ( nread = fread( rec, 1, recordSize, file ) ) == recordSize ) {
+        m_flag.push_back( rec[0] );
+        double xyz[3];
+        memcpy( xyz, rec+1, sizeof(xyz) );
+        m_xyz.insert( m_xyz.end(), xyz, xyz+3 );
+    }
+    fclose( file );
+    if ( nread != 0 ) {
+        cerr << "BFieldTrace::read(): " << filename << " ends with a partial record" << endl;
+        return 1;
+    }
+    return 0;
+}
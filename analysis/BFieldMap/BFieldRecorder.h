@@ -0,0 +1,57 @@
+//
+// BFieldRecorder.h
+//
+// Recorder of the getB() queries, to replay the field accesses of a real job
+// with replayTrace.  Each query is written to a binary trace as one byte, the
+// component map (the BFieldComposite regions) plus 4 if the derivatives were
+// requested, followed by the position as 3 doubles in the native byte order.
+// BFieldTrace reads the trace back.
+//
+#ifndef BFIELDRECORDER_H
+#define BFIELDRECORDER_H
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <cstdio>
+
+class BFieldRecorder {
+public:
+    // component maps, same values as BFieldComposite::Region
+    enum Component { Toroid = 1, Solenoid = 2, H8 = 3 };
+    BFieldRecorder() : m_file(0), m_n(0) {;}
+    ~BFieldRecorder() { close(); }
+    // start a new trace file.  Returns 0 if successful
+    int open( const char* filename );
+    // write out the buffer and close the file
+    void close();
+    bool isOpen() const { return m_file != 0; }
+    // record one query - safe to call from many threads
+    void record( int component, const double *xyz, bool deriv );
+    // number of queries recorded
+    unsigned long nrecord() const { std::lock_guard<std::mutex> lock( m_mutex ); return m_n; }
+private:
+    BFieldRecorder( const BFieldRecorder& );            // not copyable
+    BFieldRecorder& operator=( const BFieldRecorder& );
+    mutable std::mutex m_mutex;
+    FILE* m_file;
+    std::vector<char> m_buffer;
+    unsigned long m_n;
+};
+
+class BFieldTrace {
+public:
+    enum { recordSize = 1 + 3*sizeof(double) };
+    // read a trace written by BFieldRecorder.  Returns 0 if successful
+    int read( const char* filename );
+    // accessors
+    unsigned size() const { return m_flag.size(); }
+    int component( unsigned i ) const { return m_flag[i] & 3; }
+    bool deriv( unsigned i ) const { return ( m_flag[i] & 4 ) != 0; }
+    const double* xyz( unsigned i ) const { return &m_xyz[3*i]; }
+private:
+    std::vector<unsigned char> m_flag;
+    std::vector<double> m_xyz;
+};
+
+#endif
@@ -0,0 +1,139 @@
+//
+// BFieldScaledMap.cxx
+//
+#include "BFieldScaledMap.h"
+#include "BFieldMapDiff.h"
+#include <cmath>
+#include <algorithm>
+using namespace std;
+
+//
+// Add a component map and rebuild the combined map
+//
+int
+BFieldScaledMap::addComponent( const BFieldMap* map, double scale )
+{
+    if ( map->compressed() ) {
+        cerr << "BFieldScaledMap::addComponent(): the map is compressed" << endl;
+        return -1;
+    }
+    if ( map->nfolded() > 0 ) {
+        cerr << "BFieldScaledMap::addComponent(): the map is folded" << endl;
+        return -1;
+    }
+    if ( !m_component.empty() ) {
+        const BFieldMap* first = m_component.front();
+        bool same = ( map->nzone() == first->nzone() );
+        for ( int i = 0; same && i < map->nzone(); i++ ) {
+            same = ( map->zone(i).id() == first->zone(i).id() &&
+                     BFieldMapDiff::sameMesh( map->zone(i), first->zone(i), 1e-6 ) );
+        }
+        if ( !same ) {
+            cerr << "BFieldScaledMap::addComponent(): the zones and meshes do not match the first component" << endl;
+            return -1;
+        }
+    }
+    m_component.push_back( map );
+    m_scale.push_back( scale );
+    delete m_map;
+    m_map = combine();
+    return m_component.size()-1;
+}
+
+void
+BFieldScaledMap::setScale( int i, double scale, BFieldThreadPool* pool )
+{
+    m_scale[i] = scale;
+    delete m_map;
+    m_map = combine( pool );
+}
+
+void
+BFieldScaledMap::setScales( const vector<double>& scale, BFieldThreadPool* pool )
+{
+    for ( unsigned i = 0; i < m_scale.size() && i < scale.size(); i++ ) m_scale[i] = scale[i];
+    delete m_map;
+    m_map = combine( pool );
+}
+
+//
+// Build the combined map.  In each zone the scaled fields of the components are
+// added node by node, and stored as shorts with a new bscale that fits the sum.
+// The conductors of all components are collected, with their currents scaled;
+// those with zero current are dropped.  The zones are combined in parallel.
+//
+BFieldMap*
+BFieldScaledMap::combine( BFieldThreadPool* pool ) const
+{
+    BFieldMap* map = new BFieldMap;
+    if ( m_component.empty() ) return map;
+    const BFieldMap* first = m_component.front();
+    const int ncomp = m_component.size();
+    vector<BFieldZone> zone;
+    zone.reserve( first->nzone() );
+    for ( int i = 0; i < first->nzone(); i++ ) {
+        const BFieldZone& z = first->zone(i);
+        zone.push_back( BFieldZone( z.id(), z.zmin(), z.zmax(), z.rmin(), z.rmax(), z.phimin(), z.phimax(),
+                                    z.bscale() ) );
+    }
+    if ( pool == 0 ) pool = defaultPool();
+    pool->run( zone.size(), [&]( int i, int ) {
+        const BFieldZone& z0 = first->zone(i);
+        BFieldZone& newzone = zone[i];
+        newzone.reserve( z0.nmesh(0), z0.nmesh(1), z0.nmesh(2) );
+        for ( int j = 0; j < 3; j++ ) { // z, r, phi
+            for ( unsigned k = 0; k < z0.nmesh(j); k++ ) newzone.appendMesh( j, z0.mesh(j,k) );
+        }
+        // sum of the scaled fields
+        vector<double> scale( ncomp );
+        for ( int c = 0; c < ncomp; c++ ) scale[c] = m_scale[c]*m_component[c]->zone(i).bscale();
+        unsigned nfield = z0.nfield();
+        vector<double> sum( 3*nfield, 0.0 );
+        double maxB( 0.0 );
+        for ( unsigned k = 0; k < nfield; k++ ) {
+            for ( int c = 0; c < ncomp; c++ ) {
+                if ( scale[c] == 0.0 ) continue;
+                const BFieldVector<short>& f = m_component[c]->zone(i).field(k);
+                for ( int j = 0; j < 3; j++ ) sum[3*k+j] += scale[c]*f[j];
+            }
+            for ( int j = 0; j < 3; j++ ) maxB = max( maxB, abs( sum[3*k+j] ) );
+        }
+        // store as shorts, leaving a margin for rounding
+        double bscale = ( maxB > 0.0 ) ? maxB/32000. : z0.bscale();
+        newzone.setBscale( bscale );
+        for ( unsigned k = 0; k < nfield; k++ ) {
+            short b[3];
+            for ( int j = 0; j < 3; j++ ) {
+                double x = sum[3*k+j]/bscale;
+                b[j] = ( x >= 0 ) ? (short)(x+0.5) : (short)(x-0.5);
+            }
+            newzone.appendField( BFieldVector<short>( b[0], b[1], b[2] ) );
+        }
+        // conductors of all components
+        for ( int c = 0; c < ncomp; c++ ) {
+            const BFieldZone& zc = m_component[c]->zone(i);
+            for ( unsigned k = 0; k < zc.ncond(); k++ ) {
+                const BFieldCond& cond = zc.cond(k);
+                double curr = m_scale[c]*cond.curr();
+                if ( curr == 0.0 ) continue;
+                double p1[3] = { cond.p1(0), cond.p1(1), cond.p1(2) };
+                double p2[3] = { cond.p2(0), cond.p2(1), cond.p2(2) };
+                newzone.appendCond( BFieldCond( cond.finite(), p1, p2, curr ) );
+            }
+        }
+    } );
+    for ( unsigned i = 0; i < zone.size(); i++ ) map->appendZone( zone[i] );
+    map->buildLUT( pool );
+    return map;
+}
+
+//
+// Thread pool of combine() when none is given, created on first use
+//
+BFieldThreadPool*
+BFieldScaledMap::defaultPool() const
+{
+    lock_guard<mutex> lock( m_poolMutex );
+    if ( m_pool == 0 ) m_pool = new BFieldThreadPool;
+    return m_pool;
+}
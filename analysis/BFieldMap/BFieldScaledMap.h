@@ -0,0 +1,64 @@
+//
+// BFieldScaledMap.h
+//
+// Toroid field map built as a linear combination of component maps, e.g. the
+// barrel toroid and the endcap toroids, each computed for a unit current and
+// scaled by a factor that can be changed at run time.  The components are
+// BFieldMaps: the solenoid map has its own mesh, and is added by BFieldComposite,
+// which scales it by a factor of its own (BFieldComposite::setSolenoidScale()).
+// The components must share the zones and meshes of the first one, so that the
+// combination can be done node by node: the combined map is an ordinary BFieldMap,
+// and evaluating it costs the same whatever the number of components.
+// The conductors of each component are kept, with their currents scaled.
+//
+// Units: mm, kT.
+//
+#ifndef BFIELDSCALEDMAP_H
+#define BFIELDSCALEDMAP_H
+
+#include <vector>
+#include <mutex>
+#include "BFieldMap.h"
+#include "BFieldThreadPool.h"
+
+class BFieldScaledMap {
+public:
+    // constructor - the combined map is empty until a component is added, and
+    // getB() gives the field outside all zones
+    BFieldScaledMap() : m_map(new BFieldMap), m_pool(0) {;}
+    // destructor
+    ~BFieldScaledMap() { delete m_map; delete m_pool; }
+    // add a component map (not owned).  It must have the same zones and meshes as
+    // the first component.  Returns the index of the component, or -1 if not.
+    int addComponent( const BFieldMap* map, double scale = 1.0 );
+    // number of components and their scale factors
+    int ncomponent() const { return m_component.size(); }
+    double scale( int i ) const { return m_scale[i]; }
+    // change the scale factors and rebuild the combined map.  The combination
+    // runs on the pool if given, or otherwise on a pool of all hardware threads,
+    // kept for the next calls (also by addComponent()).
+    // Not thread-safe with getB(), and caches given to getB() must be cleared afterwards.
+    void setScale( int i, double scale, BFieldThreadPool* pool = 0 );
+    void setScales( const std::vector<double>& scale, BFieldThreadPool* pool = 0 );
+    // make a new combined map with the current scale factors, owned by the caller
+    BFieldMap* combine( BFieldThreadPool* pool = 0 ) const;
+    // the combined map
+    const BFieldMap* map() const { return m_map; }
+    // compute magnetic field
+    void getB( const double *xyz, double *B, double *deriv=0 ) const
+    { m_map->getB( xyz, B, deriv ); }
+    void getB( const double *xyz, double *B, double *deriv, BFieldCache& cache ) const
+    { m_map->getB( xyz, B, deriv, cache ); }
+private:
+    BFieldScaledMap( const BFieldScaledMap& );            // not copyable
+    BFieldScaledMap& operator=( const BFieldScaledMap& );
+    std::vector<const BFieldMap*> m_component;
+    std::vector<double> m_scale;
+    BFieldMap* m_map; // combined map
+    // thread pool of combine() when none is given, created on first use
+    mutable std::mutex m_poolMutex;
+    mutable BFieldThreadPool* m_pool;
+    BFieldThreadPool* defaultPool() const;
+};
+
+#endif
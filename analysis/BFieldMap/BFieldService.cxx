@@ -0,0 +1,506 @@
+//
+// BFieldService.cxx
+//
+#include "BFieldService.h"
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+using namespace std;
+
+namespace {
+
+const char helloMagic[8] = { 'B','F','S','E','R','V','0','1' };
+
+// first message from the client
+struct Hello {
+    char magic[8];
+    int shm; // 1 to use shared memory
+    int pad;
+};
+
+// answer of the server
+struct Welcome {
+    int status;    // 0 if OK
+    int shm;       // 1 if the ring below was set up
+    int nslot;
+    int maxpoint;
+    char name[48]; // name of the shared memory
+};
+
+// batch header in the socket protocol, followed by 3*npoint doubles.
+// The answer is 3*npoint doubles of B, then 9*npoint of derivatives if asked.
+struct Request {
+    int npoint;
+    int deriv;
+};
+
+// header of the shared memory, followed by nslot slots
+struct Ring {
+    int nslot;
+    int maxpoint;
+    char pad0[56];
+    std::atomic<unsigned long> head; // batches submitted by the client
+    char pad1[56];
+    std::atomic<unsigned long> tail; // batches done by the server
+    char pad2[56];
+    std::atomic<int> sleeping;       // 1 while the server waits on the socket
+    char pad3[60];
+};
+
+// header of a slot, followed by xyz[3*maxpoint], B[3*maxpoint], deriv[9*maxpoint]
+struct Slot {
+    int npoint;
+    int deriv;
+};
+
+size_t slotSize( int maxpoint ) { return sizeof(Slot) + 15*maxpoint*sizeof(double); }
+size_t ringSize( int nslot, int maxpoint ) { return sizeof(Ring) + nslot*slotSize( maxpoint ); }
+Slot* slot( Ring* ring, unsigned long i )
+{
+    return (Slot*)( (char*)( ring+1 ) + ( i % ring->nslot )*slotSize( ring->maxpoint ) );
+}
+double* slotXyz( Slot* s ) { return (double*)( s+1 ); }
+double* slotB( Slot* s, int maxpoint ) { return slotXyz( s ) + 3*maxpoint; }
+double* slotDeriv( Slot* s, int maxpoint ) { return slotXyz( s ) + 6*maxpoint; }
+
+// read or write exactly n bytes, returns false on error or end of file
+bool readAll( int fd, void* buf, size_t n )
+{
+    char* p = (char*)buf;
+    while ( n > 0 ) {
+        ssize_t k = ::read( fd, p, n );
+        if ( k <= 0 ) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+bool writeAll( int fd, const void* buf, size_t n )
+{
+    const char* p = (const char*)buf;
+    while ( n > 0 ) {
+        ssize_t k = ::send( fd, p, n, MSG_NOSIGNAL );
+        if ( k <= 0 ) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+double now()
+{
+    return chrono::duration<double>( chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+}
+
+//
+// BFieldLatency: bin k covers [2^(k/4), 2^((k+1)/4)) ns
+//
+void
+BFieldLatency::clear()
+{
+    for ( int i = 0; i < nbin; i++ ) m_bin[i] = 0;
+    m_n = 0;
+    m_sum = 0;
+}
+
+void
+BFieldLatency::fill( double ns )
+{
+    m_bin[BFieldLogHistogram::bin( ns, nbin )].fetch_add( 1, memory_order_relaxed );
+    m_n.fetch_add( 1, memory_order_relaxed );
+    m_sum.fetch_add( (unsigned long)ns, memory_order_relaxed );
+}
+
+unsigned long
+BFieldLatency::entries() const
+{
+    return m_n.load();
+}
+
+double
+BFieldLatency::mean() const
+{
+    unsigned long n = m_n.load();
+    return ( n > 0 ) ? double( m_sum.load() )/n : 0.0;
+}
+
+//
+// Quantile, interpolated in log scale inside the bin
+//
+double
+BFieldLatency::quantile( double q ) const
+{
+    unsigned long count[nbin];
+    for ( int k = 0; k < nbin; k++ ) count[k] = m_bin[k].load();
+    return BFieldLogHistogram::quantile( count, nbin, q );
+}
+
+void
+BFieldLatency::print( ostream& out ) const
+{
+    out << "mean " << mean()/1e3 << " us, 50% " << quantile(0.5)/1e3 << " us, 90% "
+        << quantile(0.9)/1e3 << " us, 99% " << quantile(0.99)/1e3 << " us, 99.9% "
+        << quantile(0.999)/1e3 << " us";
+}
+
+//
+// BFieldServer
+//
+BFieldServer::BFieldServer( const BFieldComposite& field )
+    : m_field(field), m_listen(-1), m_stop(false), m_nclient(0), m_nbatch(0), m_npoint(0), m_start(0.0)
+{;}
+
+BFieldServer::~BFieldServer()
+{
+    m_stop = true;
+    while ( m_nclient.load() > 0 ) this_thread::sleep_for( chrono::milliseconds(10) );
+    if ( m_listen >= 0 ) {
+        ::close( m_listen );
+        ::unlink( m_path.c_str() );
+    }
+}
+
+int
+BFieldServer::start( const char* path )
+{
+    sockaddr_un addr;
+    if ( strlen( path ) >= sizeof(addr.sun_path) ) {
+        cerr << "BFieldServer::start(): socket path too long: " << path << endl;
+        return 1;
+    }
+    m_listen = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( m_listen < 0 ) {
+        perror( "BFieldServer::start(): socket" );
+        return 2;
+    }
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+    ::unlink( path ); // left over by a server that died
+    if ( bind( m_listen, (sockaddr*)&addr, sizeof(addr) ) < 0 || listen( m_listen, 16 ) < 0 ) {
+        perror( "BFieldServer::start(): bind" );
+        ::close( m_listen );
+        m_listen = -1;
+        return 3;
+    }
+    m_path = path;
+    m_start = now();
+    return 0;
+}
+
+//
+// Accept loop.  Each client is served by its own thread, which returns when
+// the client disconnects or the server is stopped.
+//
+void
+BFieldServer::run( double interval )
+{
+    double last = now();
+    unsigned long lastBatch = 0;
+    int id = 0;
+    while ( !m_stop ) {
+        pollfd p = { m_listen, POLLIN, 0 };
+        if ( poll( &p, 1, 200 ) > 0 ) {
+            int fd = accept( m_listen, 0, 0 );
+            if ( fd >= 0 ) {
+                m_nclient++;
+                thread( [this,fd,id]() {
+                    Hello hello;
+                    if ( readAll( fd, &hello, sizeof(hello) ) &&
+                         memcmp( hello.magic, helloMagic, sizeof(helloMagic) ) == 0 ) {
+                        if ( hello.shm ) serveShm( fd, id );
+                        else serveSocket( fd );
+                    }
+                    ::close( fd );
+                    m_nclient--;
+                } ).detach();
+                id++;
+            }
+        }
+        if ( interval > 0.0 && now() - last > interval ) {
+            if ( m_nbatch.load() != lastBatch ) printStats( cout );
+            lastBatch = m_nbatch.load();
+            last = now();
+        }
+    }
+    while ( m_nclient.load() > 0 ) this_thread::sleep_for( chrono::milliseconds(10) );
+}
+
+void
+BFieldServer::printStats( ostream& out ) const
+{
+    double elapsed = now() - m_start;
+    unsigned long nbatch = m_nbatch.load(), npoint = m_npoint.load();
+    out << "BFieldServer: " << m_nclient.load() << " clients, " << nbatch << " batches, "
+        << npoint << " points in " << elapsed << " s (" << npoint/elapsed/1e6 << " M points/s, "
+        << ( nbatch > 0 ? double(npoint)/nbatch : 0.0 ) << " points/batch)" << endl;
+    out << "  evaluation time per batch: ";
+    m_latency.print( out );
+    out << endl;
+}
+
+//
+// Serve a client through the socket
+//
+void
+BFieldServer::serveSocket( int fd )
+{
+    Welcome welcome;
+    memset( &welcome, 0, sizeof(welcome) );
+    welcome.nslot = 0;
+    welcome.maxpoint = maxpoint;
+    if ( !writeAll( fd, &welcome, sizeof(welcome) ) ) return;
+    BFieldComposite::Cache cache;
+    vector<double> xyz( 3*maxpoint ), out( 12*maxpoint );
+    Request request;
+    while ( !m_stop ) {
+        // wait for a request, checking now and then if the server is stopped
+        pollfd p = { fd, POLLIN, 0 };
+        if ( poll( &p, 1, 200 ) <= 0 ) continue;
+        if ( !readAll( fd, &request, sizeof(request) ) ) break;
+        if ( request.npoint <= 0 || request.npoint > maxpoint ) break;
+        int n = request.npoint;
+        if ( !readAll( fd, &xyz[0], 3*n*sizeof(double) ) ) break;
+        double t0 = now();
+        for ( int i = 0; i < n; i++ ) {
+            m_field.getB( &xyz[3*i], &out[3*i], request.deriv ? &out[3*n+9*i] : 0, cache );
+        }
+        m_latency.fill( ( now()-t0 )*1e9 );
+        m_nbatch++;
+        m_npoint += n;
+        if ( !writeAll( fd, &out[0], ( request.deriv ? 12 : 3 )*n*sizeof(double) ) ) break;
+    }
+}
+
+//
+// Serve a client through a ring in shared memory.  The socket is only used
+// to wake up the server, and to notice that the client has gone.
+//
+void
+BFieldServer::serveShm( int fd, int id )
+{
+    Welcome welcome;
+    memset( &welcome, 0, sizeof(welcome) );
+    snprintf( welcome.name, sizeof(welcome.name), "/bfield-%d-%d", int(getpid()), id );
+    size_t size = ringSize( nslot, maxpoint );
+    Ring* ring = 0;
+    int shmfd = shm_open( welcome.name, O_CREAT|O_EXCL|O_RDWR, 0600 );
+    if ( shmfd >= 0 ) {
+        if ( ftruncate( shmfd, size ) == 0 ) {
+            void* p = mmap( 0, size, PROT_READ|PROT_WRITE, MAP_SHARED, shmfd, 0 );
+            if ( p != MAP_FAILED ) ring = (Ring*)p;
+        }
+        ::close( shmfd );
+    }
+    if ( ring == 0 ) {
+        // fall back to the socket
+        if ( shmfd >= 0 ) shm_unlink( welcome.name );
+        cerr << "BFieldServer: no shared memory for client " << id << ", using the socket" << endl;
+        serveSocket( fd );
+        return;
+    }
+    ring->nslot = nslot;
+    ring->maxpoint = maxpoint;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->sleeping = 0;
+    welcome.shm = 1;
+    welcome.nslot = nslot;
+    welcome.maxpoint = maxpoint;
+    char ack(0);
+    bool ok = writeAll( fd, &welcome, sizeof(welcome) ) && readAll( fd, &ack, 1 );
+    shm_unlink( welcome.name ); // mapped by the client now, or never
+    BFieldComposite::Cache cache;
+    unsigned long tail = 0;
+    int idle = 0;
+    while ( ok && !m_stop ) {
+        if ( ring->head.load( memory_order_acquire ) != tail ) {
+            Slot* s = slot( ring, tail );
+            int n = min( max( s->npoint, 0 ), maxpoint );
+            const double* xyz = slotXyz( s );
+            double* B = slotB( s, maxpoint );
+            double* deriv = s->deriv ? slotDeriv( s, maxpoint ) : 0;
+            double t0 = now();
+            for ( int i = 0; i < n; i++ ) {
+                m_field.getB( &xyz[3*i], &B[3*i], deriv ? &deriv[9*i] : 0, cache );
+            }
+            m_latency.fill( ( now()-t0 )*1e9 );
+            m_nbatch++;
+            m_npoint += n;
+            ring->tail.store( ++tail, memory_order_release );
+            idle = 0;
+            continue;
+        }
+        // spin, then give the CPU to the client (which may share it), then sleep
+        if ( ++idle < 20000 ) {
+            if ( idle > 1000 ) this_thread::yield();
+            continue;
+        }
+        // sleep on the socket.  The client tests sleeping after advancing the head,
+        // so the head is checked again once the flag is set.
+        ring->sleeping = 1;
+        if ( ring->head.load() == tail ) {
+            pollfd p = { fd, POLLIN, 0 };
+            if ( poll( &p, 1, 200 ) > 0 ) {
+                char buf[64];
+                if ( ::read( fd, buf, sizeof(buf) ) <= 0 ) ok = false; // client gone
+            }
+        }
+        ring->sleeping = 0;
+        idle = 0;
+    }
+    munmap( ring, size );
+}
+
+//
+// BFieldClient
+//
+BFieldClient::BFieldClient()
+    : m_fd(-1), m_ring(0), m_size(0), m_head(0), m_consumed(0)
+{;}
+
+int
+BFieldClient::connect( const char* path, bool shm )
+{
+    close();
+    sockaddr_un addr;
+    if ( strlen( path ) >= sizeof(addr.sun_path) ) return 1;
+    m_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if ( m_fd < 0 ) return 2;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+    if ( ::connect( m_fd, (sockaddr*)&addr, sizeof(addr) ) < 0 ) {
+        close();
+        return 3;
+    }
+    Hello hello;
+    memcpy( hello.magic, helloMagic, sizeof(helloMagic) );
+    hello.shm = shm ? 1 : 0;
+    hello.pad = 0;
+    Welcome welcome;
+    if ( !writeAll( m_fd, &hello, sizeof(hello) ) || !readAll( m_fd, &welcome, sizeof(welcome) ) ||
+         welcome.status != 0 ) {
+        close();
+        return 4;
+    }
+    if ( welcome.shm ) {
+        welcome.name[sizeof(welcome.name)-1] = 0;
+        int shmfd = shm_open( welcome.name, O_RDWR, 0600 );
+        if ( shmfd >= 0 ) {
+            m_size = ringSize( welcome.nslot, welcome.maxpoint );
+            void* p = mmap( 0, m_size, PROT_READ|PROT_WRITE, MAP_SHARED, shmfd, 0 );
+            if ( p != MAP_FAILED ) m_ring = p;
+            ::close( shmfd );
+        }
+        char ack(1);
+        if ( m_ring == 0 || !writeAll( m_fd, &ack, 1 ) ) {
+            close();
+            return 5;
+        }
+        m_head = m_consumed = 0;
+    }
+    return 0;
+}
+
+void
+BFieldClient::close()
+{
+    if ( m_ring ) munmap( m_ring, m_size );
+    m_ring = 0;
+    if ( m_fd >= 0 ) ::close( m_fd );
+    m_fd = -1;
+}
+
+int
+BFieldClient::getB( int n, const double *xyz, double *B, double *deriv )
+{
+    if ( m_fd < 0 ) return 1;
+    if ( n <= 0 ) return 0;
+    return m_ring ? getBShm( n, xyz, B, deriv ) : getBSocket( n, xyz, B, deriv );
+}
+
+//
+// Fill the free slots of the ring with batches, and read the results back in
+// order.  A slot is only reused after its results have been read.
+//
+int
+BFieldClient::getBShm( int n, const double *xyz, double *B, double *deriv )
+{
+    Ring* ring = (Ring*)m_ring;
+    const int maxpoint = ring->maxpoint;
+    const unsigned long nslot = ring->nslot;
+    const int nbatch = ( n + maxpoint - 1 )/maxpoint;
+    const unsigned long first = m_head;
+    int idle = 0;
+    while ( m_consumed < first + nbatch ) {
+        // submit
+        bool submitted = false;
+        while ( m_head < first + nbatch && m_head - m_consumed < nslot ) {
+            int ib = m_head - first;
+            int i0 = ib*maxpoint;
+            Slot* s = slot( ring, m_head );
+            s->npoint = min( maxpoint, n - i0 );
+            s->deriv = deriv ? 1 : 0;
+            memcpy( slotXyz( s ), &xyz[3*i0], 3*s->npoint*sizeof(double) );
+            ring->head.store( ++m_head );
+            submitted = true;
+        }
+        if ( submitted && ring->sleeping.load() ) {
+            char wake(1);
+            if ( !writeAll( m_fd, &wake, 1 ) ) return 2;
+        }
+        // collect
+        if ( ring->tail.load( memory_order_acquire ) > m_consumed ) {
+            int ib = m_consumed - first;
+            int i0 = ib*maxpoint;
+            Slot* s = slot( ring, m_consumed );
+            memcpy( &B[3*i0], slotB( s, maxpoint ), 3*s->npoint*sizeof(double) );
+            if ( deriv ) memcpy( &deriv[9*i0], slotDeriv( s, maxpoint ), 9*s->npoint*sizeof(double) );
+            m_consumed++;
+            idle = 0;
+        } else if ( ++idle > 1000 ) {
+            this_thread::yield();
+            // check now and then that the server is still there
+            if ( idle % 100000 == 0 ) {
+                pollfd p = { m_fd, POLLIN, 0 };
+                if ( poll( &p, 1, 0 ) > 0 ) {
+                    char buf[64];
+                    if ( ::read( m_fd, buf, sizeof(buf) ) <= 0 ) return 3;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int
+BFieldClient::getBSocket( int n, const double *xyz, double *B, double *deriv )
+{
+    const int maxpoint = BFieldServer::maxpoint;
+    vector<double> out( 12*maxpoint );
+    for ( int i0 = 0; i0 < n; i0 += maxpoint ) {
+        Request request;
+        request.npoint = min( maxpoint, n - i0 );
+        request.deriv = deriv ? 1 : 0;
+        if ( !writeAll( m_fd, &request, sizeof(request) ) ||
+             !writeAll( m_fd, &xyz[3*i0], 3*request.npoint*sizeof(double) ) ||
+             !readAll( m_fd, &out[0], ( deriv ? 12 : 3 )*request.npoint*sizeof(double) ) ) {
+            return 2;
+        }
+        memcpy( &B[3*i0], &out[0], 3*request.npoint*sizeof(double) );
+        if ( deriv ) memcpy( &deriv[9*i0], &out[3*request.npoint], 9*request.npoint*sizeof(double) );
+    }
+    return 0;
+}
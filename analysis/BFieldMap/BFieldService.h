@@ -0,0 +1,108 @@
+//
+// BFieldService.h
+//
+// Field evaluation as a service for the processes of one node, so that they
+// do not each have to load the maps.  A BFieldServer owns the maps (through a
+// BFieldComposite) and listens on a Unix socket.  A BFieldClient connects to it
+// and sends batches of positions, receiving B and optionally the derivatives.
+//
+// By default the batches go through a ring of slots in shared memory, set up
+// for each client over the socket: the client fills slots and advances the head,
+// the server evaluates them in place and advances the tail.  Both counters are
+// atomics in the shared segment, so that no lock is taken on either side.  The
+// server spins for a while when the ring is empty, then sleeps on the socket and
+// is woken up by the client with one byte.  Without shared memory the batches go
+// through the socket itself.
+//
+// Units: mm, kT.
+//
+#ifndef BFIELDSERVICE_H
+#define BFIELDSERVICE_H
+
+#include <string>
+#include <atomic>
+#include <iostream>
+#include "BFieldComposite.h"
+#include "BFieldLogHistogram.h"
+
+//
+// Histogram of latencies in ns, with 4 bins per factor 2, filled with atomics
+//
+class BFieldLatency {
+public:
+    BFieldLatency() { clear(); }
+    void clear();
+    void fill( double ns );
+    // number of entries, mean and quantile q (0-1) in ns
+    unsigned long entries() const;
+    double mean() const;
+    double quantile( double q ) const;
+    // print the mean and the 50, 90, 99 and 99.9% quantiles
+    void print( std::ostream& out ) const;
+private:
+    enum { nbin = 128 };
+    std::atomic<unsigned long> m_bin[nbin];
+    std::atomic<unsigned long> m_n;
+    std::atomic<unsigned long> m_sum; // ns
+};
+
+class BFieldServer {
+public:
+    // constructor - the maps in field must outlive the server
+    explicit BFieldServer( const BFieldComposite& field );
+    // destructor stops the server
+    ~BFieldServer();
+    // listen on the Unix socket at path.  Returns 0 if OK
+    int start( const char* path );
+    // accept clients and serve them until stop() is called, printing the
+    // statistics every interval seconds if there was any traffic (0: never)
+    void run( double interval = 0.0 );
+    // ask run() to return - can be called from a signal handler
+    void stop() { m_stop = true; }
+    // statistics since start
+    void printStats( std::ostream& out ) const;
+    // largest number of points in a batch, and number of slots in a ring
+    static const int maxpoint = 256;
+    static const int nslot = 16;
+private:
+    BFieldServer( const BFieldServer& );            // not copyable
+    BFieldServer& operator=( const BFieldServer& );
+    void serveSocket( int fd );
+    void serveShm( int fd, int id );
+    const BFieldComposite& m_field;
+    std::string m_path;
+    int m_listen;                   // listening socket
+    std::atomic<bool> m_stop;
+    std::atomic<int> m_nclient;     // client threads still running
+    // statistics
+    std::atomic<unsigned long> m_nbatch, m_npoint;
+    BFieldLatency m_latency;        // evaluation time per batch
+    double m_start;                 // time of start() (s)
+};
+
+class BFieldClient {
+public:
+    BFieldClient();
+    ~BFieldClient() { close(); }
+    // connect to the server at path, through shared memory if shm is true
+    // and the server can set it up.  Returns 0 if OK
+    int connect( const char* path, bool shm = true );
+    void close();
+    bool connected() const { return m_fd >= 0; }
+    bool sharedMemory() const { return m_ring != 0; }
+    // field at n points xyz[3*n]: fills B[3*n], and deriv[9*n] if given.
+    // Returns 0 if OK
+    int getB( int n, const double *xyz, double *B, double *deriv = 0 );
+private:
+    BFieldClient( const BFieldClient& );            // not copyable
+    BFieldClient& operator=( const BFieldClient& );
+    int getBShm( int n, const double *xyz, double *B, double *deriv );
+    int getBSocket( int n, const double *xyz, double *B, double *deriv );
+    int m_fd;          // socket
+    void* m_ring;      // shared memory, 0 if not used
+    size_t m_size;     // size of the shared memory
+    unsigned long m_head;     // batches submitted
+    unsigned long m_consumed; // batches whose results were read
+};
+
+#endif
@@ -5,7 +5,6 @@
 #include <string>
 #include <cmath>
 #include <algorithm>
-#include "TTree.h"
 using namespace std;
 
 //
@@ -84,180 +83,59 @@ BFieldSolenoid::readMap( istream& input )
 }
 
 //
-// wrire the map to a ROOT file
-// if tilted = true, write the moved-and-tilted map.
-// ohterwise, write the original map.
+// Returns the magnetic field at any position.
 //
 void
-BFieldSolenoid::writeMap( TFile* rootfile, bool tilted )
+BFieldSolenoid::getB( const double *xyz, double *B, double *deriv ) const
 {
-    BFieldMesh<double> *map = tilted ? m_tilt : m_orig;
-    if ( map == 0 ) return; // no map to write
-    if ( rootfile == 0 ) return; // no file
-    if ( rootfile->cd() == false ) return; // could not make it current directory
-    // define the tree
-    TTree* tree = new TTree( "BFieldSolenoid", "BFieldSolenoid version 4" );
-    double zmin = map->zmin();
-    double zmax = map->zmax();
-    double rmin = map->rmin();
-    double rmax = map->rmax();
-    double phimin = map->phimin();
-    double phimax = map->phimax();
-    int nmeshz = map->nmesh(0);
-    int nmeshr = map->nmesh(1);
-    int nmeshphi = map->nmesh(2);
-    double *meshz, *meshr, *meshphi;
-    int nfield = nmeshz*nmeshr*nmeshphi;
-    double *fieldz, *fieldr, *fieldphi;
-    meshz = new double[nmeshz];
-    meshr = new double[nmeshr];
-    meshphi = new double[nmeshphi];
-    fieldz = new double[nfield];
-    fieldr = new double[nfield];
-    fieldphi = new double[nfield];
-    // define the tree branches
-    tree->Branch( "zmin", &zmin, "zmin/D" );
-    tree->Branch( "zmax", &zmax, "zmax/D" );
-    tree->Branch( "rmin", &rmin, "rmin/D" );
-    tree->Branch( "rmax", &rmax, "rmax/D" );
-    tree->Branch( "phimin", &phimin, "phimin/D" );
-    tree->Branch( "phimax", &phimax, "phimax/D" );
-    tree->Branch( "nmeshz", &nmeshz, "nmeshz/I" );
-    tree->Branch( "meshz", meshz, "meshz[nmeshz]/D" );
-    tree->Branch( "nmeshr", &nmeshr, "nmeshr/I" );
-    tree->Branch( "meshr", meshr, "meshr[nmeshr]/D" );
-    tree->Branch( "nmeshphi", &nmeshphi, "nmeshphi/I" );
-    tree->Branch( "meshphi", meshphi, "meshphi[nmeshphi]/D" );
-    tree->Branch( "nfield", &nfield, "nfield/I" );
-    tree->Branch( "fieldz", fieldz, "fieldz[nfield]/D" );
-    tree->Branch( "fieldr", fieldr, "fieldr[nfield]/D" );
-    tree->Branch( "fieldphi", fieldphi, "fieldphi[nfield]/D" );
-    // fill the mesh and field arrays
-    for ( int j = 0; j < nmeshz; j++ ) {
-        meshz[j] = map->mesh(0,j);
-    }
-    for ( int j = 0; j < nmeshr; j++ ) {
-        meshr[j] = map->mesh(1,j);
-    }
-    for ( int j = 0; j < nmeshphi; j++ ) {
-        meshphi[j] = map->mesh(2,j);
-    }
-    for ( int j = 0; j < nfield; j++ ) {
-        const BFieldVector<double> f = map->field(j);
-        fieldz[j] = f.z();
-        fieldr[j] = f.r();
-        fieldphi[j] = f.phi();
-    }
-    // write
-    tree->Fill();
-    rootfile->Write();
-    // clean up
-    delete[] meshz;
-    delete[] meshr;
-    delete[] meshphi;
-    delete[] fieldz;
-    delete[] fieldr;
-    delete[] fieldphi;
+    getB( xyz, B, deriv, m_cache );
 }
 
 //
-// read the map from a ROOT file.
-// returns 0 if successful.
+// Returns the magnetic field at any position, using the cache given by the caller.
+// The field is zero outside the map.
 //
-int
-BFieldSolenoid::readMap( TFile* rootfile )
+void
+BFieldSolenoid::getB( const double *xyz, double *B, double *deriv, BFieldCache& cache ) const
 {
-    if ( rootfile == 0 ) return 1; // no file
-    if ( rootfile->cd() == false ) return 2; // could not make it current directory
-    if ( m_orig == m_tilt ) delete m_orig;
-    else { delete m_orig; delete m_tilt; }
-    m_orig = m_tilt = new BFieldMesh<double>;
-    // open the tree
-    TTree* tree = (TTree*)rootfile->Get("BFieldSolenoid");
-    if ( tree == 0 ) return 3; // no tree
-    double zmin, zmax, rmin, rmax, phimin, phimax;
-    int nmeshz, nmeshr, nmeshphi;
-    double *meshz, *meshr, *meshphi;
-    int nfield;
-    double *fieldz, *fieldr, *fieldphi;
-    //unsigned char *fbyte;
-    // define the fixed-sized branches first
-    tree->SetBranchAddress( "zmin", &zmin );
-    tree->SetBranchAddress( "zmax", &zmax );
-    tree->SetBranchAddress( "rmin", &rmin );
-    tree->SetBranchAddress( "rmax", &rmax );
-    tree->SetBranchAddress( "phimin", &phimin );
-    tree->SetBranchAddress( "phimax", &phimax );
-    tree->SetBranchAddress( "nmeshz", &nmeshz );
-    tree->SetBranchAddress( "nmeshr", &nmeshr );
-    tree->SetBranchAddress( "nmeshphi", &nmeshphi );
-    tree->SetBranchAddress( "nfield", &nfield );
-    // prepare arrays - need to know the maximum sizes
-    tree->GetEntry(0);
-    meshz = new double[nmeshz];
-    meshr = new double[nmeshr];
-    meshphi = new double[nmeshphi];
-    fieldz = new double[nfield];
-    fieldr = new double[nfield];
-    fieldphi = new double[nfield];
-    // define the variable length branches
-    tree->SetBranchAddress( "meshz", meshz );
-    tree->SetBranchAddress( "meshr", meshr );
-    tree->SetBranchAddress( "meshphi", meshphi );
-    tree->SetBranchAddress( "fieldz", fieldz );
-    tree->SetBranchAddress( "fieldr", fieldr );
-    tree->SetBranchAddress( "fieldphi", fieldphi );
-    // read again, and copy data
-    tree->GetEntry(0);
-    m_orig->setRange( zmin, zmax, rmin, rmax, phimin, phimax );
-    m_orig->reserve( nmeshz, nmeshr, nmeshphi );
-    for ( int j = 0; j < nmeshz; j++ ) {
-        m_orig->appendMesh( 0, meshz[j] );
-    }
-    for ( int j = 0; j < nmeshr; j++ ) {
-        m_orig->appendMesh( 1, meshr[j] );
-    }
-    for ( int j = 0; j < nmeshphi; j++ ) {
-        m_orig->appendMesh( 2, meshphi[j] );
-    }
-    for ( int j = 0; j < nfield; j++ ) {
-        BFieldVector<double> field( fieldz[j], fieldr[j], fieldphi[j] );
-        m_orig->appendField( field );
+    if ( m_recorder ) m_recorder->record( BFieldRecorder::Solenoid, xyz, deriv != 0 );
+    if ( m_profiler && m_profiler->sample() ) {
+        unsigned long long t0 = BFieldProfiler::cycles();
+        int hit = evaluate( xyz, B, deriv, cache );
+        unsigned long long t1 = BFieldProfiler::cycles();
+        m_profiler->fill( ( hit < 0 ) ? 1 : 0, hit > 0, t1-t0 );
+        return;
     }
-    // clean up
-    tree->Delete();
-    delete[] meshz;
-    delete[] meshr;
-    delete[] meshphi;
-    delete[] fieldz;
-    delete[] fieldr;
-    delete[] fieldphi;
-    // build the LUTs
-    m_orig->buildLUT();
-
-    return 0;
+    evaluate( xyz, B, deriv, cache );
 }
 
 //
-// Returns the magnetic field at any position.
+// Body of getB().
+// Returns 1 if the point was inside the cached bin, 0 if a bin was loaded,
+// and -1 if the point is outside the map.
 //
-void
-BFieldSolenoid::getB( const double *xyz, double *B, double *deriv ) const
+int
+BFieldSolenoid::evaluate( const double *xyz, double *B, double *deriv, BFieldCache& cache ) const
 {
     // convert to cylindrical coordinates
     double z( xyz[2] );
     double r( sqrt(xyz[0]*xyz[0]+xyz[1]*xyz[1]) );
     double phi( atan2(xyz[1],xyz[0]) );
     // test the cache
-    if ( ! m_cache.inside( z, r, phi ) ) {
-        // outside the last bin
-        if ( m_tilt && m_tilt->inside( z, r, phi ) ) {
-            m_tilt->getCache( z, r, phi, m_cache );
-        } else {
-            B[0] = B[1] = B[2] = 0.0;
-        }
+    if ( cache.inside( z, r, phi ) ) {
+        cache.getB( z, r, phi, B, deriv );
+        return 1;
+    }
+    // outside the last bin
+    if ( m_tilt && m_tilt->inside( z, r, phi ) ) {
+        m_tilt->getCache( z, r, phi, cache );
+    } else {
+        B[0] = B[1] = B[2] = 0.0;
+        if ( deriv ) for ( int i = 0; i < 9; i++ ) deriv[i] = 0.0;
+        return -1;
     }
-    m_cache.getB( z, r, phi, B, deriv );
+    cache.getB( z, r, phi, B, deriv );
+    return 0;
 }
 
 //
@@ -265,86 +143,159 @@ BFieldSolenoid::getB( const double *xyz, double *B, double *deriv ) const
 // Modify the m_tilt copy and keep the m_orig copy.
 //
 void
-BFieldSolenoid::moveMap( double dx, double dy, double dz, double ax, double ay )
+BFieldSolenoid::moveMap( double dx, double dy, double dz, double ax, double ay, BFieldThreadPool* pool )
 {
     if ( m_orig==0 ) {
         cerr << "BFieldSolenoid::moveMap() : original map has not been read" << endl;
         return;
     }
+    BFieldMesh<double> *tilted;
+    moveMaps( 1, &dx, &dy, &dz, &ax, &ay, &tilted, pool );
+    // keep the interpolation of the map it replaces
+    if ( m_tilt->tricubic() ) tilted->buildTricubic();
     if ( m_tilt != m_orig ) delete m_tilt;
+    m_tilt = tilted;
+    m_cache.clear();
+}
+
+//
+// Switch between trilinear and tricubic interpolation in the moved map
+//
+void
+BFieldSolenoid::setTricubic( bool tricubic )
+{
+    if ( m_tilt==0 ) {
+        cerr << "BFieldSolenoid::setTricubic() : map has not been read" << endl;
+        return;
+    }
+    if ( tricubic ) m_tilt->buildTricubic();
+    else m_tilt->clearTricubic();
+    m_cache.clear();
+}
+
+//
+// Make n moved and tilted copies of the solenoid map.
+// All copies share the same mesh, so each node of the new mesh is visited once
+// and resampled for every (dx,dy,dz,ax,ay) in turn.  The z slices are processed
+// in parallel, each thread with its own bin caches of the original map.
+//
+void
+BFieldSolenoid::moveMaps( int n, const double *dx, const double *dy, const double *dz,
+                          const double *ax, const double *ay, BFieldMesh<double> **tilted,
+                          BFieldThreadPool* pool ) const
+{
+    if ( m_orig==0 ) {
+        cerr << "BFieldSolenoid::moveMaps() : original map has not been read" << endl;
+        for ( int m = 0; m < n; m++ ) tilted[m] = 0;
+        return;
+    }
     //
     // copy the mesh and make it a bit smaller
     //
     const double zlim = 2820.; // mm
     const double rlim = 1075.; // mm
-    m_tilt = new BFieldMesh<double>( -zlim, zlim, 0.0, rlim, 0.0, 2*M_PI, 1.0 );
+    BFieldMesh<double> mesh( -zlim, zlim, 0.0, rlim, 0.0, 2*M_PI, 1.0 );
     // z
-    m_tilt->appendMesh( 0, -zlim );
+    mesh.appendMesh( 0, -zlim );
     for ( unsigned i = 0; i < m_orig->nmesh(0); i++ ) {
-        if ( abs(m_orig->mesh(0,i)) < zlim ) m_tilt->appendMesh( 0, m_orig->mesh(0,i) );
+        if ( abs(m_orig->mesh(0,i)) < zlim ) mesh.appendMesh( 0, m_orig->mesh(0,i) );
     }
-    m_tilt->appendMesh( 0, zlim );
+    mesh.appendMesh( 0, zlim );
     // r
     for ( unsigned i = 0; i < m_orig->nmesh(1); i++ ) {
-        if ( m_orig->mesh(1,i) < rlim ) m_tilt->appendMesh( 1, m_orig->mesh(1,i) );
+        if ( m_orig->mesh(1,i) < rlim ) mesh.appendMesh( 1, m_orig->mesh(1,i) );
     }
-    m_tilt->appendMesh( 1, rlim );
+    mesh.appendMesh( 1, rlim );
     // phi (no change)
     for ( unsigned i = 0; i < m_orig->nmesh(2); i++ ) {
-        m_tilt->appendMesh( 2, m_orig->mesh(2,i) );
+        mesh.appendMesh( 2, m_orig->mesh(2,i) );
+    }
+    const unsigned nz( mesh.nmesh(0) ), nr( mesh.nmesh(1) ), nphi( mesh.nmesh(2) );
+    // trig tables for the phi mesh and the rotation angles
+    vector<double> cosphi0( nphi ), sinphi0( nphi );
+    for ( unsigned k = 0; k < nphi; k++ ) {
+        cosphi0[k] = cos( mesh.mesh(2,k) );
+        sinphi0[k] = sin( mesh.mesh(2,k) );
+    }
+    vector<double> sinax( n ), cosax( n ), sinay( n ), cosay( n );
+    for ( int m = 0; m < n; m++ ) {
+        sinax[m] = sin(ax[m]);
+        cosax[m] = cos(ax[m]);
+        sinay[m] = sin(ay[m]);
+        cosay[m] = cos(ay[m]);
     }
     //
     // loop over the new mesh, and compute the field at the
-    // corresponding location in the original map
+    // corresponding location in the original map.
+    // field[i*n+m] holds the z slice i of map m.
     //
-    double sinax( sin(ax) );
-    double cosax( cos(ax) );
-    double sinay( sin(ay) );
-    double cosay( cos(ay) );
-    for ( unsigned i = 0; i < m_tilt->nmesh(0); i++ ) {
-        double z0( m_tilt->mesh(0,i) );
-        for ( unsigned j = 0; j < m_tilt->nmesh(1); j++ ) {
-            double r0( m_tilt->mesh(1,j) );
-            for ( unsigned k = 0; k < m_tilt->nmesh(2); k++ ) {
-                double phi0( m_tilt->mesh(2,k) );
-                double x0( r0*cos(phi0) );
-                double y0( r0*sin(phi0) );
-                // shift
-                double x1( x0 - dx );
-                double y1( y0 - dy );
-                double z1( z0 - dz );
-                // rotate around x by -ax
-                double x2( x1 );
-                double y2( y1*cosax + z1*sinax );
-                double z2( z1*cosax - y1*sinax );
-                // rotate around y by -ay
-                double x3( x2*cosay - z2*sinay );
-                double y3( y2 );
-                double z3( z2*cosay + x2*sinay );
-                // convert to cylindrical
-                double r = sqrt( x3*x3 + y3*y3 );
-                double phi = atan2( y3, x3 );
-                // get (Bx,By,Bz) in the original frame
-                double B[3];
-                m_orig->getB( z3, r, phi, B );
-                // rotate around y by +ay
-                double Bx1( B[0]*cosay + B[2]*sinay );
-                double By1( B[1] );
-                double Bz1( B[2]*cosay - B[0]*sinay );
-                // rotate around x by +ax
-                double Bx2( Bx1 );
-                double By2( By1*cosax - Bz1*sinax );
-                double Bz2( Bz1*cosax + By1*sinax );
-                // convert to cylindrical
-                double cosphi0( cos(phi0) );
-                double sinphi0( sin(phi0) );
-                double Br( Bx2*cosphi0 + By2*sinphi0 );
-                double Bphi( -Bx2*sinphi0 + By2*cosphi0 );
-                BFieldVector<double> field( Bz2, Br, Bphi );
-                m_tilt->appendField( field );
+    if ( pool == 0 ) pool = defaultPool();
+    vector< vector< BFieldVector<double> > > field( nz*n );
+    vector<BFieldCache> cache( pool->nthread()*n );
+    pool->run( nz, [&]( int i, int ithread ) {
+        BFieldCache *mycache = &cache[ithread*n];
+        double z0( mesh.mesh(0,i) );
+        for ( int m = 0; m < n; m++ ) field[i*n+m].reserve( nr*nphi );
+        for ( unsigned j = 0; j < nr; j++ ) {
+            double r0( mesh.mesh(1,j) );
+            for ( unsigned k = 0; k < nphi; k++ ) {
+                double x0( r0*cosphi0[k] );
+                double y0( r0*sinphi0[k] );
+                for ( int m = 0; m < n; m++ ) {
+                    // shift
+                    double x1( x0 - dx[m] );
+                    double y1( y0 - dy[m] );
+                    double z1( z0 - dz[m] );
+                    // rotate around x by -ax
+                    double x2( x1 );
+                    double y2( y1*cosax[m] + z1*sinax[m] );
+                    double z2( z1*cosax[m] - y1*sinax[m] );
+                    // rotate around y by -ay
+                    double x3( x2*cosay[m] - z2*sinay[m] );
+                    double y3( y2 );
+                    double z3( z2*cosay[m] + x2*sinay[m] );
+                    // convert to cylindrical
+                    double r = sqrt( x3*x3 + y3*y3 );
+                    double phi = atan2( y3, x3 );
+                    // get (Bx,By,Bz) in the original frame
+                    double B[3];
+                    if ( ! mycache[m].inside( z3, r, phi ) ) m_orig->getCache( z3, r, phi, mycache[m] );
+                    mycache[m].getB( z3, r, phi, B );
+                    // rotate around y by +ay
+                    double Bx1( B[0]*cosay[m] + B[2]*sinay[m] );
+                    double By1( B[1] );
+                    double Bz1( B[2]*cosay[m] - B[0]*sinay[m] );
+                    // rotate around x by +ax
+                    double Bx2( Bx1 );
+                    double By2( By1*cosax[m] - Bz1*sinax[m] );
+                    double Bz2( Bz1*cosax[m] + By1*sinax[m] );
+                    // convert to cylindrical
+                    double Br( Bx2*cosphi0[k] + By2*sinphi0[k] );
+                    double Bphi( -Bx2*sinphi0[k] + By2*cosphi0[k] );
+                    field[i*n+m].push_back( BFieldVector<double>( Bz2, Br, Bphi ) );
+                }
             }
         }
+    } );
+    // assemble the maps
+    for ( int m = 0; m < n; m++ ) {
+        tilted[m] = new BFieldMesh<double>( mesh );
+        tilted[m]->reserve( nz, nr, nphi );
+        for ( unsigned i = 0; i < nz; i++ ) {
+            const vector< BFieldVector<double> >& slice( field[i*n+m] );
+            for ( unsigned l = 0; l < slice.size(); l++ ) tilted[m]->appendField( slice[l] );
+        }
+        tilted[m]->buildLUT();
     }
-    m_tilt->buildLUT();
 }
 
+//
+// Thread pool of moveMaps() when none is given, created on first use
+//
+BFieldThreadPool*
+BFieldSolenoid::defaultPool() const
+{
+    lock_guard<mutex> lock( m_poolMutex );
+    if ( m_pool == 0 ) m_pool = new BFieldThreadPool;
+    return m_pool;
+}
@@ -10,23 +10,51 @@
 
 #include <vector>
 #include <iostream>
-#include "TFile.h"
+#include <mutex>
 #include "BFieldZone.h"
+#include "BFieldThreadPool.h"
+#include "BFieldProfiler.h"
+#include "BFieldRecorder.h"
+
+class TFile;
 
 class BFieldSolenoid {
 public:
+    // compression of the columnar ROOT format, as in BFieldMap
+    enum Compression { LZ4 = 404, ZSTD = 505 };
     // constructor
-    BFieldSolenoid() : m_orig(0), m_tilt(0) {;}
+    BFieldSolenoid() : m_orig(0), m_tilt(0), m_pool(0), m_profiler(0), m_recorder(0) {;}
     // destructor
-    ~BFieldSolenoid() { delete m_orig; if (m_orig!=m_tilt) delete m_tilt; }
-    // read/write map from/to file
+    ~BFieldSolenoid() { delete m_orig; if (m_orig!=m_tilt) delete m_tilt; delete m_pool; }
+    // read/write map from/to file.  The ROOT ones are in the BFieldIO library.
     int readMap( std::istream& input );
     int readMap( TFile* rootfile );
     void writeMap( TFile* rootfile, bool tilted = false );
-    // move and tilt the map
-    void moveMap( double dx, double dy, double dz, double ax, double ay );
+    // write the map in the columnar format, which readMap( TFile* ) recognizes:
+    // the ranges and meshes in one tree, and the field in another, with one
+    // entry per z plane
+    void writeColumns( TFile* rootfile, bool tilted = false, int compression = LZ4 );
+    // move and tilt the map.  The resampling runs on the pool if given,
+    // or otherwise on a pool of all hardware threads, kept for the next calls.
+    void moveMap( double dx, double dy, double dz, double ax, double ay, BFieldThreadPool* pool = 0 );
+    // make n moved and tilted copies of the original map in one pass.
+    // tilted[i] is allocated with new and owned by the caller.
+    void moveMaps( int n, const double *dx, const double *dy, const double *dz,
+                   const double *ax, const double *ay, BFieldMesh<double> **tilted,
+                   BFieldThreadPool* pool = 0 ) const;
     // compute magnetic field
     void getB( const double *xyz, double *B, double *deriv=0 ) const;
+    // same, using a cache owned by the caller (one per thread)
+    void getB( const double *xyz, double *B, double *deriv, BFieldCache& cache ) const;
+    // use tricubic interpolation in the moved map (kept by moveMap())
+    void setTricubic( bool tricubic );
+    // time a fraction of the getB() calls with profiler, which must outlive
+    // its use here (0 to stop).  The map is zone 0.
+    void setProfiler( BFieldProfiler* profiler )
+    { m_profiler = profiler; if ( profiler ) profiler->setZones( std::vector<int>( 1, 0 ), std::vector<int>( 1, 0 ) ); }
+    BFieldProfiler* profiler() const { return m_profiler; }
+    // write every getB() query to recorder, which must outlive its use here (0 to stop)
+    void setRecorder( BFieldRecorder* recorder ) { m_recorder = recorder; }
     // accessor
     const BFieldMesh<double> *tiltedMap() const { return m_tilt; }
     const BFieldMesh<double> *originalMap() const { return m_orig; }
@@ -36,6 +64,17 @@ private:
     BFieldMesh<double> *m_tilt; // tilted and moved map
     // cache for speed
     mutable BFieldCache m_cache;
+    // thread pool of moveMaps() when none is given, created on first use
+    mutable std::mutex m_poolMutex;
+    mutable BFieldThreadPool* m_pool;
+    // sampling profiler, if any
+    BFieldProfiler* m_profiler;
+    // query recorder, if any
+    BFieldRecorder* m_recorder;
+    // getB() itself: returns 1 if the cache was hit, 0 if not, -1 outside the map
+    int evaluate( const double *xyz, double *B, double *deriv, BFieldCache& cache ) const;
+    int readColumns( TFile* rootfile );
+    BFieldThreadPool* defaultPool() const;
 };
 
 #endif
@@ -0,0 +1,288 @@
+//
+// BFieldSolenoidIO.cxx
+//
+// Reading and writing of BFieldSolenoid in ROOT files, in the BFieldIO library
+//
+#include "BFieldSolenoid.h"
+#include "TFile.h"
+#include "TTree.h"
+#include "TROOT.h"
+#include <vector>
+using namespace std;
+
+//
+// wrire the map to a ROOT file
+// if tilted = true, write the moved-and-tilted map.
+// ohterwise, write the original map.
+//
+void
+BFieldSolenoid::writeMap( TFile* rootfile, bool tilted )
+{
+    BFieldMesh<double> *map = tilted ? m_tilt : m_orig;
+    if ( map == 0 ) return; // no map to write
+    if ( rootfile == 0 ) return; // no file
+    if ( rootfile->cd() == false ) return; // could not make it current directory
+    // define the tree
+    TTree* tree = new TTree( "BFieldSolenoid", "BFieldSolenoid version 4" );
+    double zmin = map->zmin();
+    double zmax = map->zmax();
+    double rmin = map->rmin();
+    double rmax = map->rmax();
+    double phimin = map->phimin();
+    double phimax = map->phimax();
+    int nmeshz = map->nmesh(0);
+    int nmeshr = map->nmesh(1);
+    int nmeshphi = map->nmesh(2);
+    double *meshz, *meshr, *meshphi;
+    int nfield = nmeshz*nmeshr*nmeshphi;
+    double *fieldz, *fieldr, *fieldphi;
+    meshz = new double[nmeshz];
+    meshr = new double[nmeshr];
+    meshphi = new double[nmeshphi];
+    fieldz = new double[nfield];
+    fieldr = new double[nfield];
+    fieldphi = new double[nfield];
+    // define the tree branches
+    tree->Branch( "zmin", &zmin, "zmin/D" );
+    tree->Branch( "zmax", &zmax, "zmax/D" );
+    tree->Branch( "rmin", &rmin, "rmin/D" );
+    tree->Branch( "rmax", &rmax, "rmax/D" );
+    tree->Branch( "phimin", &phimin, "phimin/D" );
+    tree->Branch( "phimax", &phimax, "phimax/D" );
+    tree->Branch( "nmeshz", &nmeshz, "nmeshz/I" );
+    tree->Branch( "meshz", meshz, "meshz[nmeshz]/D" );
+    tree->Branch( "nmeshr", &nmeshr, "nmeshr/I" );
+    tree->Branch( "meshr", meshr, "meshr[nmeshr]/D" );
+    tree->Branch( "nmeshphi", &nmeshphi, "nmeshphi/I" );
+    tree->Branch( "meshphi", meshphi, "meshphi[nmeshphi]/D" );
+    tree->Branch( "nfield", &nfield, "nfield/I" );
+    tree->Branch( "fieldz", fieldz, "fieldz[nfield]/D" );
+    tree->Branch( "fieldr", fieldr, "fieldr[nfield]/D" );
+    tree->Branch( "fieldphi", fieldphi, "fieldphi[nfield]/D" );
+    // fill the mesh and field arrays
+    for ( int j = 0; j < nmeshz; j++ ) {
+        meshz[j] = map->mesh(0,j);
+    }
+    for ( int j = 0; j < nmeshr; j++ ) {
+        meshr[j] = map->mesh(1,j);
+    }
+    for ( int j = 0; j < nmeshphi; j++ ) {
+        meshphi[j] = map->mesh(2,j);
+    }
+    for ( int j = 0; j < nfield; j++ ) {
+        const BFieldVector<double> f = map->field(j);
+        fieldz[j] = f.z();
+        fieldr[j] = f.r();
+        fieldphi[j] = f.phi();
+    }
+    // write
+    tree->Fill();
+    rootfile->Write();
+    // clean up
+    delete[] meshz;
+    delete[] meshr;
+    delete[] meshphi;
+    delete[] fieldz;
+    delete[] fieldr;
+    delete[] fieldphi;
+}
+
+//
+// read the map from a ROOT file.
+// returns 0 if successful.
+//
+int
+BFieldSolenoid::readMap( TFile* rootfile )
+{
+    if ( rootfile == 0 ) return 1; // no file
+    if ( rootfile->cd() == false ) return 2; // could not make it current directory
+    if ( m_orig == m_tilt ) delete m_orig;
+    else { delete m_orig; delete m_tilt; }
+    m_orig = m_tilt = new BFieldMesh<double>;
+    // the columnar format
+    if ( rootfile->Get("BFieldSolenoidMesh") != 0 ) return readColumns( rootfile );
+    // open the tree
+    TTree* tree = (TTree*)rootfile->Get("BFieldSolenoid");
+    if ( tree == 0 ) return 3; // no tree
+    double zmin, zmax, rmin, rmax, phimin, phimax;
+    int nmeshz, nmeshr, nmeshphi;
+    double *meshz, *meshr, *meshphi;
+    int nfield;
+    double *fieldz, *fieldr, *fieldphi;
+    //unsigned char *fbyte;
+    // define the fixed-sized branches first
+    tree->SetBranchAddress( "zmin", &zmin );
+    tree->SetBranchAddress( "zmax", &zmax );
+    tree->SetBranchAddress( "rmin", &rmin );
+    tree->SetBranchAddress( "rmax", &rmax );
+    tree->SetBranchAddress( "phimin", &phimin );
+    tree->SetBranchAddress( "phimax", &phimax );
+    tree->SetBranchAddress( "nmeshz", &nmeshz );
+    tree->SetBranchAddress( "nmeshr", &nmeshr );
+    tree->SetBranchAddress( "nmeshphi", &nmeshphi );
+    tree->SetBranchAddress( "nfield", &nfield );
+    // prepare arrays - need to know the maximum sizes
+    tree->GetEntry(0);
+    meshz = new double[nmeshz];
+    meshr = new double[nmeshr];
+    meshphi = new double[nmeshphi];
+    fieldz = new double[nfield];
+    fieldr = new double[nfield];
+    fieldphi = new double[nfield];
+    // define the variable length branches
+    tree->SetBranchAddress( "meshz", meshz );
+    tree->SetBranchAddress( "meshr", meshr );
+    tree->SetBranchAddress( "meshphi", meshphi );
+    tree->SetBranchAddress( "fieldz", fieldz );
+    tree->SetBranchAddress( "fieldr", fieldr );
+    tree->SetBranchAddress( "fieldphi", fieldphi );
+    // read again, and copy data
+    tree->GetEntry(0);
+    m_orig->setRange( zmin, zmax, rmin, rmax, phimin, phimax );
+    m_orig->reserve( nmeshz, nmeshr, nmeshphi );
+    for ( int j = 0; j < nmeshz; j++ ) {
+        m_orig->appendMesh( 0, meshz[j] );
+    }
+    for ( int j = 0; j < nmeshr; j++ ) {
+        m_orig->appendMesh( 1, meshr[j] );
+    }
+    for ( int j = 0; j < nmeshphi; j++ ) {
+        m_orig->appendMesh( 2, meshphi[j] );
+    }
+    for ( int j = 0; j < nfield; j++ ) {
+        BFieldVector<double> field( fieldz[j], fieldr[j], fieldphi[j] );
+        m_orig->appendField( field );
+    }
+    // clean up
+    tree->Delete();
+    delete[] meshz;
+    delete[] meshr;
+    delete[] meshphi;
+    delete[] fieldz;
+    delete[] fieldr;
+    delete[] fieldphi;
+    // build the LUTs
+    m_orig->buildLUT();
+
+    return 0;
+}
+
+//
+// Write the map in the columnar format: the tree "BFieldSolenoidMesh" holds
+// the range and the mesh, and "BFieldSolenoidField" the field, one z plane
+// per entry.
+//
+void
+BFieldSolenoid::writeColumns( TFile* rootfile, bool tilted, int compression )
+{
+    BFieldMesh<double> *map = tilted ? m_tilt : m_orig;
+    if ( map == 0 ) return; // no map to write
+    if ( rootfile == 0 ) return; // no file
+    if ( rootfile->cd() == false ) return; // could not make it current directory
+    int oldCompression = rootfile->GetCompressionSettings();
+    rootfile->SetCompressionSettings( compression );
+    TTree* tmesh = new TTree( "BFieldSolenoidMesh", "BFieldSolenoid columnar version 5: mesh" );
+    TTree* tfield = new TTree( "BFieldSolenoidField", "BFieldSolenoid columnar version 5: field" );
+    double range[6] = { map->zmin(), map->zmax(), map->rmin(), map->rmax(), map->phimin(), map->phimax() };
+    int nmesh[3] = { int(map->nmesh(0)), int(map->nmesh(1)), int(map->nmesh(2)) };
+    int nplane = nmesh[1]*nmesh[2];
+    vector<double> mesh( nmesh[0]+nmesh[1]+nmesh[2]+1 );
+    vector<double> field( 3*nplane+1 );
+    // range and mesh
+    tmesh->Branch( "zmin", &range[0], "zmin/D" );
+    tmesh->Branch( "zmax", &range[1], "zmax/D" );
+    tmesh->Branch( "rmin", &range[2], "rmin/D" );
+    tmesh->Branch( "rmax", &range[3], "rmax/D" );
+    tmesh->Branch( "phimin", &range[4], "phimin/D" );
+    tmesh->Branch( "phimax", &range[5], "phimax/D" );
+    tmesh->Branch( "nmeshz", &nmesh[0], "nmeshz/I" );
+    tmesh->Branch( "nmeshr", &nmesh[1], "nmeshr/I" );
+    tmesh->Branch( "nmeshphi", &nmesh[2], "nmeshphi/I" );
+    tmesh->Branch( "meshz", &mesh[0], "meshz[nmeshz]/D" );
+    tmesh->Branch( "meshr", &mesh[nmesh[0]], "meshr[nmeshr]/D" );
+    tmesh->Branch( "meshphi", &mesh[nmesh[0]+nmesh[1]], "meshphi[nmeshphi]/D" );
+    for ( int k = 0, j0 = 0; k < 3; j0 += nmesh[k], k++ ) {
+        for ( int j = 0; j < nmesh[k]; j++ ) mesh[j0+j] = map->mesh(k,j);
+    }
+    tmesh->Fill();
+    // field, one z plane per entry
+    tfield->Branch( "nfield", &nplane, "nfield/I" );
+    tfield->Branch( "fieldz", &field[0], "fieldz[nfield]/D" );
+    tfield->Branch( "fieldr", &field[nplane], "fieldr[nfield]/D" );
+    tfield->Branch( "fieldphi", &field[2*nplane], "fieldphi[nfield]/D" );
+    for ( int iz = 0; iz < nmesh[0]; iz++ ) {
+        for ( int j = 0; j < nplane; j++ ) {
+            const BFieldVector<double>& f = map->field( iz*nplane+j );
+            field[j] = f.z();
+            field[nplane+j] = f.r();
+            field[2*nplane+j] = f.phi();
+        }
+        tfield->Fill();
+    }
+    rootfile->Write();
+    rootfile->SetCompressionSettings( oldCompression );
+}
+
+//
+// Read the map in the columnar format into m_orig, which readMap() has made.
+// The branches are decompressed in parallel, with ROOT's implicit
+// multithreading turned on for the time of the reading if the application
+// has not done so.
+//
+int
+BFieldSolenoid::readColumns( TFile* rootfile )
+{
+    TTree* tmesh = (TTree*)rootfile->Get("BFieldSolenoidMesh");
+    TTree* tfield = (TTree*)rootfile->Get("BFieldSolenoidField");
+    if ( tmesh == 0 || tfield == 0 ) return 3; // no tree
+    double range[6];
+    int nmesh[3];
+    tmesh->SetBranchAddress( "zmin", &range[0] );
+    tmesh->SetBranchAddress( "zmax", &range[1] );
+    tmesh->SetBranchAddress( "rmin", &range[2] );
+    tmesh->SetBranchAddress( "rmax", &range[3] );
+    tmesh->SetBranchAddress( "phimin", &range[4] );
+    tmesh->SetBranchAddress( "phimax", &range[5] );
+    tmesh->SetBranchAddress( "nmeshz", &nmesh[0] );
+    tmesh->SetBranchAddress( "nmeshr", &nmesh[1] );
+    tmesh->SetBranchAddress( "nmeshphi", &nmesh[2] );
+    // need to know the sizes before the arrays
+    tmesh->GetEntry(0);
+    vector<double> mesh( nmesh[0]+nmesh[1]+nmesh[2]+1 );
+    tmesh->SetBranchAddress( "meshz", &mesh[0] );
+    tmesh->SetBranchAddress( "meshr", &mesh[nmesh[0]] );
+    tmesh->SetBranchAddress( "meshphi", &mesh[nmesh[0]+nmesh[1]] );
+    tmesh->GetEntry(0);
+    m_orig->setRange( range[0], range[1], range[2], range[3], range[4], range[5] );
+    m_orig->reserve( nmesh[0], nmesh[1], nmesh[2] );
+    for ( int k = 0, j0 = 0; k < 3; j0 += nmesh[k], k++ ) {
+        for ( int j = 0; j < nmesh[k]; j++ ) m_orig->appendMesh( k, mesh[j0+j] );
+    }
+    tmesh->Delete();
+    if ( tfield->GetEntries() != nmesh[0] ) {
+        cerr << "BFieldSolenoid::readMap(): " << tfield->GetEntries() << " z planes of field for "
+             << nmesh[0] << " z mesh points" << endl;
+        return 4;
+    }
+    bool imt = ROOT::IsImplicitMTEnabled();
+    if ( !imt ) ROOT::EnableImplicitMT();
+    int nplane = nmesh[1]*nmesh[2];
+    vector<double> field( 3*nplane+1 );
+    tfield->SetBranchAddress( "fieldz", &field[0] );
+    tfield->SetBranchAddress( "fieldr", &field[nplane] );
+    tfield->SetBranchAddress( "fieldphi", &field[2*nplane] );
+    tfield->SetCacheSize( 32<<20 );
+    tfield->AddBranchToCache( "*", true );
+    for ( int iz = 0; iz < nmesh[0]; iz++ ) {
+        tfield->GetEntry(iz);
+        for ( int j = 0; j < nplane; j++ ) {
+            m_orig->appendField( BFieldVector<double>( field[j], field[nplane+j], field[2*nplane+j] ) );
+        }
+    }
+    tfield->Delete();
+    if ( !imt ) ROOT::DisableImplicitMT();
+    // build the LUTs
+    m_orig->buildLUT();
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+//
+// BFieldThreadPool.cxx
+//
+#include "BFieldThreadPool.h"
+using namespace std;
+
+//
+// Constructor: start the workers.
+// With a single thread, the loops are run directly by the caller.
+//
+BFieldThreadPool::BFieldThreadPool( int nthread )
+    : m_nthread(nthread), m_body(0), m_n(0), m_next(0), m_busy(0), m_generation(0), m_stop(false)
+{
+    if ( m_nthread <= 0 ) m_nthread = thread::hardware_concurrency();
+    if ( m_nthread <= 0 ) m_nthread = 1;
+    if ( m_nthread == 1 ) return;
+    for ( int i = 0; i < m_nthread; i++ ) {
+        m_thread.push_back( thread( &BFieldThreadPool::work, this, i ) );
+    }
+}
+
+//
+// Destructor: stop and join the workers.
+//
+BFieldThreadPool::~BFieldThreadPool()
+{
+    {
+        lock_guard<mutex> lock( m_mutex );
+        m_stop = true;
+    }
+    m_start.notify_all();
+    for ( unsigned i = 0; i < m_thread.size(); i++ ) m_thread[i].join();
+}
+
+//
+// Run body( i, ithread ) for i = 0..n-1 and wait until all are done.
+//
+void
+BFieldThreadPool::run( int n, const function<void(int,int)>& body )
+{
+    if ( m_thread.empty() ) {
+        for ( int i = 0; i < n; i++ ) body( i, 0 );
+        return;
+    }
+    lock_guard<mutex> runlock( m_runMutex );
+    unique_lock<mutex> lock( m_mutex );
+    m_body = &body;
+    m_n = n;
+    m_next = 0;
+    m_busy = m_thread.size();
+    m_generation++;
+    m_start.notify_all();
+    m_done.wait( lock, [this]{ return m_busy == 0; } );
+    m_body = 0;
+}
+
+//
+// Worker loop: wait for a run, pick up iterations until none is left.
+//
+void
+BFieldThreadPool::work( int ithread )
+{
+    unsigned generation = 0;
+    while ( true ) {
+        const function<void(int,int)>* body;
+        int n;
+        {
+            unique_lock<mutex> lock( m_mutex );
+            m_start.wait( lock, [&]{ return m_stop || m_generation != generation; } );
+            if ( m_stop ) return;
+            generation = m_generation;
+            body = m_body;
+            n = m_n;
+        }
+        for ( int i = m_next++; i < n; i = m_next++ ) {
+            (*body)( i, ithread );
+        }
+        {
+            lock_guard<mutex> lock( m_mutex );
+            if ( --m_busy == 0 ) m_done.notify_all();
+        }
+    }
+}
@@ -0,0 +1,46 @@
+//
+// BFieldThreadPool.h
+//
+// A fixed set of worker threads that run the iterations of a loop in parallel.
+// Used for batch evaluation of the field maps.  Each worker is identified by
+// an index in [0,nthread) so that it can use its own BFieldCache.
+//
+#ifndef BFIELDTHREADPOOL_H
+#define BFIELDTHREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+class BFieldThreadPool {
+public:
+    // constructor - nthread = 0 uses all hardware threads
+    explicit BFieldThreadPool( int nthread = 0 );
+    // destructor stops and joins the workers
+    ~BFieldThreadPool();
+    // number of workers
+    int nthread() const { return m_nthread; }
+    // call body( i, ithread ) for i = 0..n-1, and return when all are done
+    void run( int n, const std::function<void(int,int)>& body );
+private:
+    BFieldThreadPool( const BFieldThreadPool& );            // not copyable
+    BFieldThreadPool& operator=( const BFieldThreadPool& );
+    void work( int ithread );
+    int m_nthread;
+    std::vector<std::thread> m_thread;
+    std::mutex m_runMutex; // serializes calls to run()
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    const std::function<void(int,int)>* m_body;
+    int m_n;               // number of iterations in the current run
+    std::atomic<int> m_next; // next iteration to be picked up
+    int m_busy;            // number of workers still running
+    unsigned m_generation; // incremented for each run
+    bool m_stop;
+};
+
+#endif
@@ -2,8 +2,115 @@
 // BFieldZone.cxx
 //
 #include "BFieldZone.h"
+#include <atomic>
 using namespace std;
 
+namespace {
+    // predictors of the value at a node from the nodes decoded before it
+    const int lorenzo = 0;    // B(000) = B(100)+B(010)+B(001)-B(110)-B(101)-B(011)+B(111), zero outside the brick
+    const int secondDiff = 1; // linear extrapolation along phi, Lorenzo for the first two nodes of a row
+
+    // (used by the encoder - the decoder has its own version of them)
+    inline int predict( int mode, const int *n, const int *v, int a, int b, int c )
+    {
+        const int sr = n[2];
+        const int sz = n[1]*n[2];
+        const int *p = v + a*sz + b*sr + c;
+        if ( mode == secondDiff && c >= 2 ) return 2*p[-1] - p[-2];
+        int pred = 0;
+        if ( c > 0 ) pred += p[-1];
+        if ( b > 0 ) {
+            pred += p[-sr];
+            if ( c > 0 ) pred -= p[-sr-1];
+        }
+        if ( a > 0 ) {
+            pred += p[-sz];
+            if ( c > 0 ) pred -= p[-sz-1];
+            if ( b > 0 ) {
+                pred -= p[-sz-sr];
+                if ( c > 0 ) pred += p[-sz-sr-1];
+            }
+        }
+        return pred;
+    }
+
+    //
+    // Encode one component of a brick with one predictor:
+    //   1 byte   predictor << 5 | width w of the codes in bits (1-16)
+    //   2 bytes  number of exceptions
+    //   codes    the zigzag-encoded residuals, w bits each, packed from the lowest bit;
+    //            the largest code 2^w-1 marks an exception
+    //   2 bytes  per exception, the value itself
+    // w is chosen to minimize the size.
+    //
+    void encodeComponent( int mode, const int *n, const vector<int>& v, vector<unsigned char>& out )
+    {
+        const int nnode = v.size();
+        vector<unsigned> code( nnode );
+        int nbit[33] = { 0 }; // number of codes with each bit length (of code+1)
+        int k = 0;
+        for ( int a = 0; a < n[0]; a++ ) {
+            for ( int b = 0; b < n[1]; b++ ) {
+                for ( int c = 0; c < n[2]; c++, k++ ) {
+                    int d = v[k] - predict( mode, n, &v[0], a, b, c );
+                    code[k] = ( unsigned(d) << 1 ) ^ unsigned( d >> 31 );
+                    int len = 0;
+                    for ( unsigned x = code[k]+1; x != 0; x >>= 1 ) len++;
+                    nbit[len]++;
+                }
+            }
+        }
+        int w = 16;
+        long best = -1;
+        for ( int width = 1; width <= 16; width++ ) {
+            int nexc = 0;
+            for ( int len = width+1; len <= 32; len++ ) nexc += nbit[len];
+            long size = long(nnode)*width + 16L*nexc;
+            if ( best < 0 || size < best ) {
+                best = size;
+                w = width;
+            }
+        }
+        const unsigned escape = ( 1u << w ) - 1;
+        vector<short> exception;
+        out.push_back( ( mode << 5 ) | w );
+        size_t nexcpos = out.size();
+        out.resize( out.size() + 2 + ( size_t(nnode)*w+7 )/8, 0 );
+        unsigned char *bits = &out[nexcpos+2];
+        size_t pos = 0;
+        for ( k = 0; k < nnode; k++, pos += w ) {
+            unsigned x = code[k];
+            if ( x >= escape ) {
+                x = escape;
+                exception.push_back( short(v[k]) );
+            }
+            for ( int i = 0; i < w; i++ ) {
+                if ( x & ( 1u << i ) ) bits[(pos+i)>>3] |= 1 << ( (pos+i)&7 );
+            }
+        }
+        out[nexcpos] = exception.size() & 0xff;
+        out[nexcpos+1] = exception.size() >> 8;
+        for ( unsigned i = 0; i < exception.size(); i++ ) {
+            unsigned short x = exception[i];
+            out.push_back( x & 0xff );
+            out.push_back( x >> 8 );
+        }
+    }
+
+    // source of the identifiers of the encoded fields
+    atomic<unsigned long> nextPackId( 1 );
+
+    // bricks decoded by this thread, direct-mapped by encoded field and brick
+    const int nBrickCache = 16;
+    struct BrickCache {
+        unsigned long id[nBrickCache];
+        int brick[nBrickCache];
+        vector<short> node[nBrickCache];
+        BrickCache() { for ( int i = 0; i < nBrickCache; i++ ) id[i] = 0; }
+    };
+    thread_local BrickCache brickCache;
+}
+
 //
 // Compute magnetic field due to the conductors
 //
@@ -15,3 +122,330 @@ BFieldZone::addBiotSavart( const double *xyz, double *B, double *deriv ) const
     }
 }
 
+//
+// Compress the field into bricks of brick^3 bins, i.e. (brick+1)^3 nodes, so
+// that every bin lies in a single brick and each brick can be decoded alone;
+// the bricks at the upper edges of the mesh may be smaller.
+// Each component of a brick is encoded losslessly as the residuals from the
+// better of two predictors, see encodeComponent().
+//
+int
+BFieldZone::compress( int brick )
+{
+    if ( folded() ) return 0; // the field is that of the image
+    if ( tricubic() ) {
+        cerr << "BFieldZone::compress(): zone " << m_id << " uses tricubic interpolation" << endl;
+        return 1;
+    }
+    if ( compressed() ) uncompress();
+    brick = std::max( 1, std::min( brick, 32 ) ); // at most 2^16 exceptions per brick
+    m_brick = brick;
+    for ( int a = 0; a < 3; a++ ) m_nbrick[a] = ( int(m_mesh[a].size())-2 )/m_brick + 1;
+    m_packed.clear();
+    m_brickOffset.clear();
+    int ib[3];
+    for ( ib[0] = 0; ib[0] < m_nbrick[0]; ib[0]++ ) {
+        for ( ib[1] = 0; ib[1] < m_nbrick[1]; ib[1]++ ) {
+            for ( ib[2] = 0; ib[2] < m_nbrick[2]; ib[2]++ ) {
+                m_brickOffset.push_back( m_packed.size() );
+                encodeBrick( ib );
+            }
+        }
+    }
+    m_brickOffset.push_back( m_packed.size() );
+    vector<unsigned char>( m_packed ).swap( m_packed );
+    vector< BFieldVector<short> >().swap( m_field );
+    m_packId = nextPackId++;
+    return 0;
+}
+
+//
+// Expand the compressed field
+//
+void
+BFieldZone::uncompress()
+{
+    if ( !compressed() ) return;
+    const int n[3] = { int(m_mesh[0].size()), int(m_mesh[1].size()), int(m_mesh[2].size()) };
+    m_field.resize( n[0]*n[1]*n[2] );
+    vector<short> node( 3*(m_brick+1)*(m_brick+1)*(m_brick+1) );
+    int ib[3];
+    for ( ib[0] = 0; ib[0] < m_nbrick[0]; ib[0]++ ) {
+        for ( ib[1] = 0; ib[1] < m_nbrick[1]; ib[1]++ ) {
+            for ( ib[2] = 0; ib[2] < m_nbrick[2]; ib[2]++ ) {
+                decodeBrick( ( ib[0]*m_nbrick[1] + ib[1] )*m_nbrick[2] + ib[2], &node[0] );
+                int nb[3];
+                for ( int a = 0; a < 3; a++ ) nb[a] = brickSize( ib[a], a );
+                int nnode = nb[0]*nb[1]*nb[2];
+                int k = 0;
+                for ( int iz = ib[0]*m_brick; iz < ib[0]*m_brick+nb[0]; iz++ ) {
+                    for ( int ir = ib[1]*m_brick; ir < ib[1]*m_brick+nb[1]; ir++ ) {
+                        for ( int iphi = ib[2]*m_brick; iphi < ib[2]*m_brick+nb[2]; iphi++, k++ ) {
+                            m_field[( iz*n[1] + ir )*n[2] + iphi] =
+                                BFieldVector<short>( node[k], node[nnode+k], node[2*nnode+k] );
+                        }
+                    }
+                }
+            }
+        }
+    }
+    vector<unsigned>().swap( m_brickOffset );
+    vector<unsigned char>().swap( m_packed );
+    m_packId = 0;
+}
+
+//
+// Encode one brick, component by component
+//
+void
+BFieldZone::encodeBrick( const int *ib )
+{
+    int n[3];
+    for ( int a = 0; a < 3; a++ ) n[a] = brickSize( ib[a], a );
+    const int nr = m_mesh[1].size();
+    const int nphi = m_mesh[2].size();
+    vector<int> v( n[0]*n[1]*n[2] );
+    for ( int j = 0; j < 3; j++ ) {
+        int k = 0;
+        for ( int a = 0; a < n[0]; a++ ) {
+            for ( int b = 0; b < n[1]; b++ ) {
+                for ( int c = 0; c < n[2]; c++, k++ ) {
+                    v[k] = m_field[( ( ib[0]*m_brick+a )*nr + ib[1]*m_brick+b )*nphi + ib[2]*m_brick+c][j];
+                }
+            }
+        }
+        vector<unsigned char> best, out;
+        for ( int mode = lorenzo; mode <= secondDiff; mode++ ) {
+            out.clear();
+            encodeComponent( mode, n, v, out );
+            if ( best.empty() || out.size() < best.size() ) best.swap( out );
+        }
+        m_packed.insert( m_packed.end(), best.begin(), best.end() );
+    }
+}
+
+//
+// Decode brick ib into node[3*nnode].
+// The values are rebuilt in an array with a border of zeros below each axis,
+// so that the predictors need no tests at the edges of the brick.
+//
+void
+BFieldZone::decodeBrick( int ib, short *node ) const
+{
+    const int n[3] = { brickSize( ib/( m_nbrick[1]*m_nbrick[2] ), 0 ),
+                       brickSize( ( ib/m_nbrick[2] )%m_nbrick[1], 1 ),
+                       brickSize( ib%m_nbrick[2], 2 ) };
+    const int nnode = n[0]*n[1]*n[2];
+    const int pr = n[2]+1;       // index offset for r-1 in the padded array
+    const int pz = (n[1]+1)*pr;  // and for z-1
+    vector<int> u( (n[0]+1)*pz, 0 );
+    const unsigned char *p = &m_packed[m_brickOffset[ib]];
+    for ( int j = 0; j < 3; j++ ) {
+        const int mode = p[0] >> 5;
+        const int w = p[0] & 31;
+        const unsigned escape = ( 1u << w ) - 1;
+        const unsigned char *bits = p + 3;
+        const unsigned char *exception = bits + ( size_t(nnode)*w+7 )/8;
+        unsigned long buffer = 0;
+        int nbuffer = 0;
+        for ( int a = 0; a < n[0]; a++ ) {
+            for ( int b = 0; b < n[1]; b++ ) {
+                int *row = &u[(a+1)*pz + (b+1)*pr + 1];
+                for ( int c = 0; c < n[2]; c++ ) {
+                    while ( nbuffer < w ) {
+                        buffer |= (unsigned long)( *bits++ ) << nbuffer;
+                        nbuffer += 8;
+                    }
+                    unsigned code = buffer & escape;
+                    buffer >>= w;
+                    nbuffer -= w;
+                    if ( code == escape ) {
+                        row[c] = short( exception[0] | exception[1] << 8 );
+                        exception += 2;
+                        continue;
+                    }
+                    int d = int( code >> 1 ) ^ -int( code & 1 );
+                    if ( mode == secondDiff && c >= 2 ) {
+                        row[c] = 2*row[c-1] - row[c-2] + d;
+                    } else {
+                        row[c] = row[c-1] + row[c-pr] + row[c-pz] - row[c-pr-1] - row[c-pz-1] - row[c-pz-pr]
+                               + row[c-pz-pr-1] + d;
+                    }
+                }
+            }
+        }
+        short *v = node + j*nnode;
+        for ( int a = 0; a < n[0]; a++ ) {
+            for ( int b = 0; b < n[1]; b++ ) {
+                const int *row = &u[(a+1)*pz + (b+1)*pr + 1];
+                for ( int c = 0; c < n[2]; c++ ) *v++ = short( row[c] );
+            }
+        }
+        p = exception;
+    }
+}
+
+//
+// Return brick ib from the cache of this thread, decoding it on a miss
+//
+const short*
+BFieldZone::brick( int ib ) const
+{
+    BrickCache& cache( brickCache );
+    int slot = ( m_packId*7 + ib ) % nBrickCache;
+    vector<short>& node( cache.node[slot] );
+    if ( cache.id[slot] != m_packId || cache.brick[slot] != ib ) {
+        size_t size = 3*(m_brick+1)*(m_brick+1)*(m_brick+1);
+        if ( node.size() < size ) node.resize( size );
+        decodeBrick( ib, &node[0] );
+        cache.id[slot] = m_packId;
+        cache.brick[slot] = ib;
+    }
+    return &node[0];
+}
+
+//
+// Find and return the cache of the bin containing (z,r,phi).
+// If the field is compressed, the 8 corners are taken from the decoded brick.
+//
+void
+BFieldZone::getCache( double z, double r, double phi, BFieldCache & cache ) const
+{
+    if ( m_image ) {
+        // the same point in the image, kept inside it against rounding
+        if ( phi < phimin() ) phi += 2.0*M_PI;
+        const BFieldZone& image( *m_image );
+        double zi = std::max( image.zmin(), std::min( m_reflect ? -z : z, image.zmax() ) );
+        double phii = std::max( image.phimin(), std::min( phi + m_dphi, image.phimax() ) );
+        image.getCache( zi, r, phii, cache );
+        cache.unfold( m_dphi, m_reflect, m_sign );
+        return;
+    }
+    if ( !compressed() ) {
+        BFieldMesh<short>::getCache( z, r, phi, cache );
+        return;
+    }
+    // make sure phi is inside this zone
+    if ( phi < phimin() ) phi += 2.0*M_PI;
+    int i[3];
+    findBin( z, r, phi, i[0], i[1], i[2] );
+    // store the bin edges
+    cache.setRange( m_mesh[0][i[0]], m_mesh[0][i[0]+1], m_mesh[1][i[1]], m_mesh[1][i[1]+1],
+                    m_mesh[2][i[2]], m_mesh[2][i[2]+1] );
+    // the brick, and the bin inside it
+    int ib[3], n[3];
+    for ( int a = 0; a < 3; a++ ) {
+        ib[a] = i[a]/m_brick;
+        i[a] -= ib[a]*m_brick;
+        n[a] = brickSize( ib[a], a );
+    }
+    const short *node = brick( ( ib[0]*m_nbrick[1] + ib[1] )*m_nbrick[2] + ib[2] );
+    const int nnode = n[0]*n[1]*n[2];
+    const int roff = n[2];
+    const int zoff = n[1]*n[2];
+    const int im0 = i[0]*zoff + i[1]*roff + i[2];
+    const int corner[8] = { im0, im0+1, im0+roff, im0+roff+1, im0+zoff, im0+zoff+1,
+                            im0+zoff+roff, im0+zoff+roff+1 };
+    for ( int k = 0; k < 8; k++ ) {
+        const short *f = node + corner[k];
+        cache.setField( k, BFieldVector<short>( f[0], f[nnode], f[2*nnode] ) );
+    }
+    cache.setBscale( m_scale );
+    cache.setTricubic( false );
+}
+
+//
+// Fold this zone onto image if they are related by the symmetries of the
+// toroid: the same r mesh, the phi mesh turned by a multiple of 45 degrees,
+// the z mesh the same or mirrored, and the same field at the matching nodes,
+// to a sign for each component.  The test is exact, so that zones with
+// asymmetric corrections keep their own field.
+//
+bool
+BFieldZone::fold( const BFieldZone& image )
+{
+    const double tol( 1.0e-6 );
+    if ( &image == this || folded() || image.folded() || compressed() || image.compressed() ) return false;
+    if ( image.bscale() != bscale() ) return false;
+    for ( int a = 0; a < 3; a++ ) {
+        if ( image.nmesh(a) != nmesh(a) ) return false;
+    }
+    if ( m_field.size() != nmesh(0)*nmesh(1)*nmesh(2) || image.m_field.size() != m_field.size() ) return false;
+    for ( unsigned i = 0; i < nmesh(1); i++ ) {
+        if ( std::abs( image.mesh(1,i) - mesh(1,i) ) > tol ) return false;
+    }
+    double dphi = image.phimin() - phimin();
+    if ( std::abs( std::remainder( dphi, M_PI/4.0 ) ) > tol ) return false;
+    for ( unsigned i = 0; i < nmesh(2); i++ ) {
+        if ( std::abs( image.mesh(2,i) - mesh(2,i) - dphi ) > tol ) return false;
+    }
+    const int nz = nmesh(0);
+    for ( int k = 0; k < 2; k++ ) {
+        bool reflect = ( k == 1 );
+        bool same = true;
+        for ( int i = 0; i < nz && same; i++ ) {
+            double zi = reflect ? -image.mesh(0,nz-1-i) : image.mesh(0,i);
+            same = ( std::abs( zi - mesh(0,i) ) < tol );
+        }
+        if ( !same || !matchField( image, reflect ) ) continue;
+        m_image = &image;
+        m_dphi = dphi;
+        m_reflect = reflect;
+        std::vector< BFieldVector<short> >().swap( m_field );
+        clearTricubic();
+        return true;
+    }
+    return false;
+}
+
+//
+// utility function used by fold(): compare the field with that of image,
+// mirrored in z if reflect, and find the sign of each component
+//
+bool
+BFieldZone::matchField( const BFieldZone& image, bool reflect )
+{
+    const int n[3] = { int(nmesh(0)), int(nmesh(1)), int(nmesh(2)) };
+    const int zoff = n[1]*n[2];
+    int sign[3] = { 0, 0, 0 };
+    for ( int iz = 0; iz < n[0]; iz++ ) {
+        const BFieldVector<short>* f = &m_field[iz*zoff];
+        const BFieldVector<short>* g = &image.m_field[( reflect ? n[0]-1-iz : iz )*zoff];
+        for ( int k = 0; k < zoff; k++ ) {
+            for ( int j = 0; j < 3; j++ ) {
+                int a = f[k][j];
+                int b = g[k][j];
+                if ( a == b && ( a == 0 || sign[j] >= 0 ) ) {
+                    if ( a != 0 ) sign[j] = 1;
+                } else if ( a == -b && sign[j] <= 0 ) {
+                    sign[j] = -1;
+                } else {
+                    return false;
+                }
+            }
+        }
+    }
+    for ( int j = 0; j < 3; j++ ) m_sign[j] = ( sign[j] < 0 ) ? -1 : 1;
+    return true;
+}
+
+//
+// Copy the field back from the image
+//
+void
+BFieldZone::unfold()
+{
+    if ( m_image == 0 ) return;
+    const BFieldZone& image( *m_image );
+    const int n[3] = { int(nmesh(0)), int(nmesh(1)), int(nmesh(2)) };
+    const int zoff = n[1]*n[2];
+    m_field.resize( n[0]*zoff );
+    for ( int iz = 0; iz < n[0]; iz++ ) {
+        const BFieldVector<short>* g = &image.m_field[( m_reflect ? n[0]-1-iz : iz )*zoff];
+        for ( int k = 0; k < zoff; k++ ) {
+            m_field[iz*zoff+k] = BFieldVector<short>( m_sign[0]*g[k].z(), m_sign[1]*g[k].r(), m_sign[2]*g[k].phi() );
+        }
+    }
+    m_image = 0;
+    if ( image.tricubic() ) buildTricubic();
+}
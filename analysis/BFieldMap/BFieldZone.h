@@ -9,6 +9,7 @@
 #define BFIELDZONE_H
 
 #include <vector>
+#include <algorithm>
 #include "BFieldMesh.h"
 #include "BFieldCond.h"
 
@@ -17,11 +18,39 @@ public:
     // constructor
     BFieldZone( int id, double zmin, double zmax, double rmin, double rmax, double phimin, double phimax,
                 double scale )
-        : BFieldMesh<short>(zmin,zmax,rmin,rmax,phimin,phimax,scale), m_id(id) {;}
+        : BFieldMesh<short>(zmin,zmax,rmin,rmax,phimin,phimax,scale), m_id(id), m_brick(0), m_nbrick(),
+          m_packId(0), m_image(0), m_dphi(0.0), m_reflect(false), m_sign() {;}
     // add elements to vectors
     void appendCond( const BFieldCond& cond ) { m_cond.push_back(cond); }
     // compute Biot-Savart magnetic field and add to B[3]
     void addBiotSavart( const double *xyz, double *B, double *deriv=0 ) const;
+    // keep the field compressed in memory, in bricks of brick^3 bins that are
+    // decoded one at a time into a small per-thread cache when first touched.
+    // field() and nfield() are not available while compressed.
+    // Returns 1 if the zone uses tricubic interpolation, which is not supported.
+    int compress( int brick=8 );
+    // expand the field again
+    void uncompress();
+    bool compressed() const { return !m_brickOffset.empty(); }
+    // share the field of image, if image has the same mesh and field up to a
+    // turn by a multiple of 45 degrees in phi and/or the reflection z -> -z,
+    // with each of Bz, Br, Bphi equal or opposite at the matching nodes.
+    // The field of this zone is dropped, and its bins are taken from image
+    // and moved back (see BFieldCache::unfold()).  The conductors are kept.
+    // Returns true if the zone was folded.  Neither zone may be compressed.
+    bool fold( const BFieldZone& image );
+    // take back a copy of the field of the image, which must not be compressed
+    void unfold();
+    bool folded() const { return m_image != 0; }
+    const BFieldZone* image() const { return m_image; }
+    // find the bin, from the compressed field or the image if needed
+    void getCache( double z, double r, double phi, BFieldCache & cache ) const;
+    // prefetch the next bin (does nothing if compressed or folded)
+    void prefetchNext( double z, double r, double phi, const double *dzrphi ) const
+    { if ( !compressed() && !folded() ) BFieldMesh<short>::prefetchNext( z, r, phi, dzrphi ); }
+    // memory used by the field values, compressed or not (bytes)
+    size_t memory() const
+    { return BFieldMesh<short>::memory() + m_packed.size() + m_brickOffset.size()*sizeof(unsigned); }
     // accessors
     int id() const { return m_id; }
     unsigned ncond() const { return m_cond.size(); }
@@ -29,6 +58,28 @@ public:
 private:
     int m_id;          // zone ID number
     std::vector<BFieldCond> m_cond;            // list of current conductors
+    // compressed field
+    int m_brick;                           // bins per brick along each axis
+    int m_nbrick[3];                       // number of bricks in z, r, phi
+    std::vector<unsigned> m_brickOffset;   // start of each brick in m_packed, and the end
+    std::vector<unsigned char> m_packed;   // encoded bricks
+    unsigned long m_packId;                // identifies the encoded bricks in the per-thread caches
+    // folded field
+    const BFieldZone* m_image;             // zone whose field is used, 0 if none
+    double m_dphi;                         // phi of the image - phi of this zone
+    bool m_reflect;                        // z of the image = -z of this zone
+    int m_sign[3];                         // (Bz,Br,Bphi) here = m_sign * (Bz,Br,Bphi) of the image
+    // true if this zone matches image with the z reflection given, and if so set m_sign
+    bool matchField( const BFieldZone& image, bool reflect );
+    // number of nodes along axis a in the bricks of index ib along that axis
+    int brickSize( int ib, int a ) const
+    { return std::min( m_brick, int(m_mesh[a].size())-1-ib*m_brick ) + 1; }
+    // append brick ib[3] to m_packed
+    void encodeBrick( const int *ib );
+    // decode brick ib into node[], planar: all Bz, all Br, then all Bphi
+    void decodeBrick( int ib, short *node ) const;
+    // brick ib, decoded in the cache of this thread if needed
+    const short* brick( int ib ) const;
 };
 
 #endif
@@ -0,0 +1,603 @@
+// benchBFieldMap.cxx
+//
+// Benchmark of BFieldMap::getB() along straight and helical tracks,
+// with and without the direction hint that prefetches the next bin.
+// With -h8, benchmark the interpolation in the grids of an H8 map instead.
+// With -swap, stress BFieldHolder: reader threads evaluate the field while
+// the map is replaced over and over.
+// With -client, measure the round trips to a running fieldServer.
+// With -compress, compare the map kept compressed in memory with the expanded one.
+// With -fold, compare the map folded by its symmetries with the full one.
+// With -lut, measure the memory of the mesh look-up tables and the bin finding.
+// With -profile, run the sampling profiler and write its histograms.
+// With -record, write a trace of the queries of a track propagation for replayTrace.
+//
+#include "BFieldMap.h"
+#include "BFieldH8Map.h"
+#include "BFieldScaledMap.h"
+#include "BFieldHolder.h"
+#include "BFieldService.h"
+#include "BFieldPropagator.h"
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <fstream>
+using namespace std;
+
+//
+// Make points along tracks coming from the origin, with a step of ds (mm).
+// Helical tracks curve in phi with a random radius of curvature.
+//
+void
+makeTracks( int ntrack, double ds, bool helix, vector<double>& pos, vector<double>& dir )
+{
+    srand48( helix ? 2 : 1 );
+    for ( int i = 0; i < ntrack; i++ ) {
+        double eta = 5.0*drand48() - 2.5;
+        double phi = 2.0*M_PI*drand48() - M_PI;
+        double theta = 2.0*atan(exp(-eta));
+        // 5 - 50 GeV in ~0.5 T, either charge
+        double rcurv = helix ? ( 5.0 + 45.0*drand48() )*6667.0 : 0.0;
+        if ( helix && drand48() < 0.5 ) rcurv = -rcurv;
+        double xyz[3] = { 0.0, 0.0, 0.0 };
+        while ( xyz[0]*xyz[0]+xyz[1]*xyz[1] < 14000.*14000. && abs(xyz[2]) < 23000. ) {
+            double u[3] = { sin(theta)*cos(phi), sin(theta)*sin(phi), cos(theta) };
+            for ( int j = 0; j < 3; j++ ) {
+                pos.push_back( xyz[j] );
+                dir.push_back( u[j] );
+                xyz[j] += ds*u[j];
+            }
+            if ( rcurv != 0.0 ) phi += ds*sin(theta)/rcurv;
+        }
+    }
+}
+
+//
+// Evict the CPU caches between measurements
+//
+void
+flushCaches()
+{
+    static vector<char> junk( 64<<20 );
+    for ( unsigned i = 0; i < junk.size(); i += 64 ) junk[i]++;
+}
+
+//
+// Time getB() on all points, with or without the direction hint.
+// Returns ns per call.
+//
+double
+timeGetB( const BFieldMap& map, const vector<double>& pos, const vector<double>& dir, bool hint, double& sum )
+{
+    flushCaches();
+    unsigned n = pos.size()/3;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    for ( unsigned i = 0; i < n; i++ ) {
+        double B[3];
+        if ( hint ) map.getB( &pos[3*i], B, 0, &dir[3*i] );
+        else map.getB( &pos[3*i], B );
+        sum += B[0] + B[1] + B[2];
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    return chrono::duration<double,nano>(t1-t0).count()/n;
+}
+
+//
+// Reference H8 grid with the field in three separate arrays, interpolated
+// as in the original BFieldH8Grid::getB()
+//
+class PlanarH8Grid {
+public:
+    PlanarH8Grid( const BFieldH8Grid& grid )
+    {
+        for ( int i = 0; i < 3; i++ ) {
+            m_n[i] = grid.n(i);
+            m_min[i] = grid.min(i);
+            m_max[i] = grid.max(i);
+        }
+        int nxyz = m_n[0]*m_n[1]*m_n[2];
+        for ( int i = 0; i < 3; i++ ) {
+            m_B[i].resize( nxyz );
+            for ( int k = 0; k < nxyz; k++ ) m_B[i][k] = grid.field( k, i );
+        }
+    }
+    void getB( const double *xyz, double *B, double *deriv ) const
+    {
+        double invunit[3];
+        int j[3];
+        double f[3];
+        double g[3];
+        for ( int i=0; i<3; i++ ) {
+            invunit[i] = (m_n[i]-1) / (m_max[i]-m_min[i]);
+            double a = (xyz[i]-m_min[i]) * invunit[i];
+            j[i] = min( int(a), m_n[i]-2 );
+            f[i] = a - j[i];
+            g[i] = 1.0 - f[i];
+        }
+        int ixyz[8];
+        ixyz[0] = j[0] + m_n[0]*(j[1] + m_n[1]*j[2]);
+        ixyz[1] = ixyz[0] + 1;
+        ixyz[2] = ixyz[0] + m_n[0];
+        ixyz[3] = ixyz[2] + 1;
+        ixyz[4] = ixyz[0] + m_n[0]*m_n[1];
+        ixyz[5] = ixyz[4] + 1;
+        ixyz[6] = ixyz[4] + m_n[0];
+        ixyz[7] = ixyz[6] + 1;
+        for ( int i=0; i<3; i++ ) {
+            const vector<double>& b = m_B[i];
+            B[i] = g[2]*( g[1]*( g[0]*b[ixyz[0]] + f[0]*b[ixyz[1]] ) +
+                          f[1]*( g[0]*b[ixyz[2]] + f[0]*b[ixyz[3]] ) ) +
+                   f[2]*( g[1]*( g[0]*b[ixyz[4]] + f[0]*b[ixyz[5]] ) +
+                          f[1]*( g[0]*b[ixyz[6]] + f[0]*b[ixyz[7]] ) );
+        }
+        if ( deriv != 0 ) {
+            for ( int i=0; i<3; i++ ) {
+                const vector<double>& b = m_B[i];
+                deriv[i*3  ] = ( g[2]*( g[1]*(b[ixyz[1]] - b[ixyz[0]]) + f[1]*(b[ixyz[3]] - b[ixyz[2]]) ) +
+                                 f[2]*( g[1]*(b[ixyz[5]] - b[ixyz[4]]) + f[1]*(b[ixyz[7]] - b[ixyz[6]]) ) ) * invunit[0];
+                deriv[i*3+1] = ( g[2]*( g[0]*(b[ixyz[2]] - b[ixyz[0]]) + f[0]*(b[ixyz[3]] - b[ixyz[1]]) ) +
+                                 f[2]*( g[0]*(b[ixyz[6]] - b[ixyz[4]]) + f[0]*(b[ixyz[7]] - b[ixyz[5]]) ) ) * invunit[1];
+                deriv[i*3+2] = ( g[1]*( g[0]*(b[ixyz[4]] - b[ixyz[0]]) + f[0]*(b[ixyz[5]] - b[ixyz[1]]) ) +
+                                 f[1]*( g[0]*(b[ixyz[6]] - b[ixyz[2]]) + f[0]*(b[ixyz[7]] - b[ixyz[3]]) ) ) * invunit[2];
+            }
+        }
+    }
+private:
+    int m_n[3];
+    double m_min[3], m_max[3];
+    vector<double> m_B[3];
+};
+
+//
+// Compare the interleaved BFieldH8Grid with the planar reference at random
+// points inside each grid of the H8 map, with and without derivatives.
+//
+int
+benchH8( const char* mapfile, int npoint )
+{
+    BFieldH8Map map;
+    if ( map.readMap( mapfile ) ) return 1;
+    srand48( 1 );
+    for ( int ig = 0; ig < map.ngrid(); ig++ ) {
+        const BFieldH8Grid& grid = map.grid( ig );
+        PlanarH8Grid planar( grid );
+        vector<double> pos( 3*npoint );
+        for ( int i = 0; i < npoint; i++ ) {
+            for ( int j = 0; j < 3; j++ ) pos[3*i+j] = grid.min(j) + drand48()*( grid.max(j)-grid.min(j) );
+        }
+        cout << "grid " << ig << ": " << grid.n(0) << " x " << grid.n(1) << " x " << grid.n(2)
+             << " nodes, " << npoint << " points" << endl;
+        for ( int withDeriv = 0; withDeriv < 2; withDeriv++ ) {
+            // keep the best of 3 trials
+            double t[2] = { 1e30, 1e30 };
+            double maxdiff(0.), maxB(0.);
+            for ( int trial = 0; trial < 3; trial++ ) {
+                for ( int k = 0; k < 2; k++ ) {
+                    flushCaches();
+                    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+                    for ( int i = 0; i < npoint; i++ ) {
+                        double B[3], deriv[9];
+                        if ( k == 0 ) planar.getB( &pos[3*i], B, withDeriv ? deriv : 0 );
+                        else grid.getB( &pos[3*i], B, withDeriv ? deriv : 0 );
+                        if ( trial == 0 ) {
+                            // compare the two layouts
+                            double Bref[3], dref[9];
+                            planar.getB( &pos[3*i], Bref, dref );
+                            for ( int j = 0; j < 3; j++ ) {
+                                maxdiff = max( maxdiff, abs( B[j]-Bref[j] ) );
+                                maxB = max( maxB, abs( Bref[j] ) );
+                            }
+                        }
+                    }
+                    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+                    if ( trial > 0 ) t[k] = min( t[k], chrono::duration<double,nano>(t1-t0).count()/npoint );
+                }
+            }
+            cout << ( withDeriv ? "  with derivatives" : "  field only      " )
+                 << "  planar " << t[0] << " ns/call, interleaved " << t[1] << " ns/call (x"
+                 << t[0]/t[1] << ")" << endl;
+            if ( maxdiff > 1e-12*maxB ) cout << "  WARNING: results differ by " << maxdiff << " kT" << endl;
+        }
+    }
+    return 0;
+}
+
+//
+// Readers evaluate the field at fixed points through a BFieldHolder, while the
+// main thread publishes nswap maps, each a copy of the original map scaled by
+// a factor that depends on its version.  Every reader checks the field against
+// the scale of the version it sees, which catches a reader given a map that is
+// half built or already deleted.
+//
+int
+stressSwap( const char* mapfile, int nreader, int nswap )
+{
+    BFieldMap map;
+    if ( map.readMap( mapfile ) ) return 1;
+    BFieldScaledMap scaled;
+    scaled.addComponent( &map );
+    const double scale[4] = { 1.0, 0.5, 1.5, -1.0 };
+    // reference field at the test points, from the combined map at scale 1
+    const int npoint = 1000;
+    vector<double> pos, dir;
+    makeTracks( 100, 100.0, true, pos, dir );
+    vector<double> xyz( 3*npoint ), Bref( 3*npoint );
+    double maxB( 0.0 );
+    for ( int i = 0; i < npoint; i++ ) {
+        int k = ( i*7919 ) % ( pos.size()/3 );
+        for ( int j = 0; j < 3; j++ ) xyz[3*i+j] = pos[3*k+j];
+        scaled.getB( &xyz[3*i], &Bref[3*i] );
+        for ( int j = 0; j < 3; j++ ) maxB = max( maxB, abs( Bref[3*i+j] ) );
+    }
+    const double tolerance = 1e-3*maxB; // re-quantization of the scaled maps
+
+    BFieldHolder<BFieldMap> holder( scaled.combine(), nreader );
+    atomic<bool> stop( false );
+    atomic<long> nread( 0 ), nerror( 0 ), nversion( 0 );
+    vector<thread> reader;
+    for ( int ir = 0; ir < nreader; ir++ ) {
+        reader.push_back( thread( [&]() {
+            int slot = holder.registerReader();
+            BFieldCache cache;
+            unsigned long last = 0;
+            long n( 0 ), nerr( 0 ), nver( 0 );
+            for ( int i = 0; !stop.load( memory_order_relaxed ); i = ( i+1 ) % npoint, n++ ) {
+                BFieldHolder<BFieldMap>::Guard field( holder, slot );
+                if ( field.version() != last ) {
+                    cache.clear();
+                    last = field.version();
+                    nver++;
+                }
+                double B[3];
+                field->getB( &xyz[3*i], B, 0, cache );
+                double s = scale[last%4];
+                for ( int j = 0; j < 3; j++ ) {
+                    if ( abs( B[j] - s*Bref[3*i+j] ) > tolerance ) { nerr++; break; }
+                }
+            }
+            holder.unregisterReader( slot );
+            nread += n;
+            nerror += nerr;
+            nversion += nver;
+        } ) );
+    }
+    // build and publish the new maps
+    double tbuild( 0.0 ), tpublish( 0.0 ), maxPublish( 0.0 );
+    int maxRetired( 0 );
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for ( int iswap = 1; iswap <= nswap; iswap++ ) {
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        scaled.setScale( 0, scale[iswap%4] );
+        BFieldMap* next = scaled.combine();
+        chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+        holder.publish( next );
+        chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+        tbuild += chrono::duration<double,milli>(t1-t0).count();
+        double t = chrono::duration<double,micro>(t2-t1).count();
+        tpublish += t;
+        maxPublish = max( maxPublish, t );
+        maxRetired = max( maxRetired, holder.nretired() );
+    }
+    stop = true;
+    for ( unsigned i = 0; i < reader.size(); i++ ) reader[i].join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+    int left = holder.reclaim();
+
+    cout << nreader << " readers, " << nswap << " swaps in " << elapsed << " s" << endl;
+    cout << "  build map         " << tbuild/nswap << " ms/swap" << endl;
+    cout << "  publish           " << tpublish/nswap << " us/swap (max " << maxPublish << " us)" << endl;
+    cout << "  reads             " << nread << " (" << nread/elapsed/1e6 << " M/s), "
+         << nversion << " version changes seen" << endl;
+    cout << "  retired maps      max " << maxRetired << " pending, " << left << " left at the end" << endl;
+    if ( nerror > 0 ) cout << "  ERROR: " << nerror << " wrong fields" << endl;
+    if ( left > 0 ) cout << "  ERROR: " << left << " maps not reclaimed" << endl;
+    return ( nerror > 0 || left > 0 ) ? 1 : 0;
+}
+
+//
+// Compress the map in bricks of the given size, and compare its memory and the
+// time per getB() call with the expanded map along straight and helical tracks.
+// The compression is lossless, so the fields must be identical.
+//
+int
+benchCompress( const char* mapfile, int brick, int ntrack )
+{
+    BFieldMap map, packed;
+    if ( map.readMap( mapfile ) || packed.readMap( mapfile ) ) return 1;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    if ( packed.compress( brick ) ) return 1;
+    double tcompress = chrono::duration<double,milli>( chrono::steady_clock::now()-t0 ).count();
+    cout << "bricks of " << brick << "^3 bins: field memory " << map.memory()/1024. << " kB -> "
+         << packed.memory()/1024. << " kB (x" << double( packed.memory() )/map.memory() << "), compressed in "
+         << tcompress << " ms" << endl;
+    const char* name[2] = { "straight", "helical" };
+    int status = 0;
+    for ( int k = 0; k < 2; k++ ) {
+        vector<double> pos, dir;
+        makeTracks( ntrack, 20.0, k==1, pos, dir );
+        double t[2] = { 1e30, 1e30 };
+        double sum[2] = { 0.0, 0.0 };
+        for ( int trial = 0; trial < 3; trial++ ) {
+            t[0] = min( t[0], timeGetB( map, pos, dir, false, sum[0] ) );
+            t[1] = min( t[1], timeGetB( packed, pos, dir, false, sum[1] ) );
+        }
+        cout << name[k] << " tracks: " << pos.size()/3 << " points" << endl;
+        cout << "  getB() expanded   " << t[0] << " ns/call" << endl;
+        cout << "  getB() compressed " << t[1] << " ns/call" << endl;
+        if ( sum[0] != sum[1] ) {
+            cout << "  ERROR: results differ" << endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+//
+// Fold the map by the symmetries of the toroid, and compare its memory and the
+// time per getB() call with the full map along straight and helical tracks.
+// The folded zones take the bins of their images moved back, so the fields
+// may differ by rounding only.
+//
+int
+benchFold( const char* mapfile, int ntrack )
+{
+    BFieldMap map, folded;
+    if ( map.readMap( mapfile ) || folded.readMap( mapfile ) ) return 1;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    int nfold = folded.fold();
+    double tfold = chrono::duration<double,milli>( chrono::steady_clock::now()-t0 ).count();
+    cout << nfold << " of " << map.nzone() << " zones folded: field memory " << map.memory()/1024. << " kB -> "
+         << folded.memory()/1024. << " kB (x" << double( folded.memory() )/map.memory() << "), folded in "
+         << tfold << " ms" << endl;
+    const char* name[2] = { "straight", "helical" };
+    int status = 0;
+    for ( int k = 0; k < 2; k++ ) {
+        vector<double> pos, dir;
+        makeTracks( ntrack, 20.0, k==1, pos, dir );
+        double t[2] = { 1e30, 1e30 };
+        double sum[2] = { 0.0, 0.0 };
+        for ( int trial = 0; trial < 3; trial++ ) {
+            t[0] = min( t[0], timeGetB( map, pos, dir, false, sum[0] ) );
+            t[1] = min( t[1], timeGetB( folded, pos, dir, false, sum[1] ) );
+        }
+        // largest difference of the field
+        double maxdB = 0.0;
+        for ( unsigned i = 0; i < pos.size()/3; i++ ) {
+            double B[2][3];
+            map.getB( &pos[3*i], B[0] );
+            folded.getB( &pos[3*i], B[1] );
+            for ( int j = 0; j < 3; j++ ) maxdB = max( maxdB, abs( B[1][j]-B[0][j] ) );
+        }
+        cout << name[k] << " tracks: " << pos.size()/3 << " points" << endl;
+        cout << "  getB() full   " << t[0] << " ns/call" << endl;
+        cout << "  getB() folded " << t[1] << " ns/call" << endl;
+        cout << "  |dB| max      " << 1e3*maxdB << " T" << endl;
+        if ( maxdB > 1e-9 ) {
+            cout << "  ERROR: results differ" << endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+//
+// Report the memory of the look-up tables of the zone meshes, and time
+// BFieldZone::findBin() at random points of random zones, with cold caches.
+//
+int
+benchLUT( const char* mapfile, int npoint )
+{
+    BFieldMap map;
+    if ( map.readMap( mapfile ) ) return 1;
+    size_t memory( 0 );
+    int nuniform( 0 );
+    for ( int i = 0; i < map.nzone(); i++ ) {
+        memory += map.zone(i).memoryLUT();
+        for ( int j = 0; j < 3; j++ ) nuniform += map.zone(i).uniform(j);
+    }
+    cout << map.nzone() << " zones: " << nuniform << " of " << 3*map.nzone() << " axes uniform, LUT memory "
+         << memory/1024. << " kB" << endl;
+    srand48( 1 );
+    vector<int> zone( npoint );
+    vector<double> zrphi( 3*npoint );
+    for ( int i = 0; i < npoint; i++ ) {
+        zone[i] = int( drand48()*map.nzone() );
+        const BFieldZone& z = map.zone( zone[i] );
+        for ( int j = 0; j < 3; j++ ) zrphi[3*i+j] = z.min(j) + drand48()*( z.max(j)-z.min(j) );
+    }
+    double t( 1e30 );
+    long sum( 0 );
+    for ( int trial = 0; trial < 3; trial++ ) {
+        flushCaches();
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        for ( int i = 0; i < npoint; i++ ) {
+            int iz, ir, iphi;
+            map.zone( zone[i] ).findBin( zrphi[3*i], zrphi[3*i+1], zrphi[3*i+2], iz, ir, iphi );
+            sum += iz + ir + iphi;
+        }
+        t = min( t, chrono::duration<double,nano>( chrono::steady_clock::now()-t0 ).count()/npoint );
+    }
+    cout << "  findBin()  " << t << " ns/call (checksum " << sum << ")" << endl;
+    return 0;
+}
+
+//
+// Time getB() along helical tracks without and with the sampling profiler,
+// timing the given fraction of the calls, and write the histograms to a file
+// for printProfile.
+//
+int
+benchProfile( const char* mapfile, double fraction, const char* dumpfile )
+{
+    BFieldMap map;
+    if ( map.readMap( mapfile ) ) return 1;
+    vector<double> pos, dir;
+    makeTracks( 10000, 20.0, true, pos, dir );
+    BFieldProfiler profiler( "toroid", fraction );
+    double t[2] = { 1e30, 1e30 };
+    double sum[2] = { 0.0, 0.0 };
+    for ( int trial = 0; trial < 3; trial++ ) {
+        for ( int k = 0; k < 2; k++ ) {
+            map.setProfiler( ( k == 1 ) ? &profiler : 0 );
+            t[k] = min( t[k], timeGetB( map, pos, dir, false, sum[k] ) );
+        }
+    }
+    cout << "helical tracks: " << pos.size()/3 << " points" << endl;
+    cout << "  getB()                " << t[0] << " ns/call" << endl;
+    cout << "  getB() with profiler  " << t[1] << " ns/call (" << fraction << " of the calls timed)" << endl;
+    ofstream out( dumpfile );
+    profiler.dump( out );
+    cout << "histograms of " << profiler.entries( -1, true ) + profiler.entries( -1, false )
+         << " calls written to " << dumpfile << endl;
+    return 0;
+}
+
+//
+// Record the getB() queries of the Runge-Kutta propagation of muons through
+// the toroid map, half of them with the Jacobian, which needs the derivatives
+//
+int
+recordTrace( const char* mapfile, const char* tracefile, int ntrack )
+{
+    BFieldMap map;
+    if ( map.readMap( mapfile ) ) return 1;
+    BFieldRecorder recorder;
+    if ( recorder.open( tracefile ) ) return 1;
+    map.setRecorder( &recorder );
+    BFieldPropagator prop( &map );
+    BFieldPropagator::Cache cache;
+    srand48( 3 );
+    for ( int i = 0; i < ntrack; i++ ) {
+        double eta = 5.0*drand48() - 2.5;
+        double phi = 2.0*M_PI*drand48() - M_PI;
+        double theta = 2.0*atan(exp(-eta));
+        double xyz[3] = { 0.0, 0.0, 0.0 };
+        double u[3] = { sin(theta)*cos(phi), sin(theta)*sin(phi), cos(theta) };
+        // 5 - 50 GeV, either charge
+        double qop = ( drand48() < 0.5 ? 1.0 : -1.0 )/( 5.0 + 45.0*drand48() );
+        BFieldTrack track( xyz, u, qop );
+        prop.propagate( track, 14000., 23000., 50000., i%2 == 1, cache );
+    }
+    map.setRecorder( 0 );
+    recorder.close();
+    cout << ntrack << " tracks: " << recorder.nrecord() << " queries written to " << tracefile << endl;
+    return 0;
+}
+
+//
+// Send the points of helical tracks to a fieldServer in calls of 1 to 4096
+// points, with and without derivatives, and report the latency per call and
+// the throughput.
+//
+int
+benchClient( const char* path, int npoint, bool shm )
+{
+    BFieldClient client;
+    if ( client.connect( path, shm ) ) {
+        cout << "cannot connect to " << path << endl;
+        return 1;
+    }
+    cout << "connected to " << path << " through " << ( client.sharedMemory() ? "shared memory" : "the socket" )
+         << endl;
+    vector<double> pos, dir;
+    makeTracks( 1000, 20.0, true, pos, dir );
+    while ( (int)pos.size() < 3*npoint ) pos.insert( pos.end(), pos.begin(), pos.end() );
+    vector<double> B( 3*npoint ), deriv( 9*npoint );
+    const int ncall[5] = { 1, 16, 256, 1024, 4096 };
+    for ( int withDeriv = 0; withDeriv < 2; withDeriv++ ) {
+        for ( int k = 0; k < 5; k++ ) {
+            BFieldLatency latency;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for ( int i = 0; i + ncall[k] <= npoint; i += ncall[k] ) {
+                chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+                if ( client.getB( ncall[k], &pos[3*i], &B[3*i], withDeriv ? &deriv[9*i] : 0 ) ) {
+                    cout << "lost the server" << endl;
+                    return 1;
+                }
+                latency.fill( chrono::duration<double,nano>( chrono::steady_clock::now()-t0 ).count() );
+            }
+            double elapsed = chrono::duration<double>( chrono::steady_clock::now()-start ).count();
+            cout << ( withDeriv ? "  with derivatives, " : "  field only,       " ) << ncall[k] << " points/call: "
+                 << ( npoint/ncall[k] )*ncall[k]/elapsed/1e6 << " M points/s" << endl << "    ";
+            latency.print( cout );
+            cout << endl;
+        }
+    }
+    return 0;
+}
+
+int main( int argc, char** argv )
+{
+    if ( argc >= 3 && string( argv[1] ) == "-h8" ) {
+        return benchH8( argv[2], ( argc > 3 ) ? atoi(argv[3]) : 1000000 );
+    }
+    if ( argc >= 3 && string( argv[1] ) == "-swap" ) {
+        return stressSwap( argv[2], ( argc > 3 ) ? atoi(argv[3]) : 4, ( argc > 4 ) ? atoi(argv[4]) : 200 );
+    }
+    if ( argc >= 3 && string( argv[1] ) == "-client" ) {
+        bool shm( true );
+        int npoint( 1000000 );
+        for ( int i = 3; i < argc; i++ ) {
+            if ( string( argv[i] ) == "-socket" ) shm = false;
+            else npoint = atoi( argv[i] );
+        }
+        return benchClient( argv[2], npoint, shm );
+    }
+    if ( argc >= 3 && string( argv[1] ) == "-lut" ) {
+        return benchLUT( argv[2], ( argc > 3 ) ? atoi(argv[3]) : 1000000 );
+    }
+    if ( argc >= 3 && string( argv[1] ) == "-profile" ) {
+        return benchProfile( argv[2], ( argc > 3 ) ? atof(argv[3]) : 0.01,
+                             ( argc > 4 ) ? argv[4] : "profile.txt" );
+    }
+    if ( argc >= 4 && string( argv[1] ) == "-record" ) {
+        return recordTrace( argv[2], argv[3], ( argc > 4 ) ? atoi(argv[4]) : 1000 );
+    }
+    if ( argc >= 3 && string( argv[1] ) == "-compress" ) {
+        return benchCompress( argv[2], ( argc > 3 ) ? atoi(argv[3]) : 8, ( argc > 4 ) ? atoi(argv[4]) : 10000 );
+    }
+    if ( argc >= 3 && string( argv[1] ) == "-fold" ) {
+        return benchFold( argv[2], ( argc > 3 ) ? atoi(argv[3]) : 10000 );
+    }
+    if ( argc < 2 || argc > 4 ) {
+        cout << "usage: benchBFieldMap <mapfile> [<ntrack>] [<step in mm>]" << endl;
+        cout << "       benchBFieldMap -h8 <H8 mapfile> [<npoint>]" << endl;
+        cout << "       benchBFieldMap -swap <mapfile> [<nreader>] [<nswap>]" << endl;
+        cout << "       benchBFieldMap -client <socket> [<npoint>] [-socket]" << endl;
+        cout << "       benchBFieldMap -compress <mapfile> [<brick>] [<ntrack>]" << endl;
+        cout << "       benchBFieldMap -fold <mapfile> [<ntrack>]" << endl;
+        cout << "       benchBFieldMap -lut <mapfile> [<npoint>]" << endl;
+        cout << "       benchBFieldMap -profile <mapfile> [<fraction>] [<dumpfile>]" << endl;
+        cout << "       benchBFieldMap -record <mapfile> <tracefile> [<ntrack>]" << endl;
+        return 1;
+    }
+    BFieldMap map;
+    if ( map.readMap( argv[1] ) ) return 1;
+    int ntrack = ( argc > 2 ) ? atoi(argv[2]) : 10000;
+    double ds = ( argc > 3 ) ? atof(argv[3]) : 20.0;
+
+    const char* name[2] = { "straight", "helical" };
+    for ( int k = 0; k < 2; k++ ) {
+        vector<double> pos, dir;
+        makeTracks( ntrack, ds, k==1, pos, dir );
+        // alternate the two modes and keep the best of 3 trials
+        double t[2] = { 1e30, 1e30 };
+        double sum[2] = { 0.0, 0.0 };
+        for ( int trial = 0; trial < 3; trial++ ) {
+            for ( int hint = 0; hint < 2; hint++ ) {
+                t[hint] = min( t[hint], timeGetB( map, pos, dir, hint==1, sum[hint] ) );
+            }
+        }
+        cout << name[k] << " tracks: " << pos.size()/3 << " points, step " << ds << " mm" << endl;
+        cout << "  getB()           " << t[0] << " ns/call" << endl;
+        cout << "  getB() with hint " << t[1] << " ns/call" << endl;
+        cout << "  hidden latency   " << t[0]-t[1] << " ns/call ("
+             << 100.0*(t[0]-t[1])/t[0] << "%)" << endl;
+        if ( sum[0] != sum[1] ) cout << "  WARNING: results differ" << endl;
+    }
+    return 0;
+}
@@ -12,9 +12,8 @@ int main( int argc, char* argv[] )
 {
     TFile* rootfile = new TFile("checkH8.root","RECREATE");
     // create the map
-    ifstream input("mbps1-200-sourcex4.data");
     BFieldH8Map map;
-    map.readMap( input );
+    if ( map.readMap( "mbps1-200-sourcex4.data" ) ) return 1;
 
     TH2D* hBx = new TH2D("hBx","Bx",100,-2300,2300,100,-260,260);
     TH2D* hBy = new TH2D("hBy","By",100,-2300,2300,100,-260,260);
@@ -0,0 +1,252 @@
+// coarsenMap.cxx
+//
+// Measure how far the mesh of each zone of a toroid map could be coarsened
+// with tricubic interpolation, at the accuracy of trilinear interpolation on
+// the original mesh.
+//
+// The trilinear error of the original mesh is estimated at the centres of its
+// bins, as the difference from tricubic interpolation on the same mesh.  Each
+// coarser mesh keeps every k-th mesh line along each axis (kz, kr, kphi = 1 to
+// kmax), plus the last one.  Its tricubic error is measured at the original
+// nodes, where the field is known, and at the bin centres, against tricubic
+// on the original mesh.  The coarsest mesh whose error does not exceed the
+// trilinear one is kept.  Conductors are not included: they are the same
+// with any mesh.
+//
+#include "BFieldMap.h"
+#include "BFieldThreadPool.h"
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+using namespace std;
+
+void usage()
+{
+    cout << "usage: coarsenMap [-k <kmax>] [-s <nsample>] [-j <nthread>] <mapfile>" << endl;
+    cout << "    <kmax>    largest coarsening factor per axis (default 4)" << endl;
+    cout << "    <nsample> bin centres and nodes sampled per zone (default 2000 each)" << endl;
+}
+
+// result for one zone
+struct Coarsening {
+    int n[3];            // original number of mesh lines in z, r, phi
+    int k[3];            // coarsening factors chosen
+    int ncoarse[3];      // resulting number of mesh lines
+    double trilinear;    // max trilinear error on the original mesh (kT)
+    double tricubic;     // max tricubic error on the coarse mesh (kT)
+    size_t memory[2];    // bytes: original (trilinear), coarse (tricubic)
+};
+
+//
+// Field (Bx,By,Bz) of a zone at (z,r,phi), without the conductors
+//
+void
+zoneB( const BFieldZone& zone, double z, double r, double phi, BFieldCache& cache, double *B )
+{
+    if ( !cache.inside( z, r, phi ) ) zone.getCache( z, r, phi, cache );
+    cache.getB( z, r, phi, B );
+}
+
+//
+// Mesh lines kept when coarsening by k: every k-th one, and the last one
+//
+vector<int>
+keep( int n, int k )
+{
+    vector<int> index;
+    for ( int i = 0; i < n-1; i += k ) index.push_back( i );
+    index.push_back( n-1 );
+    return index;
+}
+
+//
+// Make the zone coarsened by k[3], with tricubic interpolation
+//
+BFieldZone
+coarsen( const BFieldZone& zone, const int *k )
+{
+    BFieldZone coarse( zone.id(), zone.zmin(), zone.zmax(), zone.rmin(), zone.rmax(),
+                       zone.phimin(), zone.phimax(), zone.bscale() );
+    vector<int> index[3];
+    int n[3];
+    for ( int j = 0; j < 3; j++ ) {
+        n[j] = zone.nmesh(j);
+        index[j] = keep( n[j], k[j] );
+        for ( unsigned i = 0; i < index[j].size(); i++ ) coarse.appendMesh( j, zone.mesh( j, index[j][i] ) );
+    }
+    coarse.reserve( index[0].size(), index[1].size(), index[2].size() );
+    for ( unsigned iz = 0; iz < index[0].size(); iz++ ) {
+        for ( unsigned ir = 0; ir < index[1].size(); ir++ ) {
+            for ( unsigned iphi = 0; iphi < index[2].size(); iphi++ ) {
+                coarse.appendField( zone.field( ( index[0][iz]*n[1] + index[1][ir] )*n[2] + index[2][iphi] ) );
+            }
+        }
+    }
+    coarse.buildLUT();
+    coarse.buildTricubic();
+    return coarse;
+}
+
+//
+// Find the coarsest mesh of one zone at the trilinear accuracy of the original
+//
+Coarsening
+measure( const BFieldZone& zone, int kmax, int nsample )
+{
+    Coarsening result;
+    for ( int j = 0; j < 3; j++ ) {
+        result.n[j] = zone.nmesh(j);
+        result.k[j] = 1;
+        result.ncoarse[j] = result.n[j];
+    }
+    // sample the bin centres and the nodes, with a generator of our own since
+    // the zones are measured in parallel
+    unsigned short seed[3] = { 1, 2, (unsigned short)zone.id() };
+    vector<double> centre( 3*nsample ), node( 3*nsample ), Bnode( 3*nsample );
+    for ( int i = 0; i < nsample; i++ ) {
+        int ic[3], in[3];
+        for ( int j = 0; j < 3; j++ ) {
+            ic[j] = int( erand48( seed )*( result.n[j]-1 ) );
+            in[j] = int( erand48( seed )*result.n[j] );
+            centre[3*i+j] = 0.5*( zone.mesh( j, ic[j] ) + zone.mesh( j, ic[j]+1 ) );
+            node[3*i+j] = zone.mesh( j, in[j] );
+        }
+        // the field at a node, rotated to (Bx,By,Bz) as the interpolation returns it
+        const BFieldVector<short>& f = zone.field( ( in[0]*result.n[1] + in[1] )*result.n[2] + in[2] );
+        double c = cos( node[3*i+2] ), s = sin( node[3*i+2] );
+        Bnode[3*i]   = zone.bscale()*( f.r()*c - f.phi()*s );
+        Bnode[3*i+1] = zone.bscale()*( f.r()*s + f.phi()*c );
+        Bnode[3*i+2] = zone.bscale()*f.z();
+    }
+    // trilinear error on the original mesh, and tricubic reference at the centres
+    BFieldZone fine( zone );
+    fine.buildTricubic();
+    vector<double> Bcentre( 3*nsample );
+    BFieldCache cache, cacheFine;
+    result.trilinear = 0.0;
+    for ( int i = 0; i < nsample; i++ ) {
+        const double* p = &centre[3*i];
+        double B[3];
+        zoneB( zone, p[0], p[1], p[2], cache, B );
+        zoneB( fine, p[0], p[1], p[2], cacheFine, &Bcentre[3*i] );
+        for ( int j = 0; j < 3; j++ ) result.trilinear = max( result.trilinear, abs( B[j]-Bcentre[3*i+j] ) );
+    }
+    result.tricubic = result.trilinear;
+    result.memory[0] = result.memory[1] = zone.memory();
+    // try all the coarser meshes
+    int k[3];
+    for ( k[0] = 1; k[0] <= kmax; k[0]++ ) {
+        for ( k[1] = 1; k[1] <= kmax; k[1]++ ) {
+            for ( k[2] = 1; k[2] <= kmax; k[2]++ ) {
+                // at least 3 mesh lines are needed for the derivatives
+                bool ok = ( k[0]*k[1]*k[2] > 1 );
+                int nc[3];
+                for ( int j = 0; j < 3 && ok; j++ ) {
+                    nc[j] = keep( result.n[j], k[j] ).size();
+                    if ( k[j] > 1 && nc[j] < 3 ) ok = false;
+                }
+                if ( !ok ) continue;
+                size_t memory = size_t( nc[0] )*nc[1]*nc[2]*8*sizeof(BFieldVector<short>);
+                if ( memory >= result.memory[1] ) continue;
+                BFieldZone coarse = coarsen( zone, k );
+                BFieldCache cc;
+                double maxerr( 0.0 );
+                for ( int i = 0; i < nsample && maxerr <= result.trilinear; i++ ) {
+                    double B[3];
+                    zoneB( coarse, centre[3*i], centre[3*i+1], centre[3*i+2], cc, B );
+                    for ( int j = 0; j < 3; j++ ) maxerr = max( maxerr, abs( B[j]-Bcentre[3*i+j] ) );
+                    zoneB( coarse, node[3*i], node[3*i+1], node[3*i+2], cc, B );
+                    for ( int j = 0; j < 3; j++ ) maxerr = max( maxerr, abs( B[j]-Bnode[3*i+j] ) );
+                }
+                if ( maxerr > result.trilinear ) continue;
+                for ( int j = 0; j < 3; j++ ) {
+                    result.k[j] = k[j];
+                    result.ncoarse[j] = nc[j];
+                }
+                result.tricubic = maxerr;
+                result.memory[1] = memory;
+            }
+        }
+    }
+    return result;
+}
+
+//
+// Time getB() at random points in the map, in ns per call
+//
+double
+timeGetB( const BFieldMap& map, int npoint )
+{
+    srand48( 1 );
+    vector<double> xyz( 3*npoint );
+    for ( int i = 0; i < npoint; i++ ) {
+        double r = 14000.*sqrt( drand48() );
+        double phi = 2.0*M_PI*drand48();
+        xyz[3*i] = r*cos(phi);
+        xyz[3*i+1] = r*sin(phi);
+        xyz[3*i+2] = 46000.*drand48() - 23000.;
+    }
+    BFieldCache cache;
+    double sum( 0.0 );
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    for ( int i = 0; i < npoint; i++ ) {
+        double B[3];
+        map.getB( &xyz[3*i], B, 0, cache );
+        sum += B[0];
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    if ( sum == 1e30 ) cout << sum; // keep the loop
+    return chrono::duration<double,nano>(t1-t0).count()/npoint;
+}
+
+int main( int argc, char** argv )
+{
+    int kmax = 4;
+    int nsample = 2000;
+    int nthread = 0;
+    int iarg = 1;
+    for ( ; iarg < argc-1; iarg += 2 ) {
+        if ( strcmp( argv[iarg], "-k" ) == 0 ) kmax = atoi( argv[iarg+1] );
+        else if ( strcmp( argv[iarg], "-s" ) == 0 ) nsample = atoi( argv[iarg+1] );
+        else if ( strcmp( argv[iarg], "-j" ) == 0 ) nthread = atoi( argv[iarg+1] );
+        else break;
+    }
+    if ( argc-iarg != 1 || kmax < 1 || nsample <= 0 ) {
+        usage();
+        return 1;
+    }
+    BFieldMap map;
+    cout << "Reading the map from " << argv[iarg] << endl;
+    if ( map.readMap( argv[iarg] ) ) return 1;
+
+    BFieldThreadPool pool( nthread );
+    vector<Coarsening> result( map.nzone() );
+    pool.run( map.nzone(), [&]( int i, int ) {
+        result[i] = measure( map.zone(i), kmax, nsample );
+    } );
+
+    cout << "  zone      mesh (z x r x phi)     factors   trilinear err   tricubic err    memory (kB)" << endl;
+    size_t memory[2] = { 0, 0 };
+    for ( int i = 0; i < map.nzone(); i++ ) {
+        const Coarsening& c = result[i];
+        printf( "%6d  %4d x %4d x %4d -> %4d x %4d x %4d  %d %d %d  %10.3g T  %10.3g T  %8.1f -> %8.1f\n",
+                map.zone(i).id(), c.n[0], c.n[1], c.n[2], c.ncoarse[0], c.ncoarse[1], c.ncoarse[2],
+                c.k[0], c.k[1], c.k[2], 1000.*c.trilinear, 1000.*c.tricubic,
+                c.memory[0]/1024., c.memory[1]/1024. );
+        memory[0] += c.memory[0];
+        memory[1] += c.memory[1];
+    }
+    cout << "field memory: " << memory[0]/1024. << " kB trilinear, " << memory[1]/1024.
+         << " kB tricubic on the coarsened meshes (x" << double(memory[1])/memory[0] << ")" << endl;
+    // cost per call on the original mesh
+    const int npoint = 1000000;
+    double t[2];
+    t[0] = timeGetB( map, npoint );
+    map.setTricubic( true );
+    t[1] = timeGetB( map, npoint );
+    cout << "getB(): " << t[0] << " ns/call trilinear, " << t[1] << " ns/call tricubic" << endl;
+    return 0;
+}
@@ -5,16 +5,20 @@
 #include "BFieldMap.h"
 #include "BFieldSolenoid.h"
 #include <fstream>
+#include <string>
 #include "TFile.h"
 using namespace std;
 
 void usage()
 {
-    cout << "usage: combineMaps <toroidmap> [<solenoidmap>] <combinedmap>" << endl;
+    cout << "usage: combineMaps [-d] <toroidmap> [<solenoidmap>] <combinedmap>" << endl;
     cout << "    <toroidmap>   can be bmagatlas_09_fullAsym20400.data" << endl;
     cout << "    <solenoidmap> can be map7730bes2.grid" << endl;
     cout << "    <combinedmap> can be BFieldMap_FullAsym_20400.root" << endl;
     cout << "If <solenoidmap> is missing, simply convert <toroidmap> to <combinedmap>" << endl;
+    cout << "With -d, the moved and tilted solenoid map is written in double precision" << endl;
+    cout << "as a separate BFieldSolenoid tree, to be used through BFieldComposite," << endl;
+    cout << "instead of being appended to the toroid map as a zone of shorts" << endl;
 }
 
 int main( int argc, char** argv )
@@ -22,8 +26,14 @@ int main( int argc, char** argv )
     const char* toroidmap(0);
     const char* solenoidmap(0);
     const char* rootname(0);
+    bool separate(false);
 
     // check parameters
+    if ( argc > 1 && string( argv[1] ) == "-d" ) {
+        separate = true;
+        argc--;
+        argv++;
+    }
     if ( argc == 4 ) {
         toroidmap = argv[1];
         solenoidmap = argv[2];
@@ -43,16 +53,19 @@ int main( int argc, char** argv )
     map.readMap( input );
     input.close();
 
+    BFieldSolenoid solenoid;
     if ( solenoidmap ) {
         // read the solenoid map from ASCII
         cout << "Reading the map from " << solenoidmap << endl;
         ifstream input2( solenoidmap );
-        BFieldSolenoid solenoid;
         solenoid.readMap( input2 );
         input2.close();
 
         // move and tilt the solenoid
         solenoid.moveMap( 0.0, 1.6, 0.0, 0.55e-3, -0.53e-3 );
+    }
+
+    if ( solenoidmap && !separate ) {
         const BFieldMesh<double> *tilted = solenoid.tiltedMap();
 
         // create a zone that represents the solenoid
@@ -80,6 +93,7 @@ int main( int argc, char** argv )
     cout << "Writing the map to " << rootname << endl;
     TFile* rootfile = new TFile( rootname, "RECREATE" );
     map.writeMap( rootfile );
+    if ( solenoidmap && separate ) solenoid.writeMap( rootfile, true );
     rootfile->Close();
 
     return 0;
@@ -2,12 +2,13 @@
 
 // C++ standard libraries
 #include <iostream>
+#include <vector>
+#include <cmath>
 using namespace std;
 // ROOT libraries
 #include "TFile.h"
 #include "TTree.h"
 #include "TH2.h"
-#include "TF1.h"
 #include "TH1D.h"
 #include "TH2D.h"
 #include "TGraph.h"
@@ -17,43 +18,10 @@ using namespace std;
 #include "TStyle.h"
 // BField code
 #include "BFieldMap.h"
+#include "BFieldLineIntegral.h"
 
 const double PI(3.14159265358979);
 
-class BphiMap : public BFieldMap { // map with Bphi() function
-public:
-    BphiMap() : BFieldMap() {;}
-    double Bphi( double *x, double *p ) {
-        TVector3 pos;
-        pos.SetPtEtaPhi(x[0], p[0], p[1]);
-        double xyz[3], B[3];
-        pos.GetXYZ(xyz);
-        getB(xyz, B);
-        TVector3 field(B);
-        field.RotateZ(-p[1]);
-        return field.Y();
-    };
-};
-
-double
-IntBphi( TF1* fbphi, double eta, double phi )
-{
-    // range of integration
-    const double Rin(4300), Rout(12200), Zin(7100), Zout(15000);
-    double tantheta = tan(2.0*atan(exp(-eta)));
-    double Rstart(Rin);
-    if ( ( tantheta < Rin/Zin ) && ( tantheta > -Rin/Zin ) ) {
-        Rstart = abs(tantheta*Zin);
-    }
-    double Rend(Rout);
-    if ( ( tantheta < Rout/Zout ) && ( tantheta > -Rout/Zout ) ) {
-        Rend = abs(tantheta*Zout);
-    }
-    fbphi->SetParameter(0,eta);
-    fbphi->SetParameter(1,phi);
-    return fbphi->Integral( Rstart, Rend );
-}
-
 int
 main( int argc, const char* argv[] )
 {
@@ -62,16 +30,9 @@ main( int argc, const char* argv[] )
         return 1;
     }
     // maps
-    BphiMap* bmap = new BphiMap[2];
+    BFieldMap* bmap = new BFieldMap[2];
     if ( bmap[0].readMap(argv[1]) ) return 1;
     if ( bmap[1].readMap(argv[2]) ) return 1;
-    // Bphi of each map
-    TF1* fbphi[2];
-    fbphi[0] = new TF1( "fbphi0", bmap+0, &BphiMap::Bphi, 0.0, 14000.0, 2, "BphiMap", "Bphi" );
-    fbphi[1] = new TF1( "fbphi1", bmap+1, &BphiMap::Bphi, 0.0, 14000.0, 2, "BphiMap", "Bphi" );
-    for ( int i=0; i<2; i++ ) {
-        fbphi[i]->SetParameter(0,0.0); fbphi[i]->SetParameter(1,0.0); // eta and phi
-    }
 
     TFile* outputfile = new TFile("compIntBphi_out.root","RECREATE","comIntBphi output");
     //TH1::AddDirectory(false); // histograms will not belong to TDirectory
@@ -97,12 +58,20 @@ main( int argc, const char* argv[] )
         hIBphi[i]->SetYTitle("#phi");
         hIBphi[i]->SetStats(false);
     }
-    for ( int j=0; j<nbineta; j++ ) {
-        double eta = -2.7 + 5.4/nbineta*(j+0.5);
-        for ( int k=0; k<nbinphi; k++ ) {
-            double phi = -PI + 2*PI/nbinphi*(k+0.5);
-            for ( int i=0; i<2; i++ ) {
-                hIBphi[i]->Fill( eta, phi, IntBphi( fbphi[i], eta, phi ) );
+    // integrate on the (eta,phi) grid in parallel
+    // Int Bphi dl along the ray is converted to Int Bphi dR, with R transverse
+    BFieldThreadPool pool;
+    for ( int i=0; i<2; i++ ) {
+        BFieldLineIntegral integral( bmap+i );
+        vector<double> result;
+        integral.integrateGrid( nbineta, -2.7, 2.7, nbinphi, -PI, PI, 0.0, result, pool );
+        for ( int j=0; j<nbineta; j++ ) {
+            double eta = -2.7 + 5.4/nbineta*(j+0.5);
+            double sintheta = sin(2.0*atan(exp(-eta)));
+            for ( int k=0; k<nbinphi; k++ ) {
+                double phi = -PI + 2*PI/nbinphi*(k+0.5);
+                double value = result[(j*nbinphi+k)*BFieldLineIntegral::N+BFieldLineIntegral::Bphi];
+                hIBphi[i]->Fill( eta, phi, sintheta*value );
             }
         }
     }
@@ -0,0 +1,92 @@
+// compTracks.cxx
+//
+// Propagate muons from the interaction point to the outer surface of the
+// muon spectrometer through two field maps, and compare where they end up.
+//
+#include "BFieldMap.h"
+#include "BFieldPropagator.h"
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+using namespace std;
+
+void usage()
+{
+    cout << "usage: compTracks <map1> <map2> [<ntrack>] [<pT in GeV>] [<nthread>]" << endl;
+    cout << "    muons are generated uniformly in |eta| < 2.5 and phi, with both charges" << endl;
+}
+
+int main( int argc, char** argv )
+{
+    if ( argc < 3 || argc > 6 ) {
+        usage();
+        return 1;
+    }
+    int ntrack = ( argc > 3 ) ? atoi(argv[3]) : 10000;
+    double pt = ( argc > 4 ) ? atof(argv[4]) : 20.0;
+    int nthread = ( argc > 5 ) ? atoi(argv[5]) : 0;
+    BFieldMap map[2];
+    for ( int i = 0; i < 2; i++ ) {
+        cout << "Reading the map from " << argv[i+1] << endl;
+        if ( map[i].readMap( argv[i+1] ) ) return 1;
+    }
+    // outer surface of the muon spectrometer
+    const double rmax(12000.), zmax(21000.), smax(50000.);
+
+    // generate the muons
+    srand48( 1 );
+    vector<BFieldTrack> tracks[2];
+    for ( int i = 0; i < ntrack; i++ ) {
+        double eta = 5.0*drand48() - 2.5;
+        double phi = 2.0*M_PI*drand48() - M_PI;
+        double theta = 2.0*atan(exp(-eta));
+        double xyz[3] = { 0.0, 0.0, 0.0 };
+        double u[3] = { sin(theta)*cos(phi), sin(theta)*sin(phi), cos(theta) };
+        double qop = ( i%2 == 0 ? 1.0 : -1.0 )*sin(theta)/pt;
+        tracks[0].push_back( BFieldTrack( xyz, u, qop ) );
+    }
+    tracks[1] = tracks[0];
+
+    // propagate through both maps
+    BFieldThreadPool pool( nthread );
+    vector<int> status[2];
+    for ( int k = 0; k < 2; k++ ) {
+        BFieldPropagator prop( &map[k] );
+        chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        prop.propagate( tracks[k], status[k], rmax, zmax, smax, false, pool );
+        chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+        cout << "map " << k+1 << ": " << ntrack << " tracks in "
+             << chrono::duration<double>(t1-t0).count() << " s on " << pool.nthread() << " threads" << endl;
+    }
+
+    // compare the end points and directions
+    int n = 0;
+    double sumdx(0.), sumdx2(0.), maxdx(0.);
+    double sumda(0.), sumda2(0.), maxda(0.);
+    for ( int i = 0; i < ntrack; i++ ) {
+        if ( status[0][i] != BFieldPropagator::Surface || status[1][i] != BFieldPropagator::Surface ) continue;
+        const BFieldTrack& a = tracks[0][i];
+        const BFieldTrack& b = tracks[1][i];
+        double dx2(0.), dot(0.);
+        for ( int j = 0; j < 3; j++ ) {
+            dx2 += (a.pos[j]-b.pos[j])*(a.pos[j]-b.pos[j]);
+            dot += a.dir[j]*b.dir[j];
+        }
+        double dx = sqrt(dx2);
+        double da = acos( min( 1.0, dot ) )*1000.; // mrad
+        sumdx += dx; sumdx2 += dx*dx; maxdx = max( maxdx, dx );
+        sumda += da; sumda2 += da*da; maxda = max( maxda, da );
+        n++;
+    }
+    if ( n == 0 ) {
+        cout << "no track reached the surface in both maps" << endl;
+        return 1;
+    }
+    cout << n << " tracks at pT = " << pt << " GeV reached the surface in both maps" << endl;
+    cout << "  position difference  mean " << sumdx/n << " rms " << sqrt(sumdx2/n)
+         << " max " << maxdx << " mm" << endl;
+    cout << "  direction difference mean " << sumda/n << " rms " << sqrt(sumda2/n)
+         << " max " << maxda << " mrad" << endl;
+    return 0;
+}
@@ -2,6 +2,10 @@
 
 // C++ standard libraries
 #include <iostream>
+#include <vector>
+#include <functional>
+#include <cstdlib>
+#include <cstring>
 using namespace std;
 // ROOT libraries
 #include "TFile.h"
@@ -13,10 +17,47 @@ using namespace std;
 #include "TStyle.h"
 // BField code
 #include "BFieldMap.h"
+#include "BFieldThreadPool.h"
 
 const double PI(3.14159265);
 
 BFieldMap* bmap;
+BFieldThreadPool* pool;
+
+//
+// Compare the two maps on an n x n grid of positions given by position(i,j,xyz).
+// Fills value[k][i*n+j] with |B1|, |B2|, |B1-B2| (in T) and |B1-B2|/|B1| (in %).
+// Rows are computed in parallel, each worker with its own caches and row buffer.
+//
+void
+scan( int n, const function<void(int,int,double*)>& position, vector<double> value[4] )
+{
+    for ( int k = 0; k < 4; k++ ) value[k].resize( n*n );
+    vector<BFieldCache> cache( 2*pool->nthread() );
+    pool->run( n, [&]( int i, int ithread ) {
+        vector<double> row( 4*n );
+        for ( int j = 0; j < n; j++ ) {
+            double pos[3];
+            position( i, j, pos );
+            TVector3 B[2];
+            for ( int k = 0; k < 2; k++ ) {
+                double BkT[3];
+                bmap[k].getB( pos, BkT, 0, cache[2*ithread+k] ); // in kT
+                B[k] = BkT;
+                B[k] *= 1000.; // in T
+            }
+            TVector3 deltaB = B[0] - B[1];
+            row[j] = B[0].Mag();
+            row[n+j] = B[1].Mag();
+            row[2*n+j] = deltaB.Mag();
+            row[3*n+j] = deltaB.Mag()/B[0].Mag()*100;
+        }
+        // merge the row into the shared buffers
+        for ( int k = 0; k < 4; k++ ) {
+            copy( row.begin()+k*n, row.begin()+(k+1)*n, value[k].begin()+i*n );
+        }
+    } );
+}
 
 void
 xyscan( TVirtualPad* pad, double maxr, double z = 0, int n = 1000 )
@@ -26,23 +67,19 @@ xyscan( TVirtualPad* pad, double maxr, double z = 0, int n = 1000 )
     TH2D* h_dB = new TH2D("h_dB","|B_{1} - B_{2}|;x (mm);y (mm)",n,-maxr,maxr,n,-maxr,maxr);
     TH2D* h_dBpc = new TH2D("h_dBpc","|B_{1} - B_{2}|/|B_{1}| (%);x (mm);y (mm)",n,-maxr,maxr,n,-maxr,maxr);
     h_B1->SetStats(0); h_B2->SetStats(0); h_dB->SetStats(0); h_dBpc->SetStats(0);
+    vector<double> value[4];
+    scan( n, [=]( int i, int j, double* pos ) {
+        pos[0] = (2.*(i+0.5)/n-1.)*maxr;
+        pos[1] = (2.*(j+0.5)/n-1.)*maxr;
+        pos[2] = z;
+    }, value );
     for ( int i = 0; i < n; i++ ) for ( int j = 0; j < n; j++ ) {
         double x = (2.*(i+0.5)/n-1.)*maxr;
         double y = (2.*(j+0.5)/n-1.)*maxr;
-        double pos[3];
-        pos[0] = x; pos[1] = y; pos[2] = z;
-        TVector3 B[2];
-        for ( int k = 0; k < 2; k++ ) {
-            double BkT[3];
-            bmap[k].getB( pos, BkT ); // in kT
-            B[k] = BkT;
-            B[k] *= 1000.; // in T
-        }
-        h_B1->Fill(x,y,B[0].Mag());
-        h_B2->Fill(x,y,B[1].Mag());
-        TVector3 deltaB = B[0] - B[1];
-        h_dB->Fill(x,y,deltaB.Mag());
-        h_dBpc->Fill(x,y,deltaB.Mag()/B[0].Mag()*100);
+        h_B1->Fill(x,y,value[0][i*n+j]);
+        h_B2->Fill(x,y,value[1][i*n+j]);
+        h_dB->Fill(x,y,value[2][i*n+j]);
+        h_dBpc->Fill(x,y,value[3][i*n+j]);
     }
     pad->Divide(1,4);
     pad->cd(1);
@@ -70,23 +107,19 @@ zrscan( TVirtualPad* pad, double maxz, double maxr, double phi = 0, int n = 1000
     TH2D* h_dB = new TH2D("h_dB","|B_{1} - B_{2}|;z (mm);r (mm)",n,-maxz,maxz,n,-maxr,maxr);
     TH2D* h_dBpc = new TH2D("h_dBpc","|B_{1} - B_{2}|/|B_{1}| (%);z (mm);r (mm)",n,-maxz,maxz,n,-maxr,maxr);
     h_B1->SetStats(0); h_B2->SetStats(0); h_dB->SetStats(0); h_dBpc->SetStats(0);
-    for ( int i = 0; i < n; i++ ) for ( int j = 0; j < n; j++ ) {
+    vector<double> value[4];
+    scan( n, [=]( int i, int j, double* pos ) {
         double z = (2.*(i+0.5)/n-1.)*maxz;
         double r = (2.*(j+0.5)/n-1.)*maxr;
-        double pos[3];
         pos[0] = cos(phi)*r; pos[1] = sin(phi)*r; pos[2] = z;
-        TVector3 B[2];
-        for ( int k = 0; k < 2; k++ ) {
-            double BkT[3];
-            bmap[k].getB( pos, BkT ); // in kT
-            B[k] = BkT;
-            B[k] *= 1000.; // in T
-        }
-        h_B1->Fill(z,r,B[0].Mag());
-        h_B2->Fill(z,r,B[1].Mag());
-        TVector3 deltaB = B[0] - B[1];
-        h_dB->Fill(z,r,deltaB.Mag());
-        h_dBpc->Fill(z,r,deltaB.Mag()/B[0].Mag()*100);
+    }, value );
+    for ( int i = 0; i < n; i++ ) for ( int j = 0; j < n; j++ ) {
+        double z = (2.*(i+0.5)/n-1.)*maxz;
+        double r = (2.*(j+0.5)/n-1.)*maxr;
+        h_B1->Fill(z,r,value[0][i*n+j]);
+        h_B2->Fill(z,r,value[1][i*n+j]);
+        h_dB->Fill(z,r,value[2][i*n+j]);
+        h_dBpc->Fill(z,r,value[3][i*n+j]);
     }
     pad->Divide(1,4);
     pad->cd(1);
@@ -114,23 +147,19 @@ zphiscan( TVirtualPad* pad, double maxz, double r = 4000, int n = 1000 )
     TH2D* h_dB = new TH2D("h_dB","|B_{1} - B_{2}|;z (mm);#phi (rad)",n,-maxz,maxz,n,0,2.*M_PI);
     TH2D* h_dBpc = new TH2D("h_dBpc","|B_{1} - B_{2}|/|B_{1}| (%);z (mm);#phi (rad)",n,-maxz,maxz,n,0,2.*M_PI);
     h_B1->SetStats(0); h_B2->SetStats(0); h_dB->SetStats(0); h_dBpc->SetStats(0);
-    for ( int i = 0; i < n; i++ ) for ( int j = 0; j < n; j++ ) {
+    vector<double> value[4];
+    scan( n, [=]( int i, int j, double* pos ) {
         double z = (2.*(i+0.5)/n-1.)*maxz;
         double phi = 2.*(j+0.5)/n*M_PI;
-        double pos[3];
         pos[0] = cos(phi)*r; pos[1] = sin(phi)*r; pos[2] = z;
-        TVector3 B[2];
-        for ( int k = 0; k < 2; k++ ) {
-            double BkT[3];
-            bmap[k].getB( pos, BkT ); // in kT
-            B[k] = BkT;
-            B[k] *= 1000.; // in T
-        }
-        h_B1->Fill(z,phi,B[0].Mag());
-        h_B2->Fill(z,phi,B[1].Mag());
-        TVector3 deltaB = B[0] - B[1];
-        h_dB->Fill(z,phi,deltaB.Mag());
-        h_dBpc->Fill(z,phi,deltaB.Mag()/B[0].Mag()*100);
+    }, value );
+    for ( int i = 0; i < n; i++ ) for ( int j = 0; j < n; j++ ) {
+        double z = (2.*(i+0.5)/n-1.)*maxz;
+        double phi = 2.*(j+0.5)/n*M_PI;
+        h_B1->Fill(z,phi,value[0][i*n+j]);
+        h_B2->Fill(z,phi,value[1][i*n+j]);
+        h_dB->Fill(z,phi,value[2][i*n+j]);
+        h_dBpc->Fill(z,phi,value[3][i*n+j]);
     }
     pad->Divide(1,4);
     pad->cd(1);
@@ -153,12 +182,22 @@ zphiscan( TVirtualPad* pad, double maxz, double r = 4000, int n = 1000 )
 int
 main( int argc, const char* argv[] )
 {
-    if ( argc != 3 ) {
-        cerr << "usage: compareMaps <map1> <map2>" << endl;
+    // options
+    int n = 500;     // number of bins along each axis of the scans
+    int nthread = 0; // all hardware threads
+    int iarg = 1;
+    for ( ; iarg < argc-2; iarg += 2 ) {
+        if ( strcmp( argv[iarg], "-n" ) == 0 ) n = atoi( argv[iarg+1] );
+        else if ( strcmp( argv[iarg], "-j" ) == 0 ) nthread = atoi( argv[iarg+1] );
+        else break;
+    }
+    if ( argc-iarg != 2 || n <= 0 ) {
+        cerr << "usage: compareMaps [-n <nbins>] [-j <nthreads>] <map1> <map2>" << endl;
         return 1;
     }
     TString mapfile[2];
-    for ( int i=0; i<2; i++ ) mapfile[i] = argv[i+1];
+    for ( int i=0; i<2; i++ ) mapfile[i] = argv[iarg+i];
+    pool = new BFieldThreadPool( nthread );
     bmap = new BFieldMap[2];
     for ( int i=0; i<2; i++ ) {
         if ( bmap[i].readMap(mapfile[i]) ) return 1;
@@ -176,11 +215,11 @@ main( int argc, const char* argv[] )
     TCanvas* c = new TCanvas("c",title,500*Ncol,1500*Nrow);
     c->Divide(Ncol,Nrow);
     /* x-y scan @ fixed z */
-    xyscan(c->GetPad(1),14000,0,500);
-    xyscan(c->GetPad(2),14000,10000,500);
+    xyscan(c->GetPad(1),14000,0,n);
+    xyscan(c->GetPad(2),14000,10000,n);
     /* z-r scan @ fixed phi */
-    zrscan(c->GetPad(3),15000,14000,0.21*M_PI,500); // sector 4-12
-    zrscan(c->GetPad(4),15000,14000,0.25*M_PI,500); // sector 5-13
+    zrscan(c->GetPad(3),15000,14000,0.21*M_PI,n); // sector 4-12
+    zrscan(c->GetPad(4),15000,14000,0.25*M_PI,n); // sector 5-13
     //zrscan(c->GetPad(3),3000,2000,0.375*M_PI,500); // sector 4-12
     //zrscan(c->GetPad(4),3000,2000,0.5*M_PI,500); // sector 5-13
     /* z-phi scan @ fixed r */
@@ -190,4 +229,5 @@ main( int argc, const char* argv[] )
     //  zrscan(c->GetPad(i+1),15000,14000,phi1+(phi2-phi1)*(double)i/(double)Ncol,500);
     //c->Print("compareMaps_phiFeetRegionScan.png");
     c->Print("compareMaps.png");
+    delete pool;
 }
@@ -0,0 +1,168 @@
+// convertMap.cxx
+//
+// Convert a toroid or solenoid map to the columnar ROOT format, with LZ4 or
+// ZSTD compression.  The converted map is read back and compared with the
+// input, and the time to read it is reported, for all zones and for the
+// zones of a region if one is given.
+//
+#include "BFieldMap.h"
+#include "BFieldSolenoid.h"
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <sys/stat.h>
+#include "TFile.h"
+using namespace std;
+
+void usage()
+{
+    cout << "usage: convertMap [-c lz4|zstd] [-s] [-r zmin zmax rmin rmax] <mapfile> <output.root>" << endl;
+    cout << "    -c  compression (default lz4)" << endl;
+    cout << "    -s  the map is a solenoid map, ASCII or ROOT" << endl;
+    cout << "    -r  also time the reading of the zones that overlap this region (mm, all phi)" << endl;
+}
+
+double
+seconds( chrono::steady_clock::time_point t0 )
+{
+    return chrono::duration<double>( chrono::steady_clock::now()-t0 ).count();
+}
+
+long long
+fileSize( const char* filename )
+{
+    struct stat st;
+    return ( stat( filename, &st ) == 0 ) ? (long long)st.st_size : -1;
+}
+
+//
+// true if two zones have the same range, mesh, field and conductors
+//
+bool
+sameZone( const BFieldZone& z1, const BFieldZone& z2 )
+{
+    if ( z1.id() != z2.id() || z1.bscale() != z2.bscale() || z1.ncond() != z2.ncond() ||
+         z1.nfield() != z2.nfield() ) return false;
+    for ( int j = 0; j < 3; j++ ) {
+        if ( z1.min(j) != z2.min(j) || z1.max(j) != z2.max(j) || z1.nmesh(j) != z2.nmesh(j) ) return false;
+        for ( unsigned i = 0; i < z1.nmesh(j); i++ ) if ( z1.mesh(j,i) != z2.mesh(j,i) ) return false;
+    }
+    for ( unsigned i = 0; i < z1.nfield(); i++ ) {
+        const BFieldVector<short>& f1 = z1.field(i);
+        const BFieldVector<short>& f2 = z2.field(i);
+        if ( f1.z() != f2.z() || f1.r() != f2.r() || f1.phi() != f2.phi() ) return false;
+    }
+    for ( unsigned i = 0; i < z1.ncond(); i++ ) {
+        const BFieldCond& c1 = z1.cond(i);
+        const BFieldCond& c2 = z2.cond(i);
+        if ( c1.finite() != c2.finite() || c1.curr() != c2.curr() ) return false;
+        for ( int j = 0; j < 3; j++ ) if ( c1.p1(j) != c2.p1(j) || c1.p2(j) != c2.p2(j) ) return false;
+    }
+    return true;
+}
+
+int
+convertSolenoid( const char* input, const char* output, int compression )
+{
+    BFieldSolenoid solenoid;
+    if ( strstr( input, ".root" ) != 0 ) {
+        TFile rootfile( input, "READ" );
+        if ( solenoid.readMap( &rootfile ) ) return 1;
+    } else {
+        ifstream textfile( input );
+        if ( !textfile.good() || solenoid.readMap( textfile ) ) return 1;
+    }
+    TFile* rootfile = new TFile( output, "RECREATE" );
+    solenoid.writeColumns( rootfile, false, compression );
+    rootfile->Close();
+    delete rootfile;
+    // read it back
+    BFieldSolenoid copy;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    TFile infile( output, "READ" );
+    if ( copy.readMap( &infile ) ) return 1;
+    double t = seconds( t0 );
+    const BFieldMesh<double>* m1 = solenoid.originalMap();
+    const BFieldMesh<double>* m2 = copy.originalMap();
+    bool same = ( m1->nfield() == m2->nfield() );
+    for ( unsigned i = 0; i < m1->nfield() && same; i++ ) {
+        same = ( m1->field(i).z() == m2->field(i).z() && m1->field(i).r() == m2->field(i).r() &&
+                 m1->field(i).phi() == m2->field(i).phi() );
+    }
+    cout << output << ": " << fileSize( output )/1024. << " kB, read in " << 1e3*t << " ms" << endl;
+    if ( !same ) {
+        cout << "ERROR: the map read back differs" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main( int argc, char** argv )
+{
+    int compression = BFieldMap::LZ4;
+    bool solenoid = false;
+    double region[6] = { 0.0, 0.0, 0.0, 0.0, -M_PI, M_PI };
+    bool useRegion = false;
+    int iarg = 1;
+    for ( ; iarg < argc-2; iarg++ ) {
+        if ( strcmp( argv[iarg], "-c" ) == 0 ) {
+            iarg++;
+            if ( strcmp( argv[iarg], "lz4" ) == 0 ) compression = BFieldMap::LZ4;
+            else if ( strcmp( argv[iarg], "zstd" ) == 0 ) compression = BFieldMap::ZSTD;
+            else compression = -1;
+        } else if ( strcmp( argv[iarg], "-s" ) == 0 ) {
+            solenoid = true;
+        } else if ( strcmp( argv[iarg], "-r" ) == 0 && iarg+4 < argc-2 ) {
+            for ( int j = 0; j < 4; j++ ) region[j] = atof( argv[++iarg] );
+            useRegion = true;
+        } else break;
+    }
+    if ( argc-iarg != 2 || compression < 0 ) {
+        usage();
+        return 1;
+    }
+    const char* input = argv[iarg];
+    const char* output = argv[iarg+1];
+    if ( solenoid ) return convertSolenoid( input, output, compression );
+
+    BFieldMap map;
+    cout << "Reading the map from " << input << endl;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    if ( map.readMap( input ) ) return 1;
+    double tread = seconds( t0 );
+    if ( map.nzone() == 0 ) {
+        cout << "no zones in " << input << endl;
+        return 1;
+    }
+    cout << "Writing the map to " << output << endl;
+    TFile* rootfile = new TFile( output, "RECREATE" );
+    map.writeColumns( rootfile, compression );
+    rootfile->Close();
+    delete rootfile;
+
+    // read it back, all of it and a region
+    BFieldMap copy;
+    t0 = chrono::steady_clock::now();
+    if ( copy.readMap( output ) ) return 1;
+    double tcopy = seconds( t0 );
+    int ndiff = ( copy.nzone() == map.nzone() ) ? 0 : map.nzone();
+    for ( int i = 0; i < map.nzone() && ndiff == 0; i++ ) ndiff += !sameZone( map.zone(i), copy.zone(i) );
+    printf( "%s: %.1f kB, read in %.1f ms\n", input, fileSize( input )/1024., 1e3*tread );
+    printf( "%s: %.1f kB, read in %.1f ms\n", output, fileSize( output )/1024., 1e3*tcopy );
+    if ( useRegion ) {
+        BFieldMap part;
+        t0 = chrono::steady_clock::now();
+        TFile infile( output, "READ" );
+        if ( part.readMap( &infile, region ) ) return 1;
+        printf( "  %d of %d zones overlap the region, read in %.1f ms\n", part.nzone(), map.nzone(),
+                1e3*seconds( t0 ) );
+    }
+    if ( ndiff > 0 ) {
+        cout << "ERROR: " << ndiff << " zones differ in the map read back" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+// diffMaps.cxx
+//
+// Compare two toroid maps zone by zone.  Zones with identical meshes are compared
+// at the mesh nodes, the others by sampling, and the per-zone summary is printed
+// and optionally written to a ROOT file.
+//
+#include "BFieldMap.h"
+#include "BFieldMapDiff.h"
+#include "BFieldThreadPool.h"
+#include <cstdlib>
+#include <cstring>
+#include "TFile.h"
+using namespace std;
+
+void usage()
+{
+    cout << "usage: diffMaps [-s <nsample>] [-j <nthread>] [-o <output.root>] <map1> <map2>" << endl;
+    cout << "    <nsample> sampling points per axis in zones whose meshes differ (default 20)" << endl;
+}
+
+int main( int argc, char** argv )
+{
+    int nsample = 20;
+    int nthread = 0;
+    const char* rootname(0);
+    int iarg = 1;
+    for ( ; iarg < argc-2; iarg += 2 ) {
+        if ( strcmp( argv[iarg], "-s" ) == 0 ) nsample = atoi( argv[iarg+1] );
+        else if ( strcmp( argv[iarg], "-j" ) == 0 ) nthread = atoi( argv[iarg+1] );
+        else if ( strcmp( argv[iarg], "-o" ) == 0 ) rootname = argv[iarg+1];
+        else break;
+    }
+    if ( argc-iarg != 2 || nsample <= 0 ) {
+        usage();
+        return 1;
+    }
+    BFieldMap map[2];
+    for ( int i = 0; i < 2; i++ ) {
+        cout << "Reading the map from " << argv[iarg+i] << endl;
+        if ( map[i].readMap( argv[iarg+i] ) ) return 1;
+    }
+
+    BFieldThreadPool pool( nthread );
+    BFieldMapDiff diff( &map[0], &map[1] );
+    diff.setSampling( nsample );
+    diff.compare( pool );
+    diff.print( cout );
+
+    if ( rootname ) {
+        cout << "Writing the differences to " << rootname << endl;
+        TFile* rootfile = new TFile( rootname, "RECREATE" );
+        diff.writeDiff( rootfile );
+        rootfile->Close();
+        delete rootfile;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+// fieldServer.cxx
+//
+// Serve the field of a map to the local processes, through BFieldServer.
+// Clients use BFieldClient; benchBFieldMap -client measures the round trips.
+//
+#include "BFieldService.h"
+#include <string>
+#include <cstdlib>
+#include <csignal>
+#include "TFile.h"
+using namespace std;
+
+BFieldServer* server(0);
+
+void stopServer( int )
+{
+    if ( server ) server->stop();
+}
+
+void usage()
+{
+    cout << "usage: fieldServer [-s <solenoidmap>] [-i <seconds>] <mapfile> [<socket>]" << endl;
+    cout << "    <mapfile>     toroid map, e.g. BFieldMap_FullAsym_20400.root" << endl;
+    cout << "    <solenoidmap> ROOT file with a BFieldSolenoid tree, as written by combineMaps -d" << endl;
+    cout << "    <socket>      Unix socket to listen on (default /tmp/bfieldServer.sock)" << endl;
+    cout << "With -i, print the statistics every <seconds> while there are requests" << endl;
+}
+
+int main( int argc, char** argv )
+{
+    const char* solenoidmap(0);
+    double interval(10.0);
+    int iarg = 1;
+    for ( ; iarg < argc-1 && argv[iarg][0] == '-'; iarg += 2 ) {
+        string opt( argv[iarg] );
+        if ( opt == "-s" ) solenoidmap = argv[iarg+1];
+        else if ( opt == "-i" ) interval = atof( argv[iarg+1] );
+        else break;
+    }
+    if ( argc - iarg < 1 || argc - iarg > 2 ) {
+        usage();
+        return 1;
+    }
+    const char* path = ( argc - iarg > 1 ) ? argv[iarg+1] : "/tmp/bfieldServer.sock";
+
+    BFieldMap map;
+    cout << "Reading the map from " << argv[iarg] << endl;
+    if ( map.readMap( argv[iarg] ) ) return 1;
+    BFieldSolenoid solenoid;
+    if ( solenoidmap ) {
+        cout << "Reading the solenoid map from " << solenoidmap << endl;
+        TFile rootfile( solenoidmap, "READ" );
+        if ( solenoid.readMap( &rootfile ) ) return 1;
+    }
+    BFieldComposite field( &map, solenoidmap ? &solenoid : 0 );
+
+    BFieldServer srv( field );
+    if ( srv.start( path ) ) return 1;
+    server = &srv;
+    signal( SIGINT, stopServer );
+    signal( SIGTERM, stopServer );
+    cout << "Serving on " << path << endl;
+    srv.run( interval );
+    server = 0;
+    srv.printStats( cout );
+    return 0;
+}
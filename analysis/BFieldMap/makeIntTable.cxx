@@ -0,0 +1,135 @@
+// makeIntTable.cxx
+//
+// Precompute Int Bphi dl and Int Btheta dl along straight rays from (0,0,z0)
+// on a grid of (eta, phi, z0) for a toroid map, and write them to a table
+// file for BFieldIntegralTable::lookup().
+// The table is then read back and checked against the direct integration
+// with BFieldLineIntegral at random points between the nodes, and the time
+// per lookup is compared with the time per integration.
+//
+#include "BFieldIntegralTable.h"
+#include "BFieldThreadPool.h"
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+using namespace std;
+
+void
+usage()
+{
+    cout << "usage: makeIntTable [-eta <n> <min> <max>] [-phi <n>] [-z0 <n> <min> <max>]" << endl;
+    cout << "                    [-range <rin> <rout> <zin> <zout>] [-j <nthread>] [-check <npoint>]" << endl;
+    cout << "                    <mapfile> <tablefile>" << endl;
+    cout << "    -eta    nodes in eta (default 109 from -2.7 to 2.7)" << endl;
+    cout << "    -phi    nodes in phi over 2pi (default 256)" << endl;
+    cout << "    -z0     nodes in z0, mm (default 5 from -200 to 200)" << endl;
+    cout << "    -range  integration range, mm (default the muon spectrometer, see BFieldLineIntegral)" << endl;
+    cout << "    -check  random points compared with the direct integration (default 2000)" << endl;
+}
+
+double
+seconds( chrono::steady_clock::time_point t0 )
+{
+    return chrono::duration<double>( chrono::steady_clock::now()-t0 ).count();
+}
+
+int main( int argc, char** argv )
+{
+    int neta = 109, nphi = 256, nz0 = 5;
+    double etamin = -2.7, etamax = 2.7, z0min = -200., z0max = 200.;
+    double range[4] = { 0.0, 0.0, 0.0, 0.0 };
+    bool setRange = false;
+    int nthread = 0;
+    int ncheck = 2000;
+    int iarg = 1;
+    for ( ; iarg < argc-2 && argv[iarg][0] == '-'; iarg++ ) {
+        if ( strcmp( argv[iarg], "-eta" ) == 0 && iarg+3 < argc-2 ) {
+            neta = atoi( argv[++iarg] );
+            etamin = atof( argv[++iarg] );
+            etamax = atof( argv[++iarg] );
+        } else if ( strcmp( argv[iarg], "-phi" ) == 0 ) {
+            nphi = atoi( argv[++iarg] );
+        } else if ( strcmp( argv[iarg], "-z0" ) == 0 && iarg+3 < argc-2 ) {
+            nz0 = atoi( argv[++iarg] );
+            z0min = atof( argv[++iarg] );
+            z0max = atof( argv[++iarg] );
+        } else if ( strcmp( argv[iarg], "-range" ) == 0 && iarg+4 < argc-2 ) {
+            for ( int i = 0; i < 4; i++ ) range[i] = atof( argv[++iarg] );
+            setRange = true;
+        } else if ( strcmp( argv[iarg], "-j" ) == 0 ) {
+            nthread = atoi( argv[++iarg] );
+        } else if ( strcmp( argv[iarg], "-check" ) == 0 ) {
+            ncheck = atoi( argv[++iarg] );
+        } else break;
+    }
+    if ( argc-iarg != 2 || neta < 1 || nphi < 1 || nz0 < 1 ) {
+        usage();
+        return 1;
+    }
+    const char* mapfile = argv[iarg];
+    const char* tablefile = argv[iarg+1];
+
+    BFieldMap map;
+    cout << "Reading the map from " << mapfile << endl;
+    if ( map.readMap( mapfile ) ) return 1;
+    BFieldLineIntegral integral( &map );
+    if ( setRange ) integral.setRange( range[0], range[1], range[2], range[3] );
+    BFieldThreadPool pool( nthread );
+
+    // fill and write the table
+    BFieldIntegralTable table;
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    table.fill( integral, neta, etamin, etamax, nphi, nz0, z0min, z0max, pool );
+    double tfill = seconds( t0 );
+    if ( table.write( tablefile ) ) return 1;
+    printf( "%d x %d x %d nodes in (eta, phi, z0) filled in %.2f s on %d threads, %.1f kB written to %s\n",
+            table.neta(), table.nphi(), table.nz0(), tfill, pool.nthread(), table.memory()/1024., tablefile );
+
+    // read it back, and compare with the direct integration at random points
+    BFieldIntegralTable lookup;
+    if ( lookup.read( tablefile ) ) return 1;
+    if ( ncheck <= 0 ) return 0;
+    srand48( 1 );
+    vector<double> point( 3*ncheck );
+    for ( int i = 0; i < ncheck; i++ ) {
+        point[3*i] = etamin + ( etamax-etamin )*drand48();
+        point[3*i+1] = 2.0*M_PI*drand48() - M_PI;
+        point[3*i+2] = z0min + ( z0max-z0min )*drand48();
+    }
+    vector<double> direct( BFieldIntegralTable::N*ncheck ), interpolated( BFieldIntegralTable::N*ncheck );
+    BFieldCache cache;
+    t0 = chrono::steady_clock::now();
+    for ( int i = 0; i < ncheck; i++ ) {
+        double I[BFieldLineIntegral::N];
+        integral.integrate( point[3*i], point[3*i+1], point[3*i+2], I, cache );
+        direct[BFieldIntegralTable::N*i+BFieldIntegralTable::Bphi] = I[BFieldLineIntegral::Bphi];
+        direct[BFieldIntegralTable::N*i+BFieldIntegralTable::Btheta] = I[BFieldLineIntegral::Btheta];
+    }
+    double tdirect = seconds( t0 );
+    // repeat the lookups to time them
+    const int nrepeat = 100;
+    t0 = chrono::steady_clock::now();
+    for ( int k = 0; k < nrepeat; k++ ) {
+        for ( int i = 0; i < ncheck; i++ ) {
+            lookup.lookup( point[3*i], point[3*i+1], point[3*i+2], &interpolated[BFieldIntegralTable::N*i] );
+        }
+    }
+    double tlookup = seconds( t0 )/nrepeat;
+    const char* name[BFieldIntegralTable::N] = { "Int Bphi dl  ", "Int Btheta dl" };
+    for ( int k = 0; k < BFieldIntegralTable::N; k++ ) {
+        double maxd( 0.0 ), sumd2( 0.0 ), sum2( 0.0 );
+        for ( int i = 0; i < ncheck; i++ ) {
+            double d = interpolated[BFieldIntegralTable::N*i+k] - direct[BFieldIntegralTable::N*i+k];
+            maxd = max( maxd, abs( d ) );
+            sumd2 += d*d;
+            sum2 += pow( direct[BFieldIntegralTable::N*i+k], 2 );
+        }
+        printf( "%s: table - direct rms %.3g T m (%.2g%% of rms), max %.3g T m\n", name[k], sqrt( sumd2/ncheck ),
+                ( sum2 > 0.0 ) ? 100.0*sqrt( sumd2/sum2 ) : 0.0, maxd );
+    }
+    printf( "direct %.1f us/ray, lookup %.1f ns/ray\n", 1e6*tdirect/ncheck, 1e9*tlookup/ncheck );
+    return 0;
+}
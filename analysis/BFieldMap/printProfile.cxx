@@ -0,0 +1,124 @@
+// printProfile.cxx
+//
+// Print the latency histograms written by BFieldProfiler::dump().
+//
+// For each profiler in the file, the quantiles of the time per getB() call
+// are printed for all calls, then for each zone, separately for the calls
+// that hit the cached bin and for those that had to load a new bin.  The
+// zones are sorted by the 99% quantile of the misses, so the zones with the
+// longest tails come first.
+//
+#include "BFieldProfiler.h"
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+using namespace std;
+
+void
+usage()
+{
+    cout << "usage: printProfile [-n <nzone>] [-h] <dumpfile>" << endl;
+    cout << "    <nzone> zones printed per profiler, with the longest tails first (default 20, 0 for all)" << endl;
+    cout << "    -h      print the histograms of all calls too" << endl;
+}
+
+//
+// Quantiles of one histogram in ns
+//
+void
+printQuantiles( const BFieldProfiler& prof, int zone, bool hit )
+{
+    unsigned long n = prof.entries( zone, hit );
+    if ( n == 0 ) {
+        printf( " %9s %7s %7s %7s %8s", "-", "", "", "", "" );
+        return;
+    }
+    double ns = 1.0/prof.cyclesPerNs();
+    printf( " %9lu %7.0f %7.0f %7.0f %8.0f", n, ns*prof.quantile( zone, hit, 0.5 ),
+            ns*prof.quantile( zone, hit, 0.9 ), ns*prof.quantile( zone, hit, 0.99 ),
+            ns*prof.quantile( zone, hit, 0.999 ) );
+}
+
+//
+// Histogram of all calls, hits and misses side by side
+//
+void
+printHistogram( const BFieldProfiler& prof )
+{
+    double ns = 1.0/prof.cyclesPerNs();
+    unsigned long n[2] = { prof.entries( -1, false ), prof.entries( -1, true ) };
+    printf( "    %-19s %22s %22s\n", "ns", "miss", "hit" );
+    for ( int k = 0; k < BFieldProfiler::nbin; k++ ) {
+        unsigned long miss = prof.bin( -1, false, k ), hit = prof.bin( -1, true, k );
+        if ( miss == 0 && hit == 0 ) continue;
+        printf( "    %8.1f - %8.1f %12lu %8.4f%% %12lu %8.4f%%\n", ns*BFieldProfiler::binEdge( k ),
+                ns*BFieldProfiler::binEdge( k+1 ), miss, n[0] ? 100.*miss/n[0] : 0.0,
+                hit, n[1] ? 100.*hit/n[1] : 0.0 );
+    }
+}
+
+void
+print( const BFieldProfiler& prof, int nprint, bool histogram )
+{
+    printf( "%s: %d zones, %.3g of the calls timed, %.3f cycles/ns\n",
+            prof.name().empty() ? "profile" : prof.name().c_str(), prof.nzone(), prof.fraction(),
+            prof.cyclesPerNs() );
+    printf( "  zone  ncond   %42s   %42s\n", "hit (calls, ns at 50 90 99 99.9%)", "miss (calls, ns at 50 90 99 99.9%)" );
+    printf( "  %-4s %6s  ", "all", "" );
+    printQuantiles( prof, -1, true );
+    printf( "  " );
+    printQuantiles( prof, -1, false );
+    printf( "\n" );
+    // zones with entries, longest tail of the misses first
+    vector< pair<double,int> > order;
+    for ( int i = 0; i <= prof.nzone(); i++ ) {
+        if ( prof.entries( i, false ) + prof.entries( i, true ) == 0 ) continue;
+        order.push_back( make_pair( -prof.quantile( i, false, 0.99 ), i ) );
+    }
+    sort( order.begin(), order.end() );
+    if ( nprint <= 0 || nprint > int(order.size()) ) nprint = order.size();
+    for ( int j = 0; j < nprint; j++ ) {
+        int i = order[j].second;
+        if ( i < prof.nzone() ) printf( "  %4d %6d  ", prof.id(i), prof.ncond(i) );
+        else printf( "  %-11s  ", "outside" );
+        printQuantiles( prof, i, true );
+        printf( "  " );
+        printQuantiles( prof, i, false );
+        printf( "\n" );
+    }
+    if ( nprint < int(order.size()) ) printf( "  ... %d more zones\n", int(order.size())-nprint );
+    if ( histogram ) printHistogram( prof );
+}
+
+int main( int argc, char** argv )
+{
+    int nprint = 20;
+    bool histogram = false;
+    int iarg = 1;
+    for ( ; iarg < argc-1; iarg++ ) {
+        if ( strcmp( argv[iarg], "-n" ) == 0 && iarg < argc-2 ) nprint = atoi( argv[++iarg] );
+        else if ( strcmp( argv[iarg], "-h" ) == 0 ) histogram = true;
+        else break;
+    }
+    if ( argc-iarg != 1 ) {
+        usage();
+        return 1;
+    }
+    ifstream in( argv[iarg] );
+    if ( !in.good() ) {
+        cerr << "printProfile: failed to open " << argv[iarg] << endl;
+        return 1;
+    }
+    // the file may hold several profilers, one after the other
+    int nread = 0;
+    while ( in >> ws && in.peek() != EOF ) {
+        BFieldProfiler prof;
+        if ( prof.read( in ) ) return 1;
+        if ( nread++ > 0 ) printf( "\n" );
+        print( prof, nprint, histogram );
+    }
+    return 0;
+}
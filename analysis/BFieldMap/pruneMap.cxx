@@ -0,0 +1,232 @@
+// pruneMap.cxx
+//
+// Make a smaller toroid map by removing mesh planes where the field is smooth.
+//
+// In each zone, the interior planes of the mesh in z, r and phi are removed
+// one at a time, as long as trilinear interpolation on the remaining mesh stays
+// within the tolerance of the original map at every sample point.  The sample
+// points are the nodes, the bin centres, and the centres of the bin faces and
+// edges of the original mesh.  A removal only changes the field between the
+// two neighbouring planes, so only the samples there are tested.  The passes
+// over the three axes are repeated until no plane can be removed.
+// The zones are pruned in parallel, and the conductors are kept as they are.
+//
+#include "BFieldMap.h"
+#include "BFieldThreadPool.h"
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include "TFile.h"
+using namespace std;
+
+void usage()
+{
+    cout << "usage: pruneMap [-t <tolerance in T>] [-j <nthread>] <mapfile> <output.root>" << endl;
+    cout << "    <tolerance> largest change of |B| allowed at the sample points (default 1e-4 T)" << endl;
+}
+
+//
+// Greedy removal of the mesh planes of one zone
+//
+class ZonePruner {
+public:
+    ZonePruner( const BFieldZone& zone, double tolerance );
+    // remove planes until none can be removed; returns the largest error (kT)
+    double prune();
+    // the pruned zone
+    BFieldZone zone() const;
+    // number of mesh planes left along axis a
+    int nkept( int a ) const { return m_kept[a].size(); }
+private:
+    // position along axis a of the sample with half-index h (node h/2, or the
+    // middle of the bin h/2 if h is odd)
+    double coord( int a, int h ) const
+    { return ( h%2 == 0 ) ? m_zone.mesh( a, h/2 ) : 0.5*( m_zone.mesh( a, h/2 ) + m_zone.mesh( a, h/2+1 ) ); }
+    // component j of the field at a node of the original mesh (raw units)
+    double field( int iz, int ir, int iphi, int j ) const
+    { return m_zone.field( ( iz*m_n[1] + ir )*m_n[2] + iphi )[j]; }
+    // squared error at the sample h[3], if the bin along axis a runs over planes lo - hi
+    double error2( const int *h, int a, int lo, int hi ) const;
+    // try to remove the kept plane p along axis a
+    bool tryRemove( int a, int p );
+    const BFieldZone& m_zone;
+    double m_tol2;              // squared tolerance (raw units)
+    int m_n[3];                 // original number of planes
+    std::vector<int> m_kept[3]; // original indices of the planes kept
+    std::vector<int> m_cell[3]; // for each original plane, the kept plane at or below it
+    double m_maxerr2;
+};
+
+ZonePruner::ZonePruner( const BFieldZone& zone, double tolerance )
+    : m_zone(zone), m_maxerr2(0.0)
+{
+    double tol = tolerance/zone.bscale();
+    m_tol2 = tol*tol;
+    for ( int a = 0; a < 3; a++ ) {
+        m_n[a] = zone.nmesh(a);
+        for ( int i = 0; i < m_n[a]; i++ ) {
+            m_kept[a].push_back( i );
+            m_cell[a].push_back( i );
+        }
+    }
+}
+
+//
+// Squared difference between the original and the pruned field at a sample.
+// The original field is trilinear on the original mesh, i.e. the mean of the
+// nodes around the sample.  Along axis a, the pruned bin is [lo,hi].
+//
+double
+ZonePruner::error2( const int *h, int a, int lo, int hi ) const
+{
+    int i0[3], i1[3];       // bins on the pruned mesh
+    double f[3];            // fractional position inside them
+    int j0[3], j1[3];       // nodes around the sample on the original mesh
+    for ( int b = 0; b < 3; b++ ) {
+        j0[b] = h[b]/2;
+        j1[b] = ( h[b]%2 == 0 ) ? j0[b] : j0[b]+1;
+        if ( b == a ) {
+            i0[b] = lo;
+            i1[b] = hi;
+        } else {
+            int p = m_cell[b][j0[b]];
+            if ( p == int(m_kept[b].size())-1 ) p--; // the last plane
+            i0[b] = m_kept[b][p];
+            i1[b] = m_kept[b][p+1];
+        }
+        double x0 = m_zone.mesh( b, i0[b] );
+        f[b] = ( coord( b, h[b] ) - x0 )/( m_zone.mesh( b, i1[b] ) - x0 );
+    }
+    double err2( 0.0 );
+    for ( int j = 0; j < 3; j++ ) {
+        double orig = 0.125*( field( j0[0], j0[1], j0[2], j ) + field( j0[0], j0[1], j1[2], j ) +
+                              field( j0[0], j1[1], j0[2], j ) + field( j0[0], j1[1], j1[2], j ) +
+                              field( j1[0], j0[1], j0[2], j ) + field( j1[0], j0[1], j1[2], j ) +
+                              field( j1[0], j1[1], j0[2], j ) + field( j1[0], j1[1], j1[2], j ) );
+        double gz = 1.0-f[0], gr = 1.0-f[1], gphi = 1.0-f[2];
+        double pruned = gz*( gr*( gphi*field( i0[0], i0[1], i0[2], j ) + f[2]*field( i0[0], i0[1], i1[2], j ) ) +
+                             f[1]*( gphi*field( i0[0], i1[1], i0[2], j ) + f[2]*field( i0[0], i1[1], i1[2], j ) ) ) +
+                        f[0]*( gr*( gphi*field( i1[0], i0[1], i0[2], j ) + f[2]*field( i1[0], i0[1], i1[2], j ) ) +
+                               f[1]*( gphi*field( i1[0], i1[1], i0[2], j ) + f[2]*field( i1[0], i1[1], i1[2], j ) ) );
+        err2 += ( pruned-orig )*( pruned-orig );
+    }
+    return err2;
+}
+
+//
+// Remove the kept plane p along axis a if the field between its neighbours
+// stays within the tolerance
+//
+bool
+ZonePruner::tryRemove( int a, int p )
+{
+    int lo = m_kept[a][p-1];
+    int hi = m_kept[a][p+1];
+    int b = (a+1)%3, c = (a+2)%3;
+    double maxerr2( 0.0 );
+    int h[3];
+    for ( h[a] = 2*lo+1; h[a] < 2*hi; h[a]++ ) {
+        for ( h[b] = 0; h[b] < 2*m_n[b]-1; h[b]++ ) {
+            for ( h[c] = 0; h[c] < 2*m_n[c]-1; h[c]++ ) {
+                double e2 = error2( h, a, lo, hi );
+                if ( e2 > m_tol2 ) return false;
+                maxerr2 = max( maxerr2, e2 );
+            }
+        }
+    }
+    m_kept[a].erase( m_kept[a].begin()+p );
+    for ( int i = m_kept[a][p-1]; i < hi; i++ ) m_cell[a][i] = p-1;
+    for ( int i = hi; i < m_n[a]; i++ ) m_cell[a][i]--;
+    m_maxerr2 = max( m_maxerr2, maxerr2 );
+    return true;
+}
+
+double
+ZonePruner::prune()
+{
+    bool removed = true;
+    while ( removed ) {
+        removed = false;
+        for ( int a = 0; a < 3; a++ ) {
+            for ( int p = 1; p < int(m_kept[a].size())-1; p++ ) {
+                if ( tryRemove( a, p ) ) removed = true;
+            }
+        }
+    }
+    return sqrt( m_maxerr2 )*m_zone.bscale();
+}
+
+BFieldZone
+ZonePruner::zone() const
+{
+    BFieldZone zone( m_zone.id(), m_zone.zmin(), m_zone.zmax(), m_zone.rmin(), m_zone.rmax(),
+                     m_zone.phimin(), m_zone.phimax(), m_zone.bscale() );
+    for ( int a = 0; a < 3; a++ ) {
+        for ( unsigned i = 0; i < m_kept[a].size(); i++ ) zone.appendMesh( a, m_zone.mesh( a, m_kept[a][i] ) );
+    }
+    zone.reserve( m_kept[0].size(), m_kept[1].size(), m_kept[2].size() );
+    for ( unsigned iz = 0; iz < m_kept[0].size(); iz++ ) {
+        for ( unsigned ir = 0; ir < m_kept[1].size(); ir++ ) {
+            for ( unsigned iphi = 0; iphi < m_kept[2].size(); iphi++ ) {
+                zone.appendField( m_zone.field( ( m_kept[0][iz]*m_n[1] + m_kept[1][ir] )*m_n[2] + m_kept[2][iphi] ) );
+            }
+        }
+    }
+    for ( unsigned i = 0; i < m_zone.ncond(); i++ ) zone.appendCond( m_zone.cond(i) );
+    return zone;
+}
+
+int main( int argc, char** argv )
+{
+    double tolerance = 1e-4; // T
+    int nthread = 0;
+    int iarg = 1;
+    for ( ; iarg < argc-2; iarg += 2 ) {
+        if ( strcmp( argv[iarg], "-t" ) == 0 ) tolerance = atof( argv[iarg+1] );
+        else if ( strcmp( argv[iarg], "-j" ) == 0 ) nthread = atoi( argv[iarg+1] );
+        else break;
+    }
+    if ( argc-iarg != 2 || tolerance <= 0.0 ) {
+        usage();
+        return 1;
+    }
+    BFieldMap map;
+    cout << "Reading the map from " << argv[iarg] << endl;
+    if ( map.readMap( argv[iarg] ) ) return 1;
+
+    // prune the zones in parallel
+    BFieldThreadPool pool( nthread );
+    vector<ZonePruner*> pruner( map.nzone() );
+    vector<double> maxerr( map.nzone() );
+    pool.run( map.nzone(), [&]( int i, int ) {
+        pruner[i] = new ZonePruner( map.zone(i), tolerance*1e-3 );
+        maxerr[i] = pruner[i]->prune();
+    } );
+
+    cout << "  zone      mesh (z x r x phi)                 max error    memory (kB)" << endl;
+    BFieldMap pruned;
+    size_t memory[2] = { 0, 0 };
+    for ( int i = 0; i < map.nzone(); i++ ) {
+        const BFieldZone& zone = map.zone(i);
+        BFieldZone newzone = pruner[i]->zone();
+        printf( "%6d  %4d x %4d x %4d -> %4d x %4d x %4d  %10.3g T  %8.1f -> %8.1f\n", zone.id(),
+                zone.nmesh(0), zone.nmesh(1), zone.nmesh(2), newzone.nmesh(0), newzone.nmesh(1), newzone.nmesh(2),
+                1000.*maxerr[i], zone.memory()/1024., newzone.memory()/1024. );
+        memory[0] += zone.memory();
+        memory[1] += newzone.memory();
+        pruned.appendZone( newzone );
+        delete pruner[i];
+    }
+    pruned.buildLUT();
+    cout << "field memory: " << memory[0]/1024. << " kB -> " << memory[1]/1024. << " kB (x"
+         << double(memory[1])/memory[0] << ")" << endl;
+
+    cout << "Writing the map to " << argv[iarg+1] << endl;
+    TFile* rootfile = new TFile( argv[iarg+1], "RECREATE" );
+    pruned.writeMap( rootfile );
+    rootfile->Close();
+    delete rootfile;
+    return 0;
+}
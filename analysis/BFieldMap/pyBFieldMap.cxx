@@ -0,0 +1,273 @@
+// pyBFieldMap.cxx
+//
+// Python bindings (pybind11) for batch evaluation of the field maps:
+//
+//     import bfieldmap
+//     toroid = bfieldmap.BFieldMap( "BFieldMap_FullAsym_20400.root" )
+//     B = toroid.getB( xyz )                     # xyz: (N,3) float64, B: (N,3)
+//     B, deriv = toroid.getB( xyz, deriv=True )  # deriv: (N,3,3)
+//
+// BFieldSolenoid, BFieldH8Map and BFieldComposite have the same getB().
+// BFieldIntegralTable gives the bending power of muons from a makeIntTable file:
+//     table = bfieldmap.BFieldIntegralTable( "intB.table" )
+//     I = table.lookup( eta, phi, z0 )           # (N,) arrays, I: (N,2) Int Bphi dl, Int Btheta dl
+// C-contiguous float64 arrays are used in place, other arrays are converted.
+// The GIL is released during the evaluation, and batches of more than
+// minParallel points are split across the threads of a BFieldThreadPool,
+// each with its own cache.  BFieldSolenoid.moveMap() keeps the GIL, but
+// replaces the moved map that getB() reads: it must not be called while getB()
+// of the same solenoid, or of a composite that uses it, runs in another thread.
+// Units: mm, kT.
+//
+// Built by the bfieldmap target of CMakeLists.txt (when pybind11 and ROOT are
+// found), which links the core library and the ROOT I/O:
+//     cmake -S . -B build && cmake --build build --target bfieldmap
+//
+#include "BFieldMap.h"
+#include "BFieldSolenoid.h"
+#include "BFieldH8Map.h"
+#include "BFieldComposite.h"
+#include "BFieldThreadPool.h"
+#include "BFieldIntegralTable.h"
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "TFile.h"
+using namespace std;
+namespace py = pybind11;
+
+typedef py::array_t<double, py::array::c_style | py::array::forcecast> Array;
+
+// batches below this size are evaluated on the calling thread
+const int minParallel = 4096;
+// points per task on the thread pool
+const int block = 1024;
+
+// thread pool shared by all the maps, made on first use.  Each call holds a
+// copy of the pointer, so that setThreads() only drops the pool in use and the
+// last call to finish with it deletes it.
+shared_ptr<BFieldThreadPool> pool;
+int poolThreads(0);
+mutex poolMutex;
+
+shared_ptr<BFieldThreadPool>
+getPool()
+{
+    lock_guard<mutex> lock( poolMutex );
+    if ( !pool ) pool.reset( new BFieldThreadPool( poolThreads ) );
+    return pool;
+}
+
+void
+setThreads( int nthread )
+{
+    lock_guard<mutex> lock( poolMutex );
+    poolThreads = nthread;
+    pool.reset();
+}
+
+//
+// Evaluate field.getB() at the N points of xyz (N,3), with a cache of type C
+// per thread.  Returns B (N,3), or (B, deriv (N,3,3)) if deriv is true.
+// A single point of shape (3,) gives B of shape (3,) and deriv (3,3).
+//
+template <class F, class C>
+py::object
+getB( const F& field, Array xyz, bool deriv )
+{
+    bool single = ( xyz.ndim() == 1 );
+    if ( !( ( single && xyz.shape(0) == 3 ) || ( xyz.ndim() == 2 && xyz.shape(1) == 3 ) ) ) {
+        throw invalid_argument( "getB(): xyz must have shape (N,3) or (3,)" );
+    }
+    const int n = single ? 1 : xyz.shape(0);
+    vector<py::ssize_t> shapeB, shapeD;
+    if ( single ) {
+        shapeB = { 3 };
+        shapeD = { 3, 3 };
+    } else {
+        shapeB = { n, 3 };
+        shapeD = { n, 3, 3 };
+    }
+    py::array_t<double> B( shapeB );
+    py::array_t<double> D( deriv ? shapeD : vector<py::ssize_t>{ 0 } );
+    const double* pxyz = xyz.data();
+    double* pB = B.mutable_data();
+    double* pD = deriv ? D.mutable_data() : 0;
+    {
+        py::gil_scoped_release release;
+        if ( n < minParallel ) {
+            C cache;
+            for ( int i = 0; i < n; i++ ) field.getB( &pxyz[3*i], &pB[3*i], pD ? &pD[9*i] : 0, cache );
+        } else {
+            shared_ptr<BFieldThreadPool> threads = getPool();
+            vector<C> cache( threads->nthread() );
+            threads->run( ( n+block-1 )/block, [&]( int ib, int ithread ) {
+                int iend = min( n, ( ib+1 )*block );
+                for ( int i = ib*block; i < iend; i++ ) {
+                    field.getB( &pxyz[3*i], &pB[3*i], pD ? &pD[9*i] : 0, cache[ithread] );
+                }
+            } );
+        }
+    }
+    if ( deriv ) return py::make_tuple( B, D );
+    return B;
+}
+
+//
+// Look up the integrals for the N muons of eta, phi, z0 (N,).  Returns I (N,2),
+// or (2,) for scalars.
+//
+py::object
+lookupIntegral( const BFieldIntegralTable& table, Array eta, Array phi, Array z0 )
+{
+    const py::ssize_t n = eta.size();
+    if ( eta.ndim() > 1 || phi.ndim() != eta.ndim() || z0.ndim() != eta.ndim() ||
+         phi.size() != n || z0.size() != n ) {
+        throw invalid_argument( "lookup(): eta, phi and z0 must be scalars or (N,) arrays of the same size" );
+    }
+    vector<py::ssize_t> shape;
+    if ( eta.ndim() == 1 ) shape.push_back( n );
+    shape.push_back( BFieldIntegralTable::N );
+    py::array_t<double> I( shape );
+    const double* peta = eta.data();
+    const double* pphi = phi.data();
+    const double* pz0 = z0.data();
+    double* pI = I.mutable_data();
+    {
+        py::gil_scoped_release release;
+        for ( py::ssize_t i = 0; i < n; i++ ) {
+            table.lookup( peta[i], pphi[i], pz0[i], &pI[BFieldIntegralTable::N*i] );
+        }
+    }
+    return I;
+}
+
+//
+// Map readers that throw instead of returning a status
+//
+bool
+isRoot( const string& filename )
+{
+    return filename.size() > 5 && filename.compare( filename.size()-5, 5, ".root" ) == 0;
+}
+
+BFieldMap*
+readToroid( const string& filename )
+{
+    BFieldMap* map = new BFieldMap;
+    if ( map->readMap( filename.c_str() ) ) {
+        delete map;
+        throw runtime_error( "cannot read the map from " + filename );
+    }
+    return map;
+}
+
+BFieldSolenoid*
+readSolenoid( const string& filename )
+{
+    BFieldSolenoid* map = new BFieldSolenoid;
+    int status;
+    if ( isRoot( filename ) ) {
+        TFile rootfile( filename.c_str(), "READ" );
+        status = map->readMap( &rootfile );
+    } else {
+        ifstream input( filename.c_str() );
+        status = input ? map->readMap( input ) : 1;
+    }
+    if ( status ) {
+        delete map;
+        throw runtime_error( "cannot read the solenoid map from " + filename );
+    }
+    return map;
+}
+
+BFieldH8Map*
+readH8( const string& filename )
+{
+    BFieldH8Map* map = new BFieldH8Map;
+    if ( map->readMap( filename.c_str() ) ) {
+        delete map;
+        throw runtime_error( "cannot read the H8 map from " + filename );
+    }
+    return map;
+}
+
+BFieldIntegralTable*
+readIntegralTable( const string& filename )
+{
+    BFieldIntegralTable* table = new BFieldIntegralTable;
+    if ( table->read( filename.c_str() ) ) {
+        delete table;
+        throw runtime_error( "cannot read the integral table from " + filename );
+    }
+    return table;
+}
+
+PYBIND11_MODULE( bfieldmap, m )
+{
+    m.doc() = "Batch evaluation of the ATLAS magnetic field maps (mm, kT)";
+    m.def( "setThreads", &setThreads, py::arg("nthread"),
+           "number of threads for large batches (0: all hardware threads). "
+           "Calls already running keep the threads they started with" );
+
+    py::class_<BFieldMap>( m, "BFieldMap" )
+        .def( py::init( &readToroid ), py::arg("filename"), "read the toroid map from a file" )
+        .def( "getB", &getB<BFieldMap,BFieldCache>, py::arg("xyz"), py::arg("deriv") = false,
+              "field B (N,3) at xyz (N,3), and its derivatives (N,3,3) if deriv is True" )
+        .def( "nzone", &BFieldMap::nzone );
+
+    py::class_<BFieldSolenoid>( m, "BFieldSolenoid" )
+        .def( py::init( &readSolenoid ), py::arg("filename"),
+              "read the solenoid map from an ASCII grid file, or from a ROOT file" )
+        .def( "moveMap",
+              []( BFieldSolenoid& s, double dx, double dy, double dz, double ax, double ay ) {
+                  shared_ptr<BFieldThreadPool> threads = getPool();
+                  s.moveMap( dx, dy, dz, ax, ay, threads.get() );
+              },
+              py::arg("dx"), py::arg("dy"), py::arg("dz"), py::arg("ax"), py::arg("ay"),
+              "move (mm) and tilt (rad) the map.  Keeps the GIL, and must not be called "
+              "while getB() of this map runs in another thread" )
+        .def( "getB", &getB<BFieldSolenoid,BFieldCache>, py::arg("xyz"), py::arg("deriv") = false,
+              "field B (N,3) at xyz (N,3), and its derivatives (N,3,3) if deriv is True" );
+
+    py::class_<BFieldH8Map>( m, "BFieldH8Map" )
+        .def( py::init( &readH8 ), py::arg("filename"), "read the H8 map from a file" )
+        .def( "getB", &getB<BFieldH8Map,BFieldH8Cache>, py::arg("xyz"), py::arg("deriv") = false,
+              "field B (N,3) at xyz (N,3), and its derivatives (N,3,3) if deriv is True" )
+        .def( "inside",
+              []( const BFieldH8Map& h8, double x, double y, double z ) {
+                  double xyz[3] = { x, y, z };
+                  return h8.inside( xyz );
+              } )
+        .def( "ngrid", &BFieldH8Map::ngrid );
+
+    // the composite keeps its components alive
+    py::class_<BFieldComposite>( m, "BFieldComposite" )
+        .def( py::init<const BFieldMap*, const BFieldSolenoid*, const BFieldH8Map*>(),
+              py::arg("toroid") = nullptr, py::arg("solenoid") = nullptr, py::arg("h8") = nullptr,
+              py::keep_alive<1,2>(), py::keep_alive<1,3>(), py::keep_alive<1,4>() )
+        .def( "getB", &getB<BFieldComposite,BFieldComposite::Cache>, py::arg("xyz"), py::arg("deriv") = false,
+              "field B (N,3) at xyz (N,3), and its derivatives (N,3,3) if deriv is True" )
+        .def( "setSolenoidScale", &BFieldComposite::setSolenoidScale, py::arg("scale"),
+              "scale factor of the solenoid field, not to be changed during getB()" )
+        .def( "solenoidScale", &BFieldComposite::solenoidScale )
+        .def( "region",
+              []( const BFieldComposite& f, double x, double y, double z ) {
+                  double xyz[3] = { x, y, z };
+                  return f.region( xyz );
+              } );
+
+    py::class_<BFieldIntegralTable>( m, "BFieldIntegralTable" )
+        .def( py::init( &readIntegralTable ), py::arg("filename"), "read a table written by makeIntTable" )
+        .def( "lookup", &lookupIntegral, py::arg("eta"), py::arg("phi"), py::arg("z0"),
+              "Int Bphi dl and Int Btheta dl (T m), (N,2), along the rays (eta, phi) from (0,0,z0)" )
+        .def( "neta", &BFieldIntegralTable::neta )
+        .def( "nphi", &BFieldIntegralTable::nphi )
+        .def( "nz0", &BFieldIntegralTable::nz0 );
+}
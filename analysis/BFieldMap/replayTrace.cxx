@@ -0,0 +1,206 @@
+// replayTrace.cxx
+//
+// Replay a trace of getB() queries recorded with BFieldRecorder.
+//
+// The queries are sent, in the recorded order, to the component map they
+// were recorded from, once with the maps as they are read (the reference)
+// and once with the maps changed by the options (the test): another toroid
+// map, tricubic interpolation, the toroid folded by its symmetries or kept
+// compressed, or the points
+// dispatched by position through BFieldComposite.  The throughput of both is
+// reported, with the differences of the field and of the derivatives.
+// With -j, blocks of consecutive queries are replayed on a thread pool, each
+// thread with its own caches.  Queries for a component that is not loaded
+// are skipped.
+//
+#include "BFieldComposite.h"
+#include "BFieldRecorder.h"
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include "TFile.h"
+using namespace std;
+
+void
+usage()
+{
+    cout << "usage: replayTrace [-s <solenoidmap>] [-h8 <H8 mapfile>] [-j <nthread>] [-map <mapfile>]" << endl;
+    cout << "                   [-tricubic] [-fold] [-compress <brick>] [-composite] <trace> <mapfile>" << endl;
+    cout << "    <solenoidmap> ROOT file with a BFieldSolenoid tree, as written by combineMaps -d" << endl;
+    cout << "    -map          test another toroid map against <mapfile>" << endl;
+    cout << "    -tricubic     test tricubic interpolation in the toroid and solenoid maps" << endl;
+    cout << "    -fold         test the toroid map folded by its symmetries" << endl;
+    cout << "    -compress     test the toroid map compressed in bricks of <brick>^3 bins" << endl;
+    cout << "    -composite    test BFieldComposite, which finds the component from the position" << endl;
+}
+
+// the maps of one side of the comparison
+struct Side {
+    const BFieldMap* toroid;
+    const BFieldSolenoid* solenoid;
+    const BFieldH8Map* h8;
+    bool composite; // dispatch through BFieldComposite
+};
+
+//
+// Replay all queries in blocks on the pool, filling B[3*n] and deriv[9*n].
+// Returns the time in s.
+//
+double
+replay( const BFieldTrace& trace, const Side& side, BFieldThreadPool& pool, vector<double>& B,
+        vector<double>& deriv )
+{
+    const int block = 1024;
+    int n = trace.size();
+    BFieldComposite composite( side.toroid, side.solenoid, side.h8 );
+    vector<BFieldComposite::Cache> cache( pool.nthread() );
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    pool.run( ( n+block-1 )/block, [&]( int ib, int ithread ) {
+        BFieldComposite::Cache& c = cache[ithread];
+        for ( int i = ib*block; i < min( n, ( ib+1 )*block ); i++ ) {
+            const double* xyz = trace.xyz(i);
+            double* d = trace.deriv(i) ? &deriv[9*i] : 0;
+            if ( side.composite ) {
+                composite.getB( xyz, &B[3*i], d, c );
+                continue;
+            }
+            switch ( trace.component(i) ) {
+            case BFieldRecorder::Toroid:
+                if ( side.toroid ) side.toroid->getB( xyz, &B[3*i], d, c.toroid );
+                break;
+            case BFieldRecorder::Solenoid:
+                if ( side.solenoid ) side.solenoid->getB( xyz, &B[3*i], d, c.solenoid );
+                break;
+            case BFieldRecorder::H8:
+                if ( side.h8 ) side.h8->getB( xyz, &B[3*i], d, c.h8 );
+                break;
+            }
+        }
+    } );
+    return chrono::duration<double>( chrono::steady_clock::now()-t0 ).count();
+}
+
+int main( int argc, char** argv )
+{
+    const char* solenoidmap(0);
+    const char* h8map(0);
+    const char* othermap(0);
+    int nthread = 1;
+    bool tricubic = false;
+    bool fold = false;
+    int brick = 0;
+    bool composite = false;
+    int iarg = 1;
+    for ( ; iarg < argc-2 && argv[iarg][0] == '-'; iarg++ ) {
+        if ( strcmp( argv[iarg], "-s" ) == 0 ) solenoidmap = argv[++iarg];
+        else if ( strcmp( argv[iarg], "-h8" ) == 0 ) h8map = argv[++iarg];
+        else if ( strcmp( argv[iarg], "-j" ) == 0 ) nthread = atoi( argv[++iarg] );
+        else if ( strcmp( argv[iarg], "-map" ) == 0 ) othermap = argv[++iarg];
+        else if ( strcmp( argv[iarg], "-tricubic" ) == 0 ) tricubic = true;
+        else if ( strcmp( argv[iarg], "-fold" ) == 0 ) fold = true;
+        else if ( strcmp( argv[iarg], "-compress" ) == 0 ) brick = atoi( argv[++iarg] );
+        else if ( strcmp( argv[iarg], "-composite" ) == 0 ) composite = true;
+        else break;
+    }
+    if ( argc-iarg != 2 ) {
+        usage();
+        return 1;
+    }
+    BFieldTrace trace;
+    if ( trace.read( argv[iarg] ) ) return 1;
+    int ncomp[4] = { 0, 0, 0, 0 }, nderiv( 0 );
+    for ( unsigned i = 0; i < trace.size(); i++ ) {
+        ncomp[trace.component(i)]++;
+        nderiv += trace.deriv(i);
+    }
+    cout << trace.size() << " queries: " << ncomp[BFieldRecorder::Toroid] << " toroid, "
+         << ncomp[BFieldRecorder::Solenoid] << " solenoid, " << ncomp[BFieldRecorder::H8] << " H8, "
+         << nderiv << " with derivatives" << endl;
+
+    // reference maps, and the test copies that the options change
+    BFieldMap map, testmap;
+    cout << "Reading the map from " << argv[iarg+1] << endl;
+    if ( map.readMap( argv[iarg+1] ) ) return 1;
+    if ( othermap ) cout << "Reading the test map from " << othermap << endl;
+    if ( testmap.readMap( othermap ? othermap : argv[iarg+1] ) ) return 1;
+    if ( fold ) cout << testmap.fold() << " of " << testmap.nzone() << " zones folded" << endl;
+    if ( tricubic ) testmap.setTricubic( true );
+    if ( brick > 0 && testmap.compress( brick ) ) {
+        cout << "cannot compress the test map" << endl;
+        return 1;
+    }
+    BFieldSolenoid solenoid, testsolenoid;
+    if ( solenoidmap ) {
+        cout << "Reading the solenoid map from " << solenoidmap << endl;
+        TFile rootfile( solenoidmap, "READ" );
+        if ( solenoid.readMap( &rootfile ) || testsolenoid.readMap( &rootfile ) ) return 1;
+        if ( tricubic ) testsolenoid.setTricubic( true );
+    }
+    BFieldH8Map h8;
+    if ( h8map ) {
+        cout << "Reading the H8 map from " << h8map << endl;
+        if ( h8.readMap( h8map ) ) return 1;
+    }
+    Side side[2];
+    side[0].toroid = &map;
+    side[1].toroid = &testmap;
+    side[0].solenoid = solenoidmap ? &solenoid : 0;
+    side[1].solenoid = solenoidmap ? &testsolenoid : 0;
+    side[0].h8 = side[1].h8 = h8map ? &h8 : 0;
+    side[0].composite = false;
+    side[1].composite = composite;
+    int nskip = 0;
+    for ( int k = 1; k <= 3; k++ ) {
+        bool loaded = ( k == BFieldRecorder::Toroid ) || ( k == BFieldRecorder::Solenoid && solenoidmap ) ||
+                      ( k == BFieldRecorder::H8 && h8map );
+        if ( !loaded && !composite ) nskip += ncomp[k];
+    }
+    if ( nskip > 0 ) cout << nskip << " queries for components not loaded are skipped" << endl;
+
+    // replay both sides in turn, and keep the best of 3 trials
+    BFieldThreadPool pool( nthread );
+    unsigned n = trace.size();
+    vector<double> B[2], deriv[2];
+    double t[2] = { 1e30, 1e30 };
+    for ( int j = 0; j < 2; j++ ) {
+        B[j].assign( 3*n, 0.0 );
+        deriv[j].assign( 9*n, 0.0 );
+    }
+    for ( int trial = 0; trial < 3; trial++ ) {
+        for ( int j = 0; j < 2; j++ ) t[j] = min( t[j], replay( trace, side[j], pool, B[j], deriv[j] ) );
+    }
+    const char* name[2] = { "reference", "test     " };
+    for ( int j = 0; j < 2; j++ ) {
+        printf( "%s %8.3f ms  %7.2f M queries/s  %7.1f ns/query\n", name[j], 1e3*t[j], 1e-6*( n-nskip )/t[j],
+                1e9*t[j]/max( 1, int(n)-nskip ) );
+    }
+
+    // differences, in T and T/m
+    double maxdB( 0.0 ), sumdB2( 0.0 ), maxdD( 0.0 );
+    unsigned ndiff( 0 ), imax( 0 );
+    for ( unsigned i = 0; i < n; i++ ) {
+        double dB2( 0.0 );
+        for ( int j = 0; j < 3; j++ ) dB2 += pow( B[1][3*i+j]-B[0][3*i+j], 2 );
+        double dD( 0.0 );
+        if ( trace.deriv(i) ) {
+            for ( int j = 0; j < 9; j++ ) dD = max( dD, abs( deriv[1][9*i+j]-deriv[0][9*i+j] ) );
+        }
+        if ( dB2 > 0.0 || dD > 0.0 ) ndiff++;
+        sumdB2 += dB2;
+        maxdD = max( maxdD, dD );
+        if ( sqrt( dB2 ) > maxdB ) {
+            maxdB = sqrt( dB2 );
+            imax = i;
+        }
+    }
+    printf( "%u of %u results differ: |dB| max %.3g T, rms %.3g T; dB/dx max %.3g T/m\n", ndiff, n,
+            1e3*maxdB, 1e3*sqrt( sumdB2/max( 1u, n ) ), 1e6*maxdD );
+    if ( maxdB > 0.0 ) {
+        const double* p = trace.xyz( imax );
+        printf( "largest difference at query %u, (%.1f, %.1f, %.1f) mm\n", imax, p[0], p[1], p[2] );
+    }
+    return 0;
+}
@@ -0,0 +1,960 @@
+// testBFieldCore.cxx
+//
+// Unit tests of the field code that needs no ROOT, on synthetic maps.
+// Each test is run by name, e.g. "testBFieldCore compress", and returns 0 if
+// it passes; without an argument all the tests are run.  CMake registers
+// each test with ctest.
+//
+#include "BFieldMap.h"
+#include "BFieldIntegralTable.h"
+#include "BFieldPropagator.h"
+#include "BFieldH8Map.h"
+#include "BFieldHolder.h"
+#include "BFieldMapDiff.h"
+#include "BFieldSolenoid.h"
+#include "BFieldScaledMap.h"
+#include "BFieldComposite.h"
+#include "BFieldService.h"
+#include "BFieldProfiler.h"
+#include "BFieldThreadPool.h"
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+using namespace std;
+
+//
+// Synthetic toroid map: 3 slabs in z x 2 shells in r x 8 octants.
+// The field depends on phi through the position inside the octant only, Bz is
+// odd and Br, Bphi even in z, and the z mesh of the slab at z < 0 is the
+// mirror image of the one at z > 0, so that the zones are related by the
+// symmetries that BFieldMap::fold() looks for.  The outer shell has a
+// conductor in each zone.  With corrected, one zone gets an asymmetric
+// correction; with overlap, a small zone overlapping others is added last.
+//
+void
+fillZone( BFieldZone& zone, int nz, int nr, int nphi, bool mirror )
+{
+    const double bscale = zone.bscale();
+    double a = mirror ? -zone.zmax() : zone.zmin();
+    double b = mirror ? -zone.zmin() : zone.zmax();
+    vector<double> mz( nz );
+    for ( int i = 0; i < nz; i++ ) {
+        double t = double(i)/(nz-1);
+        mz[i] = a + (b-a)*( 0.3*t*t + 0.7*t );
+    }
+    for ( int i = 0; i < nz; i++ ) zone.appendMesh( 0, mirror ? -mz[nz-1-i] : mz[i] );
+    for ( int i = 0; i < nr; i++ ) zone.appendMesh( 1, zone.rmin() + (zone.rmax()-zone.rmin())*i/(nr-1) );
+    for ( int i = 0; i < nphi; i++ ) zone.appendMesh( 2, zone.phimin() + (zone.phimax()-zone.phimin())*i/(nphi-1) );
+    for ( int i = 0; i < nz; i++ ) {
+        for ( int j = 0; j < nr; j++ ) {
+            for ( int k = 0; k < nphi; k++ ) {
+                double z = abs( zone.mesh(0,i) );
+                double r = zone.mesh(1,j);
+                double p = double(k)/(nphi-1);
+                double s = ( zone.mesh(0,i) < 0.0 ) ? -1.0 : 1.0;
+                double Bz = s*0.3e-3*sin(z/3000.)*cos(p);
+                double Br = 0.2e-3*cos(r/4000.)*(1.0+p)*z/15000.;
+                double Bphi = 1.0e-3*sin(r/5000.+0.3)*(1.0+0.1*cos(3.0*p)+z/30000.);
+                zone.appendField( BFieldVector<short>( short(Bz/bscale), short(Br/bscale), short(Bphi/bscale) ) );
+            }
+        }
+    }
+}
+
+void
+makeMap( BFieldMap& map, bool corrected = false, bool overlap = false )
+{
+    const double zb[4] = { -15000., -5000., 5000., 15000. };
+    const double rb[3] = { 0., 5000., 14000. };
+    int id = 0;
+    for ( int a = 0; a < 3; a++ ) {
+        for ( int b = 0; b < 2; b++ ) {
+            for ( int c = 0; c < 8; c++ ) {
+                double phi1 = c*M_PI/4.0 - M_PI/8.0;
+                double phi2 = phi1 + M_PI/4.0;
+                BFieldZone zone( id++, zb[a], zb[a+1], rb[b], rb[b+1], phi1, phi2, 1.0e-7 );
+                fillZone( zone, 12, 9, 7, a == 0 );
+                if ( corrected && id == 7 ) {
+                    BFieldZone fixed( zone.id(), zb[a], zb[a+1], rb[b], rb[b+1], phi1, phi2, 1.0e-7 );
+                    for ( int j = 0; j < 3; j++ ) {
+                        for ( unsigned k = 0; k < zone.nmesh(j); k++ ) fixed.appendMesh( j, zone.mesh(j,k) );
+                    }
+                    for ( unsigned k = 0; k < zone.nfield(); k++ ) {
+                        fixed.appendField( ( k == 100 ) ? BFieldVector<short>( 5, 5, 5 ) : zone.field(k) );
+                    }
+                    zone = fixed;
+                }
+                if ( b == 1 ) {
+                    double p1[3] = { 9000.*cos(phi1+0.2), 9000.*sin(phi1+0.2), zb[a]+100. };
+                    double p2[3] = { 9000.*cos(phi1+0.2), 9000.*sin(phi1+0.2), zb[a+1]-100. };
+                    zone.appendCond( BFieldCond( true, p1, p2, 20000. ) );
+                }
+                map.appendZone( zone );
+            }
+        }
+    }
+    if ( overlap ) {
+        BFieldZone zone( id++, 2000., 9000., 3000., 8000., 0.3, 1.4, 1.0e-7 );
+        fillZone( zone, 6, 5, 4, false );
+        map.appendZone( zone );
+    }
+    map.buildLUT();
+}
+
+// random point inside the synthetic map, away from the beam line
+void
+randomPoint( double *xyz )
+{
+    double r = 100. + 13800.*drand48();
+    double phi = 2.0*M_PI*drand48() - M_PI;
+    xyz[0] = r*cos(phi);
+    xyz[1] = r*sin(phi);
+    xyz[2] = 30000.*drand48() - 15000.;
+}
+
+//
+// Synthetic solenoid map, read from the ASCII format (in m and gauss), with a
+// field that depends on phi
+//
+int
+readSolenoid( BFieldSolenoid& solenoid )
+{
+    const int nz = 41, nr = 13, nphi = 8;
+    ostringstream ascii;
+    ascii << "4\n" << nz << " " << nr << " " << nphi << " 0 0 0\n";
+    for ( int j = 0; j < nr; j++ ) ascii << 1.2*j/(nr-1) << " ";
+    for ( int i = 0; i < nz; i++ ) ascii << -3.0 + 6.0*i/(nz-1) << " ";
+    for ( int k = 0; k < nphi; k++ ) ascii << 2.0*M_PI*k/nphi << " ";
+    ascii << "\n0 0 0 0 0\n";
+    ascii.precision( 17 );
+    for ( int k = 0; k < nphi; k++ ) {
+        double phi = 2.0*M_PI*k/nphi;
+        for ( int c = 0; c < 3; c++ ) {
+            for ( int j = 0; j < nr; j++ ) {
+                for ( int i = 0; i < nz; i++ ) {
+                    double z = -3000. + 6000.*i/(nz-1);
+                    double r = 1200.*j/(nr-1);
+                    double b = ( c == 0 ) ? 2.0e4*cos(z/4000.)*( 1.0 - r*r/4.0e6 ) + 50.*cos(phi)
+                             : ( c == 1 ) ? 1.0e3*sin(z/3000.)*r/1200. + 20.*sin(phi) : 10.*cos(2.0*phi)*r/1200.;
+                    ascii << b << " ";
+                }
+            }
+        }
+    }
+    istringstream input( ascii.str() );
+    return solenoid.readMap( input );
+}
+
+// print a failure and return 1
+int
+fail( const char* test, const char* what )
+{
+    printf( "%s: FAILED: %s\n", test, what );
+    return 1;
+}
+
+//
+// BFieldMap::compress(): the compression is lossless, so getB() must give the
+// same results as the expanded map, and uncompress() the same field values
+//
+int
+testCompress()
+{
+    BFieldMap map, packed;
+    makeMap( map );
+    makeMap( packed );
+    if ( packed.compress( 4 ) || !packed.compressed() ) return fail( "compress", "compress() failed" );
+    if ( packed.memory() >= map.memory() ) return fail( "compress", "no memory saved" );
+    srand48( 1 );
+    BFieldCache c1, c2;
+    for ( int i = 0; i < 100000; i++ ) {
+        double xyz[3], B1[3], B2[3], D1[9], D2[9];
+        randomPoint( xyz );
+        map.getB( xyz, B1, D1, c1 );
+        packed.getB( xyz, B2, D2, c2 );
+        if ( memcmp( B1, B2, sizeof(B1) ) != 0 || memcmp( D1, D2, sizeof(D1) ) != 0 ) {
+            return fail( "compress", "getB() differs from the expanded map" );
+        }
+    }
+    packed.uncompress();
+    for ( int i = 0; i < map.nzone(); i++ ) {
+        const BFieldZone& z1 = map.zone(i);
+        const BFieldZone& z2 = packed.zone(i);
+        if ( z1.nfield() != z2.nfield() ) return fail( "compress", "uncompress() changed the size" );
+        for ( unsigned k = 0; k < z1.nfield(); k++ ) {
+            for ( int j = 0; j < 3; j++ ) {
+                if ( z1.field(k)[j] != z2.field(k)[j] ) return fail( "compress", "uncompress() changed a value" );
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// Zone look-up table: the zone found by getB() must be the last zone that
+// contains the point, as found by a linear search
+//
+int
+testZoneLUT()
+{
+    BFieldMap map;
+    makeMap( map, false, true );
+    srand48( 2 );
+    for ( int i = 0; i < 100000; i++ ) {
+        double xyz[3], B[3];
+        randomPoint( xyz );
+        double z = xyz[2];
+        double r = sqrt( xyz[0]*xyz[0] + xyz[1]*xyz[1] );
+        double phi = atan2( xyz[1], xyz[0] );
+        const BFieldZone* linear = 0;
+        for ( int k = 0; k < map.nzone(); k++ ) {
+            if ( map.zone(k).inside( z, r, phi ) ) linear = &map.zone(k);
+        }
+        BFieldCache cache;
+        map.getB( xyz, B, 0, cache );
+        if ( cache.zone() != linear ) return fail( "zonelut", "the LUT and the linear search disagree" );
+    }
+    return 0;
+}
+
+//
+// BFieldMap::overlaps(), which selects the zones of a partial read: for ranges
+// on both sides of phi = pi, in [-pi,pi] as queries usually are, it must agree
+// with inside() at points of the range, whether the zone is stored with its phi
+// range above pi or not
+//
+int
+testOverlap()
+{
+    BFieldMap map;
+    makeMap( map );
+    const double range[5][6] = {
+        { -20000., 20000., 0., 20000., -3.0, -2.3 },
+        { -20000., 20000., 0., 20000., 2.3, 3.0 },
+        { -20000., 20000., 0., 20000., 3.0, 3.5 },
+        { 1000., 4000., 6000., 7000., -3.1, 3.1 },
+        { -20000., 20000., 0., 20000., -M_PI, M_PI } };
+    for ( int i = 0; i < 5; i++ ) {
+        int nfound = 0;
+        for ( int j = 0; j < map.nzone(); j++ ) {
+            const BFieldZone& zone = map.zone(j);
+            const double zr[6] = { zone.zmin(), zone.zmax(), zone.rmin(), zone.rmax(), zone.phimin(), zone.phimax() };
+            bool inside = false;
+            if ( zr[0] <= range[i][1] && zr[1] >= range[i][0] && zr[2] <= range[i][3] && zr[3] >= range[i][2] ) {
+                double z = 0.5*( max( zr[0], range[i][0] ) + min( zr[1], range[i][1] ) );
+                double r = 0.5*( max( zr[2], range[i][2] ) + min( zr[3], range[i][3] ) );
+                for ( int k = 0; k <= 1000 && !inside; k++ ) {
+                    double phi = range[i][4] + ( range[i][5]-range[i][4] )*k/1000.;
+                    if ( phi > M_PI ) phi -= 2.0*M_PI;
+                    inside = zone.inside( z, r, phi );
+                }
+            }
+            if ( BFieldMap::overlaps( zr, range[i] ) != inside ) return fail( "overlap", "wrong zone selected" );
+            nfound += inside;
+        }
+        if ( nfound == 0 ) return fail( "overlap", "no zone in the range" );
+    }
+    return 0;
+}
+
+//
+// Mesh look-up tables: findIndex() must return the bin that contains x, on
+// uniform axes, on the mildly non-uniform z axes of the map, and on an axis
+// with bins of very different sizes, where the table is capped
+//
+int
+testMeshLUT()
+{
+    BFieldMap map;
+    makeMap( map );
+    BFieldZone zone( 0, 0., 1000., 0., 1000., 0., 1.0, 1.0e-7 );
+    for ( int i = 0; i <= 40; i++ ) zone.appendMesh( 0, ( i == 0 ) ? 0.0 : 1000.*pow( 2.0, i-40 ) );
+    for ( int i = 0; i <= 10; i++ ) zone.appendMesh( 1, 100.*i );
+    for ( int i = 0; i <= 4; i++ ) zone.appendMesh( 2, 0.25*i );
+    for ( int i = 0; i < 41*11*5; i++ ) zone.appendField( BFieldVector<short>( 0, 0, 0 ) );
+    zone.buildLUT();
+    if ( zone.uniform(0) || !zone.uniform(1) ) return fail( "meshlut", "wrong uniform axes" );
+    if ( zone.memoryLUT() > sizeof(int)*( 4*40+3 ) ) return fail( "meshlut", "the LUT is not capped" );
+    srand48( 3 );
+    for ( int k = 0; k <= map.nzone(); k++ ) {
+        const BFieldZone& z = ( k < map.nzone() ) ? map.zone(k) : zone;
+        for ( int j = 0; j < 3; j++ ) {
+            for ( int i = 0; i < 2000; i++ ) {
+                // sample uniformly, and log-uniformly near the minimum
+                double u = ( i%2 ) ? drand48() : pow( 2.0, -40.0*drand48() );
+                double x = z.min(j) + u*( z.max(j) - z.min(j) );
+                int bin = z.findIndex( j, x );
+                if ( bin < 0 || bin >= int(z.nmesh(j))-1 || x < z.mesh(j,bin) || x > z.mesh(j,bin+1) ) {
+                    return fail( "meshlut", "findIndex() returned the wrong bin" );
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// BFieldMap::fold(): the folded map must give the same field as the full map,
+// to rounding, in trilinear and tricubic modes and compressed, keep the zone
+// with the asymmetric correction, and unfold() must restore the field exactly
+//
+int
+testFold()
+{
+    BFieldMap map, folded;
+    makeMap( map, true );
+    makeMap( folded, true );
+    int nfold = folded.fold();
+    // per shell: the slab at z < 0 mirrors the one at z > 0, the octants of
+    // each slab fold onto the first, except the corrected zone
+    if ( nfold != 43 || folded.nfolded() != 43 ) return fail( "fold", "wrong number of zones folded" );
+    if ( folded.zone(6).folded() ) return fail( "fold", "the corrected zone was folded" );
+    if ( 8*folded.memory() > map.memory() ) return fail( "fold", "memory not reduced" );
+    for ( int mode = 0; mode < 3; mode++ ) {
+        if ( mode == 1 ) {
+            map.setTricubic( true );
+            folded.setTricubic( true );
+        } else if ( mode == 2 ) {
+            map.setTricubic( false );
+            folded.setTricubic( false );
+            if ( map.compress( 4 ) || folded.compress( 4 ) ) return fail( "fold", "compress() failed" );
+        }
+        srand48( 4 );
+        BFieldCache c1, c2;
+        for ( int i = 0; i < 50000; i++ ) {
+            double xyz[3], B1[3], B2[3], D1[9], D2[9];
+            randomPoint( xyz );
+            map.getB( xyz, B1, D1, c1 );
+            folded.getB( xyz, B2, D2, c2 );
+            for ( int j = 0; j < 3; j++ ) {
+                if ( abs( B1[j]-B2[j] ) > 1e-15 ) return fail( "fold", "getB() differs from the full map" );
+            }
+            for ( int j = 0; j < 9; j++ ) {
+                if ( abs( D1[j]-D2[j] ) > 1e-15 ) return fail( "fold", "the derivatives differ from the full map" );
+            }
+        }
+    }
+    map.uncompress();
+    folded.unfold();
+    if ( folded.nfolded() != 0 ) return fail( "fold", "unfold() left folded zones" );
+    for ( int i = 0; i < map.nzone(); i++ ) {
+        const BFieldZone& z1 = map.zone(i);
+        const BFieldZone& z2 = folded.zone(i);
+        if ( z1.nfield() != z2.nfield() ) return fail( "fold", "unfold() gave the wrong size" );
+        for ( unsigned k = 0; k < z1.nfield(); k++ ) {
+            for ( int j = 0; j < 3; j++ ) {
+                if ( z1.field(k)[j] != z2.field(k)[j] ) return fail( "fold", "unfold() gave a wrong value" );
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// BFieldMap::integrateB() on rays that lie on phi planes of the mesh, where
+// rounding puts the points of the quadrature on either side of the bin edge:
+// the integral must be continuous with those of rays just beside the plane
+//
+int
+testIntPhi()
+{
+    BFieldMap map;
+    makeMap( map );
+    BFieldLineIntegral integral( &map );
+    integral.setRange( 1000., 13000., 1000., 14500. );
+    for ( int c = 0; c < 8; c++ ) {
+        for ( int m = 1; m < 6; m++ ) {
+            double phi = c*M_PI/4.0 - M_PI/8.0 + m*M_PI/24.0;
+            if ( phi > M_PI ) phi -= 2.0*M_PI;
+            for ( int ieta = 0; ieta < 55; ieta++ ) {
+                double eta = -2.7 + 0.1*ieta;
+                double I[BFieldLineIntegral::N], Ilo[BFieldLineIntegral::N], Ihi[BFieldLineIntegral::N];
+                integral.integrate( eta, phi, 0.0, I );
+                integral.integrate( eta, phi-1.0e-7, 0.0, Ilo );
+                integral.integrate( eta, phi+1.0e-7, 0.0, Ihi );
+                for ( int k = 0; k < BFieldLineIntegral::N; k++ ) {
+                    double mean = 0.5*( Ilo[k] + Ihi[k] );
+                    if ( abs( I[k] - mean ) > 1.0e-4*( 1.0 + abs( mean ) ) ) {
+                        return fail( "intphi", "the integral jumps on a phi plane of the mesh" );
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// BFieldPropagator: in a uniform field the track must follow the analytic
+// helix.  The transported Jacobian must agree with finite differences of
+// propagated tracks, in the uniform field and in the synthetic toroid map,
+// with fixed steps so that the tracks differ only by their start.
+//
+int
+testPropagator()
+{
+    BFieldMap uniform;
+    const double Bz = 2.0e-3;
+    BFieldZone zone( 0, -6000., 6000., 0., 6000., 0., 2.0*M_PI, 1.0e-7 );
+    for ( int i = 0; i < 3; i++ ) zone.appendMesh( 0, -6000. + 6000.*i );
+    for ( int i = 0; i < 3; i++ ) zone.appendMesh( 1, 3000.*i );
+    for ( int i = 0; i < 5; i++ ) zone.appendMesh( 2, 0.5*M_PI*i );
+    for ( int i = 0; i < 3*3*5; i++ ) zone.appendField( BFieldVector<short>( short(Bz/1.0e-7), 0, 0 ) );
+    uniform.appendZone( zone );
+    uniform.buildLUT();
+    BFieldMap toroid;
+    makeMap( toroid );
+
+    // helix of a 1 GeV track over 3 m
+    const double x0[3] = { 100., -200., 50. };
+    const double u0[3] = { 0.6, 0.48, 0.64 };
+    const double qop = -1.0;
+    const double smax = 3000.;
+    BFieldPropagator helix( &uniform );
+    helix.setTolerance( 1.0e-6 );
+    BFieldTrack track( x0, u0, qop );
+    if ( helix.propagate( track, 5500., 5500., smax ) != BFieldPropagator::MaxPath ) {
+        return fail( "propagator", "the helix did not reach the maximum path" );
+    }
+    double w = 0.299792458*qop*Bz;
+    double c = cos( w*smax ), s = sin( w*smax );
+    double pos[3] = { x0[0] + ( u0[0]*s + u0[1]*( 1.0-c ) )/w, x0[1] + ( u0[0]*( c-1.0 ) + u0[1]*s )/w,
+                      x0[2] + u0[2]*smax };
+    double dir[3] = { u0[0]*c + u0[1]*s, -u0[0]*s + u0[1]*c, u0[2] };
+    for ( int i = 0; i < 3; i++ ) {
+        if ( abs( track.pos[i]-pos[i] ) > 1.0e-3 || abs( track.dir[i]-dir[i] ) > 1.0e-6 ) {
+            return fail( "propagator", "the track differs from the analytic helix" );
+        }
+    }
+
+    for ( int field = 0; field < 2; field++ ) {
+        BFieldPropagator prop( field ? &toroid : &uniform );
+        prop.setStepRange( 10., 10. );
+        const double start[3] = { 1000., 500., -2000. };
+        const double u[3] = { 0.5, 0.7, 0.3 };
+        BFieldTrack ref( start, u, 0.5 );
+        prop.propagate( ref, 14000., 14000., smax, true );
+        // steps in (pos, dir, qop)
+        const double eps[7] = { 1.0e-3, 1.0e-3, 1.0e-3, 1.0e-6, 1.0e-6, 1.0e-6, 1.0e-6 };
+        for ( int k = 0; k < 7; k++ ) {
+            BFieldTrack t[2];
+            for ( int side = 0; side < 2; side++ ) {
+                t[side] = BFieldTrack( start, u, 0.5 );
+                double d = side ? eps[k] : -eps[k];
+                if ( k < 3 ) t[side].pos[k] += d;
+                else if ( k < 6 ) t[side].dir[k-3] += d;
+                else t[side].qop += d;
+                prop.propagate( t[side], 14000., 14000., smax, false );
+            }
+            for ( int i = 0; i < 6; i++ ) {
+                double fd = ( i < 3 ) ? ( t[1].pos[i]-t[0].pos[i] )/( 2.0*eps[k] )
+                                      : ( t[1].dir[i-3]-t[0].dir[i-3] )/( 2.0*eps[k] );
+                // positions per unit position, or per unit direction (mm)
+                double scale = ( i < 3 && k >= 3 ) ? smax : 1.0;
+                if ( abs( ref.jac[7*i+k] - fd ) > 1.0e-4*scale ) {
+                    return fail( "propagator", field ? "the Jacobian in the toroid differs from finite differences"
+                                                     : "the Jacobian in a uniform field differs from finite differences" );
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// BFieldSolenoid::moveMap(): the field at each node of the moved map must be
+// the field of the original map at the node moved back, rotated, to rounding
+// (a node on a bin edge may be interpolated in either bin).  The map is moved
+// twice, on the pool kept by the solenoid.  moveMaps() must also give the
+// same maps when two threads call it at once, both making the pool on first use.
+//
+int
+testMoveMap()
+{
+    BFieldSolenoid solenoid;
+    if ( readSolenoid( solenoid ) ) return fail( "movemap", "readMap() failed" );
+    const BFieldMesh<double>* orig = solenoid.originalMap();
+    const double move[2][5] = { { 0.5, -1.2, 3.0, 2.0e-4, -1.0e-4 }, { -2.0, 0.7, -1.5, -3.0e-4, 5.0e-4 } };
+    for ( int m = 0; m < 2; m++ ) {
+        const double dx = move[m][0], dy = move[m][1], dz = move[m][2], ax = move[m][3], ay = move[m][4];
+        solenoid.moveMap( dx, dy, dz, ax, ay );
+        const BFieldMesh<double>* tilt = solenoid.tiltedMap();
+        if ( tilt == 0 || tilt == orig ) return fail( "movemap", "no moved map" );
+        unsigned l = 0;
+        for ( unsigned i = 0; i < tilt->nmesh(0); i++ ) {
+            for ( unsigned j = 0; j < tilt->nmesh(1); j++ ) {
+                for ( unsigned k = 0; k < tilt->nmesh(2); k++, l++ ) {
+                    double phi0 = tilt->mesh(2,k);
+                    double x1 = tilt->mesh(1,j)*cos(phi0) - dx;
+                    double y1 = tilt->mesh(1,j)*sin(phi0) - dy;
+                    double z1 = tilt->mesh(0,i) - dz;
+                    double y2 = y1*cos(ax) + z1*sin(ax);
+                    double z2 = z1*cos(ax) - y1*sin(ax);
+                    double x3 = x1*cos(ay) - z2*sin(ay);
+                    double z3 = z2*cos(ay) + x1*sin(ay);
+                    double B[3];
+                    orig->getB( z3, sqrt( x3*x3 + y2*y2 ), atan2( y2, x3 ), B );
+                    double Bx1 = B[0]*cos(ay) + B[2]*sin(ay);
+                    double Bz1 = B[2]*cos(ay) - B[0]*sin(ay);
+                    double By2 = B[1]*cos(ax) - Bz1*sin(ax);
+                    double Bz2 = Bz1*cos(ax) + B[1]*sin(ax);
+                    double ref[3] = { Bz2, Bx1*cos(phi0) + By2*sin(phi0), -Bx1*sin(phi0) + By2*cos(phi0) };
+                    for ( int c = 0; c < 3; c++ ) {
+                        if ( abs( tilt->field(l)[c] - ref[c] ) > 1.0e-15 ) {
+                            return fail( "movemap", "the moved map differs from the original map" );
+                        }
+                    }
+                }
+            }
+        }
+    }
+    BFieldSolenoid fresh;
+    if ( readSolenoid( fresh ) ) return fail( "movemap", "readMap() failed" );
+    BFieldMesh<double>* tilted[2] = { 0, 0 };
+    vector<thread> worker;
+    for ( int m = 0; m < 2; m++ ) {
+        worker.push_back( thread( [&fresh, &move, &tilted, m]() {
+            fresh.moveMaps( 1, &move[1][0], &move[1][1], &move[1][2], &move[1][3], &move[1][4], &tilted[m] );
+        } ) );
+    }
+    for ( int m = 0; m < 2; m++ ) worker[m].join();
+    const BFieldMesh<double>* tilt = solenoid.tiltedMap();
+    bool same = ( tilted[0]->nfield() == tilt->nfield() && tilted[1]->nfield() == tilt->nfield() );
+    for ( unsigned l = 0; l < tilt->nfield() && same; l++ ) {
+        for ( int c = 0; c < 3; c++ ) same = same && tilted[0]->field(l)[c] == tilt->field(l)[c] &&
+                                                 tilted[1]->field(l)[c] == tilt->field(l)[c];
+    }
+    delete tilted[0];
+    delete tilted[1];
+    if ( !same ) return fail( "movemap", "moveMaps() from two threads differs" );
+    return 0;
+}
+
+//
+// BFieldH8Map: the grid search, in the most-recently-used order of the cache,
+// must give the field of the first grid in the file that contains the point,
+// on a synthetic text map of overlapping grids
+//
+int
+testH8Grid()
+{
+    struct Grid { int n[3]; double min[3], max[3], d[3]; };
+    const Grid grids[4] = {
+        { { 21, 11, 9 }, { -2.0, -0.3, -0.5 }, { 2.0, 0.3, 0.5 }, { 0.0, 0.0, 0.0 } },
+        { { 11, 11, 11 }, { -1.0, -0.2, -0.2 }, { 1.5, 0.2, 0.4 }, { 0.1, 0.0, 0.0 } },
+        { { 5, 6, 7 }, { 3.0, -0.5, -0.5 }, { 4.0, 0.5, 0.5 }, { 0.0, 0.0, 0.0 } },
+        { { 9, 9, 9 }, { 1.5, -0.4, -0.4 }, { 3.5, 0.4, 0.4 }, { 0.0, 0.0, 0.1 } } };
+    ostringstream text;
+    text.precision( 10 );
+    text << "synthetic H8 map\n";
+    for ( int g = 0; g < 4; g++ ) {
+        const Grid& grid = grids[g];
+        text << "MAGNET" << g;
+        for ( int i = 0; i < 3; i++ ) text << " " << grid.n[i];
+        for ( int i = 0; i < 3; i++ ) text << " " << grid.min[i] << " " << grid.max[i];
+        for ( int i = 0; i < 3; i++ ) text << " " << grid.d[i];
+        text << " 1.0\n";
+        for ( int k = 0; k < grid.n[2]; k++ ) {
+            for ( int j = 0; j < grid.n[1]; j++ ) {
+                for ( int i = 0; i < grid.n[0]; i++ ) {
+                    double x = 100.*( grid.min[0] + ( grid.max[0]-grid.min[0] )*i/( grid.n[0]-1 ) );
+                    double y = 100.*( grid.min[1] + ( grid.max[1]-grid.min[1] )*j/( grid.n[1]-1 ) );
+                    double z = 100.*( grid.min[2] + ( grid.max[2]-grid.min[2] )*k/( grid.n[2]-1 ) );
+                    text << x << " " << y << " " << z << " " << sin(x/50.) + g << " " << cos(y/30.)*z/100. << " "
+                         << 0.5 + x*y/1.0e4 << "\n";
+                }
+            }
+        }
+    }
+    istringstream input( text.str() );
+    BFieldH8Map map;
+    map.readMap( input );
+    if ( map.ngrid() != 4 ) return fail( "h8grid", "wrong number of grids read" );
+    srand48( 6 );
+    BFieldH8Cache cache;
+    for ( int i = 0; i < 100000; i++ ) {
+        // points clustered in turn around each grid, to exercise the order
+        const Grid& grid = grids[( i/100 )%4];
+        double xyz[3];
+        for ( int j = 0; j < 3; j++ ) {
+            double lo = 1000.*( grid.min[j] + grid.d[j] ), hi = 1000.*( grid.max[j] + grid.d[j] );
+            xyz[j] = lo - 200. + ( hi-lo+400. )*drand48();
+        }
+        double B[3], D[9], Bref[3] = { 0.0, 0.0, 0.0 }, Dref[9] = { 0.0 };
+        for ( int g = 0; g < map.ngrid(); g++ ) {
+            if ( map.grid(g).inside( xyz ) ) {
+                map.grid(g).getB( xyz, Bref, Dref );
+                break;
+            }
+        }
+        map.getB( xyz, B, D, cache );
+        for ( int j = 0; j < 3; j++ ) {
+            if ( abs( B[j]-Bref[j] ) > 1.0e-15 ) return fail( "h8grid", "getB() differs from the first grid" );
+        }
+        for ( int j = 0; j < 9; j++ ) {
+            if ( abs( D[j]-Dref[j] ) > 1.0e-15 ) return fail( "h8grid", "the derivatives differ from the first grid" );
+        }
+    }
+    return 0;
+}
+
+//
+// BFieldH8Grid::readMap(): a node outside the grid must be skipped, and must
+// not overwrite another node
+//
+int
+testH8Read()
+{
+    ostringstream text;
+    text << "synthetic H8 map\nMAGNET 3 3 3 0 0.2 0 0.2 0 0.2 0 0 0 -1.0\n";
+    for ( int k = 0; k < 27; k++ ) {
+        double x = 10.*( k%3 ), y = 10.*( (k/3)%3 ), z = 10.*( k/9 );
+        // node 13 far beyond the grid, node 14 just below it
+        if ( k == 13 ) x = 1000.;
+        if ( k == 14 ) x = -15.;
+        text << x << " " << y << " " << z << " " << k << " " << 2*k << " " << 3*k << "\n";
+    }
+    istringstream input( text.str() );
+    BFieldH8Map map;
+    map.readMap( input );
+    if ( map.ngrid() != 1 ) return fail( "h8read", "wrong number of grids read" );
+    const BFieldH8Grid& grid = map.grid(0);
+    for ( int k = 0; k < 27; k++ ) {
+        // the skipped nodes stay at zero (tesla = 1e-3 kT)
+        double expect = ( k == 13 || k == 14 ) ? 0.0 : 1.0e-3*k;
+        if ( abs( grid.field( k, 0 ) - expect ) > 1.0e-15 ) return fail( "h8read", "wrong field at a node" );
+    }
+    return 0;
+}
+
+//
+// BFieldScaledMap: getB() must work before any component is added, and the
+// combined map must be the scaled sum of the components, to the rounding of
+// the field to shorts.  A folded map must be refused as a component.
+//
+int
+testScaledMap()
+{
+    BFieldScaledMap scaled;
+    const double xyz0[3] = { 3000., 2000., 1000. };
+    double B0[3];
+    scaled.getB( xyz0, B0 );
+    if ( scaled.map() == 0 || scaled.map()->nzone() != 0 ) return fail( "scaledmap", "no empty map" );
+    BFieldMap map1, map2;
+    makeMap( map1 );
+    makeMap( map2, true );
+    if ( scaled.addComponent( &map1, 0.7 ) != 0 || scaled.addComponent( &map2, -0.4 ) != 1 ) {
+        return fail( "scaledmap", "addComponent() failed" );
+    }
+    // a folded map has no field of its own in most zones
+    BFieldMap folded;
+    makeMap( folded );
+    folded.fold();
+    if ( scaled.addComponent( &folded, 1.0 ) != -1 ) return fail( "scaledmap", "a folded map was added" );
+    // the second pass rebuilds the combined map on the pool kept by the first
+    for ( int pass = 0; pass < 2; pass++ ) {
+        if ( pass == 1 ) scaled.setScale( 1, 0.5 );
+        const double s2 = ( pass == 0 ) ? -0.4 : 0.5;
+        srand48( 7 );
+        BFieldCache c0, c1, c2;
+        for ( int i = 0; i < 20000; i++ ) {
+            double xyz[3], B[3], B1[3], B2[3];
+            randomPoint( xyz );
+            scaled.getB( xyz, B, 0, c0 );
+            map1.getB( xyz, B1, 0, c1 );
+            map2.getB( xyz, B2, 0, c2 );
+            for ( int j = 0; j < 3; j++ ) {
+                if ( abs( B[j] - ( 0.7*B1[j] + s2*B2[j] ) ) > 1.0e-7 ) {
+                    return fail( "scaledmap", "the combined map is not the scaled sum" );
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// BFieldComposite: the solenoid field and its derivatives must be scaled by
+// the solenoid scale factor inside the solenoid, and the toroid field left as
+// it is outside
+//
+int
+testComposite()
+{
+    BFieldMap toroid;
+    makeMap( toroid );
+    BFieldSolenoid solenoid;
+    if ( readSolenoid( solenoid ) ) return fail( "composite", "readMap() failed" );
+    BFieldComposite field( &toroid, &solenoid );
+    field.setSolenoidScale( 0.6 );
+    srand48( 8 );
+    int nsolenoid = 0;
+    for ( int i = 0; i < 20000; i++ ) {
+        double xyz[3], B[3], D[9], B1[3], D1[9];
+        randomPoint( xyz );
+        if ( i%2 == 0 ) { // half of the points in the solenoid volume
+            for ( int j = 0; j < 3; j++ ) xyz[j] *= 0.08;
+        }
+        field.getB( xyz, B, D );
+        double scale = 1.0;
+        if ( field.region( xyz ) == BFieldComposite::Solenoid ) {
+            solenoid.getB( xyz, B1, D1 );
+            scale = 0.6;
+            nsolenoid++;
+        } else {
+            toroid.getB( xyz, B1, D1 );
+        }
+        for ( int j = 0; j < 3; j++ ) {
+            if ( abs( B[j] - scale*B1[j] ) > 1e-12*( 1.0 + abs( B1[j] ) ) ) return fail( "composite", "wrong field" );
+        }
+        for ( int j = 0; j < 9; j++ ) {
+            if ( abs( D[j] - scale*D1[j] ) > 1e-12*( 1.0 + abs( D1[j] ) ) ) {
+                return fail( "composite", "wrong derivatives" );
+            }
+        }
+    }
+    if ( nsolenoid == 0 ) return fail( "composite", "no point in the solenoid" );
+    return 0;
+}
+
+//
+// BFieldHolder: readers with a slot, and one without, must always see a whole
+// map of the version they are given while maps are published and reclaimed
+//
+int
+testHolder()
+{
+    typedef BFieldHolder< vector<unsigned long> > Holder;
+    Holder holder( new vector<unsigned long>( 1000, 0 ), 2 );
+    int slot[3];
+    for ( int i = 0; i < 3; i++ ) slot[i] = holder.registerReader();
+    if ( slot[0] < 0 || slot[1] < 0 || slot[2] != -1 ) return fail( "holder", "wrong reader slots" );
+    const unsigned long npublish = 200;
+    atomic<int> nbad( 0 );
+    vector<thread> reader;
+    for ( int i = 0; i < 3; i++ ) {
+        reader.push_back( thread( [&holder, &nbad, &slot, i]() {
+            unsigned long last = 0;
+            while ( last < npublish ) {
+                Holder::Guard map( holder, slot[i] );
+                unsigned long version = map.version();
+                if ( version < last || holder.version() < version ||
+                     (*map)[0] != version || map->back() != version ) nbad++;
+                last = version;
+            }
+        } ) );
+    }
+    for ( unsigned long v = 1; v <= npublish; v++ ) holder.publish( new vector<unsigned long>( 1000, v ) );
+    for ( int i = 0; i < 3; i++ ) reader[i].join();
+    holder.unregisterReader( slot[0] );
+    holder.unregisterReader( slot[1] );
+    holder.unregisterReader( slot[2] );
+    if ( nbad > 0 ) return fail( "holder", "a reader saw an inconsistent map" );
+    if ( holder.version() != npublish || holder.reclaim() != 0 ) {
+        return fail( "holder", "wrong version, or maps left to reclaim" );
+    }
+    return 0;
+}
+
+//
+// Tricubic interpolation of the solenoid: the field and its derivatives must
+// be continuous across the bins, including at phi = 0 where the 2pi phi axis
+// closes, and moveMap() must keep the interpolation
+//
+int
+testTricubic()
+{
+    BFieldSolenoid empty;
+    empty.setTricubic( true );
+    BFieldSolenoid solenoid;
+    if ( readSolenoid( solenoid ) ) return fail( "tricubic", "readMap() failed" );
+    solenoid.setTricubic( true );
+    if ( !solenoid.tiltedMap()->tricubic() ) return fail( "tricubic", "not switched on" );
+    srand48( 8 );
+    double maxd = 0.0;
+    for ( int seam = 0; seam < 2; seam++ ) {
+        // phi = 0, and a phi node inside the map
+        double phi = seam ? 0.25*M_PI : 0.0;
+        for ( int i = 0; i < 50; i++ ) {
+            double r = 100. + 900.*drand48();
+            double z = 5000.*drand48() - 2500.;
+            double xyz[2][3], B[2][3], D[2][9];
+            for ( int side = 0; side < 2; side++ ) {
+                double p = phi + ( side ? 1.0e-9 : -1.0e-9 );
+                xyz[side][0] = r*cos(p);
+                xyz[side][1] = r*sin(p);
+                xyz[side][2] = z;
+                BFieldCache cache;
+                solenoid.getB( xyz[side], B[side], D[side], cache );
+            }
+            for ( int j = 0; j < 3; j++ ) {
+                if ( abs( B[1][j]-B[0][j] ) > 1.0e-12 ) return fail( "tricubic", "the field jumps" );
+            }
+            for ( int j = 0; j < 9; j++ ) {
+                maxd = max( maxd, abs( D[1][j]-D[0][j] ) );
+            }
+        }
+    }
+    // one-sided differences at phi = 0 make the derivatives jump by ~1e-8 kT/mm
+    if ( maxd > 1.0e-12 ) return fail( "tricubic", "the derivatives jump across a bin edge" );
+    solenoid.moveMap( 0.5, -1.2, 3.0, 2.0e-4, -1.0e-4 );
+    if ( !solenoid.tiltedMap()->tricubic() ) return fail( "tricubic", "moveMap() went back to trilinear" );
+    return 0;
+}
+
+//
+// BFieldMapDiff: compressed and folded zones must be sampled with getB(),
+// since their nodes cannot be read directly, and find the zone with the
+// correction only
+//
+int
+testDiff()
+{
+    BFieldMap map1, map2;
+    makeMap( map1 );
+    makeMap( map2, true );
+    BFieldThreadPool pool( 2 );
+    for ( int pass = 0; pass < 3; pass++ ) {
+        if ( pass == 1 && ( map1.compress( 4 ) || map2.compress( 4 ) ) ) return fail( "diff", "compress() failed" );
+        if ( pass == 2 ) {
+            map1.uncompress();
+            map2.uncompress();
+            if ( map1.fold() == 0 || map2.fold() == 0 ) return fail( "diff", "fold() failed" );
+        }
+        BFieldMapDiff diff( &map1, &map2 );
+        diff.setSampling( 10 );
+        diff.compare( pool );
+        if ( int(diff.nzone()) != map1.nzone() ) return fail( "diff", "wrong number of zones" );
+        for ( unsigned i = 0; i < diff.nzone(); i++ ) {
+            const BFieldMapDiff::ZoneDiff& zone = diff.zone(i);
+            bool direct = ( pass == 0 ) ||
+                ( pass == 2 && !map1.zone( zone.izone[0] ).folded() && !map2.zone( zone.izone[1] ).folded() );
+            if ( zone.matched != direct ) return fail( "diff", "wrong choice of node or sampled comparison" );
+            if ( ( zone.maxdB > 0.0 ) != ( zone.id == 6 ) ) return fail( "diff", "wrong zone with a difference" );
+        }
+    }
+    return 0;
+}
+
+//
+// BFieldProfiler and BFieldLatency share their binning: filled with the same
+// values they must give the same quantiles, within a bin of the exact ones
+//
+int
+testHistogram()
+{
+    BFieldProfiler prof( "test", 1.0 );
+    prof.setZones( vector<int>( 1, 0 ), vector<int>( 1, 0 ) );
+    BFieldLatency latency;
+    const int n = 10000;
+    for ( int i = 1; i <= n; i++ ) {
+        prof.fill( 0, false, i );
+        latency.fill( i );
+    }
+    const double q[4] = { 0.1, 0.5, 0.9, 0.999 };
+    for ( int k = 0; k < 4; k++ ) {
+        double x1 = prof.quantile( 0, false, q[k] );
+        double x2 = latency.quantile( q[k] );
+        if ( x1 != x2 ) return fail( "histogram", "different quantiles" );
+        if ( abs( x1/( q[k]*n ) - 1.0 ) > 0.2 ) return fail( "histogram", "wrong quantile" );
+    }
+    if ( prof.quantile( 0, true, 0.5 ) != 0.0 ) return fail( "histogram", "quantile of an empty histogram" );
+    return 0;
+}
+
+//
+// BFieldIntegralTable: written and read back, lookup() at the nodes must give
+// the direct integrals, to float precision.  The phi nodes avoid the zone
+// edges, where the synthetic field jumps and rounding decides the zone.
+//
+int
+testIntTable()
+{
+    BFieldMap map;
+    makeMap( map );
+    BFieldLineIntegral integral( &map );
+    integral.setRange( 1000., 13000., 1000., 14500. );
+    BFieldThreadPool pool( 2 );
+    BFieldIntegralTable table, copy;
+    const int neta = 13, nphi = 30, nz0 = 3;
+    table.fill( integral, neta, -2.4, 2.4, nphi, nz0, -100., 100., pool );
+    const char* filename = "testBFieldCore.table";
+    if ( table.write( filename ) || copy.read( filename ) ) return fail( "inttable", "write/read failed" );
+    remove( filename );
+    if ( copy.neta() != neta || copy.nphi() != nphi || copy.nz0() != nz0 ) {
+        return fail( "inttable", "wrong grid read back" );
+    }
+    for ( int ieta = 0; ieta < neta; ieta++ ) {
+        for ( int iphi = 0; iphi < nphi; iphi++ ) {
+            for ( int iz0 = 0; iz0 < nz0; iz0++ ) {
+                double eta = -2.4 + 4.8*ieta/(neta-1);
+                double phi = -M_PI + 2.0*M_PI*iphi/nphi;
+                double z0 = -100. + 100.*iz0;
+                double I[BFieldLineIntegral::N], J[BFieldIntegralTable::N];
+                integral.integrate( eta, phi, z0, I );
+                if ( copy.lookup( eta, phi, z0, J ) != 0 ) return fail( "inttable", "node outside the table" );
+                if ( abs( J[BFieldIntegralTable::Bphi] - I[BFieldLineIntegral::Bphi] ) >
+                     1e-5*( 1.0 + abs( I[BFieldLineIntegral::Bphi] ) ) ||
+                     abs( J[BFieldIntegralTable::Btheta] - I[BFieldLineIntegral::Btheta] ) >
+                     1e-5*( 1.0 + abs( I[BFieldLineIntegral::Btheta] ) ) ) {
+                    return fail( "inttable", "lookup() at a node differs from the direct integral" );
+                }
+            }
+        }
+    }
+    double J[BFieldIntegralTable::N];
+    if ( copy.lookup( 3.0, 0.0, 0.0, J ) != 1 ) return fail( "inttable", "eta outside the table not reported" );
+    return 0;
+}
+
+struct Test {
+    const char* name;
+    int (*run)();
+};
+
+const Test tests[] = {
+    { "compress", testCompress },
+    { "diff", testDiff },
+    { "zonelut", testZoneLUT },
+    { "overlap", testOverlap },
+    { "meshlut", testMeshLUT },
+    { "fold", testFold },
+    { "histogram", testHistogram },
+    { "intphi", testIntPhi },
+    { "h8grid", testH8Grid },
+    { "h8read", testH8Read },
+    { "holder", testHolder },
+    { "inttable", testIntTable },
+    { "movemap", testMoveMap },
+    { "propagator", testPropagator },
+    { "scaledmap", testScaledMap },
+    { "composite", testComposite },
+    { "tricubic", testTricubic },
+};
+
+int main( int argc, char** argv )
+{
+    const int ntest = sizeof(tests)/sizeof(tests[0]);
+    int nfail = 0;
+    int nrun = 0;
+    for ( int i = 0; i < ntest; i++ ) {
+        if ( argc > 1 && strcmp( argv[1], tests[i].name ) != 0 ) continue;
+        nrun++;
+        if ( tests[i].run() ) {
+            nfail++;
+        } else {
+            printf( "%s: passed\n", tests[i].name );
+        }
+    }
+    if ( nrun == 0 ) {
+        printf( "usage: testBFieldCore [<test>], with <test> one of:" );
+        for ( int i = 0; i < ntest; i++ ) printf( " %s", tests[i].name );
+        printf( "\n" );
+        return 1;
+    }
+    return ( nfail > 0 ) ? 1 : 0;
+}